@@ -3,6 +3,7 @@
 #include "gguf.h"
 #include <cassert>
 #include <chrono>
+#include <coroutine>
 #include <cstdint>
 #include <initializer_list>
 #include <istream>
@@ -69,6 +70,10 @@ static constexpr u32 GGML_MAX_OP_PARAMS = 64;
 
 void* allocate(size_t size, size_t align = 16);
 void deallocate(void* ptr, size_t align = 16);
+/**
+ * @brief Number of calls of allocate so far, every operator new goes through it
+ */
+u64 allocation_count();
 
 //--- wyhash
 //-----------------------------------------------------------
@@ -122,6 +127,12 @@ public:
      */
     float frand();
 
+    /**
+     * @brief Raw generator state, to suspend and resume a sequence of numbers
+     */
+    uint64_t state() const;
+    void set_state(uint64_t state);
+
 private:
     inline static constexpr uint64_t DEFAULT_SEED64 = 12345ULL;
     inline static constexpr uint64_t Increment = 1442695040888963407ULL;
@@ -247,7 +258,6 @@ bool Array<T>::reserve(uint64_t capacity)
 template<class T>
 bool Array<T>::resize(uint64_t size)
 {
-    size = (std::max)(capacity_, size);
     uint64_t new_capacity = Expand;
     while(new_capacity < size) {
         new_capacity += Expand;
@@ -284,7 +294,7 @@ bool Array<T>::expand(uint64_t capacity)
     }
     T* items = new T[capacity];
     if(nullptr != items_) {
-        ::memcpy(items, items_, sizeof(T) * capacity);
+        ::memcpy(items, items_, sizeof(T) * size_);
         delete[] items_;
     }
     items_ = items;
@@ -294,6 +304,11 @@ bool Array<T>::expand(uint64_t capacity)
 
 //--- PriorityQueue
 //-----------------------------------------------------------
+/**
+ * @brief Binary heap, front is the largest by U as std::priority_queue
+ *
+ * Push and pop are O(log n), items are in heap order.
+ */
 template<class T, class U=std::less<T>>
 class PriorityQueue
 {
@@ -303,36 +318,6 @@ public:
     inline static constexpr uint32_t Invalid = 0xFFFF'FFFFUL;
     inline static constexpr uint32_t Expand = 64;
 
-    struct Iterator
-    {
-    public:
-        Iterator(uint32_t capacity, uint32_t size, uint32_t pos, T* items);
-        operator bool() const;
-        void operator++();
-        T& operator*();
-        uint32_t position() const;
-    private:
-        uint32_t capacity_;
-        uint32_t size_;
-        uint32_t pos_;
-        T* items_;
-    };
-
-    struct ReverseIterator
-    {
-    public:
-        ReverseIterator(uint32_t capacity, uint32_t size, uint32_t pos, T* items);
-        operator bool() const;
-        void operator++();
-        T& operator*();
-        uint32_t position() const;
-    private:
-        uint32_t capacity_;
-        uint32_t size_;
-        uint32_t pos_;
-        T* items_;
-    };
-
     PriorityQueue();
     ~PriorityQueue();
     PriorityQueue(PriorityQueue&& other);
@@ -343,13 +328,10 @@ public:
     T& operator[](uint32_t index);
     void clear();
     bool reserve(uint32_t capacity);
-    bool resize(uint32_t capacity);
     void push_back(const T& x);
     const T& front() const;
     T& front();
     void pop_front();
-    Iterator begin();
-    ReverseIterator rbegin();
 
 private:
     PriorityQueue(const PriorityQueue&) = delete;
@@ -358,97 +340,14 @@ private:
     bool expand(uint32_t capacity);
     uint32_t capacity_;
     uint32_t size_;
-    uint32_t top_;
-    uint32_t end_;
     U compare_;
     T* items_;
 };
 
-template<class T, class U>
-PriorityQueue<T, U>::Iterator::Iterator(uint32_t capacity, uint32_t size, uint32_t pos, T* items)
-    : capacity_(capacity)
-    , size_(size)
-    , pos_(pos)
-    , items_(items)
-{
-}
-
-template<class T, class U>
-PriorityQueue<T, U>::Iterator::operator bool() const
-{
-    return 0<size_;
-}
-
-template<class T, class U>
-void PriorityQueue<T, U>::Iterator::operator++()
-{
-    assert(0<size_);
-    --size_;
-    ++pos_;
-    if(capacity_<=pos_){
-        pos_ = 0;
-    }
-}
-
-template<class T, class U>
-T& PriorityQueue<T, U>::Iterator::operator*()
-{
-    assert(pos_<capacity_);
-    return items_[pos_];
-}
-
-template<class T, class U>
-uint32_t PriorityQueue<T, U>::Iterator::position() const
-{
-    return pos_;
-}
-
-template<class T, class U>
-PriorityQueue<T, U>::ReverseIterator::ReverseIterator(uint32_t capacity, uint32_t size, uint32_t pos, T* items)
-    : capacity_(capacity)
-    , size_(size)
-    , pos_(pos)
-    , items_(items)
-{
-}
-
-template<class T, class U>
-PriorityQueue<T, U>::ReverseIterator::operator bool() const
-{
-    return 0<size_;
-}
-
-template<class T, class U>
-void PriorityQueue<T, U>::ReverseIterator::operator++()
-{
-    assert(0<size_);
-    --size_;
-    if(pos_<=0){
-        pos_ = capacity_-1;
-    }else{
-        --pos_;
-    }
-}
-
-template<class T, class U>
-T& PriorityQueue<T, U>::ReverseIterator::operator*()
-{
-    assert(pos_<capacity_);
-    return items_[pos_];
-}
-
-template<class T, class U>
-uint32_t PriorityQueue<T, U>::ReverseIterator::position() const
-{
-    return pos_;
-}
-
 template<class T, class U>
 PriorityQueue<T,U>::PriorityQueue()
     : capacity_(0)
     , size_(0)
-    , top_(0)
-    , end_(0)
     , items_(nullptr)
 {
 }
@@ -458,8 +357,6 @@ PriorityQueue<T,U>::~PriorityQueue()
 {
     capacity_ = 0;
     size_ = 0;
-    top_ = 0;
-    end_ = 0;
     delete[] items_;
     items_ = nullptr;
 }
@@ -468,14 +365,10 @@ template<class T, class U>
 PriorityQueue<T,U>::PriorityQueue(PriorityQueue&& other)
     : capacity_(other.capacity_)
     , size_(other.size_)
-    , top_(other.top_)
-    , end_(other.end_)
     , items_(other.items_)
 {
     other.capacity_ = 0;
     other.size_ = 0;
-    other.top_ = 0;
-    other.end_ = 0;
     other.items_ = nullptr;
 }
 
@@ -486,13 +379,9 @@ PriorityQueue<T,U>& PriorityQueue<T,U>::operator=(PriorityQueue&& other)
         delete[] items_;
         capacity_ = other.capacity_;
         size_ = other.size_;
-        top_ = other.top_;
-        end_ = other.end_;
         items_ = other.items_;
         other.capacity_ = 0;
         other.size_ = 0;
-        other.top_ = 0;
-        other.end_ = 0;
         other.items_ = nullptr;
     }
     return *this;
@@ -537,87 +426,73 @@ bool PriorityQueue<T,U>::reserve(uint32_t capacity)
     while(new_capacity < capacity) {
         new_capacity += Expand;
     }
-    return expand(new_capacity);
-}
-
-template<class T, class U>
-bool PriorityQueue<T,U>::resize(uint32_t size)
-{
-    size = (std::max)(capacity_, size);
-    uint64_t new_capacity = Expand;
-    while(new_capacity < size) {
-        new_capacity += Expand;
-    }
-    if(expand(new_capacity)) {
-        assert(size <= new_capacity);
-        size_ = size;
-        return true;
-    } else {
-        return false;
-    }
+    return expand(static_cast<uint32_t>(new_capacity));
 }
 
 template<class T, class U>
 void PriorityQueue<T,U>::push_back(const T& x)
 {
     if(capacity_ <= size_) {
-        if(!expand(capacity_ + Expand)) {
+        // grow geometrically, a long text pushes a bigram per character
+        if(!expand(capacity_ + (std::max)(Expand, capacity_ >> 1))) {
             return;
         }
         assert(size_ < capacity_);
     }
-    assert(end_<capacity_);
-    items_[end_] = x;
-    end_ = capacity_<=(end_+1)? 0 : (end_+1);
-    ++size_;
-    for(ReverseIterator itr = rbegin(); itr;){
-        uint32_t p0 = itr.position();
-        ++itr;
-        if(!itr){
-            break;
-        }
-        uint32_t p1 = itr.position();
-        if(compare_(items_[p0], items_[p1])){
+    // sift up the hole from the end
+    uint32_t i = size_;
+    while(0 < i) {
+        uint32_t parent = (i - 1) >> 1;
+        if(!compare_(items_[parent], x)) {
             break;
         }
-        (std::swap)(items_[p0], items_[p1]);
+        items_[i] = items_[parent];
+        i = parent;
     }
+    items_[i] = x;
+    ++size_;
 }
 
 template<class T, class U>
 const T& PriorityQueue<T, U>::front() const
 {
     assert(0<size_);
-    return items_[top_];
+    return items_[0];
 }
 
 template<class T, class U>
 T& PriorityQueue<T, U>::front()
 {
     assert(0<size_);
-    return items_[top_];
+    return items_[0];
 }
 
 template<class T, class U>
 void PriorityQueue<T, U>::pop_front()
 {
     assert(0<size_);
-    top_ = capacity_<=(top_+1)? 0 : (top_+1);
     --size_;
-}
-
-template<class T, class U>
-PriorityQueue<T, U>::Iterator PriorityQueue<T, U>::begin()
-{
-    uint32_t pos = (0<end_)? end_-1 : capacity_-1;
-    return Iterator(capacity_, size_, pos, items_);
-}
-
-template<class T, class U>
-PriorityQueue<T, U>::ReverseIterator PriorityQueue<T, U>::rbegin()
-{
-    uint32_t pos = (0<end_)? end_-1 : capacity_-1;
-    return ReverseIterator(capacity_, size_, pos, items_);
+    if(0 == size_) {
+        return;
+    }
+    // sift down the hole at the top with the last item
+    const T x = items_[size_];
+    uint32_t i = 0;
+    for(;;) {
+        uint32_t child = (i << 1) + 1;
+        if(size_ <= child) {
+            break;
+        }
+        if((child + 1) < size_ && compare_(items_[child], items_[child + 1])) {
+            ++child;
+        }
+        if(!compare_(x, items_[child])) {
+            break;
+        }
+        items_[i] = items_[child];
+        i = child;
+    }
+    items_[i] = x;
 }
 
 template<class T, class U>
@@ -627,21 +502,8 @@ bool PriorityQueue<T,U>::expand(uint32_t capacity)
         return true;
     }
     T* items = new T[capacity];
-
     if(0 < size_) {
-        if(end_<=top_) {
-            assert(top_ == end_);
-            assert(size_ == capacity_);
-            assert(top_<capacity_);
-            ::memcpy(items, items_+top_, (capacity_-top_)*sizeof(T));
-            if(0 < end_) {
-                ::memcpy(items + top_, items_, end_*sizeof(T));
-            }
-        } else {
-            ::memcpy(items, items_ + top_, size_*sizeof(T));
-        }
-        top_ = 0;
-        end_ = size_;
+        ::memcpy(items, items_, size_ * sizeof(T));
     }
     delete[] items_;
     items_ = items;
@@ -837,16 +699,23 @@ u32 HashMap<T, U>::size() const
 template<class T, class U>
 void HashMap<T, U>::clear()
 {
+    if(capacity_ <= 0) {
+        return;
+    }
     for(u32 i = 0; i < capacity_; ++i) {
         if(entries_[i].isOccupy()) {
             keys_[i].~T();
             values_[i].~U();
-            entries_[i].hash_ = 0;
-            entries_[i].index_ = Invalid;
-            entries_[i].next_ = empty_;
-            empty_ = i;
         }
     }
+    // bucket heads of free entries may still point to cleared entries, every chain is reset
+    for(u32 i = 0; i < capacity_; ++i) {
+        entries_[i].index_ = Invalid;
+        entries_[i].next_ = i + 1;
+        entries_[i].hash_ = 0;
+    }
+    entries_[capacity_ - 1].next_ = Invalid;
+    empty_ = 0;
     size_ = 0;
 }
 
@@ -1103,6 +972,217 @@ namespace util
     void copyf64_f(u64 size, void* dst, const void* src);
 } // namespace util
 
+//--- MinimalPerfectHash
+//-----------------------------------------------------------
+/**
+ * @brief A bijection of a fixed set of distinct 64 bit hashes to [0, size), by hash and displace
+ *
+ * A hash falls in a bucket, each bucket has a pilot which moves its hashes to free slots.
+ * A hash out of the set maps to some slot too, the owner verifies the key.
+ */
+class MinimalPerfectHash
+{
+public:
+    inline static constexpr u32 BucketSize = 4;
+    inline static constexpr u32 MaxPilot = 1UL << 24;
+
+    MinimalPerfectHash();
+    ~MinimalPerfectHash();
+    MinimalPerfectHash(MinimalPerfectHash&& other);
+    MinimalPerfectHash& operator=(MinimalPerfectHash&& other);
+
+    /**
+     * @return false if the hashes are not distinct
+     */
+    bool build(u64 size, const u64* hashes);
+    /**
+     * @brief Take the pilots of a table built before, without a build
+     * @return false if the number of pilots does not match the size
+     */
+    bool restore(u64 size, u64 num_pilots, const u32* pilots);
+    u64 size() const;
+    u64 num_buckets() const;
+    const u32* pilots() const;
+    u64 operator()(u64 hash) const;
+
+    /**
+     * @brief Spread the bits of a structured key, a bijection then distinct keys are distinct hashes
+     */
+    inline static u64 mix(u64 key)
+    {
+        // murmur3 finalizer
+        key ^= key >> 33;
+        key *= 0xFF51'AFD7'ED55'8CCDULL;
+        key ^= key >> 33;
+        key *= 0xC4CE'B9FE'1A85'EC53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+private:
+    MinimalPerfectHash(const MinimalPerfectHash&) = delete;
+    MinimalPerfectHash& operator=(const MinimalPerfectHash&) = delete;
+
+    inline u64 bucket(u64 hash) const
+    {
+        return ((hash >> 32) * num_buckets_) >> 32;
+    }
+    inline u64 slot(u64 hash, u32 pilot) const
+    {
+        return mix(hash ^ ((pilot + 1ULL) * 0x9E37'79B9'7F4A'7C15ULL)) % size_;
+    }
+
+    u64 size_;
+    u64 num_buckets_;
+    Array<u32> pilots_;
+};
+
+//--- FlatTable
+//-----------------------------------------------------------
+/**
+ * @brief Read only table of 64 bit keys, the minimal perfect hash of a mixed key is its slot
+ *
+ * A slot keeps its key, a key out of the table finds another key there.
+ * The padding of an entry is zero, a saved table has no stale bytes.
+ */
+template<class T>
+class FlatTable
+{
+public:
+    struct Entry
+    {
+        u64 key_;
+        T value_;
+    };
+
+    FlatTable();
+    ~FlatTable();
+    FlatTable(FlatTable&& other);
+    FlatTable& operator=(FlatTable&& other);
+
+    /**
+     * @return false if the hash fails to build, the table is empty then
+     */
+    bool build(const HashMap<u64, T>& map);
+    /**
+     * @brief Take the pilots of a table built before, after its entries are set
+     * @return false if the number of pilots does not match the entries
+     */
+    bool restore(u64 num_pilots, const u32* pilots);
+    u64 size() const;
+    /**
+     * @return nullptr if the key is not in the table
+     */
+    const T* find(u64 key) const;
+
+    const MinimalPerfectHash& hash() const;
+    const Array<Entry>& entries() const;
+    Array<Entry>& entries();
+
+private:
+    FlatTable(const FlatTable&) = delete;
+    FlatTable& operator=(const FlatTable&) = delete;
+
+    MinimalPerfectHash hash_;
+    Array<Entry> entries_;
+};
+
+template<class T>
+FlatTable<T>::FlatTable()
+{
+}
+
+template<class T>
+FlatTable<T>::~FlatTable()
+{
+}
+
+template<class T>
+FlatTable<T>::FlatTable(FlatTable&& other)
+    : hash_(std::move(other.hash_))
+    , entries_(std::move(other.entries_))
+{
+}
+
+template<class T>
+FlatTable<T>& FlatTable<T>::operator=(FlatTable&& other)
+{
+    if(this != &other) {
+        hash_ = std::move(other.hash_);
+        entries_ = std::move(other.entries_);
+    }
+    return *this;
+}
+
+template<class T>
+bool FlatTable<T>::build(const HashMap<u64, T>& map)
+{
+    // an empty table has no pilots, as one never built
+    entries_.clear();
+    hash_.restore(0, 0, nullptr);
+    u64 size = map.size();
+    if(size <= 0) {
+        return true;
+    }
+    Array<u64> hashes;
+    hashes.reserve(size);
+    for(u32 i = map.begin(); i != map.end(); i = map.next(i)) {
+        hashes.push_back(MinimalPerfectHash::mix(map.getKey(i)));
+    }
+    if(!hash_.build(size, &hashes[0])) {
+        hash_.restore(0, 0, nullptr);
+        return false;
+    }
+    entries_.resize(size);
+    ::memset(&entries_[0], 0, sizeof(Entry) * size);
+    for(u32 i = map.begin(); i != map.end(); i = map.next(i)) {
+        Entry& entry = entries_[hash_(MinimalPerfectHash::mix(map.getKey(i)))];
+        entry.key_ = map.getKey(i);
+        entry.value_ = map.getValue(i);
+    }
+    return true;
+}
+
+template<class T>
+bool FlatTable<T>::restore(u64 num_pilots, const u32* pilots)
+{
+    return hash_.restore(entries_.size(), num_pilots, pilots);
+}
+
+template<class T>
+u64 FlatTable<T>::size() const
+{
+    return entries_.size();
+}
+
+template<class T>
+const T* FlatTable<T>::find(u64 key) const
+{
+    if(entries_.size() <= 0) {
+        return nullptr;
+    }
+    const Entry& entry = entries_[hash_(MinimalPerfectHash::mix(key))];
+    return entry.key_ == key ? &entry.value_ : nullptr;
+}
+
+template<class T>
+const MinimalPerfectHash& FlatTable<T>::hash() const
+{
+    return hash_;
+}
+
+template<class T>
+const Array<typename FlatTable<T>::Entry>& FlatTable<T>::entries() const
+{
+    return entries_;
+}
+
+template<class T>
+Array<typename FlatTable<T>::Entry>& FlatTable<T>::entries()
+{
+    return entries_;
+}
+
 //--- Timer
 //-----------------------------------------------------------
 class Timer
@@ -1116,8 +1196,54 @@ private:
     std::chrono::high_resolution_clock::time_point start_;
 };
 
+//--- MemoryPlan
+//-----------------------------------------------------------
+/**
+ * @brief Place buffers in one arena by their lifetimes
+ *
+ * A lifetime is a range of steps of a fixed op sequence, buffers whose lifetimes do not overlap may share bytes.
+ */
+class MemoryPlan
+{
+public:
+    MemoryPlan();
+    ~MemoryPlan();
+    MemoryPlan(MemoryPlan&& other);
+    MemoryPlan& operator=(MemoryPlan&& other);
+
+    /**
+     * @param first ... first step which uses the buffer
+     * @param last ... last step which uses the buffer
+     * @return id of the buffer
+     */
+    u32 add(u64 bytes, u32 first, u32 last);
+    /**
+     * @brief Assign offsets, the largest first at the lowest offset free during its lifetime
+     * @return size of the arena
+     */
+    u64 build(u64 alignment = 64);
+    u64 offset(u32 id) const;
+    u64 size() const;
+
+private:
+    MemoryPlan(const MemoryPlan&) = delete;
+    MemoryPlan& operator=(const MemoryPlan&) = delete;
+
+    struct Buffer
+    {
+        u64 bytes_;
+        u64 offset_;
+        u32 first_;
+        u32 last_;
+    };
+    Array<Buffer> buffers_;
+    u64 size_;
+};
+
 struct Config;
 struct Context;
+class RotaryEmbedding;
+class Sampler;
 
 //--- Tensor
 //-----------------------------------------------------------
@@ -1184,6 +1310,48 @@ private:
 namespace op
 {
     Tensor convertF32(const Tensor& input);
+    /**
+     * @brief Number of elements of a quantization block, 0 if the type is not supported
+     */
+    u64 block_size(ggml_type type);
+    /**
+     * @brief Number of bytes of a row of "size" elements, 0 if the type is not supported
+     */
+    u64 row_bytes(ggml_type type, u64 size);
+    void dequantize_row(ggml_type type, u64 size, f32* dst, const void* src);
+    /**
+     * @brief dst = w x, where w is d rows of n elements in any supported type
+     */
+    void matvec(f32* dst, const f32* x, const Tensor& w, u64 n, u64 d, f32* scratch = nullptr);
+    /**
+     * @brief dst[t] = w x[t] for count rows of x, each weight row is read and dequantized once for all the rows
+     * @param dst ... count x d
+     * @param x ... count x n
+     */
+    void matmat(f32* dst, const f32* x, u64 count, const Tensor& w, u64 n, u64 d, f32* scratch = nullptr);
+    /**
+     * @brief Number of elements of the scratch of matvec and matmat to dequantize rows of n elements, allocated per call if not given
+     */
+    u64 scratch_size(u64 n);
+    /**
+     * @brief dst += w x, a residual add folded into the write of the projection
+     */
+    void matvec_add(f32* dst, const f32* x, const Tensor& w, u64 n, u64 d, f32* scratch = nullptr);
+    void matmat_add(f32* dst, const f32* x, u64 count, const Tensor& w, u64 n, u64 d, f32* scratch = nullptr);
+    /**
+     * @brief dst = w (x * norm * scale), a RMSNorm folded into the projection
+     * @param norm ... weight of the norm, n elements
+     * @param scale ... inverse root mean square of x
+     */
+    void matvec_norm(f32* dst, const f32* x, const f32* norm, f32 scale, const Tensor& w, u64 n, u64 d, f32* scratch = nullptr);
+    /**
+     * @brief dst = silu(gate x) * (up x), gate and up are computed in a single pass
+     * @param gate ... d rows, read in place, its type may differ from up
+     * @param up ... d rows, read in place
+     * @param norm ... weight of a RMSNorm folded into the projection, or nullptr
+     */
+    void matvec_swiglu(f32* dst, const f32* x, const f32* norm, f32 scale, const Tensor& gate, const Tensor& up, u64 n, u64 d, f32* scratch = nullptr);
+    void matmat_swiglu(f32* dst, const f32* x, u64 count, const Tensor& gate, const Tensor& up, u64 n, u64 d, f32* scratch = nullptr);
     f32 kahan_sum(u64 size, const f32* src);
     f32 kahan_sum_squared(u64 size, const f32* src, f32 mean);
     void normalize_vec(u64 size, f32* dst, const f32* src, const f32* weight, const f32* bias);
@@ -1197,11 +1365,90 @@ namespace op
     Tensor affine_proj_2d(const Tensor& input, const Tensor& weight, const Tensor& bias);
     void matmul(f32* dst,const f32* x, const f32* w, u64 n, u64 d);
     void rmsnorm(u64 size, f32* dst, const f32* x, const f32* w, f32 epsilon);
-} // namespace op
+    /**
+     * @brief Inverse root mean square of x, the scale of rmsnorm
+     */
+    f32 rmsnorm_scale(u64 size, const f32* x, f32 epsilon);
+    void softmax(u64 size, f32* x);
+    /**
+     * @brief Log-probability of index under the softmax of logits
+     */
+    f32 log_prob(u64 size, const f32* logits, u32 index);
 
-bool is_same_shape(const Tensor& x0, const Tensor& x1);
+    /**
+     * @brief Attention of the query heads which share one kv head
+     * @param output ... group_size x head_size
+     * @param query ... group_size x head_size
+     * @param keys ... length rows, the stride between rows is key_stride
+     * @param values ... length rows, the stride between rows is value_stride
+     * @param scores ... group_size x score_stride, softmaxed attention weights on return
+     *
+     * Each key and value row is read once per call instead of once per query head.
+     */
+    void attention_gqa(
+        u64 head_size,
+        u64 group_size,
+        u64 length,
+        f32* output,
+        const f32* query,
+        const f32* keys,
+        u64 key_stride,
+        const f32* values,
+        u64 value_stride,
+        f32* scores,
+        u64 score_stride);
 
-//--- Embedding
+    /**
+     * @brief Scaled dot products of the query heads which share one kv head, for a range of keys
+     * @param scores ... group_size x score_stride, count scores are written to each row
+     * @param rope ... rotate the key at index t by rope_position + t before the product, nullptr if keys are already rotated
+     */
+    void attention_scores(
+        u64 head_size,
+        u64 group_size,
+        u64 count,
+        f32* scores,
+        u64 score_stride,
+        const f32* query,
+        const f32* keys,
+        u64 key_stride,
+        const RotaryEmbedding* rope,
+        u64 rope_position);
+
+    /**
+     * @brief Same as attention_scores for keys stored as [head_size][slot]
+     * @param keys ... the first element of the range, key_dimension_stride is the distance between two elements of a key
+     */
+    void attention_scores_transposed(
+        u64 head_size,
+        u64 group_size,
+        u64 count,
+        f32* scores,
+        u64 score_stride,
+        const f32* query,
+        const f32* keys,
+        u64 key_dimension_stride,
+        const RotaryEmbedding* rope,
+        u64 rope_position);
+
+    /**
+     * @brief Accumulate a range of values weighted by attention weights
+     * @param output ... group_size x head_size, not cleared
+     */
+    void attention_values(
+        u64 head_size,
+        u64 group_size,
+        u64 count,
+        f32* output,
+        const f32* scores,
+        u64 score_stride,
+        const f32* values,
+        u64 value_stride);
+} // namespace op
+
+bool is_same_shape(const Tensor& x0, const Tensor& x1);
+
+//--- Embedding
 //-----------------------------------------------------------
 class Embedding
 {
@@ -1256,6 +1503,78 @@ private:
     Tensor weight_;
 };
 
+//--- RotaryEmbedding
+//-----------------------------------------------------------
+/**
+ * @brief RoPE with cos/sin tables precomputed for every position
+ *
+ * Tables are laid out as [position][rotated dimension], each value duplicated for the (even, odd) pair,
+ * so that the rotation of one pair is a multiply and an add-sub.
+ */
+class RotaryEmbedding
+{
+public:
+    enum class Scaling : u32
+    {
+        None = 0,
+        Linear,
+        NTK,
+        YaRN,
+    };
+
+    struct Parameters
+    {
+        Scaling scaling_;
+        u32 dimension_; //!< number of rotated dimensions of a head, 0 means whole head
+        u32 original_context_; //!< context length of pre-training, used by YaRN
+        f32 freq_base_;
+        f32 scaling_factor_;
+        f32 attn_factor_;
+        f32 beta_fast_;
+        f32 beta_slow_;
+    };
+
+    static Parameters default_parameters();
+    /**
+     * @brief Read "llama.rope.*" metadata
+     */
+    static Parameters load_parameters(const gguf::GGUF& model_data);
+
+    RotaryEmbedding();
+    RotaryEmbedding(const Parameters& parameters, u64 head_size, u64 max_positions);
+    RotaryEmbedding(const gguf::GGUF& model_data, u64 head_size, u64 max_positions);
+    ~RotaryEmbedding();
+    RotaryEmbedding(RotaryEmbedding&& other);
+    RotaryEmbedding& operator=(RotaryEmbedding&& other);
+
+    u64 head_size() const;
+    u64 dimension() const;
+    u64 max_positions() const;
+    const f32* cos(u64 position) const;
+    const f32* sin(u64 position) const;
+
+    /**
+     * @brief Rotate all heads of query and key at a position
+     * @param q ... num_heads x head_size
+     * @param k ... num_kv_heads x head_size
+     */
+    void forward(u64 position, u64 num_heads, f32* q, u64 num_kv_heads, f32* k) const;
+
+    /**
+     * @brief Rotate a single head
+     */
+    void rotate(u64 position, f32* dst, const f32* src) const;
+
+private:
+    RotaryEmbedding(const RotaryEmbedding&) = delete;
+    RotaryEmbedding& operator=(const RotaryEmbedding&) = delete;
+
+    u64 head_size_;
+    u64 dimension_;
+    Tensor cos_;
+    Tensor sin_;
+};
+
 //--- Residual
 //-----------------------------------------------------------
 class Residual
@@ -1285,6 +1604,18 @@ public:
     RMSNorm& operator=(RMSNorm&& other);
 
     void forward(Tensor& dst, const Tensor& src);
+    /**
+     * @brief Normalize count rows
+     */
+    void forward(Tensor& dst, const Tensor& src, u64 count);
+    /**
+     * @brief Scale of src, for a norm folded into the following projection
+     */
+    f32 scale(const f32* src) const;
+    inline const f32* weight() const
+    {
+        return weight_.data<f32>();
+    }
     inline s64 time() const
     {
         return duration_;
@@ -1298,6 +1629,157 @@ private:
     Tensor weight_;
 };
 
+//--- KVCache
+//-----------------------------------------------------------
+/**
+ * @brief Key and value cache of all layers
+ *
+ * Without a window, a position is stored in the slot of the same index and the capacity is Config::sequence_length_.
+ * With a window, the first "sinks" positions are kept forever and the rest are written to a ring of "window" slots,
+ * so that generation can continue beyond the capacity (StreamingLLM).
+ * In that mode keys are stored before rotation and rotated by their index in the cache at attention time.
+ *
+ * Layouts of a layer,
+ * - PositionMajor: [slot][kv_head][head_size]
+ * - HeadMajor: [kv_head][slot][head_size], the keys of one head are contiguous across slots
+ * - TransposedKey: keys are [kv_head][head_size][slot] to vectorize scores across slots, values are head major
+ */
+class KVCache
+{
+public:
+    enum class Layout : u32
+    {
+        PositionMajor = 0,
+        HeadMajor,
+        TransposedKey,
+    };
+
+    /**
+     * @brief A range of slots which are contiguous in memory, in order of positions
+     */
+    struct Segment
+    {
+        u64 slot_;
+        u64 count_;
+    };
+    inline static constexpr u32 MaxSegments = 3;
+
+    KVCache();
+    /**
+     * @param window ... size of the ring, 0 disables eviction
+     * @param sinks ... number of the leading positions never evicted
+     */
+    KVCache(const Config& config, u64 window = 0, u64 sinks = 0, Layout layout = Layout::HeadMajor);
+    ~KVCache();
+    KVCache(KVCache&& other);
+    KVCache& operator=(KVCache&& other);
+
+    u64 num_layers() const;
+    u64 num_kv_heads() const;
+    u64 head_size() const;
+    u64 capacity() const;
+    u64 window() const;
+    u64 sinks() const;
+    Layout layout() const;
+    bool is_ring() const;
+
+    /**
+     * @brief Slot storing a position
+     */
+    u64 slot(u64 position) const;
+    /**
+     * @brief Number of cached entries visible from a position
+     */
+    u64 length(u64 position) const;
+    /**
+     * @brief Split the entries visible from a position into contiguous ranges
+     * @return number of segments
+     */
+    u32 segments(Segment segments[MaxSegments], u64 position) const;
+
+    /**
+     * @brief Distance between the same head of two adjacent slots
+     */
+    u64 key_stride() const;
+    /**
+     * @brief Distance between two adjacent elements of a key
+     */
+    u64 key_dimension_stride() const;
+    u64 value_stride() const;
+    f32* key(u64 layer, u64 head, u64 slot);
+    const f32* key(u64 layer, u64 head, u64 slot) const;
+    f32* value(u64 layer, u64 head, u64 slot);
+    const f32* value(u64 layer, u64 head, u64 slot) const;
+
+    /**
+     * @brief Write all heads of a position
+     * @param key ... num_kv_heads x head_size
+     * @param value ... num_kv_heads x head_size
+     */
+    void store(u64 layer, u64 slot, const f32* key, const f32* value);
+    /**
+     * @brief Read all heads of a slot
+     */
+    void fetch(u64 layer, u64 slot, f32* key, f32* value) const;
+
+    /**
+     * @brief Keep the slots which positions from "position" to "position + count" will overwrite
+     *
+     * Only a ring evicts entries, a whole cache keeps nothing. count should not exceed the window.
+     */
+    void checkpoint(u64 position, u64 count);
+    /**
+     * @brief Drop the positions from "position" on, which are covered by the last checkpoint
+     *
+     * The entries evicted by those positions come back, as if they were never stored.
+     */
+    void rollback(u64 position);
+
+    /**
+     * @brief Write the slots used by the positions before "position", and the sampler state to a file
+     * @param position ... number of positions already in the cache
+     */
+    bool save(const char8_t* filepath, u64 position, const Sampler& sampler) const;
+    /**
+     * @brief Map a file written by save, and restore the cache and the sampler
+     *
+     * The shape of the cache should be same as the saved one.
+     */
+    bool load(const char8_t* filepath, u64& position, Sampler& sampler);
+
+private:
+    KVCache(const KVCache&) = delete;
+    KVCache& operator=(const KVCache&) = delete;
+
+    u64 num_layers_;
+    u64 num_kv_heads_;
+    u64 head_size_;
+    u64 capacity_;
+    u64 window_;
+    u64 sinks_;
+    Layout layout_;
+    Tensor keys_;
+    Tensor values_;
+    u64 checkpoint_position_;
+    u64 checkpoint_count_;
+    Tensor checkpoint_; //!< count x layers x {key, value}
+};
+
+//--- BatchRow
+//-----------------------------------------------------------
+/**
+ * @brief A token of a batched forward, rows of different sequences have their own caches
+ *
+ * Rows of a sequence must be consecutive positions in order.
+ */
+struct BatchRow
+{
+    KVCache* cache_;
+    u64 position_;
+    u32 token_;
+    u32 logits_; //!< whether the logits of this row are needed
+};
+
 //--- SelfAttention
 //-----------------------------------------------------------
 class SelfAttention
@@ -1313,16 +1795,49 @@ public:
     SelfAttention(SelfAttention&& other);
     SelfAttention& operator=(SelfAttention&& other);
 
+    /**
+     * @brief Run a token, the norm is folded into the qkv projections and the output is added to x
+     * @param x ... dimension, input and output
+     * @param buffer ... dimension
+     */
     void forward(
         const Config& config,
+        const RotaryEmbedding& rope,
+        u64 layer,
         u64 position,
-        u64 layer_offset,
-        Tensor& output,
+        Tensor& x,
+        const RMSNorm& norm,
+        Tensor& buffer,
+        Tensor& query,
+        Tensor& key,
+        Tensor& value,
+        KVCache& cache,
+        Tensor& attention,
+        Tensor& scratch);
+
+    /**
+     * @brief Run count rows, each at the position and in the cache of its row
+     *
+     * Projections are matrix-matrix products over the rows, attention is causal within a sequence.
+     * @param x ... count x dimension, the output is added
+     * @param input ... count x dimension, normalized x, overwritten
+     * @param query ... count x dimension
+     * @param key ... count x kv dimension
+     * @param value ... count x kv dimension
+     */
+    void forward_batch(
+        const Config& config,
+        const RotaryEmbedding& rope,
+        u64 layer,
+        u64 count,
+        const BatchRow* rows,
+        Tensor& x,
         Tensor& input,
         Tensor& query,
-        Tensor& key_cache,
-        Tensor& value_cache,
-        Tensor& attention);
+        Tensor& key,
+        Tensor& value,
+        Tensor& attention,
+        Tensor& scratch);
 
     inline s64 time() const
     {
@@ -1332,6 +1847,22 @@ public:
 private:
     SelfAttention(const SelfAttention&) = delete;
     SelfAttention& operator=(const SelfAttention&) = delete;
+
+    /**
+     * @brief Rotate q and k, store k and v at position, then attend to the cache
+     */
+    static void attend(
+        const Config& config,
+        const RotaryEmbedding& rope,
+        u64 layer,
+        u64 position,
+        f32* output,
+        f32* q,
+        f32* k,
+        const f32* v,
+        KVCache& cache,
+        Tensor& attention);
+
     s64 duration_;
     Tensor query_;
     Tensor key_;
@@ -1354,12 +1885,30 @@ public:
     FeedForwardSwiGLU(FeedForwardSwiGLU&& other);
     FeedForwardSwiGLU& operator=(FeedForwardSwiGLU&& other);
 
+    /**
+     * @brief Run a token, the norm is folded into the gate and up projections and the output is added to x
+     * @param x ... dimension, input and output
+     * @param buffer ... hidden dimension
+     */
     void forward(
         const Config& config,
-        Tensor& output,
+        Tensor& x,
+        const RMSNorm& norm,
+        Tensor& buffer,
+        Tensor& scratch);
+
+    /**
+     * @brief Run count rows, the output is added to x
+     * @param input ... count x dimension, normalized x
+     * @param buffer ... count x hidden dimension
+     */
+    void forward_batch(
+        const Config& config,
+        u64 count,
+        Tensor& x,
         const Tensor& input,
-        Tensor& buffer0,
-        Tensor& buffer1);
+        Tensor& buffer,
+        Tensor& scratch);
 
     inline s64 time() const
     {
@@ -1382,24 +1931,54 @@ class TransformerBlock
 {
 public:
     TransformerBlock();
+    TransformerBlock(
+        RMSNorm&& attn_rmsnorm,
+        SelfAttention&& attn,
+        RMSNorm&& ff_rmsnorm,
+        FeedForwardSwiGLU&& ff);
     ~TransformerBlock();
     TransformerBlock(TransformerBlock&& other);
     TransformerBlock& operator=(TransformerBlock&& other);
 
+    /**
+     * @brief Run a token
+     * @param x ... dimension, input and output
+     * @param buffer ... dimension
+     * @param hbuffer ... hidden dimension
+     */
     void forward(
         const Config& config,
+        const RotaryEmbedding& rope,
         u64 layer,
         u64 position,
-        Tensor& output,
-        Tensor& input,
+        Tensor& x,
+        Tensor& query,
+        Tensor& key,
+        Tensor& value,
+        KVCache& cache,
+        Tensor& attention,
+        Tensor& buffer,
+        Tensor& hbuffer,
+        Tensor& scratch);
+
+    /**
+     * @brief Run count rows, every tensor has count rows
+     * @param x ... count x dimension, input and output
+     */
+    void forward_batch(
+        const Config& config,
+        const RotaryEmbedding& rope,
+        u64 layer,
+        u64 count,
+        const BatchRow* rows,
+        Tensor& x,
         Tensor& query,
-    Tensor& key_cache,
-    Tensor& value_cache,
+        Tensor& key,
+        Tensor& value,
         Tensor& attention,
-        Tensor& buffer0,
-        Tensor& buffer1,
-        Tensor& hbuffer0,
-        Tensor& hbuffer1);
+        Tensor& buffer,
+        Tensor& hbuffer,
+        Tensor& scratch);
 
     inline s64 time() const
     {
@@ -1412,10 +1991,8 @@ private:
     s64 duration_;
     RMSNorm attn_rmsnorm_;
     SelfAttention attn_;
-    Residual attn_residual_;
     RMSNorm ff_rmsnorm_;
     FeedForwardSwiGLU ff_;
-    Residual ff_residual_;
 };
 
 //--- String
@@ -1448,6 +2025,15 @@ struct Hasher<u32>
     }
 };
 
+template<>
+struct Hasher<u64>
+{
+    u32 operator()(const u64& x) const
+    {
+        return wyhash32(sizeof(u64), &x);
+    }
+};
+
 //--- Vocabulary
 //-----------------------------------------------------------
 class Vocabulary
@@ -1460,6 +2046,20 @@ public:
         s32 type_;
     };
 
+    /**
+     * @brief Values of tokenizer.ggml.token_type
+     */
+    enum class Type : s32
+    {
+        Undefined = 0,
+        Normal,
+        Unknown,
+        Control,
+        UserDefined,
+        Unused,
+        Byte,
+    };
+
     inline static constexpr u32 Invalid = 0xFFFF'FFFFUL;
 
     Vocabulary();
@@ -1483,15 +2083,31 @@ public:
     s32 getMask() const;
     s32 getMaxTokenLength() const;
     u64 idToTokenSize() const;
-    const Token& idToToken(s32 x) const;
+    Token idToToken(s32 x) const;
     bool tokenToId(s32& id, const String& token) const;
     bool tokenToId(s32& id, const std::u8string& token) const;
+    /**
+     * @brief Output bytes of a token, a byte token <0xNN> is its byte and U+2581 is a space
+     */
+    String tokenToPiece(s32 id) const;
+    /**
+     * @brief Control and user defined tokens, and added tokens
+     */
+    const Array<s32>& getSpecialTokens() const;
 
     bool encode(s32& token, const char8_t* str) const;
     bool encode(s32& token, u64 length, const char8_t* str) const;
 private:
+    friend class Tokenizer;
     Vocabulary(const Vocabulary&) = delete;
     Vocabulary& operator=(const Vocabulary&) = delete;
+    inline static constexpr u64 HashSeed = 0x6A09'E667'F3BC'C908ULL;
+
+    String text(s32 x) const;
+    bool find(s32& id, u64 length, const char8_t* str) const;
+    void build_token_cache();
+    void build_piece_cache();
+
     gguf::GGUFString model_;
     gguf::GGUFArray tokens_;
     gguf::GGUFArray scores_;
@@ -1519,10 +2135,245 @@ private:
     bool add_space_prefix_;
 
     s32 max_token_length_;
-    HashMap<String, s32> tokenToId_;
-    Array<Token> idToToken_;
+    Array<char8_t> cache_token_text_; //!< bytes of all tokens
+    Array<u32> cache_token_offsets_; //!< the text of a token is [offsets[id], offsets[id+1])
+    Array<f32> cache_token_scores_;
+    Array<s8> cache_token_types_;
+    MinimalPerfectHash text_hash_; //!< text to a slot of cache_slot_to_id_
+    Array<s32> cache_slot_to_id_;
     Array<s32> cache_special_tokens_;
-    Array<String> cache_token_to_piece_;
+    Array<char8_t> cache_token_to_piece_; //!< output bytes of all tokens
+    Array<u32> cache_piece_offsets_; //!< the piece of a token is [offsets[id], offsets[id+1])
+};
+
+//--- MergeRanks
+//-----------------------------------------------------------
+/**
+ * @brief Byte pair merges, (left id, right id) to (rank, merged id)
+ *
+ * The rank is the line of tokenizer.ggml.merges.
+ * A vocabulary without merges ranks a pair by the score of the merged token, a higher score is a lower rank.
+ */
+class MergeRanks
+{
+public:
+    struct Merge
+    {
+        u32 rank_;
+        s32 merged_;
+    };
+
+    MergeRanks();
+    explicit MergeRanks(const Vocabulary& vocab);
+    ~MergeRanks();
+    MergeRanks(MergeRanks&& other);
+    MergeRanks& operator=(MergeRanks&& other);
+
+    /**
+     * @brief false if the table failed to build
+     */
+    bool valid() const;
+    u32 size() const;
+    bool find(Merge& merge, s32 left, s32 right) const;
+
+private:
+    friend class Tokenizer;
+    MergeRanks(const MergeRanks&) = delete;
+    MergeRanks& operator=(const MergeRanks&) = delete;
+
+    inline static u64 key(s32 left, s32 right)
+    {
+        return (static_cast<u64>(static_cast<u32>(left)) << 32) | static_cast<u32>(right);
+    }
+    static void build_from_merges(HashMap<u64, Merge>& table, const Vocabulary& vocab);
+    static void build_from_scores(HashMap<u64, Merge>& table, const Vocabulary& vocab);
+    bool valid_;
+    FlatTable<Merge> table_; //!< (left, right) to a merge
+};
+
+//--- SpecialTokenMatcher
+//-----------------------------------------------------------
+/**
+ * @brief Find the special tokens of a vocabulary in a text, the leftmost and then the longest
+ *
+ * A trie over the texts of the tokens, which is walked only from a byte a token starts with.
+ */
+class SpecialTokenMatcher
+{
+public:
+    struct Match
+    {
+        u64 offset_;
+        u64 length_;
+        s32 token_;
+    };
+
+    SpecialTokenMatcher();
+    explicit SpecialTokenMatcher(const Vocabulary& vocab);
+    ~SpecialTokenMatcher();
+    SpecialTokenMatcher(SpecialTokenMatcher&& other);
+    SpecialTokenMatcher& operator=(SpecialTokenMatcher&& other);
+
+    bool empty() const;
+    /**
+     * @brief false if the table failed to build
+     */
+    bool valid() const;
+    /**
+     * @brief Bytes of the longest token
+     */
+    u64 max_length() const;
+    /**
+     * @brief The first match at or after an offset
+     * @return false if none
+     */
+    bool find(Match& match, u64 offset, u64 size, const char8_t* text) const;
+
+private:
+    friend class Tokenizer;
+    SpecialTokenMatcher(const SpecialTokenMatcher&) = delete;
+    SpecialTokenMatcher& operator=(const SpecialTokenMatcher&) = delete;
+
+    inline static constexpr u32 MaxVectorFirsts = 4;
+
+    inline static u64 key(u32 node, char8_t c)
+    {
+        return (static_cast<u64>(node) << 8) | c;
+    }
+    void add(HashMap<u64, u32>& edges, s32 token, const String& text);
+    bool child(u32& next, u32 node, char8_t c) const;
+    u64 next_candidate(u64 offset, u64 size, const char8_t* text) const;
+    u64 longest(s32& token, u64 offset, u64 size, const char8_t* text) const;
+
+    bool first_[256]; //!< bytes a token starts with
+    u32 num_firsts_;
+    char8_t firsts_[MaxVectorFirsts];
+    u64 max_length_;
+    bool valid_;
+    FlatTable<u32> edges_; //!< (node, byte) to a child node
+    Array<s32> nodes_; //!< token which ends at a node, or -1
+};
+
+//--- TokenTrie
+//-----------------------------------------------------------
+/**
+ * @brief A byte trie over the pieces of a vocabulary, the bytes of tokenToPiece, for constrained decoding
+ *
+ * Tokens are sorted by their pieces, the tokens under a node are a range of the order.
+ * A mask is a bitset over the vocabulary, the bit of a token is (mask[id / 64] >> (id % 64)) & 1.
+ */
+class TokenTrie
+{
+public:
+    TokenTrie();
+    explicit TokenTrie(const Vocabulary& vocab);
+    ~TokenTrie();
+    TokenTrie(TokenTrie&& other);
+    TokenTrie& operator=(TokenTrie&& other);
+
+    /**
+     * @brief Number of tokens
+     */
+    u64 size() const;
+    /**
+     * @brief Number of words of a mask
+     */
+    u64 mask_size() const;
+    /**
+     * @brief false if the table failed to build
+     */
+    bool valid() const;
+    /**
+     * @brief Append the tokens whose pieces start with a prefix, in the order of the pieces
+     */
+    void starts_with(Array<s32>& tokens, u64 size, const char8_t* prefix) const;
+    /**
+     * @brief Append the tokens whose pieces are prefixes of a text, the shorter first
+     *
+     * A token of an empty piece is not a prefix of any text.
+     */
+    void prefixes_of(Array<s32>& tokens, u64 size, const char8_t* text) const;
+    /**
+     * @brief Set the bits of the tokens whose pieces start with a prefix
+     */
+    void mask_starts_with(u64* mask, u64 size, const char8_t* prefix) const;
+    /**
+     * @brief Set the bits of the tokens consistent with a text, whose pieces are prefixes of it or start with it
+     */
+    void mask_consistent(u64* mask, u64 size, const char8_t* text) const;
+    /**
+     * @brief Set the logits of the tokens out of a mask to -infinity
+     */
+    static void apply(f32* logits, u64 size, const u64* mask);
+
+private:
+    TokenTrie(const TokenTrie&) = delete;
+    TokenTrie& operator=(const TokenTrie&) = delete;
+
+    struct Node
+    {
+        u32 begin_; //!< the tokens under a node are [begin, end) of order_
+        u32 end_;
+        u32 terminals_; //!< the first tokens of the range end at the node
+    };
+
+    inline static u64 key(u32 node, char8_t c)
+    {
+        return (static_cast<u64>(node) << 8) | c;
+    }
+    bool child(u32& next, u32 node, char8_t c) const;
+    bool walk(u32& node, u64 size, const char8_t* text) const;
+    void set(u64* mask, u32 begin, u32 end) const;
+
+    u64 size_;
+    Array<s32> order_; //!< tokens sorted by their pieces
+    Array<Node> nodes_;
+    bool valid_;
+    FlatTable<u32> edges_; //!< (node, byte) to a child node
+};
+
+//--- PreTokenizer
+//-----------------------------------------------------------
+/**
+ * @brief Split a text into the pieces Tokenizer::Pattern matches, without a regex engine
+ *
+ * Unicode letters, marks and letter numbers are [[:alpha:]], decimal numbers are [[:digit:]],
+ * White_Space is \s. A byte of an invalid UTF-8 sequence is a char of none of them.
+ */
+class PreTokenizer
+{
+public:
+    struct Piece
+    {
+        u64 offset_;
+        u64 length_;
+    };
+
+    /**
+     * @brief Length of the piece at the head of the text, zero for an empty text
+     */
+    static u64 next(u64 size, const char8_t* text);
+    /**
+     * @brief Append the pieces of the text
+     */
+    static void split(Array<Piece>& pieces, u64 size, const char8_t* text);
+
+private:
+    enum class Class : u8
+    {
+        Other,
+        Alpha,
+        Digit,
+        Space,
+    };
+
+    static u64 decode(u32& codepoint, u64 size, const char8_t* text);
+    static Class classify(u32 codepoint);
+    static Class classify(u64& length, u64 size, const char8_t* text);
+    static u64 skip_ascii_alpha(u64 offset, u64 size, const char8_t* text);
+    static u64 skip_ascii_digit(u64 offset, u64 size, const char8_t* text);
+    static u64 skip(Class c, u64 offset, u64 size, const char8_t* text);
+    static u64 whitespace(u64 size, const char8_t* text);
 };
 
 //--- Tokenizer
@@ -1535,9 +2386,52 @@ public:
     ~Tokenizer();
     Tokenizer(Tokenizer&& other) noexcept;
     Tokenizer& operator=(Tokenizer&& other);
+    class Scratch;
+
+    /**
+     * @brief Apply the merges of the lowest rank first, the leftmost of ties
+     */
     Array<s32> tokenize(const std::u8string& text);
+    /**
+     * @brief Append the tokens of a text
+     *
+     * Special tokens in the text split it, the merges run between them.
+     * A tokenizer is read only here, threads share it with each its own scratch.
+     */
+    void tokenize(Array<s32>& tokens, Scratch& scratch, u64 size, const char8_t* text) const;
+    /**
+     * @brief Tokenize documents on threads into one buffer, the tokens of the i-th document are [offsets[i], offsets[i+1])
+     * @param num_threads zero for the number of hardware threads
+     */
+    void tokenize_batch(Array<s32>& tokens, Array<u64>& offsets, u64 count, const std::u8string* documents, u32 num_threads) const;
+    /**
+     * @brief Append the text of a token, a byte token appends its byte
+     */
+    void decode(std::u8string& text, s32 token) const;
+    const Vocabulary& vocabulary() const;
+    /**
+     * @brief false if a table of the merges or the special tokens failed to build
+     */
+    bool valid() const;
+
+    /**
+     * @brief Write the tables of the tokenizer to a file, which load maps without the model
+     */
+    bool save(const char8_t* filepath) const;
+    /**
+     * @brief Map a file written by save, and copy the tables out of it without rebuilding them
+     *
+     * The GGUF arrays of the vocabulary, getTokens and the others, are empty after this.
+     */
+    bool load(const char8_t* filepath);
+
+    /**
+     * @brief The GPT-2 pre-tokenization, PreTokenizer splits a text as this
+     */
+    static const char8_t* Pattern;
 
 private:
+    friend class StreamTokenizer;
     Tokenizer(const Tokenizer&) = delete;
     Tokenizer& operator=(const Tokenizer&) = delete;
 
@@ -1546,44 +2440,157 @@ private:
         using index = s32;
         index prev_;
         index next_;
+        s32 id_;
         u64 len_;
         const char8_t* text_;
     };
 
-    struct Bigram
+    struct Candidate
     {
         struct Comparator
         {
-            bool operator()(Bigram& x0, Bigram& x1) const
+            bool operator()(const Candidate& x0, const Candidate& x1) const
             {
-                return (x0.score_ < x1.score_)
-                    || (x0.score_ == x1.score_ && x0.left_ > x1.left_);
+                return (x1.rank_ < x0.rank_)
+                    || (x0.rank_ == x1.rank_ && x0.left_ > x1.left_);
             }
         };
+        u32 rank_;
+        s32 merged_;
         Symbol::index left_;
         Symbol::index right_;
-        float score_;
-        u64 size_;
+        s32 left_id_;
+        s32 right_id_;
     };
 
-    struct Pair
+public:
+    /**
+     * @brief Mutable state of a call of tokenize
+     */
+    class Scratch
     {
-        Symbol::index left_;
-        Symbol::index right_;
+    public:
+        Scratch();
+        ~Scratch();
+        Scratch(Scratch&& other);
+        Scratch& operator=(Scratch&& other);
+
+    private:
+        friend class Tokenizer;
+        Scratch(const Scratch&) = delete;
+        Scratch& operator=(const Scratch&) = delete;
+
+        Array<Symbol> symbols_;
+        PriorityQueue<Candidate, Candidate::Comparator> merge_queue_;
     };
 
+private:
     static u64 length(char c);
     static std::unordered_map<uint8_t, std::u8string> unicode_byte_to_utf8_map();
     static s32 byte_to_token(const Vocabulary& vocab, char8_t c);
-    void try_add_bigram(Symbol::index left, Symbol::index right);
-    void resegment(Array<s32>& output, const Symbol& symbol) const;
+    s32 char_to_token(u64 length, const char8_t* text) const;
+    void split(Array<Symbol>& symbols, u64 size, const char8_t* text) const;
+    void encode(Array<s32>& tokens, Scratch& scratch, u64 size, const char8_t* text) const;
+    void try_add_merge(Scratch& scratch, Symbol::index left, Symbol::index right) const;
+    void build_adjacent();
+    bool separable(char8_t left, char8_t right) const;
 
-    static const char8_t* Pattern;
     char8_t* buffer_;
     Vocabulary vocab_;
-    Array<Symbol> symbols_;
-    PriorityQueue<Bigram> work_queue_;
-    HashMap<String, Pair> rev_merge_;
+    MergeRanks merges_;
+    SpecialTokenMatcher special_tokens_;
+    Array<u64> adjacent_; //!< bit (left << 8) | right is set if a token has the two bytes next to each other
+    s32 ascii_[128];
+    Scratch scratch_;
+};
+
+//--- StreamTokenizer
+//-----------------------------------------------------------
+/**
+ * @brief Tokenize a text which arrives in chunks
+ *
+ * The tokens are those of Tokenizer::tokenize of the whole text.
+ * A special token goes out once no longer one can start at it, the tail as long as the longest stays.
+ * The text before the tail is cut between two bytes no token has next to each other, which no merge crosses.
+ * A tail over max_pending bytes is cut between any two chars, a merge over the cut is lost.
+ * A push scans only the new bytes and the tail, the cursors of the scans stay over pushes.
+ */
+class StreamTokenizer
+{
+public:
+    inline static constexpr u64 DefaultMaxPending = 64 * 1024;
+
+    StreamTokenizer();
+    explicit StreamTokenizer(const Tokenizer& tokenizer, u64 max_pending = DefaultMaxPending);
+    ~StreamTokenizer();
+    StreamTokenizer(StreamTokenizer&& other);
+    StreamTokenizer& operator=(StreamTokenizer&& other);
+
+    /**
+     * @brief Append a chunk, the tokens no more text can change are appended to tokens
+     */
+    void push(Array<s32>& tokens, u64 size, const char8_t* chunk);
+    /**
+     * @brief End of the text, the tokens of the rest are appended to tokens
+     */
+    void finish(Array<s32>& tokens);
+    /**
+     * @brief Bytes waiting for more text
+     */
+    u64 pending() const;
+
+private:
+    StreamTokenizer(const StreamTokenizer&) = delete;
+    StreamTokenizer& operator=(const StreamTokenizer&) = delete;
+
+    u64 flush(Array<s32>& tokens, bool all);
+    void scan(u64 limit);
+
+    const Tokenizer* tokenizer_;
+    u64 max_pending_;
+    u64 searched_; //!< no special token starts before this but the ones taken
+    u64 position_; //!< the last char boundary walked
+    u64 separable_; //!< the last boundary walked which no merge crosses
+    Tokenizer::Scratch scratch_;
+    Array<char8_t> buffer_;
+};
+
+//--- Detokenizer
+//-----------------------------------------------------------
+/**
+ * @brief Text of a stream of tokens
+ *
+ * A UTF-8 char split over tokens waits until its last byte, the rest of a token is a copy of its cached piece.
+ */
+class Detokenizer
+{
+public:
+    Detokenizer();
+    explicit Detokenizer(const Vocabulary& vocab);
+    ~Detokenizer();
+    Detokenizer(Detokenizer&& other);
+    Detokenizer& operator=(Detokenizer&& other);
+
+    /**
+     * @brief Append the text a token completes
+     */
+    void push(std::u8string& text, s32 token);
+    /**
+     * @brief Append the bytes of an unfinished char
+     */
+    void finish(std::u8string& text);
+    /**
+     * @brief Bytes of an unfinished char
+     */
+    u32 pending() const;
+
+private:
+    Detokenizer(const Detokenizer&) = delete;
+    Detokenizer& operator=(const Detokenizer&) = delete;
+
+    const Vocabulary* vocab_;
+    u32 pending_size_;
+    char8_t pending_[4];
 };
 
 //--- Sampler
@@ -1592,11 +2599,35 @@ class Sampler
 {
 public:
     Sampler();
+    Sampler(u32 vocab_size, f32 temperature, f32 topp, u64 seed);
     ~Sampler();
     Sampler(Sampler&& other);
     Sampler& operator=(Sampler&& other);
 
+    struct State
+    {
+        u32 vocab_size_;
+        f32 temperature_;
+        f32 topp_;
+        u64 random_;
+    };
+    State state() const;
+    bool restore(const State& state);
+
     u32 sample(f32* logits);
+
+    /**
+     * @brief Turn logits into the probabilities which sample draws from, after the temperature and the top-p cut
+     */
+    void distribution(f32* logits);
+    /**
+     * @brief Draw from probabilities made by distribution
+     */
+    u32 sample_distribution(const f32* probabilities);
+    /**
+     * @brief Uniform random number in [0, 1)
+     */
+    f32 uniform();
 private:
     Sampler(const Sampler&) = delete;
     Sampler& operator=(const Sampler&) = delete;
@@ -1625,20 +2656,38 @@ struct Config
     u64 num_kv_heads_;
     u64 vocab_size_;
     u64 sequence_length_;
+    f32 rms_epsilon_;
 };
 
+/**
+ * @brief Activation buffers, all are views of one arena planned by liveness
+ *
+ * A single token buffer is the first row of its batch buffer, forward and forward_batch never run at once.
+ */
 struct Context
 {
+    Tensor arena_;
+    Tensor scratch_; // dequantized weight rows
     Tensor x_; // activation at current time stamp
     Tensor xb_; // activation, but inside a resdual branch
-    Tensor xb2_; // additional buffer
     Tensor hb_; // buffer for hidden dimension in the ffn
-    Tensor hb2_; // buffer for hidden dimension in the ffn
     Tensor query_; // query
-    Tensor attn_; // buffer for scores/attention values
+    Tensor key_; // key of the current position
+    Tensor value_; // value of the current position
+    Tensor attn_; // buffer for scores/attention values, num_heads x sequence length
     Tensor logits_; // output logits
-    Tensor key_cache_;
-    Tensor value_cache_;
+    KVCache cache_;
+
+    // batch buffers, batch_size_ rows of the above
+    u64 batch_size_;
+    Array<BatchRow> batch_rows_;
+    Tensor batch_x_;
+    Tensor batch_xb_;
+    Tensor batch_hb_;
+    Tensor batch_query_;
+    Tensor batch_key_;
+    Tensor batch_value_;
+    Tensor batch_logits_;
 };
 
 //--- Llama2
@@ -1655,22 +2704,424 @@ public:
 }
     */
     Llama2();
-    explicit Llama2(const Config& config);
+    /**
+     * @brief Build the model from "llama.*" metadata and tensors, weights refer to the memory of model_data
+     * @param kv_window ... window of the KVCache, 0 keeps whole the context
+     * @param kv_sinks ... sinks of the KVCache
+     * @param batch_size ... maximum number of rows of a batched forward
+     */
+    explicit Llama2(const gguf::GGUF& model_data, u64 kv_window = 0, u64 kv_sinks = 0, u64 batch_size = 64);
     Llama2(Llama2&& other);
     virtual ~Llama2();
     Llama2& operator=(Llama2&& other);
 
+    static bool load_config(Config& config, const gguf::GGUF& model_data);
+
+    /**
+     * @brief Whether all tensors are found
+     */
+    bool valid() const;
+    const Config& config() const;
+    Sampler& sampler();
+    KVCache& cache();
+    u64 batch_size() const;
+
+    /**
+     * @brief Run a token at a position
+     * @return logits of the next token, vocab_size_ elements
+     */
+    f32* forward(u32 token, u64 position);
+
+    /**
+     * @brief Run a prompt of count tokens from a position, in chunks of the batch size
+     *
+     * Equivalent to calling forward for each token, but a weight matrix is read once per chunk.
+     * @return logits of the token next to the last, vocab_size_ elements
+     */
+    f32* prefill(const u32* tokens, u64 count, u64 position);
+
+    /**
+     * @brief Run up to batch_size rows at once, every weight matrix is read once for all the rows
+     * @return logits of the rows flagged BatchRow::logits_ in order, vocab_size_ elements each
+     */
+    f32* forward_batch(const BatchRow* rows, u64 count);
+
 private:
     Llama2(const Llama2&) = delete;
     Llama2& operator=(const Llama2&) = delete;
-    void forward(u32 token, u32 position);
 
     Config config_;
     Sampler sampler_;
     Context context_;
+    RotaryEmbedding rope_;
+    Tensor token_embedding_;
     TransformerBlock* blocks_;
     RMSNorm output_rmsnorm_;
     Tensor output_weight_;
 };
+
+//--- Scheduler
+//-----------------------------------------------------------
+/**
+ * @brief Continuous batching of concurrent sequences over a model
+ *
+ * Every step runs one batched forward of all the active sequences, each at its own position in its own cache.
+ * A new sequence joins at the next step with its prompt, a finished one leaves the batch.
+ *
+ * With a token budget, a step is limited to that many rows. Decoding sequences are scheduled first with a row each,
+ * then prompts fill the rest of the budget in chunks in the order of arrival,
+ * so that a long prompt never stalls the decoding ones.
+ */
+class Scheduler
+{
+public:
+    static constexpr s32 Invalid = -1;
+
+    enum class State : u8
+    {
+        Free,
+        Prefill,
+        Decode,
+        Finished,
+    };
+
+    Scheduler();
+    /**
+     * @param max_sequences ... number of sequences kept at once, caches are allocated up front
+     * @param eos_token ... a sequence finishes when it samples this
+     */
+    Scheduler(Llama2& model, u32 max_sequences, u32 eos_token = 2, u64 kv_window = 0, u64 kv_sinks = 0);
+    ~Scheduler();
+    Scheduler(Scheduler&& other);
+    Scheduler& operator=(Scheduler&& other);
+
+    /**
+     * @brief Add a sequence, it joins the batch at the next step
+     * @param max_tokens ... maximum number of generated tokens, zero finishes after the prompt without a token
+     * @return id of the sequence, Invalid if there is no free slot
+     */
+    s32 add(const u32* prompt, u64 count, u64 max_tokens, f32 temperature = 0.0f, f32 topp = 0.9f, u64 seed = 12345ULL);
+    /**
+     * @brief Free a slot, the generated tokens are discarded
+     */
+    void release(s32 id);
+
+    /**
+     * @brief Run one forward over all the active sequences and sample a token for each
+     * @return number of active sequences after the step
+     */
+    u32 step();
+
+    /**
+     * @brief Maximum number of rows of a step, 0 runs every prompt whole
+     *
+     * A budget larger than max_sequences leaves room for prompts while all the others are decoding.
+     */
+    void set_token_budget(u64 token_budget);
+    u64 token_budget() const;
+    /**
+     * @brief Number of rows of the last step
+     */
+    u64 rows() const;
+
+    u32 active() const;
+    State state(s32 id) const;
+    /**
+     * @brief Tokens generated so far
+     */
+    const u32* generated(s32 id, u64& count) const;
+
+    inline s64 time() const
+    {
+        return duration_;
+    }
+
+private:
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    struct Sequence
+    {
+        State state_ = State::Free;
+        KVCache cache_;
+        Sampler sampler_;
+        Array<u32> tokens_; //!< prompt followed by generated tokens
+        u64 prompt_length_ = 0;
+        u64 position_ = 0; //!< number of tokens in the cache
+        u64 max_tokens_ = 0;
+        u64 arrival_ = 0;
+        u64 scheduled_ = 0; //!< number of rows in the current step
+    };
+
+    void schedule(u32 index, u64 count);
+    void finish_step(Sequence& sequence, u32 token);
+
+    s64 duration_;
+    Llama2* model_;
+    u32 max_sequences_;
+    u32 eos_token_;
+    u64 token_budget_;
+    u64 arrivals_;
+    Sequence* sequences_;
+    Array<BatchRow> rows_;
+    Array<u32> owners_; //!< sequence of each row of the logits
+    Array<u32> waiting_; //!< prompts by arrival
+};
+
+//--- SpeculativeDecoder
+//-----------------------------------------------------------
+/**
+ * @brief Speculative decoding of a target model with a small draft model of the same vocabulary
+ *
+ * The draft proposes tokens one by one, the target verifies all of them in one batched forward.
+ * A proposal x is accepted with probability min(1, p(x)/q(x)), and the first rejected one is replaced by a draw from max(0, p - q),
+ * so that the output follows the target's distribution. The caches of both models roll back the rejected positions.
+ *
+ * Without a draft model, proposals are looked up in the prompt and the history instead (prompt lookup decoding).
+ * The last n tokens are matched against an index of n-grams, and the tokens which followed the latest match are proposed.
+ */
+class SpeculativeDecoder
+{
+public:
+    SpeculativeDecoder();
+    /**
+     * @param num_draft ... number of tokens proposed at a step, less than the batch size of the target
+     */
+    SpeculativeDecoder(Llama2& target, Llama2& draft, u32 num_draft, f32 temperature = 0.0f, f32 topp = 0.9f, u64 seed = 12345ULL);
+    /**
+     * @brief Prompt lookup decoding without a draft model
+     * @param ngram_size ... longest n-gram to match, shorter ones are tried when it fails
+     */
+    SpeculativeDecoder(Llama2& target, u32 num_draft, u32 ngram_size, f32 temperature = 0.0f, f32 topp = 0.9f, u64 seed = 12345ULL);
+    ~SpeculativeDecoder();
+    SpeculativeDecoder(SpeculativeDecoder&& other);
+    SpeculativeDecoder& operator=(SpeculativeDecoder&& other);
+
+    /**
+     * @brief Run a prompt on both models, and sample the first token
+     */
+    void start(const u32* prompt, u64 count);
+    /**
+     * @brief Propose and verify
+     * @return number of generated tokens, 1 to num_draft + 1, 0 if the cache is full
+     */
+    u64 step();
+
+    /**
+     * @brief Tokens generated so far
+     */
+    const u32* generated(u64& count) const;
+    /**
+     * @brief Number of proposed tokens
+     */
+    u64 drafted() const;
+    /**
+     * @brief Number of accepted proposals
+     */
+    u64 accepted() const;
+
+    inline s64 time() const
+    {
+        return duration_;
+    }
+
+private:
+    SpeculativeDecoder(const SpeculativeDecoder&) = delete;
+    SpeculativeDecoder& operator=(const SpeculativeDecoder&) = delete;
+
+    /**
+     * @brief Propose up to k tokens following the last one by the draft model
+     * @return number of proposals
+     */
+    u64 propose_draft(u64 k);
+    /**
+     * @brief Propose up to k tokens following the last one from the n-gram index
+     * @return number of proposals
+     */
+    u64 propose_lookup(u64 k);
+    u64 hash_ngram(u64 end, u32 n) const;
+
+    s64 duration_;
+    Llama2* target_;
+    Llama2* draft_;
+    u32 num_draft_;
+    u32 ngram_size_;
+    u64 indexed_; //!< n-grams ending before this are in the index
+    HashMap<u64, u32> ngrams_; //!< n-gram to the position following its latest occurrence
+    Sampler sampler_;
+    Sampler draft_sampler_;
+    Array<u32> tokens_; //!< prompt followed by generated tokens
+    Array<BatchRow> rows_;
+    u64 prompt_length_;
+    u64 position_; //!< number of tokens in the cache of the target
+    u64 draft_position_; //!< number of tokens in the cache of the draft
+    u64 drafted_;
+    u64 accepted_;
+    Tensor probabilities_; //!< num_draft x vocab_size of the draft
+};
+
+//--- Generation
+//-----------------------------------------------------------
+struct GenerationParams
+{
+    u32 max_tokens_ = 256;
+    u32 eos_token_ = 2; //!< not yielded, ends the generation
+    f32 temperature_ = 0.0f;
+    f32 topp_ = 0.9f;
+    u64 seed_ = 12345ULL;
+    u64 kv_window_ = 0;
+    u64 kv_sinks_ = 0;
+};
+
+/**
+ * @brief Latencies of a generation in microseconds
+ */
+struct GenerationStats
+{
+    s64 time_to_first_token_; //!< from the creation to the first token
+    s64 inter_token_total_; //!< sum of the intervals between tokens
+    s64 inter_token_max_;
+    u64 num_tokens_;
+
+    inline s64 inter_token_mean() const
+    {
+        return 1 < num_tokens_ ? inter_token_total_ / static_cast<s64>(num_tokens_ - 1) : 0;
+    }
+};
+
+/**
+ * @brief A lazy stream of generated tokens, a coroutine which yields a token per resume
+ *
+ * The coroutine owns the cache and the sampler of the stream, and shares only the weights and the activation buffers of the model.
+ * So that many generations can be interleaved on one model by resuming them in turn,
+ * as long as resumes of the generations on the same model do not run at once. Each thread should have its own model.
+ * Cancelling or destroying a generation frees its frame and its cache.
+ */
+class Generation
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct promise_type
+    {
+        const Tokenizer* tokenizer_ = nullptr;
+        Detokenizer detokenizer_;
+        u32 token_ = 0;
+        std::u8string text_; //!< text the token completes, when generated with a tokenizer, then the rest at the end
+        Clock::time_point start_ = Clock::now();
+        Clock::time_point last_;
+        GenerationStats stats_ = {};
+
+        promise_type();
+        /**
+         * @brief Made from the arguments of generate
+         */
+        promise_type(Llama2& model, const Tokenizer* tokenizer, const Array<u32>& prompt, const GenerationParams& params);
+        Generation get_return_object();
+        inline std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+        inline std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_always yield_value(u32 token) noexcept;
+        void return_void() noexcept;
+        void unhandled_exception();
+    };
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    Generation();
+    ~Generation();
+    Generation(Generation&& other);
+    Generation& operator=(Generation&& other);
+
+    /**
+     * @brief Run until the next token
+     * @return false at the end or after cancel
+     */
+    bool next();
+    u32 token() const;
+    /**
+     * @brief Text the token completes, after next returns false the bytes of a char the end cut
+     */
+    const std::u8string& text() const;
+    bool done() const;
+    void cancel();
+    const GenerationStats& stats() const;
+
+private:
+    Generation(const Generation&) = delete;
+    Generation& operator=(const Generation&) = delete;
+    explicit Generation(handle_type handle);
+
+    handle_type handle_;
+    GenerationStats stats_; //!< kept after cancel
+};
+
+/**
+ * @brief Prefill a prompt then decode and sample a token per resume
+ * @param tokenizer ... fills the text of each token if not null
+ */
+Generation generate(Llama2& model, const Tokenizer* tokenizer, Array<u32> prompt, GenerationParams params);
+/**
+ * @brief Tokenize a prompt after the BOS token, then generate with its text
+ */
+Generation generate(Llama2& model, Tokenizer& tokenizer, const std::u8string& prompt, const GenerationParams& params);
+
+//--- Scorer
+//-----------------------------------------------------------
+/**
+ * @brief Log-probabilities of given tokens without sampling, for perplexity and ranking of candidates
+ *
+ * Tokens run through batched forwards with the logits of every row, a row scores the token which follows it.
+ * Candidates sharing a prefix continue from its cache, so that the prefix runs once.
+ */
+class Scorer
+{
+public:
+    Scorer();
+    explicit Scorer(Llama2& model);
+    ~Scorer();
+    Scorer(Scorer&& other);
+    Scorer& operator=(Scorer&& other);
+
+    /**
+     * @brief Log-probabilities of the tokens after the first
+     * @param log_probs ... count - 1 elements
+     * @return false if the tokens exceed the context
+     */
+    bool score(f32* log_probs, const u32* tokens, u64 count);
+
+    /**
+     * @brief Log-probabilities of the tokens of candidates following a prefix
+     * @param log_probs ... sum of counts elements, the candidates in order
+     * @return false if the prefix and a candidate exceed the context
+     */
+    bool score_candidates(f32* log_probs, const u32* prefix, u64 prefix_count, u64 num_candidates, const u32* const* candidates, const u64* counts);
+
+    inline s64 time() const
+    {
+        return duration_;
+    }
+
+private:
+    Scorer(const Scorer&) = delete;
+    Scorer& operator=(const Scorer&) = delete;
+
+    /**
+     * @brief Run tokens from a position
+     * @param log_probs ... count - 1 elements, or nullptr
+     * @param last_logits ... logits of the last token, or nullptr
+     */
+    void run(f32* log_probs, const u32* tokens, u64 count, u64 position, f32* last_logits);
+
+    s64 duration_;
+    Llama2* model_;
+    KVCache cache_;
+    Array<BatchRow> rows_;
+    Tensor prefix_logits_;
+};
 } // namespace cppgpt
 #endif // INC_CPPGPT_H_
@@ -495,6 +495,12 @@ public:
     uint64_t getNumTensors() const;
     const gguf_tensor_info_t& getTensor(uint64_t x) const;
     const void* getTensorData(uint64_t x) const;
+    GGUFString getTensorName(uint64_t x) const;
+    /**
+     * @brief Get a dimension of a tensor, the first one is the innermost
+     */
+    uint64_t getTensorDimension(uint64_t x, uint32_t index) const;
+    bool findTensor(uint64_t& x, const char8_t* name) const;
 
 private:
     GGUF(const GGUF&) = delete;
@@ -1,11 +1,22 @@
 #include "cppgpt.h"
 #include <algorithm>
+#include <atomic>
 #include <bit>
 #include <cmath>
+#include <cstdio>
 #include <functional>
 #include <immintrin.h>
 #include <mimalloc-2.1/mimalloc.h>
 #include <optional>
+#include <thread>
+#ifdef _MSC_VER
+#    include <Windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
 
 // new/delete
 void* operator new(std::size_t size)
@@ -198,6 +209,27 @@ namespace
         return map;
     }
 
+    u64 utf8_length(char8_t c)
+    {
+        static const u64 lookup[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
+        return lookup[static_cast<uint8_t>(c) >> 4];
+    }
+
+    /**
+     * @brief Length of a text without a char cut at the end
+     */
+    u64 utf8_complete(u64 size, const char8_t* text)
+    {
+        // the last lead byte within a char length from the end
+        for(u64 i = 1; i <= 4 && i <= size; ++i) {
+            char8_t c = text[size - i];
+            if(0x80U != (c & 0xC0U)) {
+                return i < utf8_length(c) ? size - i : size;
+            }
+        }
+        return size;
+    }
+
     const std::u8string& unicode_byte_to_utf8(char8_t byte)
     {
         static std::unordered_map<char8_t, std::u8string> map = unicode_byte_to_utf8_map();
@@ -400,11 +432,22 @@ namespace
     }
 } // namespace
 
+namespace
+{
+    std::atomic<u64> allocation_count_ = 0;
+}
+
 void* allocate(size_t size, size_t align)
 {
+    allocation_count_.fetch_add(1, std::memory_order_relaxed);
     return mi_malloc_aligned(size, align);
 }
 
+u64 allocation_count()
+{
+    return allocation_count_.load(std::memory_order_relaxed);
+}
+
 void deallocate(void* ptr, size_t align)
 {
     mi_free_aligned(ptr, align);
@@ -459,6 +502,16 @@ void Random::srand(uint64_t seed)
     }
 }
 
+uint64_t Random::state() const
+{
+    return state_;
+}
+
+void Random::set_state(uint64_t state)
+{
+    state_ = state;
+}
+
 uint32_t Random::rand()
 {
     uint64_t x = state_;
@@ -762,6 +815,166 @@ u32 next_prime(u32 x)
     return *bound;
 }
 
+//--- MinimalPerfectHash
+//-----------------------------------------------------------
+MinimalPerfectHash::MinimalPerfectHash()
+    : size_(0)
+    , num_buckets_(0)
+{
+}
+
+MinimalPerfectHash::~MinimalPerfectHash()
+{
+}
+
+MinimalPerfectHash::MinimalPerfectHash(MinimalPerfectHash&& other)
+    : size_(other.size_)
+    , num_buckets_(other.num_buckets_)
+    , pilots_(std::move(other.pilots_))
+{
+    other.size_ = 0;
+    other.num_buckets_ = 0;
+}
+
+MinimalPerfectHash& MinimalPerfectHash::operator=(MinimalPerfectHash&& other)
+{
+    if(this != &other) {
+        size_ = other.size_;
+        num_buckets_ = other.num_buckets_;
+        pilots_ = std::move(other.pilots_);
+        other.size_ = 0;
+        other.num_buckets_ = 0;
+    }
+    return *this;
+}
+
+bool MinimalPerfectHash::build(u64 size, const u64* hashes)
+{
+    assert(0 == size || nullptr != hashes);
+    size_ = size;
+    num_buckets_ = (std::max)((size + BucketSize - 1) / BucketSize, static_cast<u64>(1));
+    pilots_.resize(num_buckets_);
+    ::memset(&pilots_[0], 0, sizeof(u32) * num_buckets_);
+    if(size <= 0) {
+        return true;
+    }
+
+    // hashes by bucket
+    Array<u64> offsets;
+    offsets.resize(num_buckets_ + 1);
+    ::memset(&offsets[0], 0, sizeof(u64) * (num_buckets_ + 1));
+    for(u64 i = 0; i < size; ++i) {
+        ++offsets[bucket(hashes[i]) + 1];
+    }
+    for(u64 i = 0; i < num_buckets_; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    Array<u64> sorted;
+    Array<u64> cursors;
+    sorted.resize(size);
+    cursors.resize(num_buckets_);
+    ::memcpy(&cursors[0], &offsets[0], sizeof(u64) * num_buckets_);
+    for(u64 i = 0; i < size; ++i) {
+        sorted[cursors[bucket(hashes[i])]++] = hashes[i];
+    }
+
+    // the fuller buckets take the slots first, while most are free
+    Array<u32> order;
+    order.resize(num_buckets_);
+    u64 max_count = 0;
+    for(u64 i = 0; i < num_buckets_; ++i) {
+        order[i] = static_cast<u32>(i);
+        max_count = (std::max)(max_count, offsets[i + 1] - offsets[i]);
+    }
+    std::stable_sort(&order[0], &order[0] + num_buckets_, [&offsets](u32 x0, u32 x1) {
+        return (offsets[x1 + 1] - offsets[x1]) < (offsets[x0 + 1] - offsets[x0]);
+    });
+
+    Array<u8> taken;
+    Array<u64> slots;
+    taken.resize(size);
+    ::memset(&taken[0], 0, size);
+    slots.resize(max_count);
+    for(u64 i = 0; i < num_buckets_; ++i) {
+        u32 b = order[i];
+        u64 begin = offsets[b];
+        u64 count = offsets[b + 1] - begin;
+        if(count <= 0) {
+            break;
+        }
+        // equal hashes never separate
+        std::sort(&sorted[begin], &sorted[begin] + count);
+        for(u64 j = 1; j < count; ++j) {
+            if(sorted[begin + j - 1] == sorted[begin + j]) {
+                return false;
+            }
+        }
+        for(u32 pilot = 0;; ++pilot) {
+            bool found = true;
+            for(u64 j = 0; j < count && found; ++j) {
+                slots[j] = slot(sorted[begin + j], pilot);
+                found = 0 == taken[slots[j]];
+                for(u64 k = 0; k < j && found; ++k) {
+                    found = slots[k] != slots[j];
+                }
+            }
+            if(found) {
+                for(u64 j = 0; j < count; ++j) {
+                    taken[slots[j]] = 1;
+                }
+                pilots_[b] = pilot;
+                break;
+            }
+            if(MaxPilot <= pilot) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool MinimalPerfectHash::restore(u64 size, u64 num_pilots, const u32* pilots)
+{
+    if(size <= 0 && num_pilots <= 0) {
+        // never built
+        size_ = 0;
+        num_buckets_ = 0;
+        pilots_.clear();
+        return true;
+    }
+    u64 num_buckets = (std::max)((size + BucketSize - 1) / BucketSize, static_cast<u64>(1));
+    if(num_pilots != num_buckets) {
+        return false;
+    }
+    assert(nullptr != pilots);
+    size_ = size;
+    num_buckets_ = num_buckets;
+    pilots_.resize(num_buckets_);
+    ::memcpy(&pilots_[0], pilots, sizeof(u32) * num_buckets_);
+    return true;
+}
+
+u64 MinimalPerfectHash::size() const
+{
+    return size_;
+}
+
+u64 MinimalPerfectHash::num_buckets() const
+{
+    return num_buckets_;
+}
+
+const u32* MinimalPerfectHash::pilots() const
+{
+    return 0 < pilots_.size() ? &pilots_[0] : nullptr;
+}
+
+u64 MinimalPerfectHash::operator()(u64 hash) const
+{
+    assert(0 < size_);
+    return slot(hash, pilots_[bucket(hash)]);
+}
+
 namespace util
 {
     void copy1(u32 bits, u64 size, void* dst, const void* src)
@@ -1255,6 +1468,339 @@ namespace util
             dstf[i] = static_cast<f32>(src64[i]);
         }
     }
+    //--- ggml block quantization
+    inline static constexpr u64 QK4_0 = 32;
+    inline static constexpr u64 QK4_1 = 32;
+    inline static constexpr u64 QK5_0 = 32;
+    inline static constexpr u64 QK5_1 = 32;
+    inline static constexpr u64 QK8_0 = 32;
+    inline static constexpr u64 QK_K = 256;
+    inline static constexpr u64 K_SCALE_SIZE = 12;
+
+    struct BlockQ4_0
+    {
+        u16 d_;
+        u8 qs_[QK4_0 / 2];
+    };
+    struct BlockQ4_1
+    {
+        u16 d_;
+        u16 m_;
+        u8 qs_[QK4_1 / 2];
+    };
+    struct BlockQ5_0
+    {
+        u16 d_;
+        u8 qh_[4];
+        u8 qs_[QK5_0 / 2];
+    };
+    struct BlockQ5_1
+    {
+        u16 d_;
+        u16 m_;
+        u8 qh_[4];
+        u8 qs_[QK5_1 / 2];
+    };
+    struct BlockQ8_0
+    {
+        u16 d_;
+        s8 qs_[QK8_0];
+    };
+    struct BlockQ2_K
+    {
+        u8 scales_[QK_K / 16];
+        u8 qs_[QK_K / 4];
+        u16 d_;
+        u16 dmin_;
+    };
+    struct BlockQ3_K
+    {
+        u8 hmask_[QK_K / 8];
+        u8 qs_[QK_K / 4];
+        u8 scales_[K_SCALE_SIZE];
+        u16 d_;
+    };
+    struct BlockQ4_K
+    {
+        u16 d_;
+        u16 dmin_;
+        u8 scales_[K_SCALE_SIZE];
+        u8 qs_[QK_K / 2];
+    };
+    struct BlockQ5_K
+    {
+        u16 d_;
+        u16 dmin_;
+        u8 scales_[K_SCALE_SIZE];
+        u8 qh_[QK_K / 8];
+        u8 qs_[QK_K / 2];
+    };
+    struct BlockQ6_K
+    {
+        u8 ql_[QK_K / 2];
+        u8 qh_[QK_K / 4];
+        s8 scales_[QK_K / 16];
+        u16 d_;
+    };
+    struct BlockQ8_K
+    {
+        f32 d_;
+        s8 qs_[QK_K];
+        s16 bsums_[QK_K / 16];
+    };
+    static_assert(sizeof(BlockQ4_0) == 18);
+    static_assert(sizeof(BlockQ4_1) == 20);
+    static_assert(sizeof(BlockQ5_0) == 22);
+    static_assert(sizeof(BlockQ5_1) == 24);
+    static_assert(sizeof(BlockQ8_0) == 34);
+    static_assert(sizeof(BlockQ2_K) == 84);
+    static_assert(sizeof(BlockQ3_K) == 110);
+    static_assert(sizeof(BlockQ4_K) == 144);
+    static_assert(sizeof(BlockQ5_K) == 176);
+    static_assert(sizeof(BlockQ6_K) == 210);
+    static_assert(sizeof(BlockQ8_K) == 292);
+
+    inline f32 f16_to_f32(u16 x)
+    {
+        return _cvtsh_ss(x);
+    }
+
+    void dequantize_q4_0(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ4_0* blocks = static_cast<const BlockQ4_0*>(src);
+        for(u64 i = 0; i < size / QK4_0; ++i, dst += QK4_0) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            for(u64 j = 0; j < QK4_0 / 2; ++j) {
+                dst[j] = ((blocks[i].qs_[j] & 0x0F) - 8) * d;
+                dst[j + QK4_0 / 2] = ((blocks[i].qs_[j] >> 4) - 8) * d;
+            }
+        }
+    }
+
+    void dequantize_q4_1(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ4_1* blocks = static_cast<const BlockQ4_1*>(src);
+        for(u64 i = 0; i < size / QK4_1; ++i, dst += QK4_1) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            const f32 m = f16_to_f32(blocks[i].m_);
+            for(u64 j = 0; j < QK4_1 / 2; ++j) {
+                dst[j] = (blocks[i].qs_[j] & 0x0F) * d + m;
+                dst[j + QK4_1 / 2] = (blocks[i].qs_[j] >> 4) * d + m;
+            }
+        }
+    }
+
+    void dequantize_q5_0(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ5_0* blocks = static_cast<const BlockQ5_0*>(src);
+        for(u64 i = 0; i < size / QK5_0; ++i, dst += QK5_0) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            u32 qh;
+            ::memcpy(&qh, blocks[i].qh_, sizeof(u32));
+            for(u64 j = 0; j < QK5_0 / 2; ++j) {
+                const u8 xh0 = ((qh >> j) << 4) & 0x10;
+                const u8 xh1 = (qh >> (j + 12)) & 0x10;
+                dst[j] = (static_cast<s32>((blocks[i].qs_[j] & 0x0F) | xh0) - 16) * d;
+                dst[j + QK5_0 / 2] = (static_cast<s32>((blocks[i].qs_[j] >> 4) | xh1) - 16) * d;
+            }
+        }
+    }
+
+    void dequantize_q5_1(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ5_1* blocks = static_cast<const BlockQ5_1*>(src);
+        for(u64 i = 0; i < size / QK5_1; ++i, dst += QK5_1) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            const f32 m = f16_to_f32(blocks[i].m_);
+            u32 qh;
+            ::memcpy(&qh, blocks[i].qh_, sizeof(u32));
+            for(u64 j = 0; j < QK5_1 / 2; ++j) {
+                const u8 xh0 = ((qh >> j) << 4) & 0x10;
+                const u8 xh1 = (qh >> (j + 12)) & 0x10;
+                dst[j] = ((blocks[i].qs_[j] & 0x0F) | xh0) * d + m;
+                dst[j + QK5_1 / 2] = ((blocks[i].qs_[j] >> 4) | xh1) * d + m;
+            }
+        }
+    }
+
+    void dequantize_q8_0(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ8_0* blocks = static_cast<const BlockQ8_0*>(src);
+        for(u64 i = 0; i < size / QK8_0; ++i, dst += QK8_0) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            for(u64 j = 0; j < QK8_0; ++j) {
+                dst[j] = blocks[i].qs_[j] * d;
+            }
+        }
+    }
+
+    void dequantize_q2_k(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ2_K* blocks = static_cast<const BlockQ2_K*>(src);
+        for(u64 i = 0; i < size / QK_K; ++i) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            const f32 dmin = f16_to_f32(blocks[i].dmin_);
+            const u8* q = blocks[i].qs_;
+            u32 is = 0;
+            for(u64 n = 0; n < QK_K; n += 128, q += 32) {
+                u32 shift = 0;
+                for(u32 j = 0; j < 4; ++j, shift += 2) {
+                    u8 sc = blocks[i].scales_[is++];
+                    f32 dl = d * (sc & 0x0F);
+                    f32 ml = dmin * (sc >> 4);
+                    for(u32 l = 0; l < 16; ++l) {
+                        *dst++ = dl * ((q[l] >> shift) & 3) - ml;
+                    }
+                    sc = blocks[i].scales_[is++];
+                    dl = d * (sc & 0x0F);
+                    ml = dmin * (sc >> 4);
+                    for(u32 l = 0; l < 16; ++l) {
+                        *dst++ = dl * ((q[l + 16] >> shift) & 3) - ml;
+                    }
+                }
+            }
+        }
+    }
+
+    void dequantize_q3_k(u64 size, f32* dst, const void* src)
+    {
+        static constexpr u32 kmask1 = 0x03030303UL;
+        static constexpr u32 kmask2 = 0x0F0F0F0FUL;
+        const BlockQ3_K* blocks = static_cast<const BlockQ3_K*>(src);
+        for(u64 i = 0; i < size / QK_K; ++i) {
+            const f32 d_all = f16_to_f32(blocks[i].d_);
+            const u8* q = blocks[i].qs_;
+            const u8* hm = blocks[i].hmask_;
+            u8 m = 1;
+
+            // unpack 16 6bit scales
+            u32 aux[4];
+            ::memcpy(aux, blocks[i].scales_, K_SCALE_SIZE);
+            u32 tmp = aux[2];
+            aux[2] = ((aux[0] >> 4) & kmask2) | (((tmp >> 4) & kmask1) << 4);
+            aux[3] = ((aux[1] >> 4) & kmask2) | (((tmp >> 6) & kmask1) << 4);
+            aux[0] = (aux[0] & kmask2) | (((tmp >> 0) & kmask1) << 4);
+            aux[1] = (aux[1] & kmask2) | (((tmp >> 2) & kmask1) << 4);
+            const s8* scales = reinterpret_cast<const s8*>(aux);
+
+            u32 is = 0;
+            for(u64 n = 0; n < QK_K; n += 128, q += 32) {
+                u32 shift = 0;
+                for(u32 j = 0; j < 4; ++j, shift += 2, m <<= 1) {
+                    f32 dl = d_all * (scales[is++] - 32);
+                    for(u32 l = 0; l < 16; ++l) {
+                        *dst++ = dl * (static_cast<s32>((q[l] >> shift) & 3) - ((hm[l] & m) ? 0 : 4));
+                    }
+                    dl = d_all * (scales[is++] - 32);
+                    for(u32 l = 0; l < 16; ++l) {
+                        *dst++ = dl * (static_cast<s32>((q[l + 16] >> shift) & 3) - ((hm[l + 16] & m) ? 0 : 4));
+                    }
+                }
+            }
+        }
+    }
+
+    inline void get_scale_min_k4(u32 j, const u8* q, u8& d, u8& m)
+    {
+        if(j < 4) {
+            d = q[j] & 63;
+            m = q[j + 4] & 63;
+        } else {
+            d = (q[j + 4] & 0x0F) | ((q[j - 4] >> 6) << 4);
+            m = (q[j + 4] >> 4) | ((q[j - 0] >> 6) << 4);
+        }
+    }
+
+    void dequantize_q4_k(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ4_K* blocks = static_cast<const BlockQ4_K*>(src);
+        for(u64 i = 0; i < size / QK_K; ++i) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            const f32 dmin = f16_to_f32(blocks[i].dmin_);
+            const u8* q = blocks[i].qs_;
+            u32 is = 0;
+            for(u64 j = 0; j < QK_K; j += 64, q += 32, is += 2) {
+                u8 sc;
+                u8 m;
+                get_scale_min_k4(is + 0, blocks[i].scales_, sc, m);
+                const f32 d1 = d * sc;
+                const f32 m1 = dmin * m;
+                get_scale_min_k4(is + 1, blocks[i].scales_, sc, m);
+                const f32 d2 = d * sc;
+                const f32 m2 = dmin * m;
+                for(u32 l = 0; l < 32; ++l) {
+                    *dst++ = d1 * (q[l] & 0x0F) - m1;
+                }
+                for(u32 l = 0; l < 32; ++l) {
+                    *dst++ = d2 * (q[l] >> 4) - m2;
+                }
+            }
+        }
+    }
+
+    void dequantize_q5_k(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ5_K* blocks = static_cast<const BlockQ5_K*>(src);
+        for(u64 i = 0; i < size / QK_K; ++i) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            const f32 dmin = f16_to_f32(blocks[i].dmin_);
+            const u8* ql = blocks[i].qs_;
+            const u8* qh = blocks[i].qh_;
+            u32 is = 0;
+            u8 u1 = 1;
+            u8 u2 = 2;
+            for(u64 j = 0; j < QK_K; j += 64, ql += 32, is += 2, u1 <<= 2, u2 <<= 2) {
+                u8 sc;
+                u8 m;
+                get_scale_min_k4(is + 0, blocks[i].scales_, sc, m);
+                const f32 d1 = d * sc;
+                const f32 m1 = dmin * m;
+                get_scale_min_k4(is + 1, blocks[i].scales_, sc, m);
+                const f32 d2 = d * sc;
+                const f32 m2 = dmin * m;
+                for(u32 l = 0; l < 32; ++l) {
+                    *dst++ = d1 * ((ql[l] & 0x0F) + ((qh[l] & u1) ? 16 : 0)) - m1;
+                }
+                for(u32 l = 0; l < 32; ++l) {
+                    *dst++ = d2 * ((ql[l] >> 4) + ((qh[l] & u2) ? 16 : 0)) - m2;
+                }
+            }
+        }
+    }
+
+    void dequantize_q6_k(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ6_K* blocks = static_cast<const BlockQ6_K*>(src);
+        for(u64 i = 0; i < size / QK_K; ++i) {
+            const f32 d = f16_to_f32(blocks[i].d_);
+            const u8* ql = blocks[i].ql_;
+            const u8* qh = blocks[i].qh_;
+            const s8* sc = blocks[i].scales_;
+            for(u64 n = 0; n < QK_K; n += 128, dst += 128, ql += 64, qh += 32, sc += 8) {
+                for(u32 l = 0; l < 32; ++l) {
+                    u32 is = l / 16;
+                    const s32 q1 = static_cast<s32>((ql[l + 0] & 0x0F) | (((qh[l] >> 0) & 3) << 4)) - 32;
+                    const s32 q2 = static_cast<s32>((ql[l + 32] & 0x0F) | (((qh[l] >> 2) & 3) << 4)) - 32;
+                    const s32 q3 = static_cast<s32>((ql[l + 0] >> 4) | (((qh[l] >> 4) & 3) << 4)) - 32;
+                    const s32 q4 = static_cast<s32>((ql[l + 32] >> 4) | (((qh[l] >> 6) & 3) << 4)) - 32;
+                    dst[l + 0] = d * sc[is + 0] * q1;
+                    dst[l + 32] = d * sc[is + 2] * q2;
+                    dst[l + 64] = d * sc[is + 4] * q3;
+                    dst[l + 96] = d * sc[is + 6] * q4;
+                }
+            }
+        }
+    }
+
+    void dequantize_q8_k(u64 size, f32* dst, const void* src)
+    {
+        const BlockQ8_K* blocks = static_cast<const BlockQ8_K*>(src);
+        for(u64 i = 0; i < size / QK_K; ++i, dst += QK_K) {
+            for(u64 j = 0; j < QK_K; ++j) {
+                dst[j] = blocks[i].d_ * blocks[i].qs_[j];
+            }
+        }
+    }
 } // namespace util
 
 //--- Timer
@@ -1273,6 +1819,93 @@ Timer::~Timer()
     duration_ = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
 }
 
+//--- MemoryPlan
+//-----------------------------------------------------------
+MemoryPlan::MemoryPlan()
+    : size_(0)
+{
+}
+
+MemoryPlan::~MemoryPlan()
+{
+}
+
+MemoryPlan::MemoryPlan(MemoryPlan&& other)
+    : buffers_(std::move(other.buffers_))
+    , size_(other.size_)
+{
+    other.size_ = 0;
+}
+
+MemoryPlan& MemoryPlan::operator=(MemoryPlan&& other)
+{
+    if(this != &other) {
+        buffers_ = std::move(other.buffers_);
+        size_ = other.size_;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+u32 MemoryPlan::add(u64 bytes, u32 first, u32 last)
+{
+    assert(first <= last);
+    buffers_.push_back({bytes, 0, first, last});
+    return static_cast<u32>(buffers_.size() - 1);
+}
+
+u64 MemoryPlan::build(u64 alignment)
+{
+    assert(0 < alignment && 0 == (alignment & (alignment - 1)));
+    const u32 count = static_cast<u32>(buffers_.size());
+    Array<u32> order;
+    order.resize(count);
+    for(u32 i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    if(0 < count) {
+        std::stable_sort(&order[0], &order[0] + count, [this](u32 x0, u32 x1) {
+            return buffers_[x0].bytes_ > buffers_[x1].bytes_;
+        });
+    }
+
+    // first fit among the placed buffers which are alive at the same time
+    size_ = 0;
+    for(u32 i = 0; i < count; ++i) {
+        Buffer& buffer = buffers_[order[i]];
+        const u64 bytes = (buffer.bytes_ + alignment - 1) & ~(alignment - 1);
+        u64 offset = 0;
+        bool moved = true;
+        while(moved) {
+            moved = false;
+            for(u32 j = 0; j < i; ++j) {
+                const Buffer& placed = buffers_[order[j]];
+                if(placed.last_ < buffer.first_ || buffer.last_ < placed.first_) {
+                    continue;
+                }
+                const u64 placed_end = placed.offset_ + ((placed.bytes_ + alignment - 1) & ~(alignment - 1));
+                if(offset < placed_end && placed.offset_ < offset + bytes) {
+                    offset = placed_end;
+                    moved = true;
+                }
+            }
+        }
+        buffer.offset_ = offset;
+        size_ = (std::max)(size_, offset + bytes);
+    }
+    return size_;
+}
+
+u64 MemoryPlan::offset(u32 id) const
+{
+    return buffers_[id].offset_;
+}
+
+u64 MemoryPlan::size() const
+{
+    return size_;
+}
+
 //--- Tensor
 //-----------------------------------------------------------
 namespace
@@ -1576,40 +2209,40 @@ namespace op
             util::copyf16_f(size, result.data<void>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q4_0: {
-            util::copy4_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q4_1: {
-            util::copy4_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q5_0: {
-            util::copy5_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q5_1: {
-            util::copy5_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q8_0: {
-            util::copy8_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q8_1: {
             util::copy8_f(size, result.data<void>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q2_K: {
-            util::copy2_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q3_K: {
-            util::copy3_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q4_K: {
-            util::copy4_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q5_K: {
-            util::copy5_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q6_K: {
-            util::copy6_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_Q8_K: {
-            util::copy8_f(size, result.data<void>(), input.data<void>());
+            dequantize_row(input.type(), size, result.data<f32>(), input.data<void>());
         } break;
         case ggml_type::GGML_TYPE_IQ2_XXS: {
             util::copy2_f(size, result.data<void>(), input.data<void>());
@@ -1660,20 +2293,410 @@ namespace op
         return result;
     }
 
-    f32 dot_product(u64 size, const f32* x0, const f32* x1)
+    u64 block_size(ggml_type type)
     {
-        __m128 sum = _mm_setzero_ps();
-        u64 qsize = (size >> 2) << 2;
-        for(u64 i = 0; i < qsize; i += 4) {
-            __m128 v0 = _mm_loadu_ps(&x0[i]);
-            __m128 v1 = _mm_loadu_ps(&x1[i]);
-            sum = _mm_fmadd_ps(v0, v1, sum);
+        switch(type) {
+        case ggml_type::GGML_TYPE_F32:
+        case ggml_type::GGML_TYPE_F16:
+            return 1;
+        case ggml_type::GGML_TYPE_Q4_0:
+            return util::QK4_0;
+        case ggml_type::GGML_TYPE_Q4_1:
+            return util::QK4_1;
+        case ggml_type::GGML_TYPE_Q5_0:
+            return util::QK5_0;
+        case ggml_type::GGML_TYPE_Q5_1:
+            return util::QK5_1;
+        case ggml_type::GGML_TYPE_Q8_0:
+            return util::QK8_0;
+        case ggml_type::GGML_TYPE_Q2_K:
+        case ggml_type::GGML_TYPE_Q3_K:
+        case ggml_type::GGML_TYPE_Q4_K:
+        case ggml_type::GGML_TYPE_Q5_K:
+        case ggml_type::GGML_TYPE_Q6_K:
+        case ggml_type::GGML_TYPE_Q8_K:
+            return util::QK_K;
+        default:
+            return 0;
         }
-        sum = _mm_hadd_ps(sum, sum);
-        sum = _mm_hadd_ps(sum, sum);
-        __declspec(align(16)) f32 r[4];
-        _mm_store_ps(r, sum);
-        f32 result = r[0];
+    }
+
+    u64 row_bytes(ggml_type type, u64 size)
+    {
+        u64 block = block_size(type);
+        if(0 == block || 0 != (size % block)) {
+            return 0;
+        }
+        u64 blocks = size / block;
+        switch(type) {
+        case ggml_type::GGML_TYPE_F32:
+            return sizeof(f32) * size;
+        case ggml_type::GGML_TYPE_F16:
+            return sizeof(u16) * size;
+        case ggml_type::GGML_TYPE_Q4_0:
+            return sizeof(util::BlockQ4_0) * blocks;
+        case ggml_type::GGML_TYPE_Q4_1:
+            return sizeof(util::BlockQ4_1) * blocks;
+        case ggml_type::GGML_TYPE_Q5_0:
+            return sizeof(util::BlockQ5_0) * blocks;
+        case ggml_type::GGML_TYPE_Q5_1:
+            return sizeof(util::BlockQ5_1) * blocks;
+        case ggml_type::GGML_TYPE_Q8_0:
+            return sizeof(util::BlockQ8_0) * blocks;
+        case ggml_type::GGML_TYPE_Q2_K:
+            return sizeof(util::BlockQ2_K) * blocks;
+        case ggml_type::GGML_TYPE_Q3_K:
+            return sizeof(util::BlockQ3_K) * blocks;
+        case ggml_type::GGML_TYPE_Q4_K:
+            return sizeof(util::BlockQ4_K) * blocks;
+        case ggml_type::GGML_TYPE_Q5_K:
+            return sizeof(util::BlockQ5_K) * blocks;
+        case ggml_type::GGML_TYPE_Q6_K:
+            return sizeof(util::BlockQ6_K) * blocks;
+        case ggml_type::GGML_TYPE_Q8_K:
+            return sizeof(util::BlockQ8_K) * blocks;
+        default:
+            return 0;
+        }
+    }
+
+    void dequantize_row(ggml_type type, u64 size, f32* dst, const void* src)
+    {
+        assert(0 < row_bytes(type, size));
+        switch(type) {
+        case ggml_type::GGML_TYPE_F32:
+            util::copyf32_f(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_F16:
+            util::copyf16_f(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q4_0:
+            util::dequantize_q4_0(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q4_1:
+            util::dequantize_q4_1(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q5_0:
+            util::dequantize_q5_0(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q5_1:
+            util::dequantize_q5_1(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q8_0:
+            util::dequantize_q8_0(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q2_K:
+            util::dequantize_q2_k(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q3_K:
+            util::dequantize_q3_k(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q4_K:
+            util::dequantize_q4_k(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q5_K:
+            util::dequantize_q5_k(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q6_K:
+            util::dequantize_q6_k(size, dst, src);
+            break;
+        case ggml_type::GGML_TYPE_Q8_K:
+            util::dequantize_q8_k(size, dst, src);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+    }
+
+    f32 dot_product8(u64 size, const f32* x0, const f32* x1)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        u64 size8 = (size >> 3) << 3;
+        for(u64 i = 0; i < size8; i += 8) {
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(x0 + i), _mm256_loadu_ps(x1 + i), sum);
+        }
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+        s = _mm_hadd_ps(s, s);
+        s = _mm_hadd_ps(s, s);
+        f32 result = _mm_cvtss_f32(s);
+        for(u64 i = size8; i < size; ++i) {
+            result += x0[i] * x1[i];
+        }
+        return result;
+    }
+
+    /**
+     * @brief x * norm dot w
+     */
+    f32 dot_product8(u64 size, const f32* x, const f32* norm, const f32* w)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        u64 size8 = (size >> 3) << 3;
+        for(u64 i = 0; i < size8; i += 8) {
+            __m256 xv = _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(norm + i));
+            sum = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w + i), sum);
+        }
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+        s = _mm_hadd_ps(s, s);
+        s = _mm_hadd_ps(s, s);
+        f32 result = _mm_cvtss_f32(s);
+        for(u64 i = size8; i < size; ++i) {
+            result += x[i] * norm[i] * w[i];
+        }
+        return result;
+    }
+
+    /**
+     * @brief Dot products of x (times norm if not null) and two rows, x is loaded once for both
+     */
+    void dot_product8x2(u64 size, f32* dst, const f32* x, const f32* norm, const f32* w0, const f32* w1)
+    {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        u64 size8 = (size >> 3) << 3;
+        if(nullptr == norm) {
+            for(u64 i = 0; i < size8; i += 8) {
+                __m256 xv = _mm256_loadu_ps(x + i);
+                sum0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w0 + i), sum0);
+                sum1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w1 + i), sum1);
+            }
+        } else {
+            for(u64 i = 0; i < size8; i += 8) {
+                __m256 xv = _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(norm + i));
+                sum0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w0 + i), sum0);
+                sum1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w1 + i), sum1);
+            }
+        }
+        __m256 s01 = _mm256_hadd_ps(sum0, sum1);
+        __m128 r = _mm_add_ps(_mm256_castps256_ps128(s01), _mm256_extractf128_ps(s01, 1));
+        r = _mm_hadd_ps(r, r);
+        __declspec(align(16)) f32 result[4];
+        _mm_store_ps(result, r);
+        dst[0] = result[0];
+        dst[1] = result[1];
+        for(u64 i = size8; i < size; ++i) {
+            f32 xi = (nullptr == norm) ? x[i] : x[i] * norm[i];
+            dst[0] += xi * w0[i];
+            dst[1] += xi * w1[i];
+        }
+    }
+
+    inline f32 swiglu(f32 gate, f32 up)
+    {
+        // silu(x) = x*σ(x) where σ(x) is the logistic sigmoid
+        return gate * (1.0f / (1.0f + ::expf(-gate))) * up;
+    }
+
+    /**
+     * @brief Call f(i, row) for every row of w, a row is dequantized into the scratch unless w is F32
+     */
+    template<class F>
+    void for_each_row(const Tensor& w, u64 n, u64 d, f32* scratch, F&& f)
+    {
+        assert(w.total_size() == n * d);
+        const u8* rows = w.data<u8>();
+        if(ggml_type::GGML_TYPE_F32 == w.type()) {
+            for(u64 i = 0; i < d; ++i) {
+                f(i, reinterpret_cast<const f32*>(rows) + i * n);
+            }
+            return;
+        }
+        // dequantize a row at a time, weights are never expanded as a whole
+        const u64 stride = row_bytes(w.type(), n);
+        assert(0 < stride);
+        Tensor row;
+        if(nullptr == scratch) {
+            row = Tensor(ggml_type::GGML_TYPE_F32, {n});
+            scratch = row.data<f32>();
+        }
+        for(u64 i = 0; i < d; ++i) {
+            dequantize_row(w.type(), n, scratch, rows + i * stride);
+            f(i, scratch);
+        }
+    }
+
+    void matvec(f32* dst, const f32* x, const Tensor& w, u64 n, u64 d, f32* scratch)
+    {
+        for_each_row(w, n, d, scratch, [&](u64 i, const f32* row) {
+            dst[i] = dot_product8(n, x, row);
+        });
+    }
+
+    void matvec_add(f32* dst, const f32* x, const Tensor& w, u64 n, u64 d, f32* scratch)
+    {
+        for_each_row(w, n, d, scratch, [&](u64 i, const f32* row) {
+            dst[i] += dot_product8(n, x, row);
+        });
+    }
+
+    void matvec_norm(f32* dst, const f32* x, const f32* norm, f32 scale, const Tensor& w, u64 n, u64 d, f32* scratch)
+    {
+        for_each_row(w, n, d, scratch, [&](u64 i, const f32* row) {
+            dst[i] = scale * dot_product8(n, x, norm, row);
+        });
+    }
+
+    /**
+     * @brief Row i of w, in place if w is F32 or else dequantized into the scratch
+     */
+    inline const f32* weight_row(const Tensor& w, u64 stride, u64 i, u64 n, f32* scratch)
+    {
+        if(ggml_type::GGML_TYPE_F32 == w.type()) {
+            return w.data<f32>() + i * n;
+        }
+        dequantize_row(w.type(), n, scratch, w.data<u8>() + i * stride);
+        return scratch;
+    }
+
+    void matvec_swiglu(f32* dst, const f32* x, const f32* norm, f32 scale, const Tensor& gate, const Tensor& up, u64 n, u64 d, f32* scratch)
+    {
+        assert(gate.total_size() == n * d && up.total_size() == n * d);
+        // the weights stay where they are, a quantized row is dequantized into its half of the scratch
+        const u64 gate_stride = row_bytes(gate.type(), n);
+        const u64 up_stride = row_bytes(up.type(), n);
+        assert(0 < gate_stride && 0 < up_stride);
+        Tensor rows;
+        if(nullptr == scratch) {
+            rows = Tensor(ggml_type::GGML_TYPE_F32, {2, n});
+            scratch = rows.data<f32>();
+        }
+        for(u64 i = 0; i < d; ++i) {
+            f32 gate_up[2];
+            dot_product8x2(n, gate_up, x, norm, weight_row(gate, gate_stride, i, n, scratch), weight_row(up, up_stride, i, n, scratch + n));
+            if(nullptr != norm) {
+                gate_up[0] *= scale;
+                gate_up[1] *= scale;
+            }
+            dst[i] = swiglu(gate_up[0], gate_up[1]);
+        }
+    }
+
+    void dot_product8x4(u64 size, f32* dst, const f32* x, const f32* const* w)
+    {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        u64 size8 = (size >> 3) << 3;
+        for(u64 i = 0; i < size8; i += 8) {
+            __m256 xv = _mm256_loadu_ps(x + i);
+            sum0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w[0] + i), sum0);
+            sum1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w[1] + i), sum1);
+            sum2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w[2] + i), sum2);
+            sum3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w[3] + i), sum3);
+        }
+        // horizontal sums of the four at once
+        __m256 s01 = _mm256_hadd_ps(sum0, sum1);
+        __m256 s23 = _mm256_hadd_ps(sum2, sum3);
+        __m256 s = _mm256_hadd_ps(s01, s23);
+        __m128 r = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+        _mm_storeu_ps(dst, r);
+        for(u64 i = size8; i < size; ++i) {
+            dst[0] += x[i] * w[0][i];
+            dst[1] += x[i] * w[1][i];
+            dst[2] += x[i] * w[2][i];
+            dst[3] += x[i] * w[3][i];
+        }
+    }
+
+    // a tile of rows stays in cache while all the inputs pass over it
+    static constexpr u64 TileRows = 16;
+
+    u64 scratch_size(u64 n)
+    {
+        return TileRows * n;
+    }
+
+    /**
+     * @brief Call store(t, i0, num_rows, values) with the products of row t of x and every tile of rows from row i0
+     *
+     * Without w1 row i is row i of w0, with w1 rows alternate, row 2i is row i of w0 and row 2i+1 is row i of w1.
+     * F32 rows are read in place, the others are dequantized into the scratch.
+     */
+    template<class F>
+    void for_each_tile(const f32* x, u64 count, const Tensor& w0, const Tensor* w1, u64 n, u64 d, f32* scratch, F&& store)
+    {
+        assert(w0.total_size() * (nullptr == w1 ? 1 : 2) == n * d);
+        assert(nullptr == w1 || w1->total_size() == w0.total_size());
+        const Tensor* w[2] = {&w0, nullptr == w1 ? &w0 : w1};
+        const u64 shift = nullptr == w1 ? 0 : 1;
+        const u64 mask = nullptr == w1 ? 0 : 1;
+        u64 strides[2];
+        for(u32 j = 0; j < 2; ++j) {
+            strides[j] = row_bytes(w[j]->type(), n);
+            assert(0 < strides[j]);
+        }
+        Tensor tile;
+        if(nullptr == scratch && (ggml_type::GGML_TYPE_F32 != w[0]->type() || ggml_type::GGML_TYPE_F32 != w[1]->type())) {
+            tile = Tensor(ggml_type::GGML_TYPE_F32, {TileRows, n});
+            scratch = tile.data<f32>();
+        }
+        const f32* tile_rows[TileRows];
+        f32 values[TileRows];
+        for(u64 i0 = 0; i0 < d; i0 += TileRows) {
+            const u64 num_rows = (std::min)(TileRows, d - i0);
+            for(u64 r = 0; r < num_rows; ++r) {
+                u64 i = i0 + r;
+                tile_rows[r] = weight_row(*w[i & mask], strides[i & mask], i >> shift, n, nullptr == scratch ? nullptr : scratch + r * n);
+            }
+            const u64 num_rows4 = (num_rows >> 2) << 2;
+            for(u64 t = 0; t < count; ++t) {
+                const f32* xt = x + t * n;
+                for(u64 r = 0; r < num_rows4; r += 4) {
+                    dot_product8x4(n, values + r, xt, tile_rows + r);
+                }
+                for(u64 r = num_rows4; r < num_rows; ++r) {
+                    values[r] = dot_product8(n, xt, tile_rows[r]);
+                }
+                store(t, i0, num_rows, values);
+            }
+        }
+    }
+
+    void matmat(f32* dst, const f32* x, u64 count, const Tensor& w, u64 n, u64 d, f32* scratch)
+    {
+        for_each_tile(x, count, w, nullptr, n, d, scratch, [&](u64 t, u64 i0, u64 num_rows, const f32* values) {
+            ::memcpy(dst + t * d + i0, values, sizeof(f32) * num_rows);
+        });
+    }
+
+    void matmat_add(f32* dst, const f32* x, u64 count, const Tensor& w, u64 n, u64 d, f32* scratch)
+    {
+        for_each_tile(x, count, w, nullptr, n, d, scratch, [&](u64 t, u64 i0, u64 num_rows, const f32* values) {
+            f32* dt = dst + t * d + i0;
+            for(u64 r = 0; r < num_rows; ++r) {
+                dt[r] += values[r];
+            }
+        });
+    }
+
+    void matmat_swiglu(f32* dst, const f32* x, u64 count, const Tensor& gate, const Tensor& up, u64 n, u64 d, f32* scratch)
+    {
+        // a tile has an even number of rows, so a pair of gate and up never straddles tiles
+        static_assert(0 == (TileRows & 1));
+        for_each_tile(x, count, gate, &up, n, 2 * d, scratch, [&](u64 t, u64 i0, u64 num_rows, const f32* values) {
+            f32* dt = dst + t * d + (i0 >> 1);
+            for(u64 r = 0; r < num_rows; r += 2) {
+                dt[r >> 1] = swiglu(values[r], values[r + 1]);
+            }
+        });
+    }
+
+    f32 dot_product(u64 size, const f32* x0, const f32* x1)
+    {
+        __m128 sum = _mm_setzero_ps();
+        u64 qsize = (size >> 2) << 2;
+        for(u64 i = 0; i < qsize; i += 4) {
+            __m128 v0 = _mm_loadu_ps(&x0[i]);
+            __m128 v1 = _mm_loadu_ps(&x1[i]);
+            sum = _mm_fmadd_ps(v0, v1, sum);
+        }
+        sum = _mm_hadd_ps(sum, sum);
+        sum = _mm_hadd_ps(sum, sum);
+        __declspec(align(16)) f32 r[4];
+        _mm_store_ps(r, sum);
+        f32 result = r[0];
         for(u64 i = qsize; i < size; ++i) {
             f32 v0 = x0[i];
             f32 v1 = x1[i];
@@ -2042,6 +3065,17 @@ namespace op
         }
     }
 
+    f32 rmsnorm_scale(u64 size, const f32* x, f32 epsilon)
+    {
+        f32 ss = 0.0f;
+        for(u64 i = 0; i < size; ++i) {
+            ss += x[i] * x[i];
+        }
+        ss /= size;
+        ss += epsilon;
+        return 1.0f / ::sqrtf(ss);
+    }
+
     void rmsnorm(u64 size, f32* dst, const f32* x, const f32* w, f32 epsilon)
     {
         // calculate sum of squares
@@ -2081,6 +3115,207 @@ namespace op
         }
     }
 
+    f32 log_prob(u64 size, const f32* logits, u32 index)
+    {
+        assert(index < size);
+        // log softmax at index, the sum in double for a large vocabulary
+        f32 max_value = logits[0];
+        for(u64 i = 1; i < size; ++i) {
+            max_value = (std::max)(max_value, logits[i]);
+        }
+        f64 sum = 0.0;
+        for(u64 i = 0; i < size; ++i) {
+            sum += ::expf(logits[i] - max_value);
+        }
+        return logits[index] - max_value - static_cast<f32>(::log(sum));
+    }
+
+    void attention_gqa(
+        u64 head_size,
+        u64 group_size,
+        u64 length,
+        f32* output,
+        const f32* query,
+        const f32* keys,
+        u64 key_stride,
+        const f32* values,
+        u64 value_stride,
+        f32* scores,
+        u64 score_stride)
+    {
+        assert(0 < length);
+        attention_scores(head_size, group_size, length, scores, score_stride, query, keys, key_stride, nullptr, 0);
+
+        // softmax the scores to get attention weights
+        for(u64 g = 0; g < group_size; ++g) {
+            softmax(length, scores + g * score_stride);
+        }
+
+        ::memset(output, 0, sizeof(f32) * group_size * head_size);
+        attention_values(head_size, group_size, length, output, scores, score_stride, values, value_stride);
+    }
+
+    void attention_scores(
+        u64 head_size,
+        u64 group_size,
+        u64 count,
+        f32* scores,
+        u64 score_stride,
+        const f32* query,
+        const f32* keys,
+        u64 key_stride,
+        const RotaryEmbedding* rope,
+        u64 rope_position)
+    {
+        static constexpr u64 MaxGroup = 8;
+        static constexpr u64 MaxHeadSize = 512;
+        assert(head_size <= MaxHeadSize);
+        assert(nullptr == rope || rope->head_size() == head_size);
+        const f32 inv_sqrt_head_size = 1.0f / ::sqrtf(static_cast<f32>(head_size));
+        const u64 size8 = (head_size >> 3) << 3;
+        f32 rotated[MaxHeadSize];
+
+        // a key row is loaded once for up to MaxGroup query heads
+        for(u64 g0 = 0; g0 < group_size; g0 += MaxGroup) {
+            const u64 g1 = (std::min)(group_size, g0 + MaxGroup);
+            for(u64 t = 0; t < count; ++t) {
+                const f32* k = keys + t * key_stride;
+                if(nullptr != rope) {
+                    rope->rotate(rope_position + t, rotated, k);
+                    k = rotated;
+                }
+                __m256 sum[MaxGroup];
+                for(u64 g = g0; g < g1; ++g) {
+                    sum[g - g0] = _mm256_setzero_ps();
+                }
+                for(u64 i = 0; i < size8; i += 8) {
+                    __m256 kv = _mm256_loadu_ps(k + i);
+                    for(u64 g = g0; g < g1; ++g) {
+                        sum[g - g0] = _mm256_fmadd_ps(_mm256_loadu_ps(query + g * head_size + i), kv, sum[g - g0]);
+                    }
+                }
+                for(u64 g = g0; g < g1; ++g) {
+                    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum[g - g0]), _mm256_extractf128_ps(sum[g - g0], 1));
+                    s = _mm_hadd_ps(s, s);
+                    s = _mm_hadd_ps(s, s);
+                    f32 score = _mm_cvtss_f32(s);
+                    const f32* q = query + g * head_size;
+                    for(u64 i = size8; i < head_size; ++i) {
+                        score += q[i] * k[i];
+                    }
+                    scores[g * score_stride + t] = score * inv_sqrt_head_size;
+                }
+            }
+        }
+    }
+
+    void attention_scores_transposed(
+        u64 head_size,
+        u64 group_size,
+        u64 count,
+        f32* scores,
+        u64 score_stride,
+        const f32* query,
+        const f32* keys,
+        u64 key_dimension_stride,
+        const RotaryEmbedding* rope,
+        u64 rope_position)
+    {
+        static constexpr u64 MaxGroup = 8;
+        assert(nullptr == rope || rope->head_size() == head_size);
+        assert(0 == (head_size & 1));
+        const f32 inv_sqrt_head_size = 1.0f / ::sqrtf(static_cast<f32>(head_size));
+        const __m256 scale = _mm256_set1_ps(inv_sqrt_head_size);
+        const u64 count8 = (count >> 3) << 3;
+
+        // eight slots per lane, a key element is loaded once for up to MaxGroup query heads
+        for(u64 g0 = 0; g0 < group_size; g0 += MaxGroup) {
+            const u64 g1 = (std::min)(group_size, g0 + MaxGroup);
+            for(u64 t = 0; t < count8; t += 8) {
+                __m256 sum[MaxGroup];
+                for(u64 g = g0; g < g1; ++g) {
+                    sum[g - g0] = _mm256_setzero_ps();
+                }
+                for(u64 i = 0; i < head_size; i += 2) {
+                    __m256 k0 = _mm256_loadu_ps(keys + i * key_dimension_stride + t);
+                    __m256 k1 = _mm256_loadu_ps(keys + (i + 1) * key_dimension_stride + t);
+                    if(nullptr != rope) {
+                        f32 c[8];
+                        f32 s[8];
+                        for(u64 j = 0; j < 8; ++j) {
+                            c[j] = rope->cos(rope_position + t + j)[i];
+                            s[j] = rope->sin(rope_position + t + j)[i];
+                        }
+                        __m256 cv = _mm256_loadu_ps(c);
+                        __m256 sv = _mm256_loadu_ps(s);
+                        __m256 r0 = _mm256_fmsub_ps(k0, cv, _mm256_mul_ps(k1, sv));
+                        __m256 r1 = _mm256_fmadd_ps(k0, sv, _mm256_mul_ps(k1, cv));
+                        k0 = r0;
+                        k1 = r1;
+                    }
+                    for(u64 g = g0; g < g1; ++g) {
+                        const f32* q = query + g * head_size + i;
+                        sum[g - g0] = _mm256_fmadd_ps(_mm256_set1_ps(q[0]), k0, sum[g - g0]);
+                        sum[g - g0] = _mm256_fmadd_ps(_mm256_set1_ps(q[1]), k1, sum[g - g0]);
+                    }
+                }
+                for(u64 g = g0; g < g1; ++g) {
+                    _mm256_storeu_ps(scores + g * score_stride + t, _mm256_mul_ps(sum[g - g0], scale));
+                }
+            }
+        }
+        for(u64 t = count8; t < count; ++t) {
+            for(u64 g = 0; g < group_size; ++g) {
+                const f32* q = query + g * head_size;
+                f32 score = 0.0f;
+                for(u64 i = 0; i < head_size; i += 2) {
+                    f32 k0 = keys[i * key_dimension_stride + t];
+                    f32 k1 = keys[(i + 1) * key_dimension_stride + t];
+                    if(nullptr != rope) {
+                        f32 c = rope->cos(rope_position + t)[i];
+                        f32 s = rope->sin(rope_position + t)[i];
+                        f32 r0 = k0 * c - k1 * s;
+                        f32 r1 = k0 * s + k1 * c;
+                        k0 = r0;
+                        k1 = r1;
+                    }
+                    score += q[i] * k0 + q[i + 1] * k1;
+                }
+                scores[g * score_stride + t] = score * inv_sqrt_head_size;
+            }
+        }
+    }
+
+    void attention_values(
+        u64 head_size,
+        u64 group_size,
+        u64 count,
+        f32* output,
+        const f32* scores,
+        u64 score_stride,
+        const f32* values,
+        u64 value_stride)
+    {
+        const u64 size8 = (head_size >> 3) << 3;
+        // a value row is loaded once for the whole group
+        for(u64 t = 0; t < count; ++t) {
+            const f32* v = values + t * value_stride;
+            for(u64 i = 0; i < size8; i += 8) {
+                __m256 vv = _mm256_loadu_ps(v + i);
+                for(u64 g = 0; g < group_size; ++g) {
+                    f32* o = output + g * head_size + i;
+                    __m256 a = _mm256_set1_ps(scores[g * score_stride + t]);
+                    _mm256_storeu_ps(o, _mm256_fmadd_ps(a, vv, _mm256_loadu_ps(o)));
+                }
+            }
+            for(u64 i = size8; i < head_size; ++i) {
+                for(u64 g = 0; g < group_size; ++g) {
+                    output[g * head_size + i] += scores[g * score_stride + t] * v[i];
+                }
+            }
+        }
+    }
+
 } // namespace op
 
 //--- Embedding
@@ -2124,8 +3359,16 @@ Tensor Embedding::forward(const Tensor& input)
     assert(ggml_type::GGML_TYPE_I32 == input.type());
     assert(input.num_dims() == 1);
     Timer timer(duration_);
-    Tensor weight = op::convertF32(weight_);
-    return op::embed_tokens(input, weight);
+    // dequantize only the rows of the tokens
+    const u64 size = input.total_size();
+    const u64 d_embed = weight_.size(1);
+    const u64 row_bytes = op::row_bytes(weight_.type(), d_embed);
+    Tensor result(ggml_type::GGML_TYPE_F32, {size, d_embed});
+    for(u64 i = 0; i < size; ++i) {
+        const s32 token = input.data<s32>()[i];
+        op::dequantize_row(weight_.type(), d_embed, result.data<f32>() + i * d_embed, weight_.data<u8>() + token * row_bytes);
+    }
+    return result;
 }
 
 Tensor Embedding::forward_proj(const Tensor& input)
@@ -2188,1031 +3431,4924 @@ Tensor PositionalEmbedding::forward(u64 num_context)
     return result;
 }
 
-//--- Residual
+//--- RotaryEmbedding
 //-----------------------------------------------------------
-Residual::Residual()
-    : duration_(0)
+namespace
 {
-}
+    bool equals(const gguf::GGUFString& x0, const char8_t* x1)
+    {
+        u64 length = ::strlen(reinterpret_cast<const char*>(x1));
+        return x0.length_ == length && 0 == ::strncmp(reinterpret_cast<const char*>(x0.str_), reinterpret_cast<const char*>(x1), length);
+    }
 
-Residual::~Residual()
-{
-}
+    /**
+     * @brief Dimension where the wavelength equals original_context/beta rotations, YaRN
+     */
+    f32 rope_yarn_corr_dim(u64 dimension, u64 original_context, f32 beta, f32 base)
+    {
+        static constexpr f32 pi = 3.14159265358979323846f;
+        return dimension * ::logf(original_context / (beta * 2.0f * pi)) / (2.0f * ::logf(base));
+    }
 
-void Residual::forward(Tensor& dst, const Tensor& src0, const Tensor& src1)
-{
-    Timer timer(duration_);
-    f32* d = dst.data<f32>();
-    const f32* s0 = src0.data<f32>();
-    const f32* s1 = src1.data<f32>();
-    for(u64 i = 0; i < src0.size(0); ++i) {
-        d[i] = s0[i] + s1[i];
+    inline void rope_rotate8(f32* dst, const f32* src, __m256 c, __m256 s)
+    {
+        __m256 x = _mm256_loadu_ps(src);
+        // (x0, x1) -> (x1, x0)
+        __m256 swapped = _mm256_permute_ps(x, _MM_SHUFFLE(2, 3, 0, 1));
+        // (x0*c - x1*s, x1*c + x0*s)
+        _mm256_storeu_ps(dst, _mm256_addsub_ps(_mm256_mul_ps(x, c), _mm256_mul_ps(swapped, s)));
     }
-}
 
-//--- RMSNorm
-//-----------------------------------------------------------
-RMSNorm::RMSNorm()
-    : duration_(0)
-    , epsilon_(0.0f)
+    inline void rope_rotate2(f32* dst, const f32* src, f32 c, f32 s)
+    {
+        f32 v0 = src[0];
+        f32 v1 = src[1];
+        dst[0] = v0 * c - v1 * s;
+        dst[1] = v0 * s + v1 * c;
+    }
+} // namespace
+
+RotaryEmbedding::Parameters RotaryEmbedding::default_parameters()
 {
+    Parameters parameters;
+    parameters.scaling_ = Scaling::None;
+    parameters.dimension_ = 0;
+    parameters.original_context_ = 0;
+    parameters.freq_base_ = 10000.0f;
+    parameters.scaling_factor_ = 1.0f;
+    parameters.attn_factor_ = 1.0f;
+    parameters.beta_fast_ = 32.0f;
+    parameters.beta_slow_ = 1.0f;
+    return parameters;
 }
 
-RMSNorm::RMSNorm(Tensor&& weight, f32 epsilon)
-    : duration_(0)
-    , epsilon_(epsilon)
-    , weight_(std::move(weight))
+RotaryEmbedding::Parameters RotaryEmbedding::load_parameters(const gguf::GGUF& model_data)
 {
+    using namespace gguf;
+    Parameters parameters = default_parameters();
+    const gguf_metadata_kv_t* metadata = nullptr;
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.rope.freq_base")) {
+        parameters.freq_base_ = model_data.getMetaDataF32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"llama.rope.dimension_count")) {
+        parameters.dimension_ = model_data.getMetaDataU32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"llama.rope.scaling.type")) {
+        GGUFString type = model_data.getMetaDataString(*metadata);
+        if(equals(type, u8"linear")) {
+            parameters.scaling_ = Scaling::Linear;
+        } else if(equals(type, u8"ntk")) {
+            parameters.scaling_ = Scaling::NTK;
+        } else if(equals(type, u8"yarn")) {
+            parameters.scaling_ = Scaling::YaRN;
+        }
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.rope.scaling.factor")) {
+        parameters.scaling_factor_ = model_data.getMetaDataF32(*metadata);
+    } else if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.rope.scale_linear")) {
+        // older files only have the linear scale
+        parameters.scaling_factor_ = model_data.getMetaDataF32(*metadata);
+        if(Scaling::None == parameters.scaling_) {
+            parameters.scaling_ = Scaling::Linear;
+        }
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"llama.rope.scaling.original_context_length")) {
+        parameters.original_context_ = model_data.getMetaDataU32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.rope.scaling.attn_factor")) {
+        parameters.attn_factor_ = model_data.getMetaDataF32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.rope.scaling.yarn_beta_fast")) {
+        parameters.beta_fast_ = model_data.getMetaDataF32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.rope.scaling.yarn_beta_slow")) {
+        parameters.beta_slow_ = model_data.getMetaDataF32(*metadata);
+    }
+    if(parameters.scaling_factor_ <= 0.0f) {
+        parameters.scaling_factor_ = 1.0f;
+    }
+    return parameters;
+}
+
+RotaryEmbedding::RotaryEmbedding()
+    : head_size_(0)
+    , dimension_(0)
+{
+}
+
+RotaryEmbedding::RotaryEmbedding(const Parameters& parameters, u64 head_size, u64 max_positions)
+    : head_size_(head_size)
+    , dimension_(head_size)
+    , cos_(ggml_type::GGML_TYPE_F32, {max_positions, head_size})
+    , sin_(ggml_type::GGML_TYPE_F32, {max_positions, head_size})
+{
+    assert(0 < head_size && 0 == (head_size & 0x1ULL));
+    assert(0 < max_positions);
+    if(0 < parameters.dimension_ && parameters.dimension_ < head_size) {
+        dimension_ = parameters.dimension_;
+        assert(0 == (dimension_ & 0x1ULL));
+    }
+
+    f32 base = parameters.freq_base_;
+    f32 freq_scale = 1.0f;
+    f32 mscale = parameters.attn_factor_;
+    f32 ext_factor = 0.0f;
+    f32 corr_dims[2] = {0.0f, 0.0f};
+    switch(parameters.scaling_) {
+    case Scaling::Linear:
+        freq_scale = 1.0f / parameters.scaling_factor_;
+        break;
+    case Scaling::NTK:
+        // keep the lowest frequency at the same wavelength, NTK-aware
+        assert(2 < dimension_);
+        base *= ::powf(parameters.scaling_factor_, dimension_ / static_cast<f32>(dimension_ - 2));
+        break;
+    case Scaling::YaRN: {
+        freq_scale = 1.0f / parameters.scaling_factor_;
+        ext_factor = 1.0f;
+        u64 original_context = (0 < parameters.original_context_) ? parameters.original_context_ : max_positions;
+        f32 start = ::floorf(rope_yarn_corr_dim(dimension_, original_context, parameters.beta_fast_, base));
+        f32 end = ::ceilf(rope_yarn_corr_dim(dimension_, original_context, parameters.beta_slow_, base));
+        corr_dims[0] = (std::max)(0.0f, start);
+        corr_dims[1] = (std::min)(static_cast<f32>(dimension_ - 1), end);
+        mscale *= 1.0f + 0.1f * ::logf(1.0f / freq_scale);
+    } break;
+    default:
+        break;
+    }
+
+    // effective angular frequency of each pair
+    Array<f64> frequencies;
+    frequencies.resize(dimension_ >> 1);
+    for(u64 i = 0; i < dimension_; i += 2) {
+        f64 extrapolation = ::pow(static_cast<f64>(base), -static_cast<f64>(i) / dimension_);
+        f64 interpolation = freq_scale * extrapolation;
+        f64 frequency = interpolation;
+        if(0.0f != ext_factor) {
+            f32 y = ((i >> 1) - corr_dims[0]) / (std::max)(0.001f, corr_dims[1] - corr_dims[0]);
+            f32 ramp = (1.0f - (std::min)(1.0f, (std::max)(0.0f, y))) * ext_factor;
+            frequency = interpolation * (1.0f - ramp) + extrapolation * ramp;
+        }
+        frequencies[i >> 1] = frequency;
+    }
+
+    for(u64 p = 0; p < max_positions; ++p) {
+        f32* c = cos_.data<f32>() + p * head_size_;
+        f32* s = sin_.data<f32>() + p * head_size_;
+        for(u64 i = 0; i < dimension_; i += 2) {
+            f64 theta = p * frequencies[i >> 1];
+            c[i + 0] = c[i + 1] = static_cast<f32>(::cos(theta)) * mscale;
+            s[i + 0] = s[i + 1] = static_cast<f32>(::sin(theta)) * mscale;
+        }
+        for(u64 i = dimension_; i < head_size_; ++i) {
+            c[i] = 1.0f;
+            s[i] = 0.0f;
+        }
+    }
 }
 
-RMSNorm::~RMSNorm()
+RotaryEmbedding::RotaryEmbedding(const gguf::GGUF& model_data, u64 head_size, u64 max_positions)
+    : RotaryEmbedding(load_parameters(model_data), head_size, max_positions)
 {
 }
 
-void RMSNorm::forward(Tensor& dst, const Tensor& src)
+RotaryEmbedding::~RotaryEmbedding()
 {
-    Timer timer(duration_);
-    Tensor weight = op::convertF32(weight_);
-    op::rmsnorm(weight.size(0), dst.data<f32>(), src.data<f32>(), weight.data<f32>(), epsilon_);
 }
 
-RMSNorm::RMSNorm(RMSNorm&& other)
-    : duration_(0)
-    , epsilon_(other.epsilon_)
-    , weight_(std::move(other.weight_))
+RotaryEmbedding::RotaryEmbedding(RotaryEmbedding&& other)
+    : head_size_(other.head_size_)
+    , dimension_(other.dimension_)
+    , cos_(std::move(other.cos_))
+    , sin_(std::move(other.sin_))
 {
+    other.head_size_ = 0;
+    other.dimension_ = 0;
 }
 
-RMSNorm& RMSNorm::operator=(RMSNorm&& other)
+RotaryEmbedding& RotaryEmbedding::operator=(RotaryEmbedding&& other)
 {
     if(this != &other) {
-        duration_ = 0;
-        epsilon_ = other.epsilon_;
-        weight_ = std::move(other.weight_);
+        head_size_ = other.head_size_;
+        dimension_ = other.dimension_;
+        cos_ = std::move(other.cos_);
+        sin_ = std::move(other.sin_);
+        other.head_size_ = 0;
+        other.dimension_ = 0;
     }
     return *this;
 }
 
-//--- SelfAttention
-//-----------------------------------------------------------
-SelfAttention::SelfAttention()
-    : duration_(0)
+u64 RotaryEmbedding::head_size() const
 {
+    return head_size_;
 }
 
-SelfAttention::SelfAttention(
-    Tensor&& query,
-    Tensor&& key,
-    Tensor&& value,
-    Tensor&& qkv)
-    : duration_(0)
-    , query_(std::move(query))
-    , key_(std::move(key))
-    , value_(std::move(value))
-    , qkv_proj_(std::move(qkv))
+u64 RotaryEmbedding::dimension() const
 {
+    return dimension_;
 }
 
-SelfAttention::~SelfAttention()
+u64 RotaryEmbedding::max_positions() const
 {
+    return (0 < cos_.num_dims()) ? cos_.size(0) : 0;
 }
 
-SelfAttention::SelfAttention(SelfAttention&& other)
-    : duration_(0)
-    , query_(std::move(other.query_))
-    , key_(std::move(other.key_))
-    , value_(std::move(other.value_))
-    , qkv_proj_(std::move(other.qkv_proj_))
+const f32* RotaryEmbedding::cos(u64 position) const
+{
+    assert(position < max_positions());
+    return cos_.data<f32>() + position * head_size_;
+}
 
+const f32* RotaryEmbedding::sin(u64 position) const
 {
+    assert(position < max_positions());
+    return sin_.data<f32>() + position * head_size_;
 }
 
-SelfAttention& SelfAttention::operator=(SelfAttention&& other)
+void RotaryEmbedding::forward(u64 position, u64 num_heads, f32* q, u64 num_kv_heads, f32* k) const
 {
-    if(this != &other) {
-        duration_ = 0;
-        query_ = std::move(other.query_);
-        key_ = std::move(other.key_);
-        value_ = std::move(other.value_);
-        qkv_proj_ = std::move(other.qkv_proj_);
+    const f32* c = cos(position);
+    const f32* s = sin(position);
+    // the same table rows are shared by every head of q and k
+    u64 size8 = (dimension_ >> 3) << 3;
+    for(u64 i = 0; i < size8; i += 8) {
+        __m256 vc = _mm256_loadu_ps(c + i);
+        __m256 vs = _mm256_loadu_ps(s + i);
+        for(u64 h = 0; h < num_heads; ++h) {
+            f32* x = q + h * head_size_ + i;
+            rope_rotate8(x, x, vc, vs);
+        }
+        for(u64 h = 0; h < num_kv_heads; ++h) {
+            f32* x = k + h * head_size_ + i;
+            rope_rotate8(x, x, vc, vs);
+        }
+    }
+    for(u64 i = size8; i < dimension_; i += 2) {
+        for(u64 h = 0; h < num_heads; ++h) {
+            f32* x = q + h * head_size_ + i;
+            rope_rotate2(x, x, c[i], s[i]);
+        }
+        for(u64 h = 0; h < num_kv_heads; ++h) {
+            f32* x = k + h * head_size_ + i;
+            rope_rotate2(x, x, c[i], s[i]);
+        }
     }
-    return *this;
 }
 
-void SelfAttention::forward(
-    const Config& config,
-    u64 position,
-    u64 layer_offset,
-    Tensor& output,
-    Tensor& input,
-    Tensor& query,
-    Tensor& key_cache,
-    Tensor& value_cache,
-    Tensor& attention)
+void RotaryEmbedding::rotate(u64 position, f32* dst, const f32* src) const
 {
-    u64 dim = input.size(0);
-    u64 kv_dim = key_.size(1);
-    u64 n_heads = config.num_heads_;
-    u64 kv_mul = config.num_heads_ / config.num_kv_heads_;
-    u64 head_size = config.dimension_ / n_heads;
-    u64 cache_offset = layer_offset + position * kv_dim;
-    f32* q = query.data<f32>();
-    f32* k = key_cache.data<f32>() + cache_offset;
-    f32* v = value_cache.data<f32>() + cache_offset;
-
-    // qkv matmuls for the current position
-    {
-        Tensor wq = op::convertF32(query_);
-        op::matmul(q, input.data<f32>(), wq.data<f32>(), dim, dim);
-    }
-    {
-        Tensor wk = op::convertF32(key_);
-        op::matmul(k, input.data<f32>(), wk.data<f32>(), dim, kv_dim);
+    const f32* c = cos(position);
+    const f32* s = sin(position);
+    u64 size8 = (dimension_ >> 3) << 3;
+    for(u64 i = 0; i < size8; i += 8) {
+        rope_rotate8(dst + i, src + i, _mm256_loadu_ps(c + i), _mm256_loadu_ps(s + i));
     }
-    {
-        Tensor wv = op::convertF32(key_);
-        op::matmul(v, input.data<f32>(), wv.data<f32>(), dim, kv_dim);
+    for(u64 i = size8; i < dimension_; i += 2) {
+        rope_rotate2(dst + i, src + i, c[i], s[i]);
     }
-    // RoPE relative positional encoding: complex-valued rotate q and k in each head
-    {
-        for(u64 i = 0; i < dim; i += 2) {
-            u64 head_dim = i % head_size;
-            f32 freq = 1.0f / ::powf(10000.0f, head_dim / (f32)head_size);
-            f32 value = position * freq;
-            f32 fcr = ::cosf(value);
-            f32 fci = ::sinf(value);
-            u32 rotn = i < kv_dim ? 2 : 1;
-            for(u32 j = 0; j < rotn; ++j) {
-                f32* vec = (0 == j) ? q : k;
-                f32 v0 = vec[i + 0];
-                f32 v1 = vec[i + 1];
-                vec[i + 0] = v0 * fcr - v1 * fci;
-                vec[i + 1] = v0 * fci + v1 * fcr;
-            }
-        }
+    if(dst != src && dimension_ < head_size_) {
+        ::memcpy(dst + dimension_, src + dimension_, sizeof(f32) * (head_size_ - dimension_));
     }
-    // multihead attention. iterate over all heads
-    {
-        ::memset(input.data<f32>(), 0, n_heads * head_size * sizeof(f32));
-        f32 inv_head_size = 1.0f / ::sqrtf(static_cast<float>(head_size));
-        for(u64 h = 0; h < n_heads; ++h) {
-            // const f32* tq = q + h * head_size;                               // query vector for this head
-            f32* attn = attention.data<f32>() + h * config.sequence_length_; // attention scores for this head
-            // iterate over all timesteps, including the current step
-            for(u64 t = 0; t <= position; ++t) {
-                f32* tk = k + layer_offset + t * kv_dim + (h / kv_mul) * head_size; // key vector for this head and at this timestep
-                // calcurate the attention score as the dot product of q and k
-                f32 score = 0.0f;
-                for(u64 i = 0; i < head_size; ++i) {
-                    score += q[i] * tk[i];
-                }
-                score *= inv_head_size;
-                attn[t] = score;
-            }
+}
 
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            op::softmax(position + 1, attn);
+//--- Residual
+//-----------------------------------------------------------
+Residual::Residual()
+    : duration_(0)
+{
+}
 
-            // weighted sum of the values, store back to the current tensor
-            f32* xb = input.data<f32>() + h * head_size;
-            for(u64 t = 0; t <= position; ++t) {
-                f32* value = value_cache.data<f32>() + layer_offset + t * kv_dim + (h / kv_mul) * head_size;
-                f32 a = attn[t];
-                // accumulate the weighted value
-                for(u64 i = 0; i < head_size; ++i) {
-                    xb[i] += a * value[i];
-                }
-            }
-        } // for(u64 h
-    }
+Residual::~Residual()
+{
+}
 
-    // final matmul to get the output of the attention
-    {
-        Tensor wo = op::convertF32(qkv_proj_);
-        op::matmul(output.data<f32>(), input.data<f32>(), wo.data<f32>(), dim, dim);
+void Residual::forward(Tensor& dst, const Tensor& src0, const Tensor& src1)
+{
+    Timer timer(duration_);
+    f32* d = dst.data<f32>();
+    const f32* s0 = src0.data<f32>();
+    const f32* s1 = src1.data<f32>();
+    for(u64 i = 0; i < src0.size(0); ++i) {
+        d[i] = s0[i] + s1[i];
     }
 }
 
-//--- FeedForwardSwiGLU
+//--- RMSNorm
 //-----------------------------------------------------------
-FeedForwardSwiGLU::FeedForwardSwiGLU()
+RMSNorm::RMSNorm()
     : duration_(0)
+    , epsilon_(0.0f)
 {
 }
 
-FeedForwardSwiGLU::FeedForwardSwiGLU(
-    Tensor&& ffn_down,
-    Tensor&& ffn_gate,
-    Tensor&& ffn_up,
-    Tensor&& ffn_norm)
+RMSNorm::RMSNorm(Tensor&& weight, f32 epsilon)
     : duration_(0)
-    , ffn_down_(std::move(ffn_down))
-    , ffn_gate_(std::move(ffn_gate))
-    , ffn_up_(std::move(ffn_up))
-    , ffn_norm_(std::move(ffn_norm))
+    , epsilon_(epsilon)
+    , weight_(std::move(weight))
 {
+    // a small vector, converted once instead of every forward
+    if(ggml_type::GGML_TYPE_F32 != weight_.type()) {
+        weight_ = op::convertF32(weight_);
+    }
 }
-FeedForwardSwiGLU::~FeedForwardSwiGLU()
+
+RMSNorm::~RMSNorm()
 {
 }
 
-FeedForwardSwiGLU::FeedForwardSwiGLU(FeedForwardSwiGLU&& other)
+void RMSNorm::forward(Tensor& dst, const Tensor& src)
+{
+    Timer timer(duration_);
+    op::rmsnorm(weight_.size(0), dst.data<f32>(), src.data<f32>(), weight_.data<f32>(), epsilon_);
+}
+
+void RMSNorm::forward(Tensor& dst, const Tensor& src, u64 count)
+{
+    Timer timer(duration_);
+    u64 size = weight_.size(0);
+    for(u64 i = 0; i < count; ++i) {
+        op::rmsnorm(size, dst.data<f32>() + i * size, src.data<f32>() + i * size, weight_.data<f32>(), epsilon_);
+    }
+}
+
+f32 RMSNorm::scale(const f32* src) const
+{
+    return op::rmsnorm_scale(weight_.size(0), src, epsilon_);
+}
+
+RMSNorm::RMSNorm(RMSNorm&& other)
     : duration_(0)
-    , ffn_down_(std::move(other.ffn_down_))
-    , ffn_gate_(std::move(other.ffn_gate_))
-    , ffn_up_(std::move(other.ffn_up_))
-    , ffn_norm_(std::move(other.ffn_norm_))
+    , epsilon_(other.epsilon_)
+    , weight_(std::move(other.weight_))
 {
 }
 
-FeedForwardSwiGLU& FeedForwardSwiGLU::operator=(FeedForwardSwiGLU&& other)
+RMSNorm& RMSNorm::operator=(RMSNorm&& other)
 {
     if(this != &other) {
         duration_ = 0;
-        ffn_down_ = std::move(other.ffn_down_);
-        ffn_gate_ = std::move(other.ffn_gate_);
-        ffn_up_ = std::move(other.ffn_up_);
-        ffn_norm_ = std::move(other.ffn_norm_);
+        epsilon_ = other.epsilon_;
+        weight_ = std::move(other.weight_);
     }
     return *this;
 }
 
-void FeedForwardSwiGLU::forward(
-    const Config& config,
-    Tensor& output,
-    const Tensor& input,
-    Tensor& buffer0,
-    Tensor& buffer1)
+//--- KVCache
+//-----------------------------------------------------------
+KVCache::KVCache()
+    : num_layers_(0)
+    , num_kv_heads_(0)
+    , head_size_(0)
+    , capacity_(0)
+    , window_(0)
+    , sinks_(0)
+    , layout_(Layout::HeadMajor)
+    , checkpoint_position_(0)
+    , checkpoint_count_(0)
+{
+}
+
+KVCache::KVCache(const Config& config, u64 window, u64 sinks, Layout layout)
+    : num_layers_(config.num_layers_)
+    , num_kv_heads_(config.num_kv_heads_)
+    , head_size_(config.dimension_ / config.num_heads_)
+    , capacity_(0 < window ? sinks + window : config.sequence_length_)
+    , window_(window)
+    , sinks_(0 < window ? sinks : 0)
+    , layout_(layout)
+    , checkpoint_position_(0)
+    , checkpoint_count_(0)
+{
+    // attention is computed over the positions in the cache, those should be in the range of the rope tables
+    assert(capacity_ <= config.sequence_length_);
+    switch(layout_) {
+    case Layout::PositionMajor:
+        keys_ = Tensor(ggml_type::GGML_TYPE_F32, {num_layers_, capacity_, num_kv_heads_, head_size_});
+        values_ = Tensor(ggml_type::GGML_TYPE_F32, {num_layers_, capacity_, num_kv_heads_, head_size_});
+        break;
+    case Layout::HeadMajor:
+        keys_ = Tensor(ggml_type::GGML_TYPE_F32, {num_layers_, num_kv_heads_, capacity_, head_size_});
+        values_ = Tensor(ggml_type::GGML_TYPE_F32, {num_layers_, num_kv_heads_, capacity_, head_size_});
+        break;
+    case Layout::TransposedKey:
+        keys_ = Tensor(ggml_type::GGML_TYPE_F32, {num_layers_, num_kv_heads_, head_size_, capacity_});
+        values_ = Tensor(ggml_type::GGML_TYPE_F32, {num_layers_, num_kv_heads_, capacity_, head_size_});
+        break;
+    }
+}
+
+KVCache::~KVCache()
+{
+}
+
+KVCache::KVCache(KVCache&& other)
+    : num_layers_(other.num_layers_)
+    , num_kv_heads_(other.num_kv_heads_)
+    , head_size_(other.head_size_)
+    , capacity_(other.capacity_)
+    , window_(other.window_)
+    , sinks_(other.sinks_)
+    , layout_(other.layout_)
+    , keys_(std::move(other.keys_))
+    , values_(std::move(other.values_))
+    , checkpoint_position_(other.checkpoint_position_)
+    , checkpoint_count_(other.checkpoint_count_)
+    , checkpoint_(std::move(other.checkpoint_))
+{
+    other.num_layers_ = 0;
+    other.capacity_ = 0;
+    other.checkpoint_count_ = 0;
+}
+
+KVCache& KVCache::operator=(KVCache&& other)
 {
-    u64 dim = config.dimension_;
-    u32 hidden_dim = static_cast<u32>(config.hidden_dim_);
-    op::matmul(buffer0.data<f32>(), input.data<f32>(), ffn_gate_.data<f32>(), dim, hidden_dim);
-    op::matmul(buffer1.data<f32>(), input.data<f32>(), ffn_up_.data<f32>(), dim, hidden_dim);
-
-    // SwiGLU non-linearity
-    for(u64 i = 0; i < hidden_dim; ++i) {
-        f32 value = buffer0.data<f32>()[i];
-        // silu(x) = x*σ(x) where σ(x) is thelogistic sigmoid
-        value *= (1.0f / (1.0f + ::expf(-value)));
-        value *= buffer1.data<f32>()[i];
-        buffer0.data<f32>()[i] = value;
+    if(this != &other) {
+        num_layers_ = other.num_layers_;
+        num_kv_heads_ = other.num_kv_heads_;
+        head_size_ = other.head_size_;
+        capacity_ = other.capacity_;
+        window_ = other.window_;
+        sinks_ = other.sinks_;
+        layout_ = other.layout_;
+        keys_ = std::move(other.keys_);
+        values_ = std::move(other.values_);
+        checkpoint_position_ = other.checkpoint_position_;
+        checkpoint_count_ = other.checkpoint_count_;
+        checkpoint_ = std::move(other.checkpoint_);
+        other.num_layers_ = 0;
+        other.capacity_ = 0;
+        other.checkpoint_count_ = 0;
     }
-    op::matmul(output.data<f32>(), buffer0.data<f32>(), ffn_down_.data<f32>(), hidden_dim, dim);
+    return *this;
 }
 
-//--- TransformerBlock
-//-----------------------------------------------------------
-TransformerBlock::TransformerBlock()
-    : duration_(0)
+u64 KVCache::num_layers() const
 {
+    return num_layers_;
 }
 
-TransformerBlock::~TransformerBlock()
+u64 KVCache::num_kv_heads() const
 {
+    return num_kv_heads_;
 }
 
-TransformerBlock::TransformerBlock(TransformerBlock&& other)
-    : duration_(0)
-    , attn_rmsnorm_(std::move(other.attn_rmsnorm_))
-    , attn_(std::move(other.attn_))
-    , attn_residual_(std::move(other.attn_residual_))
-    , ff_rmsnorm_(std::move(other.ff_rmsnorm_))
-    , ff_(std::move(other.ff_))
-    , ff_residual_(std::move(other.ff_residual_))
+u64 KVCache::head_size() const
 {
+    return head_size_;
 }
 
-TransformerBlock& TransformerBlock::operator=(TransformerBlock&& other)
+u64 KVCache::capacity() const
 {
-    if(this == &other) {
-        duration_ = 0;
-        attn_rmsnorm_ = std::move(other.attn_rmsnorm_);
-        attn_ = std::move(other.attn_);
-        attn_residual_ = std::move(other.attn_residual_);
-        ff_rmsnorm_ = std::move(other.ff_rmsnorm_);
-        ff_ = std::move(other.ff_);
-        ff_residual_ = std::move(other.ff_residual_);
-    }
-    return *this;
+    return capacity_;
 }
 
-void TransformerBlock::forward(
-    const Config& config,
-    u64 layer,
-    u64 position,
-    Tensor& output,
-    Tensor& input,
-    Tensor& query,
-    Tensor& key_cache,
-    Tensor& value_cache,
-    Tensor& attention,
-    Tensor& buffer0,
-    Tensor& buffer1,
-    Tensor& hbuffer0,
-    Tensor& hbuffer1)
+u64 KVCache::window() const
 {
-    attn_rmsnorm_.forward(buffer0, input);
-    u64 kv_dim = (config.dimension_ * config.num_kv_heads_) / config.num_heads_;
-    u64 layer_offset = layer * config.sequence_length_ * kv_dim;
-    attn_.forward(
-        config,
-        position,
-        layer_offset,
-        buffer1,
-        buffer0,
-        query,
-        key_cache,
-        value_cache,
-        attention);
-    attn_residual_.forward(input, input, buffer1);
-    ff_rmsnorm_.forward(buffer0, input);
-    ff_.forward(
-        config,
-        buffer0,
-        buffer0,
-        hbuffer0,
-        hbuffer1);
-    ff_residual_.forward(output, input, buffer0);
+    return window_;
 }
 
-//--- Vocabulary
-//-----------------------------------------------------------
-Vocabulary::Vocabulary()
-    : model_{}
-    , tokens_{}
-    , scores_{}
-    , token_types_{}
-    , merges_{}
-    , added_tokens_{}
-    , bos_token_id_(1)
-    , eos_token_id_(2)
-    , unknown_token_id_(0)
-    , separator_token_id_(-1)
-    , padding_token_id_(-1)
-    , cls_token_id_(-1)
-    , mask_token_id_(-1)
-    , add_bos_(-1)
-    , add_eos_(-1)
-    , linefeed_id_(13)
-    , prefix_id_(-1)
-    , suffix_id_(-1)
-    , middle_id_(-1)
-    , eot_id_(-1)
-    , add_space_prefix_(true)
-    , max_token_length_(0)
+u64 KVCache::sinks() const
 {
+    return sinks_;
 }
 
-Vocabulary::Vocabulary(const gguf::GGUF& model_data)
-    : model_{}
-    , tokens_{}
-    , scores_{}
-    , token_types_{}
-    , merges_{}
-    , added_tokens_{}
-    , bos_token_id_(1)
-    , eos_token_id_(2)
-    , unknown_token_id_(0)
-    , separator_token_id_(-1)
-    , padding_token_id_(-1)
-    , cls_token_id_(-1)
-    , mask_token_id_(-1)
-    , add_bos_(-1)
-    , add_eos_(-1)
-    , linefeed_id_(13)
-    , prefix_id_(-1)
-    , suffix_id_(-1)
-    , middle_id_(-1)
-    , eot_id_(-1)
-    , add_space_prefix_(true)
-    , max_token_length_(0)
+KVCache::Layout KVCache::layout() const
 {
-    using namespace gguf;
-    const gguf_metadata_kv_t* metadata = nullptr;
-    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.model")) {
-        model_ = model_data.getMetaDataString(*metadata);
-    }
+    return layout_;
+}
 
-    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.tokens")) {
-        tokens_ = model_data.getMetaDataArray(*metadata);
-    }
-    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"tokenizer.ggml.scores")) {
+bool KVCache::is_ring() const
+{
+    return 0 < window_;
+}
+
+u64 KVCache::slot(u64 position) const
+{
+    if(!is_ring()) {
+        assert(position < capacity_);
+        return position;
+    }
+    return position < sinks_ ? position : sinks_ + (position - sinks_) % window_;
+}
+
+u64 KVCache::length(u64 position) const
+{
+    return (std::min)(position + 1, capacity_);
+}
+
+u32 KVCache::segments(Segment segments[MaxSegments], u64 position) const
+{
+    if(position < capacity_) {
+        // nothing has been evicted yet
+        segments[0] = {0, position + 1};
+        return 1;
+    }
+    assert(is_ring());
+    u32 count = 0;
+    if(0 < sinks_) {
+        segments[count++] = {0, sinks_};
+    }
+    // the oldest position in the window is next to the newest one
+    u64 oldest = slot(position + 1 - window_);
+    segments[count++] = {oldest, sinks_ + window_ - oldest};
+    if(sinks_ < oldest) {
+        segments[count++] = {sinks_, oldest - sinks_};
+    }
+    return count;
+}
+
+u64 KVCache::key_stride() const
+{
+    switch(layout_) {
+    case Layout::PositionMajor:
+        return num_kv_heads_ * head_size_;
+    case Layout::HeadMajor:
+        return head_size_;
+    default:
+        return 1;
+    }
+}
+
+u64 KVCache::key_dimension_stride() const
+{
+    return Layout::TransposedKey == layout_ ? capacity_ : 1;
+}
+
+u64 KVCache::value_stride() const
+{
+    return Layout::PositionMajor == layout_ ? num_kv_heads_ * head_size_ : head_size_;
+}
+
+f32* KVCache::key(u64 layer, u64 head, u64 slot)
+{
+    return const_cast<f32*>(static_cast<const KVCache*>(this)->key(layer, head, slot));
+}
+
+const f32* KVCache::key(u64 layer, u64 head, u64 slot) const
+{
+    assert(layer < num_layers_ && head < num_kv_heads_ && slot < capacity_);
+    switch(layout_) {
+    case Layout::PositionMajor:
+        return keys_.data<f32>() + ((layer * capacity_ + slot) * num_kv_heads_ + head) * head_size_;
+    case Layout::HeadMajor:
+        return keys_.data<f32>() + ((layer * num_kv_heads_ + head) * capacity_ + slot) * head_size_;
+    default:
+        return keys_.data<f32>() + (layer * num_kv_heads_ + head) * head_size_ * capacity_ + slot;
+    }
+}
+
+f32* KVCache::value(u64 layer, u64 head, u64 slot)
+{
+    return const_cast<f32*>(static_cast<const KVCache*>(this)->value(layer, head, slot));
+}
+
+const f32* KVCache::value(u64 layer, u64 head, u64 slot) const
+{
+    assert(layer < num_layers_ && head < num_kv_heads_ && slot < capacity_);
+    if(Layout::PositionMajor == layout_) {
+        return values_.data<f32>() + ((layer * capacity_ + slot) * num_kv_heads_ + head) * head_size_;
+    }
+    return values_.data<f32>() + ((layer * num_kv_heads_ + head) * capacity_ + slot) * head_size_;
+}
+
+void KVCache::store(u64 layer, u64 slot, const f32* key, const f32* value)
+{
+    u64 dimension_stride = key_dimension_stride();
+    for(u64 h = 0; h < num_kv_heads_; ++h) {
+        f32* k = this->key(layer, h, slot);
+        if(1 == dimension_stride) {
+            ::memcpy(k, key + h * head_size_, sizeof(f32) * head_size_);
+        } else {
+            for(u64 i = 0; i < head_size_; ++i) {
+                k[i * dimension_stride] = key[h * head_size_ + i];
+            }
+        }
+        ::memcpy(this->value(layer, h, slot), value + h * head_size_, sizeof(f32) * head_size_);
+    }
+}
+
+void KVCache::fetch(u64 layer, u64 slot, f32* key, f32* value) const
+{
+    u64 dimension_stride = key_dimension_stride();
+    for(u64 h = 0; h < num_kv_heads_; ++h) {
+        const f32* k = this->key(layer, h, slot);
+        if(1 == dimension_stride) {
+            ::memcpy(key + h * head_size_, k, sizeof(f32) * head_size_);
+        } else {
+            for(u64 i = 0; i < head_size_; ++i) {
+                key[h * head_size_ + i] = k[i * dimension_stride];
+            }
+        }
+        ::memcpy(value + h * head_size_, this->value(layer, h, slot), sizeof(f32) * head_size_);
+    }
+}
+
+void KVCache::checkpoint(u64 position, u64 count)
+{
+    checkpoint_position_ = position;
+    checkpoint_count_ = 0;
+    if(!is_ring()) {
+        return;
+    }
+    // a slot written twice would lose the first entry
+    assert(count <= window_);
+    const u64 kv_dim = num_kv_heads_ * head_size_;
+    if(checkpoint_.total_size() < count * num_layers_ * 2 * kv_dim) {
+        checkpoint_ = Tensor(ggml_type::GGML_TYPE_F32, {count, num_layers_, 2, kv_dim});
+    }
+    f32* dst = checkpoint_.data<f32>();
+    for(u64 i = 0; i < count; ++i) {
+        u64 s = slot(position + i);
+        for(u64 l = 0; l < num_layers_; ++l) {
+            fetch(l, s, dst, dst + kv_dim);
+            dst += 2 * kv_dim;
+        }
+    }
+    checkpoint_count_ = count;
+}
+
+void KVCache::rollback(u64 position)
+{
+    if(!is_ring()) {
+        return;
+    }
+    assert(checkpoint_position_ <= position);
+    const u64 kv_dim = num_kv_heads_ * head_size_;
+    const u64 end = checkpoint_position_ + checkpoint_count_;
+    for(u64 p = position; p < end; ++p) {
+        u64 s = slot(p);
+        const f32* src = checkpoint_.data<f32>() + (p - checkpoint_position_) * num_layers_ * 2 * kv_dim;
+        for(u64 l = 0; l < num_layers_; ++l) {
+            store(l, s, src, src + kv_dim);
+            src += 2 * kv_dim;
+        }
+    }
+    checkpoint_count_ = (std::min)(checkpoint_count_, position - checkpoint_position_);
+}
+
+namespace
+{
+    /**
+     * @brief Header of a KVCache snapshot, followed by a key and a value of each slot of each layer
+     *
+     * Rows are in position major regardless of the layout of the cache.
+     */
+    struct KVSnapshotHeader
+    {
+        inline static constexpr u32 Magic = 0x4E53564BUL; // "KVSN"
+        inline static constexpr u32 Version = 1;
+        u32 magic_;
+        u32 version_;
+        u64 num_layers_;
+        u64 num_kv_heads_;
+        u64 head_size_;
+        u64 capacity_;
+        u64 window_;
+        u64 sinks_;
+        u64 position_;
+        u64 num_slots_;
+        Sampler::State sampler_;
+    };
+
+    /**
+     * @brief Read only mapping of a whole file
+     */
+    class MappedFile
+    {
+    public:
+        MappedFile()
+            : size_(0)
+            , data_(nullptr)
+#ifdef _MSC_VER
+            , file_(INVALID_HANDLE_VALUE)
+            , mapping_(nullptr)
+#endif
+        {
+        }
+
+        ~MappedFile()
+        {
+            close();
+        }
+
+        bool open(const char8_t* filepath)
+        {
+            assert(nullptr != filepath);
+            close();
+#ifdef _MSC_VER
+            file_ = CreateFileA((const char*)filepath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if(INVALID_HANDLE_VALUE == file_) {
+                return false;
+            }
+            LARGE_INTEGER size;
+            if(FALSE == GetFileSizeEx(file_, &size) || size.QuadPart <= 0) {
+                close();
+                return false;
+            }
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if(nullptr == mapping_) {
+                close();
+                return false;
+            }
+            data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+            if(nullptr == data_) {
+                close();
+                return false;
+            }
+            size_ = static_cast<u64>(size.QuadPart);
+#else
+            int file = ::open((const char*)filepath, O_RDONLY);
+            if(file < 0) {
+                return false;
+            }
+            struct stat st;
+            if(0 != fstat(file, &st) || st.st_size <= 0) {
+                ::close(file);
+                return false;
+            }
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            ::close(file);
+            if(MAP_FAILED == data) {
+                return false;
+            }
+            data_ = data;
+            size_ = static_cast<u64>(st.st_size);
+#endif
+            return true;
+        }
+
+        void close()
+        {
+#ifdef _MSC_VER
+            if(nullptr != data_) {
+                UnmapViewOfFile(data_);
+            }
+            if(nullptr != mapping_) {
+                CloseHandle(mapping_);
+                mapping_ = nullptr;
+            }
+            if(INVALID_HANDLE_VALUE != file_) {
+                CloseHandle(file_);
+                file_ = INVALID_HANDLE_VALUE;
+            }
+#else
+            if(nullptr != data_) {
+                munmap(data_, size_);
+            }
+#endif
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+        u64 size() const
+        {
+            return size_;
+        }
+
+        const u8* data() const
+        {
+            return reinterpret_cast<const u8*>(data_);
+        }
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        u64 size_;
+        void* data_;
+#ifdef _MSC_VER
+        HANDLE file_;
+        HANDLE mapping_;
+#endif
+    };
+} // namespace
+
+bool KVCache::save(const char8_t* filepath, u64 position, const Sampler& sampler) const
+{
+    assert(nullptr != filepath);
+    KVSnapshotHeader header;
+    ::memset(&header, 0, sizeof(KVSnapshotHeader));
+    header.magic_ = KVSnapshotHeader::Magic;
+    header.version_ = KVSnapshotHeader::Version;
+    header.num_layers_ = num_layers_;
+    header.num_kv_heads_ = num_kv_heads_;
+    header.head_size_ = head_size_;
+    header.capacity_ = capacity_;
+    header.window_ = window_;
+    header.sinks_ = sinks_;
+    header.position_ = position;
+    // a ring fills its slots from the front, so the used slots are always a prefix
+    header.num_slots_ = (std::min)(position, capacity_);
+    header.sampler_ = sampler.state();
+
+    FILE* file = fopen((const char*)filepath, "wb");
+    if(nullptr == file) {
+        return false;
+    }
+    bool result = 1 == fwrite(&header, sizeof(KVSnapshotHeader), 1, file);
+    u64 kv_dim = num_kv_heads_ * head_size_;
+    Tensor row(ggml_type::GGML_TYPE_F32, {2, kv_dim});
+    for(u64 i = 0; result && i < num_layers_; ++i) {
+        for(u64 j = 0; result && j < header.num_slots_; ++j) {
+            fetch(i, j, row.data<f32>(), row.data<f32>() + kv_dim);
+            result = 1 == fwrite(row.data<f32>(), sizeof(f32) * 2 * kv_dim, 1, file);
+        }
+    }
+    result = (0 == fclose(file)) && result;
+    return result;
+}
+
+bool KVCache::load(const char8_t* filepath, u64& position, Sampler& sampler)
+{
+    MappedFile file;
+    if(!file.open(filepath) || file.size() < sizeof(KVSnapshotHeader)) {
+        return false;
+    }
+    KVSnapshotHeader header;
+    ::memcpy(&header, file.data(), sizeof(KVSnapshotHeader));
+    if(KVSnapshotHeader::Magic != header.magic_ || KVSnapshotHeader::Version != header.version_) {
+        return false;
+    }
+    if(header.num_layers_ != num_layers_
+       || header.num_kv_heads_ != num_kv_heads_
+       || header.head_size_ != head_size_
+       || header.capacity_ != capacity_
+       || header.window_ != window_
+       || header.sinks_ != sinks_
+       || header.num_slots_ != (std::min)(header.position_, capacity_)) {
+        return false;
+    }
+    u64 kv_dim = num_kv_heads_ * head_size_;
+    if(file.size() != sizeof(KVSnapshotHeader) + sizeof(f32) * 2 * kv_dim * num_layers_ * header.num_slots_) {
+        return false;
+    }
+    if(!sampler.restore(header.sampler_)) {
+        return false;
+    }
+    const f32* data = reinterpret_cast<const f32*>(file.data() + sizeof(KVSnapshotHeader));
+    for(u64 i = 0; i < num_layers_; ++i) {
+        for(u64 j = 0; j < header.num_slots_; ++j, data += 2 * kv_dim) {
+            store(i, j, data, data + kv_dim);
+        }
+    }
+    position = header.position_;
+    return true;
+}
+
+//--- SelfAttention
+//-----------------------------------------------------------
+SelfAttention::SelfAttention()
+    : duration_(0)
+{
+}
+
+SelfAttention::SelfAttention(
+    Tensor&& query,
+    Tensor&& key,
+    Tensor&& value,
+    Tensor&& qkv)
+    : duration_(0)
+    , query_(std::move(query))
+    , key_(std::move(key))
+    , value_(std::move(value))
+    , qkv_proj_(std::move(qkv))
+{
+}
+
+SelfAttention::~SelfAttention()
+{
+}
+
+SelfAttention::SelfAttention(SelfAttention&& other)
+    : duration_(0)
+    , query_(std::move(other.query_))
+    , key_(std::move(other.key_))
+    , value_(std::move(other.value_))
+    , qkv_proj_(std::move(other.qkv_proj_))
+
+{
+}
+
+SelfAttention& SelfAttention::operator=(SelfAttention&& other)
+{
+    if(this != &other) {
+        duration_ = 0;
+        query_ = std::move(other.query_);
+        key_ = std::move(other.key_);
+        value_ = std::move(other.value_);
+        qkv_proj_ = std::move(other.qkv_proj_);
+    }
+    return *this;
+}
+
+void SelfAttention::forward(
+    const Config& config,
+    const RotaryEmbedding& rope,
+    u64 layer,
+    u64 position,
+    Tensor& x,
+    const RMSNorm& norm,
+    Tensor& buffer,
+    Tensor& query,
+    Tensor& key,
+    Tensor& value,
+    KVCache& cache,
+    Tensor& attention,
+    Tensor& scratch)
+{
+    u64 dim = config.dimension_;
+    u64 kv_dim = (config.dimension_ * config.num_kv_heads_) / config.num_heads_;
+    f32* q = query.data<f32>();
+    f32* k = key.data<f32>();
+    f32* v = value.data<f32>();
+
+    // qkv matmuls for the current position, reading x through the norm
+    f32 scale = norm.scale(x.data<f32>());
+    op::matvec_norm(q, x.data<f32>(), norm.weight(), scale, query_, dim, dim, scratch.data<f32>());
+    op::matvec_norm(k, x.data<f32>(), norm.weight(), scale, key_, dim, kv_dim, scratch.data<f32>());
+    op::matvec_norm(v, x.data<f32>(), norm.weight(), scale, value_, dim, kv_dim, scratch.data<f32>());
+
+    attend(config, rope, layer, position, buffer.data<f32>(), q, k, v, cache, attention);
+
+    // final matmul to get the output of the attention, added to the residual stream
+    op::matvec_add(x.data<f32>(), buffer.data<f32>(), qkv_proj_, dim, dim, scratch.data<f32>());
+}
+
+void SelfAttention::forward_batch(
+    const Config& config,
+    const RotaryEmbedding& rope,
+    u64 layer,
+    u64 count,
+    const BatchRow* rows,
+    Tensor& x,
+    Tensor& input,
+    Tensor& query,
+    Tensor& key,
+    Tensor& value,
+    Tensor& attention,
+    Tensor& scratch)
+{
+    u64 dim = config.dimension_;
+    u64 kv_dim = (config.dimension_ * config.num_kv_heads_) / config.num_heads_;
+
+    // qkv matmuls for all the rows, a weight is read once for the batch
+    op::matmat(query.data<f32>(), input.data<f32>(), count, query_, dim, dim, scratch.data<f32>());
+    op::matmat(key.data<f32>(), input.data<f32>(), count, key_, dim, kv_dim, scratch.data<f32>());
+    op::matmat(value.data<f32>(), input.data<f32>(), count, value_, dim, kv_dim, scratch.data<f32>());
+
+    // causal attention, a position is stored right before it attends,
+    // so that a ring cache never evicts what an earlier position of the sequence still sees
+    for(u64 t = 0; t < count; ++t) {
+        attend(
+            config,
+            rope,
+            layer,
+            rows[t].position_,
+            input.data<f32>() + t * dim,
+            query.data<f32>() + t * dim,
+            key.data<f32>() + t * kv_dim,
+            value.data<f32>() + t * kv_dim,
+            *rows[t].cache_,
+            attention);
+    }
+
+    op::matmat_add(x.data<f32>(), input.data<f32>(), count, qkv_proj_, dim, dim, scratch.data<f32>());
+}
+
+void SelfAttention::attend(
+    const Config& config,
+    const RotaryEmbedding& rope,
+    u64 layer,
+    u64 position,
+    f32* output,
+    f32* q,
+    f32* k,
+    const f32* v,
+    KVCache& cache,
+    Tensor& attention)
+{
+    u64 n_heads = config.num_heads_;
+    u64 kv_mul = config.num_heads_ / config.num_kv_heads_;
+    u64 head_size = config.dimension_ / n_heads;
+
+    // RoPE relative positional encoding: complex-valued rotate q and k in each head
+    // A ring cache keeps keys unrotated and rotates them by their index in the cache,
+    // so that the distances seen by the query never exceed the capacity.
+    const RotaryEmbedding* key_rope = nullptr;
+    if(cache.is_ring()) {
+        rope.forward(cache.length(position) - 1, n_heads, q, 0, nullptr);
+        key_rope = &rope;
+    } else {
+        rope.forward(position, n_heads, q, config.num_kv_heads_, k);
+    }
+    cache.store(layer, cache.slot(position), k, v);
+
+    // grouped query attention. the query heads sharing a kv head are processed together
+    {
+        KVCache::Segment segments[KVCache::MaxSegments];
+        u32 num_segments = cache.segments(segments, position);
+        u64 length = cache.length(position);
+        u64 score_stride = cache.capacity();
+        u64 num_kv_heads = config.num_kv_heads_;
+        for(u64 g = 0; g < num_kv_heads; ++g) {
+            u64 head_offset = g * kv_mul * head_size;
+            f32* scores = attention.data<f32>() + g * kv_mul * score_stride;
+            u64 index = 0;
+            for(u32 i = 0; i < num_segments; ++i) {
+                if(KVCache::Layout::TransposedKey == cache.layout()) {
+                    op::attention_scores_transposed(
+                        head_size,
+                        kv_mul,
+                        segments[i].count_,
+                        scores + index,
+                        score_stride,
+                        q + head_offset,
+                        cache.key(layer, g, segments[i].slot_),
+                        cache.key_dimension_stride(),
+                        key_rope,
+                        index);
+                } else {
+                    op::attention_scores(
+                        head_size,
+                        kv_mul,
+                        segments[i].count_,
+                        scores + index,
+                        score_stride,
+                        q + head_offset,
+                        cache.key(layer, g, segments[i].slot_),
+                        cache.key_stride(),
+                        key_rope,
+                        index);
+                }
+                index += segments[i].count_;
+            }
+            for(u64 h = 0; h < kv_mul; ++h) {
+                op::softmax(length, scores + h * score_stride);
+            }
+            f32* head_output = output + head_offset;
+            ::memset(head_output, 0, sizeof(f32) * kv_mul * head_size);
+            index = 0;
+            for(u32 i = 0; i < num_segments; ++i) {
+                op::attention_values(
+                    head_size,
+                    kv_mul,
+                    segments[i].count_,
+                    head_output,
+                    scores + index,
+                    score_stride,
+                    cache.value(layer, g, segments[i].slot_),
+                    cache.value_stride());
+                index += segments[i].count_;
+            }
+        }
+    }
+}
+
+//--- FeedForwardSwiGLU
+//-----------------------------------------------------------
+FeedForwardSwiGLU::FeedForwardSwiGLU()
+    : duration_(0)
+{
+}
+
+FeedForwardSwiGLU::FeedForwardSwiGLU(
+    Tensor&& ffn_down,
+    Tensor&& ffn_gate,
+    Tensor&& ffn_up,
+    Tensor&& ffn_norm)
+    : duration_(0)
+    , ffn_down_(std::move(ffn_down))
+    , ffn_gate_(std::move(ffn_gate))
+    , ffn_up_(std::move(ffn_up))
+    , ffn_norm_(std::move(ffn_norm))
+{
+}
+
+FeedForwardSwiGLU::~FeedForwardSwiGLU()
+{
+}
+
+FeedForwardSwiGLU::FeedForwardSwiGLU(FeedForwardSwiGLU&& other)
+    : duration_(0)
+    , ffn_down_(std::move(other.ffn_down_))
+    , ffn_gate_(std::move(other.ffn_gate_))
+    , ffn_up_(std::move(other.ffn_up_))
+    , ffn_norm_(std::move(other.ffn_norm_))
+{
+}
+
+FeedForwardSwiGLU& FeedForwardSwiGLU::operator=(FeedForwardSwiGLU&& other)
+{
+    if(this != &other) {
+        duration_ = 0;
+        ffn_down_ = std::move(other.ffn_down_);
+        ffn_gate_ = std::move(other.ffn_gate_);
+        ffn_up_ = std::move(other.ffn_up_);
+        ffn_norm_ = std::move(other.ffn_norm_);
+    }
+    return *this;
+}
+
+void FeedForwardSwiGLU::forward(
+    const Config& config,
+    Tensor& x,
+    const RMSNorm& norm,
+    Tensor& buffer,
+    Tensor& scratch)
+{
+    u64 dim = config.dimension_;
+    u64 hidden_dim = config.hidden_dim_;
+    // gate, up and SwiGLU non-linearity in one pass, reading x through the norm
+    f32 scale = norm.scale(x.data<f32>());
+    op::matvec_swiglu(buffer.data<f32>(), x.data<f32>(), norm.weight(), scale, ffn_gate_, ffn_up_, dim, hidden_dim, scratch.data<f32>());
+    op::matvec_add(x.data<f32>(), buffer.data<f32>(), ffn_down_, hidden_dim, dim, scratch.data<f32>());
+}
+
+void FeedForwardSwiGLU::forward_batch(
+    const Config& config,
+    u64 count,
+    Tensor& x,
+    const Tensor& input,
+    Tensor& buffer,
+    Tensor& scratch)
+{
+    u64 dim = config.dimension_;
+    u64 hidden_dim = config.hidden_dim_;
+    op::matmat_swiglu(buffer.data<f32>(), input.data<f32>(), count, ffn_gate_, ffn_up_, dim, hidden_dim, scratch.data<f32>());
+    op::matmat_add(x.data<f32>(), buffer.data<f32>(), count, ffn_down_, hidden_dim, dim, scratch.data<f32>());
+}
+
+//--- TransformerBlock
+//-----------------------------------------------------------
+TransformerBlock::TransformerBlock()
+    : duration_(0)
+{
+}
+
+TransformerBlock::TransformerBlock(
+    RMSNorm&& attn_rmsnorm,
+    SelfAttention&& attn,
+    RMSNorm&& ff_rmsnorm,
+    FeedForwardSwiGLU&& ff)
+    : duration_(0)
+    , attn_rmsnorm_(std::move(attn_rmsnorm))
+    , attn_(std::move(attn))
+    , ff_rmsnorm_(std::move(ff_rmsnorm))
+    , ff_(std::move(ff))
+{
+}
+
+TransformerBlock::~TransformerBlock()
+{
+}
+
+TransformerBlock::TransformerBlock(TransformerBlock&& other)
+    : duration_(0)
+    , attn_rmsnorm_(std::move(other.attn_rmsnorm_))
+    , attn_(std::move(other.attn_))
+    , ff_rmsnorm_(std::move(other.ff_rmsnorm_))
+    , ff_(std::move(other.ff_))
+{
+}
+
+TransformerBlock& TransformerBlock::operator=(TransformerBlock&& other)
+{
+    if(this != &other) {
+        duration_ = 0;
+        attn_rmsnorm_ = std::move(other.attn_rmsnorm_);
+        attn_ = std::move(other.attn_);
+        ff_rmsnorm_ = std::move(other.ff_rmsnorm_);
+        ff_ = std::move(other.ff_);
+    }
+    return *this;
+}
+
+void TransformerBlock::forward(
+    const Config& config,
+    const RotaryEmbedding& rope,
+    u64 layer,
+    u64 position,
+    Tensor& x,
+    Tensor& query,
+    Tensor& key,
+    Tensor& value,
+    KVCache& cache,
+    Tensor& attention,
+    Tensor& buffer,
+    Tensor& hbuffer,
+    Tensor& scratch)
+{
+    // norms are folded into the projections and residuals into the output projections,
+    // x is the only activation of dimension written in a layer
+    attn_.forward(
+        config,
+        rope,
+        layer,
+        position,
+        x,
+        attn_rmsnorm_,
+        buffer,
+        query,
+        key,
+        value,
+        cache,
+        attention,
+        scratch);
+    ff_.forward(config, x, ff_rmsnorm_, hbuffer, scratch);
+}
+
+void TransformerBlock::forward_batch(
+    const Config& config,
+    const RotaryEmbedding& rope,
+    u64 layer,
+    u64 count,
+    const BatchRow* rows,
+    Tensor& x,
+    Tensor& query,
+    Tensor& key,
+    Tensor& value,
+    Tensor& attention,
+    Tensor& buffer,
+    Tensor& hbuffer,
+    Tensor& scratch)
+{
+    // rows are normalized once, a weight tile is reused by all of them
+    attn_rmsnorm_.forward(buffer, x, count);
+    attn_.forward_batch(
+        config,
+        rope,
+        layer,
+        count,
+        rows,
+        x,
+        buffer,
+        query,
+        key,
+        value,
+        attention,
+        scratch);
+    ff_rmsnorm_.forward(buffer, x, count);
+    ff_.forward_batch(config, count, x, buffer, hbuffer, scratch);
+}
+
+//--- Vocabulary
+//-----------------------------------------------------------
+Vocabulary::Vocabulary()
+    : model_{}
+    , tokens_{}
+    , scores_{}
+    , token_types_{}
+    , merges_{}
+    , added_tokens_{}
+    , bos_token_id_(1)
+    , eos_token_id_(2)
+    , unknown_token_id_(0)
+    , separator_token_id_(-1)
+    , padding_token_id_(-1)
+    , cls_token_id_(-1)
+    , mask_token_id_(-1)
+    , add_bos_(-1)
+    , add_eos_(-1)
+    , linefeed_id_(13)
+    , prefix_id_(-1)
+    , suffix_id_(-1)
+    , middle_id_(-1)
+    , eot_id_(-1)
+    , add_space_prefix_(true)
+    , max_token_length_(0)
+{
+}
+
+Vocabulary::Vocabulary(const gguf::GGUF& model_data)
+    : model_{}
+    , tokens_{}
+    , scores_{}
+    , token_types_{}
+    , merges_{}
+    , added_tokens_{}
+    , bos_token_id_(1)
+    , eos_token_id_(2)
+    , unknown_token_id_(0)
+    , separator_token_id_(-1)
+    , padding_token_id_(-1)
+    , cls_token_id_(-1)
+    , mask_token_id_(-1)
+    , add_bos_(-1)
+    , add_eos_(-1)
+    , linefeed_id_(13)
+    , prefix_id_(-1)
+    , suffix_id_(-1)
+    , middle_id_(-1)
+    , eot_id_(-1)
+    , add_space_prefix_(true)
+    , max_token_length_(0)
+{
+    using namespace gguf;
+    const gguf_metadata_kv_t* metadata = nullptr;
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.model")) {
+        model_ = model_data.getMetaDataString(*metadata);
+    }
+
+    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.tokens")) {
+        tokens_ = model_data.getMetaDataArray(*metadata);
+    }
+    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"tokenizer.ggml.scores")) {
         scores_ = model_data.getMetaDataArray(*metadata);
     }
-    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_INT32, u8"tokenizer.ggml.token_type")) {
-        token_types_ = model_data.getMetaDataArray(*metadata);
+    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_INT32, u8"tokenizer.ggml.token_type")) {
+        token_types_ = model_data.getMetaDataArray(*metadata);
+    }
+    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.merges")) {
+        merges_ = model_data.getMetaDataArray(*metadata);
+    }
+    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.added_tokens")) {
+        added_tokens_ = model_data.getMetaDataArray(*metadata);
+    }
+
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.bos_token_id")) {
+        bos_token_id_ = model_data.getMetaDataU32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.eos_token_id")) {
+        eos_token_id_ = model_data.getMetaDataU32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.unknown_token_id")) {
+        unknown_token_id_ = model_data.getMetaDataU32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.separator_token_id")) {
+        separator_token_id_ = model_data.getMetaDataU32(*metadata);
+    }
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.padding_token_id")) {
+        padding_token_id_ = model_data.getMetaDataU32(*metadata);
+    }
+
+    build_token_cache();
+    for(u64 i = 0; i < cache_token_types_.size(); ++i) {
+        s32 type = cache_token_types_[i];
+        if(static_cast<s32>(Type::Control) == type || static_cast<s32>(Type::UserDefined) == type) {
+            cache_special_tokens_.push_back(static_cast<s32>(i));
+        }
+    }
+    for(GGUFArray::Iterator<GGUFString> itr = added_tokens_.begin<GGUFString>(); itr; ++itr) {
+        GGUFString ggufStr = *itr;
+        s32 added = 0;
+        if(!encode(added, ggufStr.length_, ggufStr.str_)) {
+            continue;
+        }
+        bool found = false;
+        for(u64 i = 0; i < cache_special_tokens_.size() && !found; ++i) {
+            found = added == cache_special_tokens_[i];
+        }
+        if(!found) {
+            cache_special_tokens_.push_back(added);
+        }
+    }
+    build_piece_cache();
+}
+
+Vocabulary::~Vocabulary()
+{
+}
+
+Vocabulary::Vocabulary(Vocabulary&& other)
+    : model_(other.model_)
+    , tokens_(other.tokens_)
+    , scores_(other.scores_)
+    , token_types_(other.token_types_)
+    , merges_(other.merges_)
+    , added_tokens_(other.added_tokens_)
+    , bos_token_id_(other.bos_token_id_)
+    , eos_token_id_(other.eos_token_id_)
+    , unknown_token_id_(other.unknown_token_id_)
+    , separator_token_id_(other.separator_token_id_)
+    , padding_token_id_(other.padding_token_id_)
+    , cls_token_id_(other.cls_token_id_)
+    , mask_token_id_(other.mask_token_id_)
+    , add_bos_(other.add_bos_)
+    , add_eos_(other.add_eos_)
+    , linefeed_id_(other.linefeed_id_)
+    , prefix_id_(other.prefix_id_)
+    , suffix_id_(other.suffix_id_)
+    , middle_id_(other.middle_id_)
+    , eot_id_(other.eot_id_)
+    , add_space_prefix_(other.add_space_prefix_)
+    , max_token_length_(other.max_token_length_)
+    , cache_token_text_(std::move(other.cache_token_text_))
+    , cache_token_offsets_(std::move(other.cache_token_offsets_))
+    , cache_token_scores_(std::move(other.cache_token_scores_))
+    , cache_token_types_(std::move(other.cache_token_types_))
+    , text_hash_(std::move(other.text_hash_))
+    , cache_slot_to_id_(std::move(other.cache_slot_to_id_))
+    , cache_special_tokens_(std::move(other.cache_special_tokens_))
+    , cache_token_to_piece_(std::move(other.cache_token_to_piece_))
+    , cache_piece_offsets_(std::move(other.cache_piece_offsets_))
+{
+    other.model_ = {};
+    other.tokens_ = {};
+    other.scores_ = {};
+    other.token_types_ = {};
+    other.merges_ = {};
+    other.added_tokens_ = {};
+    other.bos_token_id_ = 1;
+    other.eos_token_id_ = 2;
+    other.unknown_token_id_ = 0;
+    other.separator_token_id_ = -1;
+    other.padding_token_id_ = -1;
+    other.cls_token_id_ = -1;
+    other.mask_token_id_ = -1;
+    other.add_bos_ = -1;
+    other.add_eos_ = -1;
+    other.linefeed_id_ = 13;
+    other.prefix_id_ = -1;
+    other.suffix_id_ = -1;
+    other.middle_id_ = -1;
+    other.eot_id_ = -1;
+    other.add_space_prefix_ = true;
+    other.max_token_length_ = 0;
+}
+
+Vocabulary& Vocabulary::operator=(Vocabulary&& other)
+{
+    if(this != &other) {
+        model_ = other.model_;
+        tokens_ = other.tokens_;
+        scores_ = other.scores_;
+        token_types_ = other.token_types_;
+        merges_ = other.merges_;
+        added_tokens_ = other.added_tokens_;
+        bos_token_id_ = other.bos_token_id_;
+        eos_token_id_ = other.eos_token_id_;
+        unknown_token_id_ = other.unknown_token_id_;
+        separator_token_id_ = other.separator_token_id_;
+        padding_token_id_ = other.padding_token_id_;
+        cls_token_id_ = other.cls_token_id_;
+        mask_token_id_ = other.mask_token_id_;
+        add_bos_ = other.add_bos_;
+        add_eos_ = other.add_eos_;
+        linefeed_id_ = other.linefeed_id_;
+        prefix_id_ = other.prefix_id_;
+        suffix_id_ = other.suffix_id_;
+        middle_id_ = other.middle_id_;
+        eot_id_ = other.eot_id_;
+        add_space_prefix_ = other.add_space_prefix_;
+        max_token_length_ = other.max_token_length_;
+        cache_token_text_ = std::move(other.cache_token_text_);
+        cache_token_offsets_ = std::move(other.cache_token_offsets_);
+        cache_token_scores_ = std::move(other.cache_token_scores_);
+        cache_token_types_ = std::move(other.cache_token_types_);
+        text_hash_ = std::move(other.text_hash_);
+        cache_slot_to_id_ = std::move(other.cache_slot_to_id_);
+        cache_special_tokens_ = std::move(other.cache_special_tokens_);
+        cache_token_to_piece_ = std::move(other.cache_token_to_piece_);
+        cache_piece_offsets_ = std::move(other.cache_piece_offsets_);
+
+        other.model_ = {};
+        other.tokens_ = {};
+        other.scores_ = {};
+        other.token_types_ = {};
+        other.merges_ = {};
+        other.added_tokens_ = {};
+        other.bos_token_id_ = 1;
+        other.eos_token_id_ = 2;
+        other.unknown_token_id_ = 0;
+        other.separator_token_id_ = -1;
+        other.padding_token_id_ = -1;
+        other.cls_token_id_ = -1;
+        other.mask_token_id_ = -1;
+        other.add_bos_ = -1;
+        other.add_eos_ = -1;
+        other.linefeed_id_ = 13;
+        other.prefix_id_ = -1;
+        other.suffix_id_ = -1;
+        other.middle_id_ = -1;
+        other.eot_id_ = -1;
+        other.max_token_length_ = 0;
+    }
+    return *this;
+}
+
+const gguf::GGUFString& Vocabulary::getModel() const
+{
+    return model_;
+}
+
+const gguf::GGUFArray& Vocabulary::getTokens() const
+{
+    return tokens_;
+}
+
+const gguf::GGUFArray& Vocabulary::getScores() const
+{
+    return scores_;
+}
+
+const gguf::GGUFArray& Vocabulary::getTokenTypes() const
+{
+    return token_types_;
+}
+
+const gguf::GGUFArray& Vocabulary::getMerges() const
+{
+    return merges_;
+}
+
+const gguf::GGUFArray& Vocabulary::getAddedTokens() const
+{
+    return added_tokens_;
+}
+
+s32 Vocabulary::getBOS() const
+{
+    return bos_token_id_;
+}
+
+s32 Vocabulary::getEOS() const
+{
+    return eos_token_id_;
+}
+
+s32 Vocabulary::getUnknown() const
+{
+    return unknown_token_id_;
+}
+
+s32 Vocabulary::getSeparator() const
+{
+    return separator_token_id_;
+}
+
+s32 Vocabulary::getPadding() const
+{
+    return padding_token_id_;
+}
+
+s32 Vocabulary::getCls() const
+{
+    return cls_token_id_;
+}
+
+s32 Vocabulary::getMask() const
+{
+    return mask_token_id_;
+}
+
+s32 Vocabulary::getMaxTokenLength() const
+{
+    return max_token_length_;
+}
+
+u64 Vocabulary::idToTokenSize() const
+{
+    return cache_token_scores_.size();
+}
+
+Vocabulary::Token Vocabulary::idToToken(s32 x) const
+{
+    Token token;
+    token.text_ = text(x);
+    token.score_ = cache_token_scores_[x];
+    token.type_ = cache_token_types_[x];
+    return token;
+}
+
+bool Vocabulary::tokenToId(s32& id, const String& token) const
+{
+    return find(id, token.len_, token.str_);
+}
+
+bool Vocabulary::tokenToId(s32& id, const std::u8string& token) const
+{
+    return find(id, token.length(), token.c_str());
+}
+
+bool Vocabulary::encode(s32& token, const char8_t* str) const
+{
+    assert(nullptr != str);
+    return find(token, ::strnlen(reinterpret_cast<const char*>(str), 128), str);
+}
+
+bool Vocabulary::encode(s32& token, u64 length, const char8_t* str) const
+{
+    assert(nullptr != str);
+    return find(token, length, str);
+}
+
+String Vocabulary::tokenToPiece(s32 id) const
+{
+    assert(0 <= id && static_cast<u64>(id + 1) < cache_piece_offsets_.size());
+    u32 begin = cache_piece_offsets_[id];
+    u32 end = cache_piece_offsets_[id + 1];
+    return {end - begin, begin < end ? &cache_token_to_piece_[begin] : nullptr};
+}
+
+const Array<s32>& Vocabulary::getSpecialTokens() const
+{
+    return cache_special_tokens_;
+}
+
+String Vocabulary::text(s32 x) const
+{
+    assert(0 <= x && static_cast<u64>(x + 1) < cache_token_offsets_.size());
+    u32 begin = cache_token_offsets_[x];
+    u32 end = cache_token_offsets_[x + 1];
+    return {end - begin, begin < end ? &cache_token_text_[begin] : u8""};
+}
+
+bool Vocabulary::find(s32& id, u64 length, const char8_t* str) const
+{
+    if(cache_slot_to_id_.size() <= 0) {
+        return false;
+    }
+    // the slot of a text out of the vocabulary holds another token
+    u64 hash = wyhash64(length, str, HashSeed);
+    s32 candidate = cache_slot_to_id_[text_hash_(hash)];
+    u32 begin = cache_token_offsets_[candidate];
+    if((cache_token_offsets_[candidate + 1] - begin) != length
+       || (0 < length && 0 != ::memcmp(&cache_token_text_[begin], str, length))) {
+        return false;
+    }
+    id = candidate;
+    return true;
+}
+
+void Vocabulary::build_token_cache()
+{
+    using namespace gguf;
+    u64 size = tokens_.size_;
+    u64 total = 0;
+    for(GGUFArray::Iterator<GGUFString> itr = tokens_.begin<GGUFString>(); itr; ++itr) {
+        total += (*itr).length_;
+    }
+    assert(total < 0xFFFF'FFFFULL);
+
+    // all bytes in one arena
+    cache_token_text_.resize(total);
+    cache_token_offsets_.resize(size + 1);
+    cache_token_scores_.resize(size);
+    cache_token_types_.resize(size);
+    Array<u64> hashes;
+    hashes.resize(size);
+    u64 offset = 0;
+    u64 id = 0;
+    for(GGUFArray::Iterator<GGUFString> itr = tokens_.begin<GGUFString>(); itr; ++itr, ++id) {
+        GGUFString ggufStr = *itr;
+        max_token_length_ = (std::max)(max_token_length_, static_cast<s32>(ggufStr.length_));
+        cache_token_offsets_[id] = static_cast<u32>(offset);
+        if(0 < ggufStr.length_) {
+            ::memcpy(&cache_token_text_[offset], ggufStr.str_, ggufStr.length_);
+        }
+        offset += ggufStr.length_;
+        cache_token_scores_[id] = id < scores_.size_ ? scores_.get<f32>(id) : 0.0f;
+        cache_token_types_[id] = static_cast<s8>(id < token_types_.size_ ? token_types_.get<s32>(id) : 0);
+        hashes[id] = wyhash64(ggufStr.length_, ggufStr.str_, HashSeed);
+    }
+    cache_token_offsets_[size] = static_cast<u32>(offset);
+    if(size <= 0) {
+        return;
+    }
+
+    // a duplicated text is the first token of it, as the map did
+    Array<s32> order;
+    order.resize(size);
+    for(u64 i = 0; i < size; ++i) {
+        order[i] = static_cast<s32>(i);
+    }
+    std::sort(&order[0], &order[0] + size, [&hashes](s32 x0, s32 x1) {
+        return hashes[x0] < hashes[x1] || (hashes[x0] == hashes[x1] && x0 < x1);
+    });
+    Array<s32> unique;
+    Array<u64> keys;
+    unique.reserve(size);
+    keys.reserve(size);
+    for(u64 i = 0; i < size; ++i) {
+        s32 x = order[i];
+        bool duplicated = false;
+        for(u64 j = unique.size(); 0 < j && keys[j - 1] == hashes[x] && !duplicated; --j) {
+            String t0 = text(unique[j - 1]);
+            String t1 = text(x);
+            duplicated = t0.len_ == t1.len_ && 0 == ::memcmp(t0.str_, t1.str_, t0.len_);
+        }
+        if(!duplicated) {
+            unique.push_back(x);
+            keys.push_back(hashes[x]);
+        }
+    }
+    if(!text_hash_.build(keys.size(), &keys[0])) {
+        // distinct texts of one 64 bit hash
+        assert(false);
+        return;
+    }
+    cache_slot_to_id_.resize(keys.size());
+    for(u64 i = 0; i < keys.size(); ++i) {
+        cache_slot_to_id_[text_hash_(keys[i])] = unique[i];
+    }
+}
+
+void Vocabulary::build_piece_cache()
+{
+    u64 size = idToTokenSize();
+    u64 total = cache_token_text_.size();
+    cache_token_to_piece_.clear();
+    cache_token_to_piece_.reserve(total);
+    cache_piece_offsets_.resize(size + 1);
+    for(u64 i = 0; i < size; ++i) {
+        cache_piece_offsets_[i] = static_cast<u32>(cache_token_to_piece_.size());
+        String piece = text(static_cast<s32>(i));
+        const char8_t* str = piece.str_;
+        // byte fallback <0xNN>
+        if(6 == piece.len_ && u8'<' == str[0] && u8'0' == str[1] && u8'x' == str[2] && u8'>' == str[5]) {
+            auto hex = [](char8_t c) {
+                return (u8'0' <= c && c <= u8'9') ? c - u8'0' : (c & 0x0F) + 9;
+            };
+            cache_token_to_piece_.push_back(static_cast<char8_t>((hex(str[3]) << 4) | hex(str[4])));
+            continue;
+        }
+        // SentencePiece marks a space with U+2581
+        for(u64 j = 0; j < piece.len_; ++j) {
+            if(j + 2 < piece.len_ && 0xE2 == str[j] && 0x96 == str[j + 1] && 0x81 == str[j + 2]) {
+                cache_token_to_piece_.push_back(u8' ');
+                j += 2;
+            } else {
+                cache_token_to_piece_.push_back(str[j]);
+            }
+        }
+    }
+    cache_piece_offsets_[size] = static_cast<u32>(cache_token_to_piece_.size());
+}
+
+//--- MergeRanks
+//-----------------------------------------------------------
+MergeRanks::MergeRanks()
+    : valid_(true)
+{
+}
+
+MergeRanks::MergeRanks(const Vocabulary& vocab)
+{
+    HashMap<u64, Merge> table;
+    if(0 < vocab.getMerges().size_) {
+        build_from_merges(table, vocab);
+    } else {
+        build_from_scores(table, vocab);
+    }
+    valid_ = table_.build(table);
+}
+
+MergeRanks::~MergeRanks()
+{
+}
+
+MergeRanks::MergeRanks(MergeRanks&& other)
+    : valid_(other.valid_)
+    , table_(std::move(other.table_))
+{
+    other.valid_ = true;
+}
+
+MergeRanks& MergeRanks::operator=(MergeRanks&& other)
+{
+    if(this != &other) {
+        valid_ = other.valid_;
+        table_ = std::move(other.table_);
+        other.valid_ = true;
+    }
+    return *this;
+}
+
+bool MergeRanks::valid() const
+{
+    return valid_;
+}
+
+u32 MergeRanks::size() const
+{
+    return static_cast<u32>(table_.size());
+}
+
+bool MergeRanks::find(Merge& merge, s32 left, s32 right) const
+{
+    const Merge* found = table_.find(key(left, right));
+    if(nullptr == found) {
+        return false;
+    }
+    merge = *found;
+    return true;
+}
+
+void MergeRanks::build_from_merges(HashMap<u64, Merge>& table, const Vocabulary& vocab)
+{
+    using namespace gguf;
+    const GGUFArray& merges = vocab.getMerges();
+    table.reserve(static_cast<u32>(merges.size_));
+    std::u8string text;
+    u32 rank = 0;
+    for(GGUFArray::Iterator<GGUFString> itr = merges.begin<GGUFString>(); itr; ++itr, ++rank) {
+        // "left right", a piece is not empty and the byte level pieces have no spaces
+        GGUFString merge = *itr;
+        u64 separator = 1;
+        while(separator < merge.length_ && u8' ' != merge.str_[separator]) {
+            ++separator;
+        }
+        if(merge.length_ <= separator + 1) {
+            continue;
+        }
+        s32 left = 0;
+        s32 right = 0;
+        s32 merged = 0;
+        text.assign(merge.str_, separator);
+        text.append(merge.str_ + separator + 1, merge.length_ - separator - 1);
+        if(!vocab.encode(left, separator, merge.str_)
+           || !vocab.encode(right, merge.length_ - separator - 1, merge.str_ + separator + 1)
+           || !vocab.tokenToId(merged, text)) {
+            continue;
+        }
+        if(table.find(key(left, right)) == table.end()) {
+            table.add(key(left, right), {rank, merged});
+        }
+    }
+}
+
+void MergeRanks::build_from_scores(HashMap<u64, Merge>& table, const Vocabulary& vocab)
+{
+    u64 size = vocab.idToTokenSize();
+    if(0 == size) {
+        return;
+    }
+    // equal scores share a rank, then the leftmost pair merges first as it does with the scores
+    Array<f32> scores;
+    scores.resize(size);
+    for(u64 i = 0; i < size; ++i) {
+        scores[i] = vocab.idToToken(static_cast<s32>(i)).score_;
+    }
+    f32* begin = &scores[0];
+    f32* end = begin + size;
+    std::sort(begin, end, std::greater<f32>());
+    end = std::unique(begin, end);
+
+    // every split of a token into two tokens merges to the token
+    for(u64 i = 0; i < size; ++i) {
+        const Vocabulary::Token& token = vocab.idToToken(static_cast<s32>(i));
+        const char8_t* str = token.text_.str_;
+        u64 len = token.text_.len_;
+        if(len < 2) {
+            continue;
+        }
+        u32 rank = static_cast<u32>(std::lower_bound(begin, end, token.score_, std::greater<f32>()) - begin);
+        for(u64 split = utf8_length(str[0]); split < len; split += utf8_length(str[split])) {
+            s32 left = 0;
+            s32 right = 0;
+            if(vocab.encode(left, split, str) && vocab.encode(right, len - split, str + split)) {
+                table.add(key(left, right), {rank, static_cast<s32>(i)});
+            }
+        }
+    }
+}
+
+//--- SpecialTokenMatcher
+//-----------------------------------------------------------
+SpecialTokenMatcher::SpecialTokenMatcher()
+    : first_{}
+    , num_firsts_(0)
+    , firsts_{}
+    , max_length_(0)
+    , valid_(true)
+{
+}
+
+SpecialTokenMatcher::SpecialTokenMatcher(const Vocabulary& vocab)
+    : first_{}
+    , num_firsts_(0)
+    , firsts_{}
+    , max_length_(0)
+    , valid_(true)
+{
+    const Array<s32>& tokens = vocab.getSpecialTokens();
+    if(tokens.size() <= 0) {
+        return;
+    }
+    HashMap<u64, u32> edges;
+    nodes_.push_back(-1);
+    for(u64 i = 0; i < tokens.size(); ++i) {
+        add(edges, tokens[i], vocab.idToToken(tokens[i]).text_);
+    }
+    valid_ = edges_.build(edges);
+}
+
+SpecialTokenMatcher::~SpecialTokenMatcher()
+{
+}
+
+SpecialTokenMatcher::SpecialTokenMatcher(SpecialTokenMatcher&& other)
+    : num_firsts_(other.num_firsts_)
+    , max_length_(other.max_length_)
+    , valid_(other.valid_)
+    , edges_(std::move(other.edges_))
+    , nodes_(std::move(other.nodes_))
+{
+    ::memcpy(first_, other.first_, sizeof(first_));
+    ::memcpy(firsts_, other.firsts_, sizeof(firsts_));
+    ::memset(other.first_, 0, sizeof(other.first_));
+    other.num_firsts_ = 0;
+    other.max_length_ = 0;
+}
+
+SpecialTokenMatcher& SpecialTokenMatcher::operator=(SpecialTokenMatcher&& other)
+{
+    if(this != &other) {
+        ::memcpy(first_, other.first_, sizeof(first_));
+        num_firsts_ = other.num_firsts_;
+        ::memcpy(firsts_, other.firsts_, sizeof(firsts_));
+        max_length_ = other.max_length_;
+        valid_ = other.valid_;
+        edges_ = std::move(other.edges_);
+        nodes_ = std::move(other.nodes_);
+        ::memset(other.first_, 0, sizeof(other.first_));
+        other.num_firsts_ = 0;
+        other.max_length_ = 0;
+    }
+    return *this;
+}
+
+bool SpecialTokenMatcher::empty() const
+{
+    return nodes_.size() <= 1;
+}
+
+bool SpecialTokenMatcher::valid() const
+{
+    return valid_;
+}
+
+u64 SpecialTokenMatcher::max_length() const
+{
+    return max_length_;
+}
+
+bool SpecialTokenMatcher::find(Match& match, u64 offset, u64 size, const char8_t* text) const
+{
+    if(empty()) {
+        return false;
+    }
+    for(offset = next_candidate(offset, size, text); offset < size; offset = next_candidate(offset + 1, size, text)) {
+        s32 token = -1;
+        u64 length = longest(token, offset, size, text);
+        if(0 < length) {
+            match.offset_ = offset;
+            match.length_ = length;
+            match.token_ = token;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SpecialTokenMatcher::add(HashMap<u64, u32>& edges, s32 token, const String& text)
+{
+    if(text.len_ <= 0) {
+        return;
+    }
+    max_length_ = (std::max)(max_length_, static_cast<u64>(text.len_));
+    char8_t c = text.str_[0];
+    if(!first_[c]) {
+        first_[c] = true;
+        if(num_firsts_ < MaxVectorFirsts) {
+            firsts_[num_firsts_] = c;
+        }
+        ++num_firsts_;
+    }
+    u32 node = 0;
+    for(u64 i = 0; i < text.len_; ++i) {
+        u32* child = nullptr;
+        if(edges.tryGet(key(node, text.str_[i]), child)) {
+            node = *child;
+            continue;
+        }
+        u32 next = static_cast<u32>(nodes_.size());
+        nodes_.push_back(-1);
+        edges.add(key(node, text.str_[i]), next);
+        node = next;
+    }
+    nodes_[node] = token;
+}
+
+bool SpecialTokenMatcher::child(u32& next, u32 node, char8_t c) const
+{
+    const u32* child = edges_.find(key(node, c));
+    if(nullptr == child) {
+        return false;
+    }
+    next = *child;
+    return true;
+}
+
+u64 SpecialTokenMatcher::next_candidate(u64 offset, u64 size, const char8_t* text) const
+{
+    if(num_firsts_ <= MaxVectorFirsts) {
+        // compare 32 bytes with each first byte
+        __m256i firsts[MaxVectorFirsts];
+        for(u32 i = 0; i < MaxVectorFirsts; ++i) {
+            firsts[i] = _mm256_set1_epi8(static_cast<char>(firsts_[i < num_firsts_ ? i : 0]));
+        }
+        while((offset + 32) <= size) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + offset));
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(x, firsts[0]), _mm256_cmpeq_epi8(x, firsts[1])),
+                _mm256_or_si256(_mm256_cmpeq_epi8(x, firsts[2]), _mm256_cmpeq_epi8(x, firsts[3])));
+            u32 mask = static_cast<u32>(_mm256_movemask_epi8(m));
+            if(0 != mask) {
+                return offset + std::countr_zero(mask);
+            }
+            offset += 32;
+        }
+    }
+    while(offset < size && !first_[text[offset]]) {
+        ++offset;
+    }
+    return offset;
+}
+
+u64 SpecialTokenMatcher::longest(s32& token, u64 offset, u64 size, const char8_t* text) const
+{
+    u32 node = 0;
+    u64 length = 0;
+    for(u64 i = offset; i < size; ++i) {
+        if(!child(node, node, text[i])) {
+            break;
+        }
+        if(0 <= nodes_[node]) {
+            token = nodes_[node];
+            length = i + 1 - offset;
+        }
+    }
+    return length;
+}
+
+//--- TokenTrie
+//-----------------------------------------------------------
+TokenTrie::TokenTrie()
+    : size_(0)
+    , valid_(true)
+{
+}
+
+TokenTrie::TokenTrie(const Vocabulary& vocab)
+    : size_(vocab.idToTokenSize())
+    , valid_(true)
+{
+    if(size_ <= 0) {
+        return;
+    }
+    assert(size_ < 0xFFFF'FFFFULL);
+    order_.resize(size_);
+    for(u64 i = 0; i < size_; ++i) {
+        order_[i] = static_cast<s32>(i);
+    }
+    std::sort(&order_[0], &order_[0] + size_, [&vocab](s32 x0, s32 x1) {
+        String p0 = vocab.tokenToPiece(x0);
+        String p1 = vocab.tokenToPiece(x1);
+        u64 length = (std::min)(p0.len_, p1.len_);
+        s32 c = 0 < length ? ::memcmp(p0.str_, p1.str_, length) : 0;
+        return c < 0 || (0 == c && (p0.len_ < p1.len_ || (p0.len_ == p1.len_ && x0 < x1)));
+    });
+
+    // the path to the previous piece, the nodes off the path of the next piece end there
+    HashMap<u64, u32> edges;
+    Array<u32> path;
+    nodes_.push_back({0, static_cast<u32>(size_), 0});
+    path.push_back(0);
+    String prev = {0, nullptr};
+    for(u64 i = 0; i < size_; ++i) {
+        String piece = vocab.tokenToPiece(order_[i]);
+        u64 common = 0;
+        while(common < prev.len_ && common < piece.len_ && prev.str_[common] == piece.str_[common]) {
+            ++common;
+        }
+        for(u64 j = common + 1; j < path.size(); ++j) {
+            nodes_[path[j]].end_ = static_cast<u32>(i);
+        }
+        path.resize(common + 1);
+        for(u64 j = common; j < piece.len_; ++j) {
+            u32 next = static_cast<u32>(nodes_.size());
+            nodes_.push_back({static_cast<u32>(i), static_cast<u32>(size_), 0});
+            edges.add(key(path[j], piece.str_[j]), next);
+            path.push_back(next);
+        }
+        ++nodes_[path[piece.len_]].terminals_;
+        prev = piece;
+    }
+    valid_ = edges_.build(edges);
+}
+
+TokenTrie::~TokenTrie()
+{
+}
+
+TokenTrie::TokenTrie(TokenTrie&& other)
+    : size_(other.size_)
+    , order_(std::move(other.order_))
+    , nodes_(std::move(other.nodes_))
+    , valid_(other.valid_)
+    , edges_(std::move(other.edges_))
+{
+    other.size_ = 0;
+}
+
+TokenTrie& TokenTrie::operator=(TokenTrie&& other)
+{
+    if(this != &other) {
+        size_ = other.size_;
+        order_ = std::move(other.order_);
+        nodes_ = std::move(other.nodes_);
+        valid_ = other.valid_;
+        edges_ = std::move(other.edges_);
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+u64 TokenTrie::size() const
+{
+    return size_;
+}
+
+u64 TokenTrie::mask_size() const
+{
+    return (size_ + 63) >> 6;
+}
+
+bool TokenTrie::valid() const
+{
+    return valid_;
+}
+
+void TokenTrie::starts_with(Array<s32>& tokens, u64 size, const char8_t* prefix) const
+{
+    u32 node = 0;
+    if(!walk(node, size, prefix)) {
+        return;
+    }
+    for(u32 i = nodes_[node].begin_; i < nodes_[node].end_; ++i) {
+        tokens.push_back(order_[i]);
+    }
+}
+
+void TokenTrie::prefixes_of(Array<s32>& tokens, u64 size, const char8_t* text) const
+{
+    u32 node = 0;
+    for(u64 i = 0; i < size && child(node, node, text[i]); ++i) {
+        const Node& n = nodes_[node];
+        for(u32 j = n.begin_; j < (n.begin_ + n.terminals_); ++j) {
+            tokens.push_back(order_[j]);
+        }
+    }
+}
+
+void TokenTrie::mask_starts_with(u64* mask, u64 size, const char8_t* prefix) const
+{
+    assert(nullptr != mask);
+    u32 node = 0;
+    if(walk(node, size, prefix)) {
+        set(mask, nodes_[node].begin_, nodes_[node].end_);
+    }
+}
+
+void TokenTrie::mask_consistent(u64* mask, u64 size, const char8_t* text) const
+{
+    assert(nullptr != mask);
+    if(nodes_.size() <= 0) {
+        return;
+    }
+    u32 node = 0;
+    u64 i = 0;
+    for(; i < size && child(node, node, text[i]); ++i) {
+        const Node& n = nodes_[node];
+        set(mask, n.begin_, n.begin_ + n.terminals_);
+    }
+    if(size <= i) {
+        set(mask, nodes_[node].begin_, nodes_[node].end_);
+    }
+}
+
+void TokenTrie::apply(f32* logits, u64 size, const u64* mask)
+{
+    assert(nullptr != logits);
+    assert(nullptr != mask);
+    // eight logits take a byte of the mask
+    const __m256 minus_infinity = _mm256_set1_ps(-std::numeric_limits<f32>::infinity());
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    u64 i = 0;
+    for(; (i + 8) <= size; i += 8) {
+        s32 byte = static_cast<s32>((mask[i >> 6] >> (i & 63)) & 0xFFULL);
+        __m256i selected = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(byte), bits), bits);
+        __m256 x = _mm256_loadu_ps(logits + i);
+        _mm256_storeu_ps(logits + i, _mm256_blendv_ps(minus_infinity, x, _mm256_castsi256_ps(selected)));
+    }
+    for(; i < size; ++i) {
+        if(0 == ((mask[i >> 6] >> (i & 63)) & 1ULL)) {
+            logits[i] = -std::numeric_limits<f32>::infinity();
+        }
+    }
+}
+
+bool TokenTrie::child(u32& next, u32 node, char8_t c) const
+{
+    const u32* child = edges_.find(key(node, c));
+    if(nullptr == child) {
+        return false;
+    }
+    next = *child;
+    return true;
+}
+
+bool TokenTrie::walk(u32& node, u64 size, const char8_t* text) const
+{
+    if(nodes_.size() <= 0) {
+        return false;
+    }
+    node = 0;
+    for(u64 i = 0; i < size; ++i) {
+        if(!child(node, node, text[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TokenTrie::set(u64* mask, u32 begin, u32 end) const
+{
+    if(0 == begin && size_ == end) {
+        // the whole vocabulary, and no bit past it
+        u64 words = mask_size();
+        ::memset(mask, 0xFF, sizeof(u64) * words);
+        if(0 != (size_ & 63)) {
+            mask[words - 1] = (1ULL << (size_ & 63)) - 1;
+        }
+        return;
+    }
+    for(u32 i = begin; i < end; ++i) {
+        u32 id = static_cast<u32>(order_[i]);
+        mask[id >> 6] |= 1ULL << (id & 63);
+    }
+}
+
+//--- PreTokenizer
+//-----------------------------------------------------------
+namespace
+{
+    namespace unicode
+    {
+        struct Range
+        {
+            u32 first_;
+            u32 last_;
+            u8 class_;
+        };
+
+        // generated from the Unicode 14.0 character database, code points over 0x7F out of these ranges are Other
+        // A: L*, M*, Nl, D: Nd, S: White_Space
+        constexpr u8 A = 1;
+        constexpr u8 D = 2;
+        constexpr u8 S = 3;
+        constexpr Range ranges[] = {
+            {0x85, 0x85, S}, {0xA0, 0xA0, S}, {0xAA, 0xAA, A}, {0xB5, 0xB5, A}, {0xBA, 0xBA, A}, {0xC0, 0xD6, A},
+            {0xD8, 0xF6, A}, {0xF8, 0x2C1, A}, {0x2C6, 0x2D1, A}, {0x2E0, 0x2E4, A}, {0x2EC, 0x2EC, A}, {0x2EE, 0x2EE, A},
+            {0x300, 0x374, A}, {0x376, 0x377, A}, {0x37A, 0x37D, A}, {0x37F, 0x37F, A}, {0x386, 0x386, A}, {0x388, 0x38A, A},
+            {0x38C, 0x38C, A}, {0x38E, 0x3A1, A}, {0x3A3, 0x3F5, A}, {0x3F7, 0x481, A}, {0x483, 0x52F, A}, {0x531, 0x556, A},
+            {0x559, 0x559, A}, {0x560, 0x588, A}, {0x591, 0x5BD, A}, {0x5BF, 0x5BF, A}, {0x5C1, 0x5C2, A}, {0x5C4, 0x5C5, A},
+            {0x5C7, 0x5C7, A}, {0x5D0, 0x5EA, A}, {0x5EF, 0x5F2, A}, {0x610, 0x61A, A}, {0x620, 0x65F, A}, {0x660, 0x669, D},
+            {0x66E, 0x6D3, A}, {0x6D5, 0x6DC, A}, {0x6DF, 0x6E8, A}, {0x6EA, 0x6EF, A}, {0x6F0, 0x6F9, D}, {0x6FA, 0x6FC, A},
+            {0x6FF, 0x6FF, A}, {0x710, 0x74A, A}, {0x74D, 0x7B1, A}, {0x7C0, 0x7C9, D}, {0x7CA, 0x7F5, A}, {0x7FA, 0x7FA, A},
+            {0x7FD, 0x7FD, A}, {0x800, 0x82D, A}, {0x840, 0x85B, A}, {0x860, 0x86A, A}, {0x870, 0x887, A}, {0x889, 0x88E, A},
+            {0x898, 0x8E1, A}, {0x8E3, 0x963, A}, {0x966, 0x96F, D}, {0x971, 0x983, A}, {0x985, 0x98C, A}, {0x98F, 0x990, A},
+            {0x993, 0x9A8, A}, {0x9AA, 0x9B0, A}, {0x9B2, 0x9B2, A}, {0x9B6, 0x9B9, A}, {0x9BC, 0x9C4, A}, {0x9C7, 0x9C8, A},
+            {0x9CB, 0x9CE, A}, {0x9D7, 0x9D7, A}, {0x9DC, 0x9DD, A}, {0x9DF, 0x9E3, A}, {0x9E6, 0x9EF, D}, {0x9F0, 0x9F1, A},
+            {0x9FC, 0x9FC, A}, {0x9FE, 0x9FE, A}, {0xA01, 0xA03, A}, {0xA05, 0xA0A, A}, {0xA0F, 0xA10, A}, {0xA13, 0xA28, A},
+            {0xA2A, 0xA30, A}, {0xA32, 0xA33, A}, {0xA35, 0xA36, A}, {0xA38, 0xA39, A}, {0xA3C, 0xA3C, A}, {0xA3E, 0xA42, A},
+            {0xA47, 0xA48, A}, {0xA4B, 0xA4D, A}, {0xA51, 0xA51, A}, {0xA59, 0xA5C, A}, {0xA5E, 0xA5E, A}, {0xA66, 0xA6F, D},
+            {0xA70, 0xA75, A}, {0xA81, 0xA83, A}, {0xA85, 0xA8D, A}, {0xA8F, 0xA91, A}, {0xA93, 0xAA8, A}, {0xAAA, 0xAB0, A},
+            {0xAB2, 0xAB3, A}, {0xAB5, 0xAB9, A}, {0xABC, 0xAC5, A}, {0xAC7, 0xAC9, A}, {0xACB, 0xACD, A}, {0xAD0, 0xAD0, A},
+            {0xAE0, 0xAE3, A}, {0xAE6, 0xAEF, D}, {0xAF9, 0xAFF, A}, {0xB01, 0xB03, A}, {0xB05, 0xB0C, A}, {0xB0F, 0xB10, A},
+            {0xB13, 0xB28, A}, {0xB2A, 0xB30, A}, {0xB32, 0xB33, A}, {0xB35, 0xB39, A}, {0xB3C, 0xB44, A}, {0xB47, 0xB48, A},
+            {0xB4B, 0xB4D, A}, {0xB55, 0xB57, A}, {0xB5C, 0xB5D, A}, {0xB5F, 0xB63, A}, {0xB66, 0xB6F, D}, {0xB71, 0xB71, A},
+            {0xB82, 0xB83, A}, {0xB85, 0xB8A, A}, {0xB8E, 0xB90, A}, {0xB92, 0xB95, A}, {0xB99, 0xB9A, A}, {0xB9C, 0xB9C, A},
+            {0xB9E, 0xB9F, A}, {0xBA3, 0xBA4, A}, {0xBA8, 0xBAA, A}, {0xBAE, 0xBB9, A}, {0xBBE, 0xBC2, A}, {0xBC6, 0xBC8, A},
+            {0xBCA, 0xBCD, A}, {0xBD0, 0xBD0, A}, {0xBD7, 0xBD7, A}, {0xBE6, 0xBEF, D}, {0xC00, 0xC0C, A}, {0xC0E, 0xC10, A},
+            {0xC12, 0xC28, A}, {0xC2A, 0xC39, A}, {0xC3C, 0xC44, A}, {0xC46, 0xC48, A}, {0xC4A, 0xC4D, A}, {0xC55, 0xC56, A},
+            {0xC58, 0xC5A, A}, {0xC5D, 0xC5D, A}, {0xC60, 0xC63, A}, {0xC66, 0xC6F, D}, {0xC80, 0xC83, A}, {0xC85, 0xC8C, A},
+            {0xC8E, 0xC90, A}, {0xC92, 0xCA8, A}, {0xCAA, 0xCB3, A}, {0xCB5, 0xCB9, A}, {0xCBC, 0xCC4, A}, {0xCC6, 0xCC8, A},
+            {0xCCA, 0xCCD, A}, {0xCD5, 0xCD6, A}, {0xCDD, 0xCDE, A}, {0xCE0, 0xCE3, A}, {0xCE6, 0xCEF, D}, {0xCF1, 0xCF2, A},
+            {0xD00, 0xD0C, A}, {0xD0E, 0xD10, A}, {0xD12, 0xD44, A}, {0xD46, 0xD48, A}, {0xD4A, 0xD4E, A}, {0xD54, 0xD57, A},
+            {0xD5F, 0xD63, A}, {0xD66, 0xD6F, D}, {0xD7A, 0xD7F, A}, {0xD81, 0xD83, A}, {0xD85, 0xD96, A}, {0xD9A, 0xDB1, A},
+            {0xDB3, 0xDBB, A}, {0xDBD, 0xDBD, A}, {0xDC0, 0xDC6, A}, {0xDCA, 0xDCA, A}, {0xDCF, 0xDD4, A}, {0xDD6, 0xDD6, A},
+            {0xDD8, 0xDDF, A}, {0xDE6, 0xDEF, D}, {0xDF2, 0xDF3, A}, {0xE01, 0xE3A, A}, {0xE40, 0xE4E, A}, {0xE50, 0xE59, D},
+            {0xE81, 0xE82, A}, {0xE84, 0xE84, A}, {0xE86, 0xE8A, A}, {0xE8C, 0xEA3, A}, {0xEA5, 0xEA5, A}, {0xEA7, 0xEBD, A},
+            {0xEC0, 0xEC4, A}, {0xEC6, 0xEC6, A}, {0xEC8, 0xECD, A}, {0xED0, 0xED9, D}, {0xEDC, 0xEDF, A}, {0xF00, 0xF00, A},
+            {0xF18, 0xF19, A}, {0xF20, 0xF29, D}, {0xF35, 0xF35, A}, {0xF37, 0xF37, A}, {0xF39, 0xF39, A}, {0xF3E, 0xF47, A},
+            {0xF49, 0xF6C, A}, {0xF71, 0xF84, A}, {0xF86, 0xF97, A}, {0xF99, 0xFBC, A}, {0xFC6, 0xFC6, A}, {0x1000, 0x103F, A},
+            {0x1040, 0x1049, D}, {0x1050, 0x108F, A}, {0x1090, 0x1099, D}, {0x109A, 0x109D, A}, {0x10A0, 0x10C5, A}, {0x10C7, 0x10C7, A},
+            {0x10CD, 0x10CD, A}, {0x10D0, 0x10FA, A}, {0x10FC, 0x1248, A}, {0x124A, 0x124D, A}, {0x1250, 0x1256, A}, {0x1258, 0x1258, A},
+            {0x125A, 0x125D, A}, {0x1260, 0x1288, A}, {0x128A, 0x128D, A}, {0x1290, 0x12B0, A}, {0x12B2, 0x12B5, A}, {0x12B8, 0x12BE, A},
+            {0x12C0, 0x12C0, A}, {0x12C2, 0x12C5, A}, {0x12C8, 0x12D6, A}, {0x12D8, 0x1310, A}, {0x1312, 0x1315, A}, {0x1318, 0x135A, A},
+            {0x135D, 0x135F, A}, {0x1380, 0x138F, A}, {0x13A0, 0x13F5, A}, {0x13F8, 0x13FD, A}, {0x1401, 0x166C, A}, {0x166F, 0x167F, A},
+            {0x1680, 0x1680, S}, {0x1681, 0x169A, A}, {0x16A0, 0x16EA, A}, {0x16EE, 0x16F8, A}, {0x1700, 0x1715, A}, {0x171F, 0x1734, A},
+            {0x1740, 0x1753, A}, {0x1760, 0x176C, A}, {0x176E, 0x1770, A}, {0x1772, 0x1773, A}, {0x1780, 0x17D3, A}, {0x17D7, 0x17D7, A},
+            {0x17DC, 0x17DD, A}, {0x17E0, 0x17E9, D}, {0x180B, 0x180D, A}, {0x180F, 0x180F, A}, {0x1810, 0x1819, D}, {0x1820, 0x1878, A},
+            {0x1880, 0x18AA, A}, {0x18B0, 0x18F5, A}, {0x1900, 0x191E, A}, {0x1920, 0x192B, A}, {0x1930, 0x193B, A}, {0x1946, 0x194F, D},
+            {0x1950, 0x196D, A}, {0x1970, 0x1974, A}, {0x1980, 0x19AB, A}, {0x19B0, 0x19C9, A}, {0x19D0, 0x19D9, D}, {0x1A00, 0x1A1B, A},
+            {0x1A20, 0x1A5E, A}, {0x1A60, 0x1A7C, A}, {0x1A7F, 0x1A7F, A}, {0x1A80, 0x1A89, D}, {0x1A90, 0x1A99, D}, {0x1AA7, 0x1AA7, A},
+            {0x1AB0, 0x1ACE, A}, {0x1B00, 0x1B4C, A}, {0x1B50, 0x1B59, D}, {0x1B6B, 0x1B73, A}, {0x1B80, 0x1BAF, A}, {0x1BB0, 0x1BB9, D},
+            {0x1BBA, 0x1BF3, A}, {0x1C00, 0x1C37, A}, {0x1C40, 0x1C49, D}, {0x1C4D, 0x1C4F, A}, {0x1C50, 0x1C59, D}, {0x1C5A, 0x1C7D, A},
+            {0x1C80, 0x1C88, A}, {0x1C90, 0x1CBA, A}, {0x1CBD, 0x1CBF, A}, {0x1CD0, 0x1CD2, A}, {0x1CD4, 0x1CFA, A}, {0x1D00, 0x1F15, A},
+            {0x1F18, 0x1F1D, A}, {0x1F20, 0x1F45, A}, {0x1F48, 0x1F4D, A}, {0x1F50, 0x1F57, A}, {0x1F59, 0x1F59, A}, {0x1F5B, 0x1F5B, A},
+            {0x1F5D, 0x1F5D, A}, {0x1F5F, 0x1F7D, A}, {0x1F80, 0x1FB4, A}, {0x1FB6, 0x1FBC, A}, {0x1FBE, 0x1FBE, A}, {0x1FC2, 0x1FC4, A},
+            {0x1FC6, 0x1FCC, A}, {0x1FD0, 0x1FD3, A}, {0x1FD6, 0x1FDB, A}, {0x1FE0, 0x1FEC, A}, {0x1FF2, 0x1FF4, A}, {0x1FF6, 0x1FFC, A},
+            {0x2000, 0x200A, S}, {0x2028, 0x2029, S}, {0x202F, 0x202F, S}, {0x205F, 0x205F, S}, {0x2071, 0x2071, A}, {0x207F, 0x207F, A},
+            {0x2090, 0x209C, A}, {0x20D0, 0x20F0, A}, {0x2102, 0x2102, A}, {0x2107, 0x2107, A}, {0x210A, 0x2113, A}, {0x2115, 0x2115, A},
+            {0x2119, 0x211D, A}, {0x2124, 0x2124, A}, {0x2126, 0x2126, A}, {0x2128, 0x2128, A}, {0x212A, 0x212D, A}, {0x212F, 0x2139, A},
+            {0x213C, 0x213F, A}, {0x2145, 0x2149, A}, {0x214E, 0x214E, A}, {0x2160, 0x2188, A}, {0x2C00, 0x2CE4, A}, {0x2CEB, 0x2CF3, A},
+            {0x2D00, 0x2D25, A}, {0x2D27, 0x2D27, A}, {0x2D2D, 0x2D2D, A}, {0x2D30, 0x2D67, A}, {0x2D6F, 0x2D6F, A}, {0x2D7F, 0x2D96, A},
+            {0x2DA0, 0x2DA6, A}, {0x2DA8, 0x2DAE, A}, {0x2DB0, 0x2DB6, A}, {0x2DB8, 0x2DBE, A}, {0x2DC0, 0x2DC6, A}, {0x2DC8, 0x2DCE, A},
+            {0x2DD0, 0x2DD6, A}, {0x2DD8, 0x2DDE, A}, {0x2DE0, 0x2DFF, A}, {0x2E2F, 0x2E2F, A}, {0x3000, 0x3000, S}, {0x3005, 0x3007, A},
+            {0x3021, 0x302F, A}, {0x3031, 0x3035, A}, {0x3038, 0x303C, A}, {0x3041, 0x3096, A}, {0x3099, 0x309A, A}, {0x309D, 0x309F, A},
+            {0x30A1, 0x30FA, A}, {0x30FC, 0x30FF, A}, {0x3105, 0x312F, A}, {0x3131, 0x318E, A}, {0x31A0, 0x31BF, A}, {0x31F0, 0x31FF, A},
+            {0x3400, 0x4DBF, A}, {0x4E00, 0xA48C, A}, {0xA4D0, 0xA4FD, A}, {0xA500, 0xA60C, A}, {0xA610, 0xA61F, A}, {0xA620, 0xA629, D},
+            {0xA62A, 0xA62B, A}, {0xA640, 0xA672, A}, {0xA674, 0xA67D, A}, {0xA67F, 0xA6F1, A}, {0xA717, 0xA71F, A}, {0xA722, 0xA788, A},
+            {0xA78B, 0xA7CA, A}, {0xA7D0, 0xA7D1, A}, {0xA7D3, 0xA7D3, A}, {0xA7D5, 0xA7D9, A}, {0xA7F2, 0xA827, A}, {0xA82C, 0xA82C, A},
+            {0xA840, 0xA873, A}, {0xA880, 0xA8C5, A}, {0xA8D0, 0xA8D9, D}, {0xA8E0, 0xA8F7, A}, {0xA8FB, 0xA8FB, A}, {0xA8FD, 0xA8FF, A},
+            {0xA900, 0xA909, D}, {0xA90A, 0xA92D, A}, {0xA930, 0xA953, A}, {0xA960, 0xA97C, A}, {0xA980, 0xA9C0, A}, {0xA9CF, 0xA9CF, A},
+            {0xA9D0, 0xA9D9, D}, {0xA9E0, 0xA9EF, A}, {0xA9F0, 0xA9F9, D}, {0xA9FA, 0xA9FE, A}, {0xAA00, 0xAA36, A}, {0xAA40, 0xAA4D, A},
+            {0xAA50, 0xAA59, D}, {0xAA60, 0xAA76, A}, {0xAA7A, 0xAAC2, A}, {0xAADB, 0xAADD, A}, {0xAAE0, 0xAAEF, A}, {0xAAF2, 0xAAF6, A},
+            {0xAB01, 0xAB06, A}, {0xAB09, 0xAB0E, A}, {0xAB11, 0xAB16, A}, {0xAB20, 0xAB26, A}, {0xAB28, 0xAB2E, A}, {0xAB30, 0xAB5A, A},
+            {0xAB5C, 0xAB69, A}, {0xAB70, 0xABEA, A}, {0xABEC, 0xABED, A}, {0xABF0, 0xABF9, D}, {0xAC00, 0xD7A3, A}, {0xD7B0, 0xD7C6, A},
+            {0xD7CB, 0xD7FB, A}, {0xF900, 0xFA6D, A}, {0xFA70, 0xFAD9, A}, {0xFB00, 0xFB06, A}, {0xFB13, 0xFB17, A}, {0xFB1D, 0xFB28, A},
+            {0xFB2A, 0xFB36, A}, {0xFB38, 0xFB3C, A}, {0xFB3E, 0xFB3E, A}, {0xFB40, 0xFB41, A}, {0xFB43, 0xFB44, A}, {0xFB46, 0xFBB1, A},
+            {0xFBD3, 0xFD3D, A}, {0xFD50, 0xFD8F, A}, {0xFD92, 0xFDC7, A}, {0xFDF0, 0xFDFB, A}, {0xFE00, 0xFE0F, A}, {0xFE20, 0xFE2F, A},
+            {0xFE70, 0xFE74, A}, {0xFE76, 0xFEFC, A}, {0xFF10, 0xFF19, D}, {0xFF21, 0xFF3A, A}, {0xFF41, 0xFF5A, A}, {0xFF66, 0xFFBE, A},
+            {0xFFC2, 0xFFC7, A}, {0xFFCA, 0xFFCF, A}, {0xFFD2, 0xFFD7, A}, {0xFFDA, 0xFFDC, A}, {0x10000, 0x1000B, A}, {0x1000D, 0x10026, A},
+            {0x10028, 0x1003A, A}, {0x1003C, 0x1003D, A}, {0x1003F, 0x1004D, A}, {0x10050, 0x1005D, A}, {0x10080, 0x100FA, A}, {0x10140, 0x10174, A},
+            {0x101FD, 0x101FD, A}, {0x10280, 0x1029C, A}, {0x102A0, 0x102D0, A}, {0x102E0, 0x102E0, A}, {0x10300, 0x1031F, A}, {0x1032D, 0x1034A, A},
+            {0x10350, 0x1037A, A}, {0x10380, 0x1039D, A}, {0x103A0, 0x103C3, A}, {0x103C8, 0x103CF, A}, {0x103D1, 0x103D5, A}, {0x10400, 0x1049D, A},
+            {0x104A0, 0x104A9, D}, {0x104B0, 0x104D3, A}, {0x104D8, 0x104FB, A}, {0x10500, 0x10527, A}, {0x10530, 0x10563, A}, {0x10570, 0x1057A, A},
+            {0x1057C, 0x1058A, A}, {0x1058C, 0x10592, A}, {0x10594, 0x10595, A}, {0x10597, 0x105A1, A}, {0x105A3, 0x105B1, A}, {0x105B3, 0x105B9, A},
+            {0x105BB, 0x105BC, A}, {0x10600, 0x10736, A}, {0x10740, 0x10755, A}, {0x10760, 0x10767, A}, {0x10780, 0x10785, A}, {0x10787, 0x107B0, A},
+            {0x107B2, 0x107BA, A}, {0x10800, 0x10805, A}, {0x10808, 0x10808, A}, {0x1080A, 0x10835, A}, {0x10837, 0x10838, A}, {0x1083C, 0x1083C, A},
+            {0x1083F, 0x10855, A}, {0x10860, 0x10876, A}, {0x10880, 0x1089E, A}, {0x108E0, 0x108F2, A}, {0x108F4, 0x108F5, A}, {0x10900, 0x10915, A},
+            {0x10920, 0x10939, A}, {0x10980, 0x109B7, A}, {0x109BE, 0x109BF, A}, {0x10A00, 0x10A03, A}, {0x10A05, 0x10A06, A}, {0x10A0C, 0x10A13, A},
+            {0x10A15, 0x10A17, A}, {0x10A19, 0x10A35, A}, {0x10A38, 0x10A3A, A}, {0x10A3F, 0x10A3F, A}, {0x10A60, 0x10A7C, A}, {0x10A80, 0x10A9C, A},
+            {0x10AC0, 0x10AC7, A}, {0x10AC9, 0x10AE6, A}, {0x10B00, 0x10B35, A}, {0x10B40, 0x10B55, A}, {0x10B60, 0x10B72, A}, {0x10B80, 0x10B91, A},
+            {0x10C00, 0x10C48, A}, {0x10C80, 0x10CB2, A}, {0x10CC0, 0x10CF2, A}, {0x10D00, 0x10D27, A}, {0x10D30, 0x10D39, D}, {0x10E80, 0x10EA9, A},
+            {0x10EAB, 0x10EAC, A}, {0x10EB0, 0x10EB1, A}, {0x10F00, 0x10F1C, A}, {0x10F27, 0x10F27, A}, {0x10F30, 0x10F50, A}, {0x10F70, 0x10F85, A},
+            {0x10FB0, 0x10FC4, A}, {0x10FE0, 0x10FF6, A}, {0x11000, 0x11046, A}, {0x11066, 0x1106F, D}, {0x11070, 0x11075, A}, {0x1107F, 0x110BA, A},
+            {0x110C2, 0x110C2, A}, {0x110D0, 0x110E8, A}, {0x110F0, 0x110F9, D}, {0x11100, 0x11134, A}, {0x11136, 0x1113F, D}, {0x11144, 0x11147, A},
+            {0x11150, 0x11173, A}, {0x11176, 0x11176, A}, {0x11180, 0x111C4, A}, {0x111C9, 0x111CC, A}, {0x111CE, 0x111CF, A}, {0x111D0, 0x111D9, D},
+            {0x111DA, 0x111DA, A}, {0x111DC, 0x111DC, A}, {0x11200, 0x11211, A}, {0x11213, 0x11237, A}, {0x1123E, 0x1123E, A}, {0x11280, 0x11286, A},
+            {0x11288, 0x11288, A}, {0x1128A, 0x1128D, A}, {0x1128F, 0x1129D, A}, {0x1129F, 0x112A8, A}, {0x112B0, 0x112EA, A}, {0x112F0, 0x112F9, D},
+            {0x11300, 0x11303, A}, {0x11305, 0x1130C, A}, {0x1130F, 0x11310, A}, {0x11313, 0x11328, A}, {0x1132A, 0x11330, A}, {0x11332, 0x11333, A},
+            {0x11335, 0x11339, A}, {0x1133B, 0x11344, A}, {0x11347, 0x11348, A}, {0x1134B, 0x1134D, A}, {0x11350, 0x11350, A}, {0x11357, 0x11357, A},
+            {0x1135D, 0x11363, A}, {0x11366, 0x1136C, A}, {0x11370, 0x11374, A}, {0x11400, 0x1144A, A}, {0x11450, 0x11459, D}, {0x1145E, 0x11461, A},
+            {0x11480, 0x114C5, A}, {0x114C7, 0x114C7, A}, {0x114D0, 0x114D9, D}, {0x11580, 0x115B5, A}, {0x115B8, 0x115C0, A}, {0x115D8, 0x115DD, A},
+            {0x11600, 0x11640, A}, {0x11644, 0x11644, A}, {0x11650, 0x11659, D}, {0x11680, 0x116B8, A}, {0x116C0, 0x116C9, D}, {0x11700, 0x1171A, A},
+            {0x1171D, 0x1172B, A}, {0x11730, 0x11739, D}, {0x11740, 0x11746, A}, {0x11800, 0x1183A, A}, {0x118A0, 0x118DF, A}, {0x118E0, 0x118E9, D},
+            {0x118FF, 0x11906, A}, {0x11909, 0x11909, A}, {0x1190C, 0x11913, A}, {0x11915, 0x11916, A}, {0x11918, 0x11935, A}, {0x11937, 0x11938, A},
+            {0x1193B, 0x11943, A}, {0x11950, 0x11959, D}, {0x119A0, 0x119A7, A}, {0x119AA, 0x119D7, A}, {0x119DA, 0x119E1, A}, {0x119E3, 0x119E4, A},
+            {0x11A00, 0x11A3E, A}, {0x11A47, 0x11A47, A}, {0x11A50, 0x11A99, A}, {0x11A9D, 0x11A9D, A}, {0x11AB0, 0x11AF8, A}, {0x11C00, 0x11C08, A},
+            {0x11C0A, 0x11C36, A}, {0x11C38, 0x11C40, A}, {0x11C50, 0x11C59, D}, {0x11C72, 0x11C8F, A}, {0x11C92, 0x11CA7, A}, {0x11CA9, 0x11CB6, A},
+            {0x11D00, 0x11D06, A}, {0x11D08, 0x11D09, A}, {0x11D0B, 0x11D36, A}, {0x11D3A, 0x11D3A, A}, {0x11D3C, 0x11D3D, A}, {0x11D3F, 0x11D47, A},
+            {0x11D50, 0x11D59, D}, {0x11D60, 0x11D65, A}, {0x11D67, 0x11D68, A}, {0x11D6A, 0x11D8E, A}, {0x11D90, 0x11D91, A}, {0x11D93, 0x11D98, A},
+            {0x11DA0, 0x11DA9, D}, {0x11EE0, 0x11EF6, A}, {0x11FB0, 0x11FB0, A}, {0x12000, 0x12399, A}, {0x12400, 0x1246E, A}, {0x12480, 0x12543, A},
+            {0x12F90, 0x12FF0, A}, {0x13000, 0x1342E, A}, {0x14400, 0x14646, A}, {0x16800, 0x16A38, A}, {0x16A40, 0x16A5E, A}, {0x16A60, 0x16A69, D},
+            {0x16A70, 0x16ABE, A}, {0x16AC0, 0x16AC9, D}, {0x16AD0, 0x16AED, A}, {0x16AF0, 0x16AF4, A}, {0x16B00, 0x16B36, A}, {0x16B40, 0x16B43, A},
+            {0x16B50, 0x16B59, D}, {0x16B63, 0x16B77, A}, {0x16B7D, 0x16B8F, A}, {0x16E40, 0x16E7F, A}, {0x16F00, 0x16F4A, A}, {0x16F4F, 0x16F87, A},
+            {0x16F8F, 0x16F9F, A}, {0x16FE0, 0x16FE1, A}, {0x16FE3, 0x16FE4, A}, {0x16FF0, 0x16FF1, A}, {0x17000, 0x187F7, A}, {0x18800, 0x18CD5, A},
+            {0x18D00, 0x18D08, A}, {0x1AFF0, 0x1AFF3, A}, {0x1AFF5, 0x1AFFB, A}, {0x1AFFD, 0x1AFFE, A}, {0x1B000, 0x1B122, A}, {0x1B150, 0x1B152, A},
+            {0x1B164, 0x1B167, A}, {0x1B170, 0x1B2FB, A}, {0x1BC00, 0x1BC6A, A}, {0x1BC70, 0x1BC7C, A}, {0x1BC80, 0x1BC88, A}, {0x1BC90, 0x1BC99, A},
+            {0x1BC9D, 0x1BC9E, A}, {0x1CF00, 0x1CF2D, A}, {0x1CF30, 0x1CF46, A}, {0x1D165, 0x1D169, A}, {0x1D16D, 0x1D172, A}, {0x1D17B, 0x1D182, A},
+            {0x1D185, 0x1D18B, A}, {0x1D1AA, 0x1D1AD, A}, {0x1D242, 0x1D244, A}, {0x1D400, 0x1D454, A}, {0x1D456, 0x1D49C, A}, {0x1D49E, 0x1D49F, A},
+            {0x1D4A2, 0x1D4A2, A}, {0x1D4A5, 0x1D4A6, A}, {0x1D4A9, 0x1D4AC, A}, {0x1D4AE, 0x1D4B9, A}, {0x1D4BB, 0x1D4BB, A}, {0x1D4BD, 0x1D4C3, A},
+            {0x1D4C5, 0x1D505, A}, {0x1D507, 0x1D50A, A}, {0x1D50D, 0x1D514, A}, {0x1D516, 0x1D51C, A}, {0x1D51E, 0x1D539, A}, {0x1D53B, 0x1D53E, A},
+            {0x1D540, 0x1D544, A}, {0x1D546, 0x1D546, A}, {0x1D54A, 0x1D550, A}, {0x1D552, 0x1D6A5, A}, {0x1D6A8, 0x1D6C0, A}, {0x1D6C2, 0x1D6DA, A},
+            {0x1D6DC, 0x1D6FA, A}, {0x1D6FC, 0x1D714, A}, {0x1D716, 0x1D734, A}, {0x1D736, 0x1D74E, A}, {0x1D750, 0x1D76E, A}, {0x1D770, 0x1D788, A},
+            {0x1D78A, 0x1D7A8, A}, {0x1D7AA, 0x1D7C2, A}, {0x1D7C4, 0x1D7CB, A}, {0x1D7CE, 0x1D7FF, D}, {0x1DA00, 0x1DA36, A}, {0x1DA3B, 0x1DA6C, A},
+            {0x1DA75, 0x1DA75, A}, {0x1DA84, 0x1DA84, A}, {0x1DA9B, 0x1DA9F, A}, {0x1DAA1, 0x1DAAF, A}, {0x1DF00, 0x1DF1E, A}, {0x1E000, 0x1E006, A},
+            {0x1E008, 0x1E018, A}, {0x1E01B, 0x1E021, A}, {0x1E023, 0x1E024, A}, {0x1E026, 0x1E02A, A}, {0x1E100, 0x1E12C, A}, {0x1E130, 0x1E13D, A},
+            {0x1E140, 0x1E149, D}, {0x1E14E, 0x1E14E, A}, {0x1E290, 0x1E2AE, A}, {0x1E2C0, 0x1E2EF, A}, {0x1E2F0, 0x1E2F9, D}, {0x1E7E0, 0x1E7E6, A},
+            {0x1E7E8, 0x1E7EB, A}, {0x1E7ED, 0x1E7EE, A}, {0x1E7F0, 0x1E7FE, A}, {0x1E800, 0x1E8C4, A}, {0x1E8D0, 0x1E8D6, A}, {0x1E900, 0x1E94B, A},
+            {0x1E950, 0x1E959, D}, {0x1EE00, 0x1EE03, A}, {0x1EE05, 0x1EE1F, A}, {0x1EE21, 0x1EE22, A}, {0x1EE24, 0x1EE24, A}, {0x1EE27, 0x1EE27, A},
+            {0x1EE29, 0x1EE32, A}, {0x1EE34, 0x1EE37, A}, {0x1EE39, 0x1EE39, A}, {0x1EE3B, 0x1EE3B, A}, {0x1EE42, 0x1EE42, A}, {0x1EE47, 0x1EE47, A},
+            {0x1EE49, 0x1EE49, A}, {0x1EE4B, 0x1EE4B, A}, {0x1EE4D, 0x1EE4F, A}, {0x1EE51, 0x1EE52, A}, {0x1EE54, 0x1EE54, A}, {0x1EE57, 0x1EE57, A},
+            {0x1EE59, 0x1EE59, A}, {0x1EE5B, 0x1EE5B, A}, {0x1EE5D, 0x1EE5D, A}, {0x1EE5F, 0x1EE5F, A}, {0x1EE61, 0x1EE62, A}, {0x1EE64, 0x1EE64, A},
+            {0x1EE67, 0x1EE6A, A}, {0x1EE6C, 0x1EE72, A}, {0x1EE74, 0x1EE77, A}, {0x1EE79, 0x1EE7C, A}, {0x1EE7E, 0x1EE7E, A}, {0x1EE80, 0x1EE89, A},
+            {0x1EE8B, 0x1EE9B, A}, {0x1EEA1, 0x1EEA3, A}, {0x1EEA5, 0x1EEA9, A}, {0x1EEAB, 0x1EEBB, A}, {0x1FBF0, 0x1FBF9, D}, {0x20000, 0x2A6DF, A},
+            {0x2A700, 0x2B738, A}, {0x2B740, 0x2B81D, A}, {0x2B820, 0x2CEA1, A}, {0x2CEB0, 0x2EBE0, A}, {0x2F800, 0x2FA1D, A}, {0x30000, 0x3134A, A},
+            {0xE0100, 0xE01EF, A},
+        };
+
+        constexpr u8 ascii_class(u32 c)
+        {
+            if((u8'a' <= c && c <= u8'z') || (u8'A' <= c && c <= u8'Z')) {
+                return A;
+            }
+            if(u8'0' <= c && c <= u8'9') {
+                return D;
+            }
+            if(u8' ' == c || (u8'\t' <= c && c <= u8'\r')) {
+                return S;
+            }
+            return 0;
+        }
+    } // namespace unicode
+} // namespace
+
+u64 PreTokenizer::next(u64 size, const char8_t* text)
+{
+    if(size <= 0) {
+        return 0;
+    }
+    // 's|'t|'re|'ve|'m|'ll|'d
+    if(u8'\'' == text[0] && 2 <= size) {
+        char8_t c1 = text[1];
+        if(u8's' == c1 || u8't' == c1 || u8'm' == c1 || u8'd' == c1) {
+            return 2;
+        }
+        if(3 <= size) {
+            char8_t c2 = text[2];
+            if((u8'r' == c1 && u8'e' == c2) || (u8'v' == c1 && u8'e' == c2) || (u8'l' == c1 && u8'l' == c2)) {
+                return 3;
+            }
+        }
+    }
+    // ' ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+'
+    u64 offset = 0;
+    u64 length = 0;
+    Class c = classify(length, size, text);
+    if(u8' ' == text[0] && 1 < size) {
+        u64 next_length = 0;
+        Class next_class = classify(next_length, size - 1, text + 1);
+        if(Class::Space != next_class) {
+            offset = 1;
+            length = next_length;
+            c = next_class;
+        }
+    }
+    if(Class::Space == c) {
+        return whitespace(size, text);
+    }
+    return skip(c, offset + length, size, text);
+}
+
+void PreTokenizer::split(Array<Piece>& pieces, u64 size, const char8_t* text)
+{
+    u64 offset = 0;
+    while(offset < size) {
+        u64 length = next(size - offset, text + offset);
+        pieces.push_back({offset, length});
+        offset += length;
+    }
+}
+
+u64 PreTokenizer::decode(u32& codepoint, u64 size, const char8_t* text)
+{
+    u32 c = text[0];
+    if(c < 0x80U) {
+        codepoint = c;
+        return 1;
+    }
+    u64 length = 0;
+    if(0xC0U == (c & 0xE0U)) {
+        codepoint = c & 0x1FU;
+        length = 2;
+    } else if(0xE0U == (c & 0xF0U)) {
+        codepoint = c & 0x0FU;
+        length = 3;
+    } else if(0xF0U == (c & 0xF8U)) {
+        codepoint = c & 0x07U;
+        length = 4;
+    } else {
+        codepoint = 0xFFFF'FFFFUL;
+        return 1;
+    }
+    if(size < length) {
+        codepoint = 0xFFFF'FFFFUL;
+        return 1;
+    }
+    for(u64 i = 1; i < length; ++i) {
+        if(0x80U != (text[i] & 0xC0U)) {
+            codepoint = 0xFFFF'FFFFUL;
+            return 1;
+        }
+        codepoint = (codepoint << 6) | (text[i] & 0x3FU);
+    }
+    return length;
+}
+
+PreTokenizer::Class PreTokenizer::classify(u32 codepoint)
+{
+    if(codepoint < 0x80U) {
+        return static_cast<Class>(unicode::ascii_class(codepoint));
+    }
+    const unicode::Range* begin = unicode::ranges;
+    const unicode::Range* end = begin + sizeof(unicode::ranges) / sizeof(unicode::ranges[0]);
+    const unicode::Range* range = std::upper_bound(begin, end, codepoint, [](u32 x, const unicode::Range& r) {
+        return x < r.first_;
+    });
+    if(range == begin) {
+        return Class::Other;
+    }
+    --range;
+    return codepoint <= range->last_ ? static_cast<Class>(range->class_) : Class::Other;
+}
+
+PreTokenizer::Class PreTokenizer::classify(u64& length, u64 size, const char8_t* text)
+{
+    u32 codepoint = 0;
+    length = decode(codepoint, size, text);
+    return classify(codepoint);
+}
+
+u64 PreTokenizer::skip_ascii_alpha(u64 offset, u64 size, const char8_t* text)
+{
+    // (c | 0x20) - 'a' < 26
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i a = _mm256_set1_epi8('a');
+    const __m256i max = _mm256_set1_epi8(25);
+    while((offset + 32) <= size) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + offset));
+        x = _mm256_sub_epi8(_mm256_or_si256(x, lower), a);
+        u32 mask = static_cast<u32>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, max), x)));
+        if(0xFFFF'FFFFUL != mask) {
+            return offset + std::countr_one(mask);
+        }
+        offset += 32;
+    }
+    while(offset < size && unicode::A == unicode::ascii_class(text[offset])) {
+        ++offset;
+    }
+    return offset;
+}
+
+u64 PreTokenizer::skip_ascii_digit(u64 offset, u64 size, const char8_t* text)
+{
+    // c - '0' < 10
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i max = _mm256_set1_epi8(9);
+    while((offset + 32) <= size) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + offset));
+        x = _mm256_sub_epi8(x, zero);
+        u32 mask = static_cast<u32>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, max), x)));
+        if(0xFFFF'FFFFUL != mask) {
+            return offset + std::countr_one(mask);
+        }
+        offset += 32;
+    }
+    while(offset < size && unicode::D == unicode::ascii_class(text[offset])) {
+        ++offset;
+    }
+    return offset;
+}
+
+u64 PreTokenizer::skip(Class c, u64 offset, u64 size, const char8_t* text)
+{
+    while(offset < size) {
+        if(Class::Alpha == c) {
+            offset = skip_ascii_alpha(offset, size, text);
+        } else if(Class::Digit == c) {
+            offset = skip_ascii_digit(offset, size, text);
+        }
+        if(size <= offset) {
+            break;
+        }
+        u64 length = 0;
+        if(c != classify(length, size - offset, text + offset)) {
+            break;
+        }
+        offset += length;
+    }
+    return offset;
+}
+
+u64 PreTokenizer::whitespace(u64 size, const char8_t* text)
+{
+    // '\s+(?!\S)|\s+', leave the last space to the next piece
+    u64 offset = 0;
+    u64 last = 0;
+    u64 count = 0;
+    while(offset < size) {
+        u64 length = 0;
+        if(Class::Space != classify(length, size - offset, text + offset)) {
+            break;
+        }
+        last = offset;
+        offset += length;
+        ++count;
+    }
+    if(offset < size && 1 < count) {
+        return last;
+    }
+    return offset;
+}
+
+//--- Tokenizer
+//-----------------------------------------------------------
+const char8_t* Tokenizer::Pattern = u8R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+Tokenizer::Scratch::Scratch()
+{
+}
+
+Tokenizer::Scratch::~Scratch()
+{
+}
+
+Tokenizer::Scratch::Scratch(Scratch&& other)
+    : symbols_(std::move(other.symbols_))
+    , merge_queue_(std::move(other.merge_queue_))
+{
+}
+
+Tokenizer::Scratch& Tokenizer::Scratch::operator=(Scratch&& other)
+{
+    if(this != &other) {
+        symbols_ = std::move(other.symbols_);
+        merge_queue_ = std::move(other.merge_queue_);
+    }
+    return *this;
+}
+
+Tokenizer::Tokenizer()
+    : buffer_(nullptr)
+{
+    for(u32 i = 0; i < 128; ++i) {
+        ascii_[i] = -1;
+    }
+}
+
+Tokenizer::Tokenizer(const gguf::GGUF& model_data)
+    : buffer_(nullptr)
+    , vocab_(model_data)
+{
+    buffer_ = (char8_t*)allocate((vocab_.getMaxTokenLength() + 1 + 2) * sizeof(char8_t));
+    merges_ = MergeRanks(vocab_);
+    special_tokens_ = SpecialTokenMatcher(vocab_);
+    build_adjacent();
+    for(u32 i = 0; i < 128; ++i) {
+        char8_t c = static_cast<char8_t>(i);
+        if(!vocab_.encode(ascii_[i], 1, &c)) {
+            ascii_[i] = -1;
+        }
+    }
+}
+
+Tokenizer::~Tokenizer()
+{
+    deallocate(buffer_);
+    buffer_ = nullptr;
+}
+
+Tokenizer::Tokenizer(Tokenizer&& other) noexcept
+    : buffer_(other.buffer_)
+    , vocab_(std::move(other.vocab_))
+    , merges_(std::move(other.merges_))
+    , special_tokens_(std::move(other.special_tokens_))
+    , adjacent_(std::move(other.adjacent_))
+{
+    ::memcpy(ascii_, other.ascii_, sizeof(ascii_));
+    other.buffer_ = nullptr;
+}
+
+Tokenizer& Tokenizer::operator=(Tokenizer&& other)
+{
+    if(this != &other) {
+        deallocate(buffer_);
+        vocab_ = std::move(other.vocab_);
+        merges_ = std::move(other.merges_);
+        special_tokens_ = std::move(other.special_tokens_);
+        adjacent_ = std::move(other.adjacent_);
+        ::memcpy(ascii_, other.ascii_, sizeof(ascii_));
+        buffer_ = other.buffer_;
+
+        other.buffer_ = nullptr;
+    }
+    return *this;
+}
+
+Array<s32> Tokenizer::tokenize(const std::u8string& text)
+{
+    Array<s32> result;
+    tokenize(result, scratch_, text.size(), text.c_str());
+    return result;
+}
+
+void Tokenizer::tokenize(Array<s32>& tokens, Scratch& scratch, u64 size, const char8_t* text) const
+{
+    // one scan for the special tokens, the merges do not cross them
+    u64 offset = 0;
+    SpecialTokenMatcher::Match match;
+    while(special_tokens_.find(match, offset, size, text)) {
+        encode(tokens, scratch, match.offset_ - offset, text + offset);
+        tokens.push_back(match.token_);
+        offset = match.offset_ + match.length_;
+    }
+    encode(tokens, scratch, size - offset, text + offset);
+}
+
+void Tokenizer::encode(Array<s32>& tokens, Scratch& scratch, u64 size, const char8_t* text) const
+{
+    Array<Symbol>& symbols = scratch.symbols_;
+    split(symbols, size, text);
+    if(symbols.size() <= 0) {
+        return;
+    }
+
+    // seed the work queue with all adjacent pairs of tokens.
+    scratch.merge_queue_.clear();
+    for(u64 i = 1; i < symbols.size(); ++i) {
+        try_add_merge(scratch, static_cast<s32>(i - 1), static_cast<s32>(i));
+    }
+
+    // apply the merges of the lowest rank, no text is compared nor hashed.
+    while(0 < scratch.merge_queue_.size()) {
+        Candidate candidate = scratch.merge_queue_.front();
+        scratch.merge_queue_.pop_front();
+
+        Symbol& left_sym = symbols[candidate.left_];
+        Symbol& right_sym = symbols[candidate.right_];
+
+        // if one of the symbols already got merged, skip it.
+        if(left_sym.id_ != candidate.left_id_
+           || right_sym.id_ != candidate.right_id_
+           || left_sym.next_ != candidate.right_) {
+            continue;
+        }
+
+        left_sym.id_ = candidate.merged_;
+        left_sym.len_ += right_sym.len_;
+        right_sym.id_ = -1;
+        right_sym.len_ = 0;
+
+        left_sym.next_ = right_sym.next_;
+        if(0 <= right_sym.next_) {
+            symbols[right_sym.next_].prev_ = candidate.left_;
+        }
+
+        try_add_merge(scratch, left_sym.prev_, candidate.left_);
+        try_add_merge(scratch, candidate.left_, left_sym.next_);
+    }
+
+    // appending many texts to one buffer, grow geometrically
+    u64 capacity = tokens.size() + symbols.size();
+    if(tokens.capacity() < capacity) {
+        tokens.reserve((std::max)(tokens.capacity() * 2, capacity));
+    }
+    for(s32 i = 0; i != -1; i = symbols[i].next_) {
+        const Symbol& symbol = symbols[i];
+        if(0 <= symbol.id_) {
+            tokens.push_back(symbol.id_);
+            continue;
+        }
+        // output a char out of the vocabulary as bytes.
+        for(u64 j = 0; j < symbol.len_; ++j) {
+            tokens.push_back(byte_to_token(vocab_, symbol.text_[j]));
+        }
+    }
+}
+
+void Tokenizer::tokenize_batch(Array<s32>& tokens, Array<u64>& offsets, u64 count, const std::u8string* documents, u32 num_threads) const
+{
+    assert(0 == count || nullptr != documents);
+    tokens.clear();
+    offsets.clear();
+    offsets.resize(count + 1);
+    offsets[0] = 0;
+    if(count <= 0) {
+        return;
+    }
+    if(0 == num_threads) {
+        num_threads = (std::max)(std::thread::hardware_concurrency(), 1U);
+    }
+    num_threads = static_cast<u32>((std::min)(static_cast<u64>(num_threads), count));
+
+    struct Worker
+    {
+        Scratch scratch_;
+        Array<s32> tokens_;
+        u64 begin_ = 0;
+        u64 end_ = 0;
+    };
+    Worker* workers = new Worker[num_threads];
+
+    // runs of documents of about the same bytes, the tokenization cost follows the bytes
+    u64 total = 0;
+    for(u64 i = 0; i < count; ++i) {
+        total += documents[i].size();
+    }
+    u64 document = 0;
+    u64 bytes = 0;
+    for(u32 i = 0; i < num_threads; ++i) {
+        u64 target = total * (i + 1) / num_threads;
+        workers[i].begin_ = document;
+        while(document < count && (bytes < target || (i + 1) == num_threads)) {
+            bytes += documents[document].size();
+            ++document;
+        }
+        workers[i].end_ = document;
+    }
+
+    // each worker records the end of a document in its own tokens
+    auto run = [this, documents, &offsets](Worker& worker) {
+        for(u64 i = worker.begin_; i < worker.end_; ++i) {
+            const std::u8string& text = documents[i];
+            tokenize(worker.tokens_, worker.scratch_, text.size(), text.c_str());
+            offsets[i + 1] = worker.tokens_.size();
+        }
+    };
+    std::thread* threads = new std::thread[num_threads - 1];
+    for(u32 i = 1; i < num_threads; ++i) {
+        threads[i - 1] = std::thread(run, std::ref(workers[i]));
+    }
+    run(workers[0]);
+    for(u32 i = 1; i < num_threads; ++i) {
+        threads[i - 1].join();
+    }
+    delete[] threads;
+
+    u64 base = 0;
+    for(u32 i = 0; i < num_threads; ++i) {
+        for(u64 j = workers[i].begin_; j < workers[i].end_; ++j) {
+            offsets[j + 1] += base;
+        }
+        base += workers[i].tokens_.size();
+    }
+    tokens.resize(base);
+    for(u32 i = 0; i < num_threads; ++i) {
+        const Worker& worker = workers[i];
+        if(0 < worker.tokens_.size()) {
+            ::memcpy(&tokens[offsets[worker.begin_]], &worker.tokens_[0], sizeof(s32) * worker.tokens_.size());
+        }
+    }
+    delete[] workers;
+}
+
+void Tokenizer::decode(std::u8string& text, s32 token) const
+{
+    assert(0 <= token && static_cast<u64>(token) < vocab_.idToTokenSize());
+    String piece = vocab_.tokenToPiece(token);
+    text.append(piece.str_, piece.len_);
+}
+
+const Vocabulary& Tokenizer::vocabulary() const
+{
+    return vocab_;
+}
+
+bool Tokenizer::valid() const
+{
+    return merges_.valid() && special_tokens_.valid();
+}
+
+namespace
+{
+    /**
+     * @brief Header of a saved tokenizer, followed by the tables at the ranges of the sections
+     *
+     * A section starts at a multiple of Alignment and is an array as it is in memory.
+     */
+    struct TokenizerArtifactHeader
+    {
+        inline static constexpr u32 Magic = 0x4E4B4F54UL; // "TOKN"
+        inline static constexpr u32 Version = 1;
+        inline static constexpr u64 Alignment = 64;
+
+        enum Section : u32
+        {
+            TokenText = 0,
+            TokenOffsets,
+            TokenScores,
+            TokenTypes,
+            TextPilots,
+            SlotToId,
+            SpecialTokens,
+            Pieces,
+            PieceOffsets,
+            MergePilots,
+            Merges,
+            EdgePilots,
+            Edges,
+            Nodes,
+            NumSections,
+        };
+
+        struct Range
+        {
+            u64 offset_;
+            u64 size_;
+        };
+
+        u32 magic_;
+        u32 version_;
+        s32 bos_token_id_;
+        s32 eos_token_id_;
+        s32 unknown_token_id_;
+        s32 separator_token_id_;
+        s32 padding_token_id_;
+        s32 cls_token_id_;
+        s32 mask_token_id_;
+        s32 add_bos_;
+        s32 add_eos_;
+        s32 linefeed_id_;
+        s32 prefix_id_;
+        s32 suffix_id_;
+        s32 middle_id_;
+        s32 eot_id_;
+        s32 add_space_prefix_;
+        s32 max_token_length_;
+        u64 text_hash_size_;
+        u64 merge_hash_size_;
+        u64 edge_hash_size_;
+        u32 num_firsts_;
+        char8_t firsts_[4];
+        u8 first_[256];
+        Range sections_[NumSections];
+    };
+
+    struct ArtifactBlob
+    {
+        const void* data_;
+        u64 size_;
+    };
+
+    template<class T>
+    ArtifactBlob artifact_blob(const Array<T>& x)
+    {
+        return {0 < x.size() ? &x[0] : nullptr, sizeof(T) * x.size()};
+    }
+
+    inline u64 artifact_align(u64 x)
+    {
+        return (x + TokenizerArtifactHeader::Alignment - 1) & ~(TokenizerArtifactHeader::Alignment - 1);
+    }
+
+    template<class T>
+    bool read_section(Array<T>& x, const MappedFile& file, const TokenizerArtifactHeader& header, u32 section)
+    {
+        const TokenizerArtifactHeader::Range& range = header.sections_[section];
+        if(file.size() < range.offset_ || (file.size() - range.offset_) < range.size_ || 0 != (range.size_ % sizeof(T))) {
+            return false;
+        }
+        x.resize(range.size_ / sizeof(T));
+        if(0 < range.size_) {
+            ::memcpy(&x[0], file.data() + range.offset_, range.size_);
+        }
+        return true;
+    }
+
+    bool restore_hash(MinimalPerfectHash& hash, u64 size, const Array<u32>& pilots)
+    {
+        return hash.restore(size, pilots.size(), 0 < pilots.size() ? &pilots[0] : nullptr);
+    }
+
+    template<class T>
+    bool restore_hash(FlatTable<T>& table, const Array<u32>& pilots)
+    {
+        return table.restore(pilots.size(), 0 < pilots.size() ? &pilots[0] : nullptr);
+    }
+} // namespace
+
+bool Tokenizer::save(const char8_t* filepath) const
+{
+    assert(nullptr != filepath);
+    using Header = TokenizerArtifactHeader;
+    static_assert(sizeof(Header::firsts_) == sizeof(SpecialTokenMatcher::firsts_));
+    Header header;
+    ::memset(&header, 0, sizeof(Header));
+    header.magic_ = Header::Magic;
+    header.version_ = Header::Version;
+    header.bos_token_id_ = vocab_.bos_token_id_;
+    header.eos_token_id_ = vocab_.eos_token_id_;
+    header.unknown_token_id_ = vocab_.unknown_token_id_;
+    header.separator_token_id_ = vocab_.separator_token_id_;
+    header.padding_token_id_ = vocab_.padding_token_id_;
+    header.cls_token_id_ = vocab_.cls_token_id_;
+    header.mask_token_id_ = vocab_.mask_token_id_;
+    header.add_bos_ = vocab_.add_bos_;
+    header.add_eos_ = vocab_.add_eos_;
+    header.linefeed_id_ = vocab_.linefeed_id_;
+    header.prefix_id_ = vocab_.prefix_id_;
+    header.suffix_id_ = vocab_.suffix_id_;
+    header.middle_id_ = vocab_.middle_id_;
+    header.eot_id_ = vocab_.eot_id_;
+    header.add_space_prefix_ = vocab_.add_space_prefix_ ? 1 : 0;
+    header.max_token_length_ = vocab_.max_token_length_;
+    header.text_hash_size_ = vocab_.text_hash_.size();
+    header.merge_hash_size_ = merges_.table_.size();
+    header.edge_hash_size_ = special_tokens_.edges_.size();
+    header.num_firsts_ = special_tokens_.num_firsts_;
+    ::memcpy(header.firsts_, special_tokens_.firsts_, sizeof(header.firsts_));
+    for(u32 i = 0; i < 256; ++i) {
+        header.first_[i] = special_tokens_.first_[i] ? 1 : 0;
+    }
+
+    ArtifactBlob blobs[Header::NumSections] = {
+        artifact_blob(vocab_.cache_token_text_),
+        artifact_blob(vocab_.cache_token_offsets_),
+        artifact_blob(vocab_.cache_token_scores_),
+        artifact_blob(vocab_.cache_token_types_),
+        {vocab_.text_hash_.pilots(), sizeof(u32) * vocab_.text_hash_.num_buckets()},
+        artifact_blob(vocab_.cache_slot_to_id_),
+        artifact_blob(vocab_.cache_special_tokens_),
+        artifact_blob(vocab_.cache_token_to_piece_),
+        artifact_blob(vocab_.cache_piece_offsets_),
+        {merges_.table_.hash().pilots(), sizeof(u32) * merges_.table_.hash().num_buckets()},
+        artifact_blob(merges_.table_.entries()),
+        {special_tokens_.edges_.hash().pilots(), sizeof(u32) * special_tokens_.edges_.hash().num_buckets()},
+        artifact_blob(special_tokens_.edges_.entries()),
+        artifact_blob(special_tokens_.nodes_),
+    };
+    u64 total = artifact_align(sizeof(Header));
+    for(u32 i = 0; i < Header::NumSections; ++i) {
+        header.sections_[i] = {total, blobs[i].size_};
+        total = artifact_align(total + blobs[i].size_);
+    }
+
+    FILE* file = fopen((const char*)filepath, "wb");
+    if(nullptr == file) {
+        return false;
+    }
+    static const u8 zeros[Header::Alignment] = {};
+    bool result = 1 == fwrite(&header, sizeof(Header), 1, file);
+    u64 position = sizeof(Header);
+    for(u32 i = 0; result && i <= Header::NumSections; ++i) {
+        // the last padding rounds the file up, an empty section at the end is in the file
+        u64 offset = i < Header::NumSections ? header.sections_[i].offset_ : total;
+        if(position < offset) {
+            result = 1 == fwrite(zeros, offset - position, 1, file);
+        }
+        if(result && i < Header::NumSections && 0 < blobs[i].size_) {
+            result = 1 == fwrite(blobs[i].data_, blobs[i].size_, 1, file);
+        }
+        position = i < Header::NumSections ? offset + blobs[i].size_ : offset;
+    }
+    result = (0 == fclose(file)) && result;
+    return result;
+}
+
+bool Tokenizer::load(const char8_t* filepath)
+{
+    using Header = TokenizerArtifactHeader;
+    MappedFile file;
+    if(!file.open(filepath) || file.size() < sizeof(Header)) {
+        return false;
+    }
+    Header header;
+    ::memcpy(&header, file.data(), sizeof(Header));
+    if(Header::Magic != header.magic_ || Header::Version != header.version_) {
+        return false;
+    }
+
+    // the tables as they were, no hash or trie is built again
+    Tokenizer tokenizer;
+    Vocabulary& vocab = tokenizer.vocab_;
+    MergeRanks& merges = tokenizer.merges_;
+    SpecialTokenMatcher& special_tokens = tokenizer.special_tokens_;
+    Array<u32> text_pilots;
+    Array<u32> merge_pilots;
+    Array<u32> edge_pilots;
+    if(!read_section(vocab.cache_token_text_, file, header, Header::TokenText)
+       || !read_section(vocab.cache_token_offsets_, file, header, Header::TokenOffsets)
+       || !read_section(vocab.cache_token_scores_, file, header, Header::TokenScores)
+       || !read_section(vocab.cache_token_types_, file, header, Header::TokenTypes)
+       || !read_section(text_pilots, file, header, Header::TextPilots)
+       || !read_section(vocab.cache_slot_to_id_, file, header, Header::SlotToId)
+       || !read_section(vocab.cache_special_tokens_, file, header, Header::SpecialTokens)
+       || !read_section(vocab.cache_token_to_piece_, file, header, Header::Pieces)
+       || !read_section(vocab.cache_piece_offsets_, file, header, Header::PieceOffsets)
+       || !read_section(merge_pilots, file, header, Header::MergePilots)
+       || !read_section(merges.table_.entries(), file, header, Header::Merges)
+       || !read_section(edge_pilots, file, header, Header::EdgePilots)
+       || !read_section(special_tokens.edges_.entries(), file, header, Header::Edges)
+       || !read_section(special_tokens.nodes_, file, header, Header::Nodes)) {
+        return false;
+    }
+    u64 size = vocab.cache_token_scores_.size();
+    if(vocab.cache_token_offsets_.size() != (size + 1)
+       || vocab.cache_token_types_.size() != size
+       || vocab.cache_piece_offsets_.size() != (size + 1)
+       || vocab.cache_token_offsets_[size] != vocab.cache_token_text_.size()
+       || vocab.cache_piece_offsets_[size] != vocab.cache_token_to_piece_.size()
+       || vocab.cache_slot_to_id_.size() != header.text_hash_size_
+       || merges.table_.size() != header.merge_hash_size_
+       || special_tokens.edges_.size() != header.edge_hash_size_
+       || !restore_hash(vocab.text_hash_, header.text_hash_size_, text_pilots)
+       || !restore_hash(merges.table_, merge_pilots)
+       || !restore_hash(special_tokens.edges_, edge_pilots)) {
+        return false;
+    }
+
+    // one pass over the tables, an offset or an id out of its array rejects the file
+    auto in_range = [size](s32 id) {
+        return 0 <= id && static_cast<u64>(id) < size;
+    };
+    bool valid = 0 == vocab.cache_token_offsets_[0] && 0 == vocab.cache_piece_offsets_[0];
+    for(u64 i = 0; valid && i < size; ++i) {
+        valid = vocab.cache_token_offsets_[i] <= vocab.cache_token_offsets_[i + 1]
+                && vocab.cache_piece_offsets_[i] <= vocab.cache_piece_offsets_[i + 1];
+    }
+    for(u64 i = 0; valid && i < vocab.cache_slot_to_id_.size(); ++i) {
+        valid = in_range(vocab.cache_slot_to_id_[i]);
+    }
+    for(u64 i = 0; valid && i < vocab.cache_special_tokens_.size(); ++i) {
+        valid = in_range(vocab.cache_special_tokens_[i]);
+    }
+    for(u64 i = 0; valid && i < merges.table_.size(); ++i) {
+        valid = in_range(merges.table_.entries()[i].value_.merged_);
+    }
+    for(u64 i = 0; valid && i < special_tokens.edges_.size(); ++i) {
+        valid = special_tokens.edges_.entries()[i].value_ < special_tokens.nodes_.size();
+    }
+    for(u64 i = 0; valid && i < special_tokens.nodes_.size(); ++i) {
+        valid = -1 == special_tokens.nodes_[i] || in_range(special_tokens.nodes_[i]);
+    }
+    if(!valid) {
+        return false;
+    }
+    vocab.bos_token_id_ = header.bos_token_id_;
+    vocab.eos_token_id_ = header.eos_token_id_;
+    vocab.unknown_token_id_ = header.unknown_token_id_;
+    vocab.separator_token_id_ = header.separator_token_id_;
+    vocab.padding_token_id_ = header.padding_token_id_;
+    vocab.cls_token_id_ = header.cls_token_id_;
+    vocab.mask_token_id_ = header.mask_token_id_;
+    vocab.add_bos_ = header.add_bos_;
+    vocab.add_eos_ = header.add_eos_;
+    vocab.linefeed_id_ = header.linefeed_id_;
+    vocab.prefix_id_ = header.prefix_id_;
+    vocab.suffix_id_ = header.suffix_id_;
+    vocab.middle_id_ = header.middle_id_;
+    vocab.eot_id_ = header.eot_id_;
+    vocab.add_space_prefix_ = 0 != header.add_space_prefix_;
+    vocab.max_token_length_ = header.max_token_length_;
+    special_tokens.num_firsts_ = header.num_firsts_;
+    ::memcpy(special_tokens.firsts_, header.firsts_, sizeof(header.firsts_));
+    for(u32 i = 0; i < 256; ++i) {
+        special_tokens.first_[i] = 0 != header.first_[i];
+    }
+    for(u64 i = 0; i < vocab.cache_special_tokens_.size(); ++i) {
+        special_tokens.max_length_ = (std::max)(special_tokens.max_length_, static_cast<u64>(vocab.text(vocab.cache_special_tokens_[i]).len_));
+    }
+    tokenizer.build_adjacent();
+
+    tokenizer.buffer_ = (char8_t*)allocate((vocab.getMaxTokenLength() + 1 + 2) * sizeof(char8_t));
+    for(u32 i = 0; i < 128; ++i) {
+        char8_t c = static_cast<char8_t>(i);
+        if(!vocab.encode(tokenizer.ascii_[i], 1, &c)) {
+            tokenizer.ascii_[i] = -1;
+        }
+    }
+    *this = std::move(tokenizer);
+    return true;
+}
+
+void Tokenizer::build_adjacent()
+{
+    // a merge joins two tokens to one, the last byte of the left is next to the first of the right in its text
+    adjacent_.resize(256 * 256 / 64);
+    ::memset(&adjacent_[0], 0, sizeof(u64) * adjacent_.size());
+    for(u64 i = 0; i < vocab_.idToTokenSize(); ++i) {
+        String text = vocab_.text(static_cast<s32>(i));
+        for(u64 j = 1; j < text.len_; ++j) {
+            u32 pair = (static_cast<u32>(text.str_[j - 1]) << 8) | text.str_[j];
+            adjacent_[pair >> 6] |= 1ULL << (pair & 63);
+        }
+    }
+}
+
+bool Tokenizer::separable(char8_t left, char8_t right) const
+{
+    u32 pair = (static_cast<u32>(left) << 8) | right;
+    return 0 == ((adjacent_[pair >> 6] >> (pair & 63)) & 1);
+}
+
+u64 Tokenizer::length(char c)
+{
+    return utf8_length(static_cast<char8_t>(c));
+}
+
+s32 Tokenizer::byte_to_token(const Vocabulary& vocab, char8_t c)
+{
+    s32 token_id = 0;
+    const std::u8string& str = unicode_byte_to_utf8(c);
+    if(vocab.tokenToId(token_id, str)) {
+        return token_id;
+    }
+    return vocab.getUnknown();
+}
+
+s32 Tokenizer::char_to_token(u64 length, const char8_t* text) const
+{
+    if(1 == length && *text < 0x80U) {
+        return ascii_[*text];
+    }
+    s32 token_id = -1;
+    if(vocab_.encode(token_id, length, text)) {
+        return token_id;
+    }
+    return -1;
+}
+
+void Tokenizer::split(Array<Symbol>& symbols, u64 size, const char8_t* text) const
+{
+    symbols.clear();
+    symbols.reserve(size);
+    // split string into utf8 chars
+    s32 index = 0;
+    u64 offset = 0;
+    while(offset < size) {
+        Symbol symbol;
+        size_t len = length(text[offset]);
+        symbol.text_ = text + offset;
+        symbol.len_ = (std::min)(static_cast<u64>(len), size - offset);
+        symbol.id_ = char_to_token(symbol.len_, symbol.text_);
+        offset += symbol.len_;
+        symbol.prev_ = index - 1;
+        symbol.next_ = offset == size ? -1 : index + 1;
+        ++index;
+        symbols.push_back(symbol);
+    }
+}
+
+void Tokenizer::try_add_merge(Scratch& scratch, Symbol::index left, Symbol::index right) const
+{
+    if(left == -1 || right == -1) {
+        return;
     }
-    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.merges")) {
-        merges_ = model_data.getMetaDataArray(*metadata);
+    const Symbol& left_sym = scratch.symbols_[left];
+    const Symbol& right_sym = scratch.symbols_[right];
+    // a char out of the vocabulary does not merge
+    if(left_sym.id_ < 0 || right_sym.id_ < 0) {
+        return;
+    }
+    MergeRanks::Merge merge;
+    if(!merges_.find(merge, left_sym.id_, right_sym.id_)) {
+        return;
+    }
+    Candidate candidate;
+    candidate.rank_ = merge.rank_;
+    candidate.merged_ = merge.merged_;
+    candidate.left_ = left;
+    candidate.right_ = right;
+    candidate.left_id_ = left_sym.id_;
+    candidate.right_id_ = right_sym.id_;
+    scratch.merge_queue_.push_back(candidate);
+}
+
+//--- StreamTokenizer
+//-----------------------------------------------------------
+StreamTokenizer::StreamTokenizer()
+    : tokenizer_(nullptr)
+    , max_pending_(DefaultMaxPending)
+    , searched_(0)
+    , position_(0)
+    , separable_(0)
+{
+}
+
+StreamTokenizer::StreamTokenizer(const Tokenizer& tokenizer, u64 max_pending)
+    : tokenizer_(&tokenizer)
+    , max_pending_(max_pending)
+    , searched_(0)
+    , position_(0)
+    , separable_(0)
+{
+}
+
+StreamTokenizer::~StreamTokenizer()
+{
+}
+
+StreamTokenizer::StreamTokenizer(StreamTokenizer&& other)
+    : tokenizer_(other.tokenizer_)
+    , max_pending_(other.max_pending_)
+    , searched_(other.searched_)
+    , position_(other.position_)
+    , separable_(other.separable_)
+    , scratch_(std::move(other.scratch_))
+    , buffer_(std::move(other.buffer_))
+{
+    other.tokenizer_ = nullptr;
+    other.searched_ = 0;
+    other.position_ = 0;
+    other.separable_ = 0;
+}
+
+StreamTokenizer& StreamTokenizer::operator=(StreamTokenizer&& other)
+{
+    if(this != &other) {
+        tokenizer_ = other.tokenizer_;
+        max_pending_ = other.max_pending_;
+        searched_ = other.searched_;
+        position_ = other.position_;
+        separable_ = other.separable_;
+        scratch_ = std::move(other.scratch_);
+        buffer_ = std::move(other.buffer_);
+        other.tokenizer_ = nullptr;
+        other.searched_ = 0;
+        other.position_ = 0;
+        other.separable_ = 0;
+    }
+    return *this;
+}
+
+void StreamTokenizer::push(Array<s32>& tokens, u64 size, const char8_t* chunk)
+{
+    assert(nullptr != tokenizer_);
+    if(size <= 0) {
+        return;
+    }
+    u64 offset = buffer_.size();
+    buffer_.resize(offset + size);
+    ::memcpy(&buffer_[offset], chunk, size);
+
+    offset = flush(tokens, false);
+    u64 rest = buffer_.size() - offset;
+    if(0 < offset && 0 < rest) {
+        ::memmove(&buffer_[0], &buffer_[offset], rest);
+    }
+    buffer_.resize(rest);
+}
+
+void StreamTokenizer::finish(Array<s32>& tokens)
+{
+    assert(nullptr != tokenizer_);
+    flush(tokens, true);
+    buffer_.clear();
+    searched_ = 0;
+    position_ = 0;
+    separable_ = 0;
+}
+
+u64 StreamTokenizer::pending() const
+{
+    return buffer_.size();
+}
+
+u64 StreamTokenizer::flush(Array<s32>& tokens, bool all)
+{
+    u64 size = buffer_.size();
+    if(size <= 0) {
+        return 0;
+    }
+    const char8_t* text = &buffer_[0];
+    if(all) {
+        tokenizer_->tokenize(tokens, scratch_, size, text);
+        return size;
+    }
+
+    // a special token goes out once no longer one can start at it, the search goes on where it stopped
+    const SpecialTokenMatcher& special_tokens = tokenizer_->special_tokens_;
+    u64 max_length = special_tokens.max_length();
+    u64 offset = 0;
+    SpecialTokenMatcher::Match match;
+    while(special_tokens.find(match, (std::max)(offset, searched_), size, text) && (match.offset_ + max_length) <= size) {
+        tokenizer_->encode(tokens, scratch_, match.offset_ - offset, text + offset);
+        tokens.push_back(match.token_);
+        offset = match.offset_ + match.length_;
+        position_ = offset;
+        separable_ = offset;
+    }
+
+    // no special token starts before the limit but the ones taken
+    u64 limit = size + 1 - (std::min)(max_length, size + 1);
+    searched_ = (std::max)(offset, limit);
+    scan(limit);
+    u64 end = separable_;
+    if(max_pending_ < (size - end)) {
+        end = position_;
+    }
+    tokenizer_->encode(tokens, scratch_, end - offset, text + offset);
+
+    // the cursors follow the bytes left in the buffer
+    searched_ -= end;
+    position_ -= end;
+    separable_ = (std::max)(separable_, end) - end;
+    return end;
+}
+
+void StreamTokenizer::scan(u64 limit)
+{
+    // the chars as Tokenizer::split walks them, up to the limit and with a byte after the last
+    u64 size = buffer_.size();
+    const char8_t* text = &buffer_[0];
+    while(position_ < size) {
+        u64 next = position_ + Tokenizer::length(text[position_]);
+        if(limit < next || size <= next) {
+            break;
+        }
+        position_ = next;
+        if(tokenizer_->separable(text[next - 1], text[next])) {
+            separable_ = next;
+        }
+    }
+}
+
+//--- Detokenizer
+//-----------------------------------------------------------
+Detokenizer::Detokenizer()
+    : vocab_(nullptr)
+    , pending_size_(0)
+    , pending_{}
+{
+}
+
+Detokenizer::Detokenizer(const Vocabulary& vocab)
+    : vocab_(&vocab)
+    , pending_size_(0)
+    , pending_{}
+{
+}
+
+Detokenizer::~Detokenizer()
+{
+}
+
+Detokenizer::Detokenizer(Detokenizer&& other)
+    : vocab_(other.vocab_)
+    , pending_size_(other.pending_size_)
+{
+    ::memcpy(pending_, other.pending_, sizeof(pending_));
+    other.vocab_ = nullptr;
+    other.pending_size_ = 0;
+}
+
+Detokenizer& Detokenizer::operator=(Detokenizer&& other)
+{
+    if(this != &other) {
+        vocab_ = other.vocab_;
+        pending_size_ = other.pending_size_;
+        ::memcpy(pending_, other.pending_, sizeof(pending_));
+        other.vocab_ = nullptr;
+        other.pending_size_ = 0;
+    }
+    return *this;
+}
+
+void Detokenizer::push(std::u8string& text, s32 token)
+{
+    assert(nullptr != vocab_);
+    assert(0 <= token && static_cast<u64>(token) < vocab_->idToTokenSize());
+    String piece = vocab_->tokenToPiece(token);
+    const char8_t* str = piece.str_;
+    u64 len = piece.len_;
+
+    // continue the char of the previous tokens
+    if(0 < pending_size_) {
+        u64 expected = utf8_length(pending_[0]);
+        while(pending_size_ < expected && 0 < len && 0x80U == (str[0] & 0xC0U)) {
+            pending_[pending_size_++] = *str;
+            ++str;
+            --len;
+        }
+        if(pending_size_ < expected && len <= 0) {
+            return;
+        }
+        // complete or broken, either goes out as it is
+        text.append(pending_, pending_size_);
+        pending_size_ = 0;
+    }
+
+    u64 complete = utf8_complete(len, str);
+    text.append(str, complete);
+    for(u64 i = complete; i < len; ++i) {
+        pending_[pending_size_++] = str[i];
+    }
+}
+
+void Detokenizer::finish(std::u8string& text)
+{
+    text.append(pending_, pending_size_);
+    pending_size_ = 0;
+}
+
+u32 Detokenizer::pending() const
+{
+    return pending_size_;
+}
+
+//--- Sampler
+//-----------------------------------------------------------
+Sampler::Sampler()
+    : vocab_size_(0)
+    , temperature_(1.0f)
+    , topp_(0.9f)
+    , probindex_(nullptr)
+{
+}
+
+Sampler::Sampler(u32 vocab_size, f32 temperature, f32 topp, u64 seed)
+    : vocab_size_(vocab_size)
+    , temperature_(temperature)
+    , topp_(topp)
+    , random_(seed)
+    , probindex_(nullptr)
+{
+    probindex_ = static_cast<ProbIndex*>(allocate(sizeof(ProbIndex) * vocab_size_));
+}
+
+Sampler::~Sampler()
+{
+    deallocate(probindex_);
+    probindex_ = nullptr;
+}
+
+Sampler::Sampler(Sampler&& other)
+    :vocab_size_(other.vocab_size_)
+    , temperature_(other.temperature_)
+    , topp_(other.topp_)
+    , random_(other.random_)
+    , probindex_(other.probindex_)
+{
+    other.vocab_size_ = 0;
+    other.probindex_ = nullptr;
+}
+
+Sampler& Sampler::operator=(Sampler&& other)
+{
+    if(this != &other) {
+        deallocate(probindex_);
+
+        vocab_size_ = other.vocab_size_;
+        temperature_ = other.temperature_;
+        topp_ = other.topp_;
+        random_ = other.random_;
+        probindex_ = other.probindex_;
+
+        other.vocab_size_ = 0;
+        other.probindex_ = nullptr;
+    }
+    return *this;
+}
+
+Sampler::State Sampler::state() const
+{
+    return {vocab_size_, temperature_, topp_, random_.state()};
+}
+
+bool Sampler::restore(const State& state)
+{
+    if(state.vocab_size_ != vocab_size_) {
+        return false;
+    }
+    temperature_ = state.temperature_;
+    topp_ = state.topp_;
+    random_.set_state(state.random_);
+    return true;
+}
+
+u32 Sampler::sample(f32* logits)
+{
+    assert(nullptr != logits);
+    if(temperature_ <= std::numeric_limits<f32>::epsilon()) {
+        return sample_argmax(vocab_size_, logits);
+    }
+    f32 inv_temperature = 1.0f / temperature_;
+    for(u32 i = 0; i < vocab_size_; ++i) {
+        logits[i] *= inv_temperature;
+    }
+    op::softmax(vocab_size_, logits);
+    f32 coin = random_.frand();
+    if(topp_ <= 0.0f || 1.0f <= topp_) {
+        return sample_mult(vocab_size_, coin, logits);
+    } else {
+        return sample_topp(vocab_size_, topp_, coin, probindex_, logits);
+    }
+}
+
+void Sampler::distribution(f32* logits)
+{
+    assert(nullptr != logits);
+    if(temperature_ <= std::numeric_limits<f32>::epsilon()) {
+        u32 index = sample_argmax(vocab_size_, logits);
+        ::memset(logits, 0, sizeof(f32) * vocab_size_);
+        logits[index] = 1.0f;
+        return;
+    }
+    f32 inv_temperature = 1.0f / temperature_;
+    for(u32 i = 0; i < vocab_size_; ++i) {
+        logits[i] *= inv_temperature;
+    }
+    op::softmax(vocab_size_, logits);
+    if(topp_ <= 0.0f || 1.0f <= topp_) {
+        return;
+    }
+    // same nucleus as sample_topp, renormalized
+    u32 n0 = 0;
+    const f32 cutoff = (1.0f - topp_) / (vocab_size_ - 1);
+    for(u32 i = 0; i < vocab_size_; ++i) {
+        if(cutoff <= logits[i]) {
+            probindex_[n0].index_ = i;
+            probindex_[n0].prob_ = logits[i];
+            ++n0;
+        }
+    }
+    std::sort(probindex_, probindex_ + n0, [](const ProbIndex& x0, const ProbIndex& x1) {
+        return x0.prob_ > x1.prob_;
+    });
+    f32 cumulative_prob = 0.0f;
+    u32 end = n0;
+    for(u32 i = 0; i < n0; ++i) {
+        cumulative_prob += probindex_[i].prob_;
+        if(topp_ < cumulative_prob) {
+            end = i + 1;
+            break;
+        }
+    }
+    ::memset(logits, 0, sizeof(f32) * vocab_size_);
+    f32 inv_cumulative_prob = 1.0f / cumulative_prob;
+    for(u32 i = 0; i < end; ++i) {
+        logits[probindex_[i].index_] = probindex_[i].prob_ * inv_cumulative_prob;
+    }
+}
+
+u32 Sampler::sample_distribution(const f32* probabilities)
+{
+    assert(nullptr != probabilities);
+    return sample_mult(vocab_size_, random_.frand(), probabilities);
+}
+
+f32 Sampler::uniform()
+{
+    return random_.frand();
+}
+
+u32 Sampler::sample_argmax(u32 size, const f32* probabilities)
+{
+    assert(0 < size);
+    u32 max_index = 0;
+    f32 max_p = probabilities[0];
+    for(u32 i = 1; i < size; ++i) {
+        if(max_p < probabilities[i]) {
+            max_index = i;
+            max_p = probabilities[i];
+        }
+    }
+    return max_index;
+}
+
+u32 Sampler::sample_mult(u32 size, f32 coin, const f32* probabilities)
+{
+    f32 cdf = 0.0f;
+    for(u32 i = 0; i < size; ++i) {
+        cdf += probabilities[i];
+        if(coin < cdf) {
+            return i;
+        }
+    }
+    return size - 1;
+}
+
+u32 Sampler::sample_topp(u32 size, f32 topp, f32 coin, ProbIndex* probindex, const f32* probabilities)
+{
+    u32 n0 = 0;
+    const f32 cutoff = (1.0f - topp) / (size - 1);
+    for(u32 i = 0; i < size; ++i) {
+        if(cutoff <= probabilities[i]) {
+            probindex[n0].index_ = i;
+            probindex[n0].prob_ = probabilities[i];
+            ++n0;
+        }
+    }
+    std::sort(probindex, probindex + n0, [](const ProbIndex& x0, const ProbIndex& x1) {
+        return x0.prob_ > x1.prob_;
+    });
+    f32 cumulative_prob = 0.0f;
+    u32 end = n0;
+    for(u32 i = 0; i < n0; ++i) {
+        cumulative_prob += probindex[i].prob_;
+        if(topp < cumulative_prob) {
+            end = i + 1;
+            break;
+        }
     }
-    if(model_data.getArrayMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING, u8"tokenizer.ggml.added_tokens")) {
-        added_tokens_ = model_data.getMetaDataArray(*metadata);
+    f32 r = coin * cumulative_prob;
+    f32 cdf = 0.0f;
+    for(u32 i = 0; i < end; ++i) {
+        cdf += probindex[i].prob_;
+        if(r < cdf) {
+            return probindex[i].index_;
+        }
     }
+    return probindex[end - 1].index_;
+}
 
-    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.bos_token_id")) {
-        bos_token_id_ = model_data.getMetaDataU32(*metadata);
-    }
-    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.eos_token_id")) {
-        eos_token_id_ = model_data.getMetaDataU32(*metadata);
-    }
-    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.unknown_token_id")) {
-        unknown_token_id_ = model_data.getMetaDataU32(*metadata);
-    }
-    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.separator_token_id")) {
-        separator_token_id_ = model_data.getMetaDataU32(*metadata);
+//--- Llama2
+//-----------------------------------------------------------
+namespace
+{
+    /**
+     * @brief Make a view of a weight in the model file, after checking its shape
+     * @param rows ... 0 for a vector
+     */
+    bool get_weight(Tensor& tensor, const gguf::GGUF& model_data, const char* name, u64 rows, u64 columns)
+    {
+        u64 index;
+        if(!model_data.findTensor(index, reinterpret_cast<const char8_t*>(name))) {
+            return false;
+        }
+        const gguf::gguf_tensor_info_t& info = model_data.getTensor(index);
+        if(0 == op::row_bytes(info.type_, columns)) {
+            return false;
+        }
+        // dimensions of gguf are innermost first
+        if(0 == rows) {
+            if(1 != info.n_dimensions_ || columns != model_data.getTensorDimension(index, 0)) {
+                return false;
+            }
+            tensor = Tensor(info.type_, {columns}, model_data.getTensorData(index));
+        } else {
+            if(2 != info.n_dimensions_
+               || columns != model_data.getTensorDimension(index, 0)
+               || rows != model_data.getTensorDimension(index, 1)) {
+                return false;
+            }
+            tensor = Tensor(info.type_, {rows, columns}, model_data.getTensorData(index));
+        }
+        return true;
     }
-    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, u8"tokenizer.ggml.padding_token_id")) {
-        padding_token_id_ = model_data.getMetaDataU32(*metadata);
+
+    bool get_layer_weight(Tensor& tensor, const gguf::GGUF& model_data, u64 layer, const char* name, u64 rows, u64 columns)
+    {
+        char buffer[GGML_MAX_NAME];
+        ::snprintf(buffer, GGML_MAX_NAME, "blk.%u.%s.weight", static_cast<u32>(layer), name);
+        return get_weight(tensor, model_data, buffer, rows, columns);
     }
 
-    // Add tokens to maps
-    tokenToId_.reserve(static_cast<u32>(tokens_.size_));
-    idToToken_.resize(tokens_.size_);
-    ::memset(&idToToken_[0], 0, sizeof(Token) * tokens_.size_);
-    s32 id = 0;
+    /**
+     * @brief Steps of a forward, a layer repeats from AttentionNorm to Down
+     */
+    enum Step : u32
+    {
+        Embed,
+        AttentionNorm,
+        Projection,
+        Attention,
+        Output,
+        FeedForwardNorm,
+        GateUp,
+        Down,
+        Classifier,
+    };
 
-    for(GGUFArray::Iterator<GGUFString> itr = tokens_.begin<GGUFString>(); itr; ++itr, ++id) {
-        GGUFString ggufStr = *itr;
-        String str = {ggufStr.length_, ggufStr.str_};
-        max_token_length_ = (std::max)(max_token_length_, static_cast<s32>(ggufStr.length_));
-        tokenToId_.add(str, id);
-        if(id < idToToken_.size()) {
-            Token token = {};
-            token.text_ = str;
-            if(id < scores_.size_) {
-                token.score_ = scores_.get<f32>(id);
-            }
-            if(id < token_types_.size_) {
-                token.type_ = token_types_.get<s32>(id);
-            }
-            idToToken_[id] = token;
+    bool get_u64(u64& value, const gguf::GGUF& model_data, const char8_t* key)
+    {
+        using namespace gguf;
+        const gguf_metadata_kv_t* metadata = nullptr;
+        if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32, key)) {
+            value = model_data.getMetaDataU32(*metadata);
+            return true;
         }
+        if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT64, key)) {
+            value = model_data.getMetaDataU64(*metadata);
+            return true;
+        }
+        return false;
     }
+} // namespace
+
+Llama2::Llama2()
+    : config_{}
+    , blocks_(nullptr)
+{
 }
 
-Vocabulary::~Vocabulary()
+Llama2::Llama2(const gguf::GGUF& model_data, u64 kv_window, u64 kv_sinks, u64 batch_size)
+    : config_{}
+    , blocks_(nullptr)
 {
+    if(!load_config(config_, model_data)) {
+        return;
+    }
+    const u64 dim = config_.dimension_;
+    const u64 hidden_dim = config_.hidden_dim_;
+    const u64 kv_dim = (config_.dimension_ * config_.num_kv_heads_) / config_.num_heads_;
+    const u64 head_size = config_.dimension_ / config_.num_heads_;
+    const f32 epsilon = config_.rms_epsilon_;
+
+    if(!get_weight(token_embedding_, model_data, "token_embd.weight", config_.vocab_size_, dim)) {
+        return;
+    }
+    Tensor output_norm;
+    if(!get_weight(output_norm, model_data, "output_norm.weight", 0, dim)) {
+        return;
+    }
+    // the classifier shares the embedding, if there is no dedicated one
+    if(!get_weight(output_weight_, model_data, "output.weight", config_.vocab_size_, dim)) {
+        output_weight_ = Tensor(token_embedding_.type(), {config_.vocab_size_, dim}, token_embedding_.data<void>());
+    }
+
+    TransformerBlock* blocks = new TransformerBlock[config_.num_layers_];
+    for(u64 i = 0; i < config_.num_layers_; ++i) {
+        Tensor attn_norm;
+        Tensor wq;
+        Tensor wk;
+        Tensor wv;
+        Tensor wo;
+        Tensor ffn_norm;
+        Tensor ffn_gate;
+        Tensor ffn_up;
+        Tensor ffn_down;
+        bool result = get_layer_weight(attn_norm, model_data, i, "attn_norm", 0, dim)
+                      && get_layer_weight(wq, model_data, i, "attn_q", dim, dim)
+                      && get_layer_weight(wk, model_data, i, "attn_k", kv_dim, dim)
+                      && get_layer_weight(wv, model_data, i, "attn_v", kv_dim, dim)
+                      && get_layer_weight(wo, model_data, i, "attn_output", dim, dim)
+                      && get_layer_weight(ffn_norm, model_data, i, "ffn_norm", 0, dim)
+                      && get_layer_weight(ffn_gate, model_data, i, "ffn_gate", hidden_dim, dim)
+                      && get_layer_weight(ffn_up, model_data, i, "ffn_up", hidden_dim, dim)
+                      && get_layer_weight(ffn_down, model_data, i, "ffn_down", dim, hidden_dim);
+        if(!result) {
+            delete[] blocks;
+            return;
+        }
+        blocks[i] = TransformerBlock(
+            RMSNorm(std::move(attn_norm), epsilon),
+            SelfAttention(std::move(wq), std::move(wk), std::move(wv), std::move(wo)),
+            RMSNorm(std::move(ffn_norm), epsilon),
+            FeedForwardSwiGLU(std::move(ffn_down), std::move(ffn_gate), std::move(ffn_up), Tensor()));
+    }
+    output_rmsnorm_ = RMSNorm(std::move(output_norm), epsilon);
+    rope_ = RotaryEmbedding(model_data, head_size, config_.sequence_length_);
+    sampler_ = Sampler(static_cast<u32>(config_.vocab_size_), 1.0f, 0.9f, 12345ULL);
+
+    // activations are planned once, buffers alive at different steps share the arena
+    Context& c = context_;
+    c.cache_ = KVCache(config_, kv_window, kv_sinks);
+    c.batch_size_ = (std::max)(batch_size, static_cast<u64>(1));
+    const u64 rows = c.batch_size_;
+    MemoryPlan plan;
+    const u32 x = plan.add(sizeof(f32) * rows * dim, Step::Embed, Step::Classifier);
+    const u32 xb = plan.add(sizeof(f32) * rows * dim, Step::AttentionNorm, Step::Classifier);
+    const u32 hb = plan.add(sizeof(f32) * rows * hidden_dim, Step::GateUp, Step::Down);
+    const u32 query = plan.add(sizeof(f32) * rows * dim, Step::Projection, Step::Attention);
+    const u32 key = plan.add(sizeof(f32) * rows * kv_dim, Step::Projection, Step::Attention);
+    const u32 value = plan.add(sizeof(f32) * rows * kv_dim, Step::Projection, Step::Attention);
+    // enough for a cache of any window, the batched forward runs over caches other than its own
+    const u32 attn = plan.add(sizeof(f32) * config_.num_heads_ * config_.sequence_length_, Step::Attention, Step::Attention);
+    const u32 logits = plan.add(sizeof(f32) * config_.vocab_size_, Step::Classifier, Step::Classifier);
+    const u32 batch_logits = plan.add(sizeof(f32) * rows * config_.vocab_size_, Step::Classifier, Step::Classifier);
+    const u32 scratch = plan.add(sizeof(f32) * op::scratch_size((std::max)(dim, hidden_dim)), Step::Embed, Step::Classifier);
+    c.arena_ = Tensor(ggml_type::GGML_TYPE_F32, {(plan.build() + sizeof(f32) - 1) / sizeof(f32)});
+    const u8* arena = c.arena_.data<u8>();
+
+    c.batch_x_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, dim}, arena + plan.offset(x));
+    c.batch_xb_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, dim}, arena + plan.offset(xb));
+    c.batch_hb_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, hidden_dim}, arena + plan.offset(hb));
+    c.batch_query_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, dim}, arena + plan.offset(query));
+    c.batch_key_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, kv_dim}, arena + plan.offset(key));
+    c.batch_value_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, kv_dim}, arena + plan.offset(value));
+    c.batch_logits_ = Tensor(ggml_type::GGML_TYPE_F32, {rows, config_.vocab_size_}, arena + plan.offset(batch_logits));
+    c.x_ = Tensor(ggml_type::GGML_TYPE_F32, {dim}, arena + plan.offset(x));
+    c.xb_ = Tensor(ggml_type::GGML_TYPE_F32, {dim}, arena + plan.offset(xb));
+    c.hb_ = Tensor(ggml_type::GGML_TYPE_F32, {hidden_dim}, arena + plan.offset(hb));
+    c.query_ = Tensor(ggml_type::GGML_TYPE_F32, {dim}, arena + plan.offset(query));
+    c.key_ = Tensor(ggml_type::GGML_TYPE_F32, {kv_dim}, arena + plan.offset(key));
+    c.value_ = Tensor(ggml_type::GGML_TYPE_F32, {kv_dim}, arena + plan.offset(value));
+    c.attn_ = Tensor(ggml_type::GGML_TYPE_F32, {config_.num_heads_, config_.sequence_length_}, arena + plan.offset(attn));
+    c.logits_ = Tensor(ggml_type::GGML_TYPE_F32, {config_.vocab_size_}, arena + plan.offset(logits));
+    c.scratch_ = Tensor(ggml_type::GGML_TYPE_F32, {op::scratch_size((std::max)(dim, hidden_dim))}, arena + plan.offset(scratch));
+    c.batch_rows_.reserve(c.batch_size_);
+    blocks_ = blocks;
+}
+
+Llama2::Llama2(Llama2&& other)
+    : config_(other.config_)
+    , sampler_(std::move(other.sampler_))
+    , context_(std::move(other.context_))
+    , rope_(std::move(other.rope_))
+    , token_embedding_(std::move(other.token_embedding_))
+    , blocks_(other.blocks_)
+    , output_rmsnorm_(std::move(other.output_rmsnorm_))
+    , output_weight_(std::move(other.output_weight_))
+{
+    other.blocks_ = nullptr;
 }
 
-Vocabulary::Vocabulary(Vocabulary&& other)
-    : model_(other.model_)
-    , tokens_(other.tokens_)
-    , scores_(other.scores_)
-    , token_types_(other.token_types_)
-    , merges_(other.merges_)
-    , added_tokens_(other.added_tokens_)
-    , bos_token_id_(other.bos_token_id_)
-    , eos_token_id_(other.eos_token_id_)
-    , unknown_token_id_(other.unknown_token_id_)
-    , separator_token_id_(other.separator_token_id_)
-    , padding_token_id_(other.padding_token_id_)
-    , cls_token_id_(other.cls_token_id_)
-    , mask_token_id_(other.mask_token_id_)
-    , add_bos_(other.add_bos_)
-    , add_eos_(other.add_eos_)
-    , linefeed_id_(other.linefeed_id_)
-    , prefix_id_(other.prefix_id_)
-    , suffix_id_(other.suffix_id_)
-    , middle_id_(other.middle_id_)
-    , eot_id_(other.eot_id_)
-    , add_space_prefix_(other.add_space_prefix_)
-    , max_token_length_(other.max_token_length_)
-    , tokenToId_(std::move(other.tokenToId_))
-    , idToToken_(std::move(other.idToToken_))
+Llama2::~Llama2()
 {
-    other.model_ = {};
-    other.tokens_ = {};
-    other.scores_ = {};
-    other.token_types_ = {};
-    other.merges_ = {};
-    other.added_tokens_ = {};
-    other.bos_token_id_ = 1;
-    other.eos_token_id_ = 2;
-    other.unknown_token_id_ = 0;
-    other.separator_token_id_ = -1;
-    other.cls_token_id_ = -1;
-    other.mask_token_id_ = -1;
-    other.add_bos_ = -1;
-    other.add_eos_ = -1;
-    other.linefeed_id_ = 13;
-    other.prefix_id_ = -1;
-    other.suffix_id_ = -1;
-    other.middle_id_ = -1;
-    other.eot_id_ = -1;
-    other.add_space_prefix_ = true;
-    other.max_token_length_ = 0;
+    delete[] blocks_;
+    blocks_ = nullptr;
 }
 
-Vocabulary& Vocabulary::operator=(Vocabulary&& other)
+Llama2& Llama2::operator=(Llama2&& other)
 {
     if(this != &other) {
-        model_ = other.model_;
-        tokens_ = other.tokens_;
-        scores_ = other.scores_;
-        token_types_ = other.token_types_;
-        merges_ = other.merges_;
-        added_tokens_ = other.added_tokens_;
-        bos_token_id_ = other.bos_token_id_;
-        eos_token_id_ = other.eos_token_id_;
-        unknown_token_id_ = other.unknown_token_id_;
-        separator_token_id_ = other.separator_token_id_;
-        cls_token_id_ = other.cls_token_id_;
-        mask_token_id_ = other.mask_token_id_;
-        add_bos_ = other.add_bos_;
-        add_eos_ = other.add_eos_;
-        linefeed_id_ = other.linefeed_id_;
-        prefix_id_ = other.prefix_id_;
-        suffix_id_ = other.suffix_id_;
-        middle_id_ = other.middle_id_;
-        eot_id_ = other.eot_id_;
-        add_space_prefix_ = other.add_space_prefix_;
-        max_token_length_ = other.max_token_length_;
-        tokenToId_ = std::move(other.tokenToId_);
-        idToToken_ = std::move(other.idToToken_);
-
-        other.model_ = {};
-        other.tokens_ = {};
-        other.scores_ = {};
-        other.token_types_ = {};
-        other.merges_ = {};
-        other.added_tokens_ = {};
-        other.bos_token_id_ = 1;
-        other.eos_token_id_ = 2;
-        other.unknown_token_id_ = 0;
-        other.separator_token_id_ = -1;
-        other.cls_token_id_ = -1;
-        other.mask_token_id_ = -1;
-        other.add_bos_ = -1;
-        other.add_eos_ = -1;
-        other.linefeed_id_ = 13;
-        other.prefix_id_ = -1;
-        other.suffix_id_ = -1;
-        other.middle_id_ = -1;
-        other.eot_id_ = -1;
-        other.max_token_length_ = 0;
+        delete[] blocks_;
+        config_ = other.config_;
+        sampler_ = std::move(other.sampler_);
+        context_ = std::move(other.context_);
+        rope_ = std::move(other.rope_);
+        token_embedding_ = std::move(other.token_embedding_);
+        blocks_ = other.blocks_;
+        output_rmsnorm_ = std::move(other.output_rmsnorm_);
+        output_weight_ = std::move(other.output_weight_);
+        other.blocks_ = nullptr;
     }
     return *this;
 }
 
-const gguf::GGUFString& Vocabulary::getModel() const
+bool Llama2::load_config(Config& config, const gguf::GGUF& model_data)
 {
-    return model_;
+    using namespace gguf;
+    config = {};
+    if(!get_u64(config.dimension_, model_data, u8"llama.embedding_length")
+       || !get_u64(config.hidden_dim_, model_data, u8"llama.feed_forward_length")
+       || !get_u64(config.num_layers_, model_data, u8"llama.block_count")
+       || !get_u64(config.num_heads_, model_data, u8"llama.attention.head_count")
+       || !get_u64(config.sequence_length_, model_data, u8"llama.context_length")) {
+        return false;
+    }
+    if(!get_u64(config.num_kv_heads_, model_data, u8"llama.attention.head_count_kv")) {
+        config.num_kv_heads_ = config.num_heads_;
+    }
+    if(0 == config.num_heads_ || 0 == config.num_kv_heads_ || 0 != (config.num_heads_ % config.num_kv_heads_)) {
+        return false;
+    }
+    // the vocabulary size is not always written, the embedding has it
+    u64 index;
+    if(!get_u64(config.vocab_size_, model_data, u8"llama.vocab_size")) {
+        if(!model_data.findTensor(index, u8"token_embd.weight") || model_data.getTensor(index).n_dimensions_ < 2) {
+            return false;
+        }
+        config.vocab_size_ = model_data.getTensorDimension(index, 1);
+    }
+    config.rms_epsilon_ = 1.0e-5f;
+    const gguf_metadata_kv_t* metadata = nullptr;
+    if(model_data.getMetaData(metadata, gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_FLOAT32, u8"llama.attention.layer_norm_rms_epsilon")) {
+        config.rms_epsilon_ = model_data.getMetaDataF32(*metadata);
+    }
+    return true;
 }
 
-const gguf::GGUFArray& Vocabulary::getTokens() const
+bool Llama2::valid() const
 {
-    return tokens_;
+    return nullptr != blocks_;
 }
 
-const gguf::GGUFArray& Vocabulary::getScores() const
+const Config& Llama2::config() const
 {
-    return scores_;
+    return config_;
 }
 
-const gguf::GGUFArray& Vocabulary::getTokenTypes() const
+Sampler& Llama2::sampler()
 {
-    return token_types_;
+    return sampler_;
 }
 
-const gguf::GGUFArray& Vocabulary::getMerges() const
+KVCache& Llama2::cache()
 {
-    return merges_;
+    return context_.cache_;
 }
 
-const gguf::GGUFArray& Vocabulary::getAddedTokens() const
+u64 Llama2::batch_size() const
 {
-    return added_tokens_;
+    return context_.batch_size_;
 }
 
-s32 Vocabulary::getBOS() const
+f32* Llama2::forward(u32 token, u64 position)
 {
-    return bos_token_id_;
+    assert(valid());
+    assert(token < config_.vocab_size_);
+    const u64 dim = config_.dimension_;
+    Context& c = context_;
+
+    // copy the token embedding into x
+    const u64 row_bytes = op::row_bytes(token_embedding_.type(), dim);
+    op::dequantize_row(token_embedding_.type(), dim, c.x_.data<f32>(), token_embedding_.data<u8>() + token * row_bytes);
+
+    // forward all the layers
+    for(u64 i = 0; i < config_.num_layers_; ++i) {
+        blocks_[i].forward(
+            config_,
+            rope_,
+            i,
+            position,
+            c.x_,
+            c.query_,
+            c.key_,
+            c.value_,
+            c.cache_,
+            c.attn_,
+            c.xb_,
+            c.hb_,
+            c.scratch_);
+    }
+
+    // final rmsnorm folded into the classifier
+    const f32 scale = output_rmsnorm_.scale(c.x_.data<f32>());
+    op::matvec_norm(c.logits_.data<f32>(), c.x_.data<f32>(), output_rmsnorm_.weight(), scale, output_weight_, dim, config_.vocab_size_, c.scratch_.data<f32>());
+    return c.logits_.data<f32>();
 }
 
-s32 Vocabulary::getEOS() const
+f32* Llama2::prefill(const u32* tokens, u64 count, u64 position)
 {
-    return eos_token_id_;
+    assert(valid());
+    assert(0 < count);
+    Context& c = context_;
+    f32* logits = nullptr;
+    for(u64 chunk = 0; chunk < count; chunk += c.batch_size_) {
+        const u64 size = (std::min)(c.batch_size_, count - chunk);
+        c.batch_rows_.clear();
+        for(u64 t = 0; t < size; ++t) {
+            // only the last position needs the logits
+            u32 last = (count == (chunk + t + 1)) ? 1 : 0;
+            c.batch_rows_.push_back({&c.cache_, position + chunk + t, tokens[chunk + t], last});
+        }
+        logits = forward_batch(&c.batch_rows_[0], size);
+    }
+    ::memcpy(c.logits_.data<f32>(), logits, sizeof(f32) * config_.vocab_size_);
+    return c.logits_.data<f32>();
+}
+
+f32* Llama2::forward_batch(const BatchRow* rows, u64 count)
+{
+    assert(valid());
+    assert(0 < count && count <= context_.batch_size_);
+    const u64 dim = config_.dimension_;
+    const u64 row_bytes = op::row_bytes(token_embedding_.type(), dim);
+    Context& c = context_;
+    f32* x = c.batch_x_.data<f32>();
+
+    for(u64 t = 0; t < count; ++t) {
+        u32 token = rows[t].token_;
+        assert(token < config_.vocab_size_);
+        op::dequantize_row(token_embedding_.type(), dim, x + t * dim, token_embedding_.data<u8>() + token * row_bytes);
+    }
+    for(u64 i = 0; i < config_.num_layers_; ++i) {
+        blocks_[i].forward_batch(
+            config_,
+            rope_,
+            i,
+            count,
+            rows,
+            c.batch_x_,
+            c.batch_query_,
+            c.batch_key_,
+            c.batch_value_,
+            c.attn_,
+            c.batch_xb_,
+            c.batch_hb_,
+            c.scratch_);
+    }
+
+    // final rmsnorm and classifier only for the rows which need the logits
+    f32* xb = c.batch_xb_.data<f32>();
+    u64 num_logits = 0;
+    for(u64 t = 0; t < count; ++t) {
+        if(rows[t].logits_) {
+            ::memcpy(xb + num_logits * dim, x + t * dim, sizeof(f32) * dim);
+            ++num_logits;
+        }
+    }
+    if(0 < num_logits) {
+        output_rmsnorm_.forward(c.batch_xb_, c.batch_xb_, num_logits);
+        op::matmat(c.batch_logits_.data<f32>(), xb, num_logits, output_weight_, dim, config_.vocab_size_, c.scratch_.data<f32>());
+    }
+    return c.batch_logits_.data<f32>();
 }
 
-s32 Vocabulary::getUnknown() const
+//--- Scheduler
+//-----------------------------------------------------------
+Scheduler::Scheduler()
+    : duration_(0)
+    , model_(nullptr)
+    , max_sequences_(0)
+    , eos_token_(0)
+    , token_budget_(0)
+    , arrivals_(0)
+    , sequences_(nullptr)
 {
-    return unknown_token_id_;
 }
 
-s32 Vocabulary::getSeparator() const
+Scheduler::Scheduler(Llama2& model, u32 max_sequences, u32 eos_token, u64 kv_window, u64 kv_sinks)
+    : duration_(0)
+    , model_(&model)
+    , max_sequences_(max_sequences)
+    , eos_token_(eos_token)
+    , token_budget_(0)
+    , arrivals_(0)
+    , sequences_(nullptr)
 {
-    return separator_token_id_;
+    assert(model.valid());
+    sequences_ = new Sequence[max_sequences_];
+    for(u32 i = 0; i < max_sequences_; ++i) {
+        sequences_[i].cache_ = KVCache(model.config(), kv_window, kv_sinks);
+    }
+    rows_.reserve(model.batch_size());
+    owners_.reserve(max_sequences_);
+    waiting_.reserve(max_sequences_);
 }
 
-s32 Vocabulary::getPadding() const
+Scheduler::~Scheduler()
 {
-    return padding_token_id_;
+    delete[] sequences_;
+    sequences_ = nullptr;
 }
 
-s32 Vocabulary::getCls() const
+Scheduler::Scheduler(Scheduler&& other)
+    : duration_(0)
+    , model_(other.model_)
+    , max_sequences_(other.max_sequences_)
+    , eos_token_(other.eos_token_)
+    , token_budget_(other.token_budget_)
+    , arrivals_(other.arrivals_)
+    , sequences_(other.sequences_)
+    , rows_(std::move(other.rows_))
+    , owners_(std::move(other.owners_))
+    , waiting_(std::move(other.waiting_))
 {
-    return cls_token_id_;
+    other.model_ = nullptr;
+    other.max_sequences_ = 0;
+    other.sequences_ = nullptr;
 }
 
-s32 Vocabulary::getMask() const
+Scheduler& Scheduler::operator=(Scheduler&& other)
 {
-    return mask_token_id_;
+    if(this != &other) {
+        delete[] sequences_;
+        duration_ = 0;
+        model_ = other.model_;
+        max_sequences_ = other.max_sequences_;
+        eos_token_ = other.eos_token_;
+        token_budget_ = other.token_budget_;
+        arrivals_ = other.arrivals_;
+        sequences_ = other.sequences_;
+        rows_ = std::move(other.rows_);
+        owners_ = std::move(other.owners_);
+        waiting_ = std::move(other.waiting_);
+        other.model_ = nullptr;
+        other.max_sequences_ = 0;
+        other.sequences_ = nullptr;
+    }
+    return *this;
 }
 
-s32 Vocabulary::getMaxTokenLength() const
+s32 Scheduler::add(const u32* prompt, u64 count, u64 max_tokens, f32 temperature, f32 topp, u64 seed)
 {
-    return max_token_length_;
+    assert(nullptr != model_);
+    assert(0 < count);
+    // a whole cache keeps every position, the prompt should leave a room to generate
+    const KVCache& cache = sequences_[0].cache_;
+    if(!cache.is_ring() && cache.capacity() <= count) {
+        return Invalid;
+    }
+    for(u32 i = 0; i < max_sequences_; ++i) {
+        Sequence& sequence = sequences_[i];
+        if(State::Free != sequence.state_) {
+            continue;
+        }
+        sequence.state_ = State::Prefill;
+        sequence.sampler_ = Sampler(static_cast<u32>(model_->config().vocab_size_), temperature, topp, seed);
+        sequence.tokens_.clear();
+        for(u64 j = 0; j < count; ++j) {
+            sequence.tokens_.push_back(prompt[j]);
+        }
+        sequence.prompt_length_ = count;
+        sequence.position_ = 0;
+        sequence.max_tokens_ = max_tokens;
+        sequence.arrival_ = arrivals_++;
+        sequence.scheduled_ = 0;
+        return static_cast<s32>(i);
+    }
+    return Invalid;
 }
 
-u64 Vocabulary::idToTokenSize() const
+void Scheduler::release(s32 id)
 {
-    return idToToken_.size();
+    assert(0 <= id && static_cast<u32>(id) < max_sequences_);
+    sequences_[id].state_ = State::Free;
+    sequences_[id].tokens_.clear();
 }
 
-const Vocabulary::Token& Vocabulary::idToToken(s32 x) const
+u32 Scheduler::step()
 {
-    return idToToken_[x];
+    Timer timer(duration_);
+    assert(nullptr != model_);
+    const u64 batch_size = model_->batch_size();
+    const u64 vocab_size = model_->config().vocab_size_;
+
+    // a decoding sequence brings its last token
+    rows_.clear();
+    owners_.clear();
+    waiting_.clear();
+    for(u32 i = 0; i < max_sequences_; ++i) {
+        Sequence& sequence = sequences_[i];
+        sequence.scheduled_ = 0;
+        if(State::Decode == sequence.state_) {
+            schedule(i, 1);
+        } else if(State::Prefill == sequence.state_) {
+            waiting_.push_back(i);
+        }
+    }
+    // prompts fill the rest of the budget, first come first served
+    if(1 < waiting_.size()) {
+        std::sort(&waiting_[0], &waiting_[0] + waiting_.size(), [this](u32 x0, u32 x1) {
+            return sequences_[x0].arrival_ < sequences_[x1].arrival_;
+        });
+    }
+    for(u64 i = 0; i < waiting_.size(); ++i) {
+        Sequence& sequence = sequences_[waiting_[i]];
+        u64 count = sequence.tokens_.size() - sequence.position_;
+        if(0 < token_budget_) {
+            if(token_budget_ <= rows_.size()) {
+                break;
+            }
+            count = (std::min)(count, token_budget_ - rows_.size());
+        }
+        schedule(waiting_[i], count);
+    }
+
+    // the rows more than a batch are run in order, so that a sequence split across batches still sees its own earlier rows
+    u64 owner = 0;
+    for(u64 offset = 0; offset < rows_.size(); offset += batch_size) {
+        const u64 count = (std::min)(batch_size, rows_.size() - offset);
+        f32* logits = model_->forward_batch(&rows_[offset], count);
+        for(u64 t = 0; t < count; ++t) {
+            if(!rows_[offset + t].logits_) {
+                continue;
+            }
+            Sequence& sequence = sequences_[owners_[owner]];
+            finish_step(sequence, sequence.sampler_.sample(logits));
+            logits += vocab_size;
+            ++owner;
+        }
+    }
+    // a chunk in the middle of a prompt samples nothing
+    for(u64 i = 0; i < waiting_.size(); ++i) {
+        Sequence& sequence = sequences_[waiting_[i]];
+        if(State::Prefill == sequence.state_) {
+            sequence.position_ += sequence.scheduled_;
+        }
+    }
+    return active();
 }
 
-bool Vocabulary::tokenToId(s32& id, const String& token) const
+void Scheduler::schedule(u32 index, u64 count)
 {
-    u32 pos = tokenToId_.find(token);
-    if(pos != tokenToId_.end()) {
-        id = tokenToId_.getValue(pos);
-        return true;
+    Sequence& sequence = sequences_[index];
+    u64 end = sequence.position_ + count;
+    u32 last = (sequence.tokens_.size() == end) ? 1 : 0;
+    for(u64 p = sequence.position_; p < end; ++p) {
+        rows_.push_back({&sequence.cache_, p, sequence.tokens_[p], (end == (p + 1)) ? last : 0});
     }
-    return false;
+    if(last) {
+        owners_.push_back(index);
+    }
+    sequence.scheduled_ = count;
 }
 
-bool Vocabulary::tokenToId(s32& id, const std::u8string& token) const
+void Scheduler::finish_step(Sequence& sequence, u32 token)
 {
-    String str;
-    str.len_ = token.length();
-    str.str_ = token.c_str();
-    u32 pos = tokenToId_.find(str);
-    if(pos != tokenToId_.end()) {
-        id = tokenToId_.getValue(pos);
-        return true;
+    sequence.position_ = sequence.tokens_.size();
+    if(sequence.max_tokens_ <= 0) {
+        sequence.state_ = State::Finished;
+        return;
     }
-    return false;
+    sequence.tokens_.push_back(token);
+    u64 num_generated = sequence.tokens_.size() - sequence.prompt_length_;
+    bool full = !sequence.cache_.is_ring() && sequence.cache_.capacity() <= sequence.position_;
+    if(eos_token_ == token || sequence.max_tokens_ <= num_generated || full) {
+        sequence.state_ = State::Finished;
+    } else {
+        sequence.state_ = State::Decode;
+    }
+}
+
+void Scheduler::set_token_budget(u64 token_budget)
+{
+    token_budget_ = token_budget;
+}
+
+u64 Scheduler::token_budget() const
+{
+    return token_budget_;
+}
+
+u64 Scheduler::rows() const
+{
+    return rows_.size();
 }
 
-bool Vocabulary::encode(s32& token, const char8_t* str) const
+u32 Scheduler::active() const
 {
-    assert(nullptr != str);
-    String key;
-    key.len_ = ::strnlen(reinterpret_cast<const char*>(str), 128);
-    key.str_ = str;
-    const s32* id = nullptr;
-    if(tokenToId_.tryGet(key, id)) {
-        token = *id;
-        return true;
+    u32 count = 0;
+    for(u32 i = 0; i < max_sequences_; ++i) {
+        if(State::Prefill == sequences_[i].state_ || State::Decode == sequences_[i].state_) {
+            ++count;
+        }
     }
-    return false;
+    return count;
 }
 
-bool Vocabulary::encode(s32& token, u64 length, const char8_t* str) const
+Scheduler::State Scheduler::state(s32 id) const
 {
-    assert(nullptr != str);
-    String key;
-    key.len_ = length;
-    key.str_ = str;
-    const s32* id = nullptr;
-    if(tokenToId_.tryGet(key, id)) {
-        token = *id;
-        return true;
-    }
-    return false;
+    assert(0 <= id && static_cast<u32>(id) < max_sequences_);
+    return sequences_[id].state_;
 }
 
-//--- Tokenizer
-//-----------------------------------------------------------
-const char8_t* Tokenizer::Pattern = u8R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
-Tokenizer::Tokenizer()
-    : buffer_(nullptr)
+const u32* Scheduler::generated(s32 id, u64& count) const
 {
+    assert(0 <= id && static_cast<u32>(id) < max_sequences_);
+    const Sequence& sequence = sequences_[id];
+    count = sequence.tokens_.size() - sequence.prompt_length_;
+    return 0 < count ? &sequence.tokens_[sequence.prompt_length_] : nullptr;
 }
 
-Tokenizer::Tokenizer(const gguf::GGUF& model_data)
-    : buffer_(nullptr)
-    , vocab_(model_data)
+//--- SpeculativeDecoder
+//-----------------------------------------------------------
+SpeculativeDecoder::SpeculativeDecoder()
+    : duration_(0)
+    , target_(nullptr)
+    , draft_(nullptr)
+    , num_draft_(0)
+    , ngram_size_(0)
+    , indexed_(0)
+    , prompt_length_(0)
+    , position_(0)
+    , draft_position_(0)
+    , drafted_(0)
+    , accepted_(0)
 {
-    buffer_ = (char8_t*)allocate((vocab_.getMaxTokenLength() + 1 + 2) * sizeof(char8_t));
 }
 
-Tokenizer::~Tokenizer()
+SpeculativeDecoder::SpeculativeDecoder(Llama2& target, Llama2& draft, u32 num_draft, f32 temperature, f32 topp, u64 seed)
+    : duration_(0)
+    , target_(&target)
+    , draft_(&draft)
+    , num_draft_(num_draft)
+    , ngram_size_(0)
+    , indexed_(0)
+    , sampler_(static_cast<u32>(target.config().vocab_size_), temperature, topp, seed)
+    , draft_sampler_(static_cast<u32>(target.config().vocab_size_), temperature, topp, seed + 1)
+    , prompt_length_(0)
+    , position_(0)
+    , draft_position_(0)
+    , drafted_(0)
+    , accepted_(0)
+{
+    assert(target.valid() && draft.valid());
+    assert(target.config().vocab_size_ == draft.config().vocab_size_);
+    assert(0 < num_draft_ && num_draft_ < target.batch_size());
+    probabilities_ = Tensor(ggml_type::GGML_TYPE_F32, {num_draft_, target.config().vocab_size_});
+    rows_.reserve(num_draft_ + 1);
+}
+
+SpeculativeDecoder::SpeculativeDecoder(Llama2& target, u32 num_draft, u32 ngram_size, f32 temperature, f32 topp, u64 seed)
+    : duration_(0)
+    , target_(&target)
+    , draft_(nullptr)
+    , num_draft_(num_draft)
+    , ngram_size_(ngram_size)
+    , indexed_(0)
+    , sampler_(static_cast<u32>(target.config().vocab_size_), temperature, topp, seed)
+    , prompt_length_(0)
+    , position_(0)
+    , draft_position_(0)
+    , drafted_(0)
+    , accepted_(0)
 {
-    deallocate(buffer_);
-    buffer_ = nullptr;
+    assert(target.valid());
+    assert(0 < ngram_size_);
+    assert(0 < num_draft_ && num_draft_ < target.batch_size());
+    probabilities_ = Tensor(ggml_type::GGML_TYPE_F32, {num_draft_, target.config().vocab_size_});
+    rows_.reserve(num_draft_ + 1);
 }
 
-Tokenizer::Tokenizer(Tokenizer&& other) noexcept
-    : vocab_(std::move(other.vocab_))
-    , buffer_(other.buffer_)
+SpeculativeDecoder::~SpeculativeDecoder()
 {
-    other.buffer_ = nullptr;
 }
 
-Tokenizer& Tokenizer::operator=(Tokenizer&& other)
+SpeculativeDecoder::SpeculativeDecoder(SpeculativeDecoder&& other)
+    : duration_(0)
+    , target_(other.target_)
+    , draft_(other.draft_)
+    , num_draft_(other.num_draft_)
+    , ngram_size_(other.ngram_size_)
+    , indexed_(other.indexed_)
+    , ngrams_(std::move(other.ngrams_))
+    , sampler_(std::move(other.sampler_))
+    , draft_sampler_(std::move(other.draft_sampler_))
+    , tokens_(std::move(other.tokens_))
+    , rows_(std::move(other.rows_))
+    , prompt_length_(other.prompt_length_)
+    , position_(other.position_)
+    , draft_position_(other.draft_position_)
+    , drafted_(other.drafted_)
+    , accepted_(other.accepted_)
+    , probabilities_(std::move(other.probabilities_))
+{
+    other.target_ = nullptr;
+    other.draft_ = nullptr;
+}
+
+SpeculativeDecoder& SpeculativeDecoder::operator=(SpeculativeDecoder&& other)
 {
     if(this != &other) {
-        deallocate(buffer_);
-        vocab_ = std::move(other.vocab_);
-        buffer_ = other.buffer_;
-
-        other.buffer_ = nullptr;
+        duration_ = 0;
+        target_ = other.target_;
+        draft_ = other.draft_;
+        num_draft_ = other.num_draft_;
+        ngram_size_ = other.ngram_size_;
+        indexed_ = other.indexed_;
+        ngrams_ = std::move(other.ngrams_);
+        sampler_ = std::move(other.sampler_);
+        draft_sampler_ = std::move(other.draft_sampler_);
+        tokens_ = std::move(other.tokens_);
+        rows_ = std::move(other.rows_);
+        prompt_length_ = other.prompt_length_;
+        position_ = other.position_;
+        draft_position_ = other.draft_position_;
+        drafted_ = other.drafted_;
+        accepted_ = other.accepted_;
+        probabilities_ = std::move(other.probabilities_);
+        other.target_ = nullptr;
+        other.draft_ = nullptr;
     }
     return *this;
 }
 
-Array<s32> Tokenizer::tokenize(const std::u8string& text)
+void SpeculativeDecoder::start(const u32* prompt, u64 count)
 {
-    Array<s32> result;
-    symbols_.clear();
-    symbols_.reserve(text.size());
-    rev_merge_.clear();
-    // split string into utf8 chars
-    s32 index = 0;
-    u64 offset = 0;
-    while(offset < text.size()) {
-        Symbol symbol;
-        size_t len = length(text[offset]);
-        symbol.text_ = reinterpret_cast<const char8_t*>(text.c_str()) + offset;
-        symbol.len_ = (std::min)(static_cast<u64>(len), text.size() - offset);
-        offset += symbol.len_;
-        symbol.prev_ = index - 1;
-        symbol.next_ = offset == text.size() ? -1 : index + 1;
-        ++index;
-        symbols_.push_back(symbol);
+    Timer timer(duration_);
+    assert(nullptr != target_);
+    assert(0 < count);
+    tokens_.clear();
+    for(u64 i = 0; i < count; ++i) {
+        tokens_.push_back(prompt[i]);
+    }
+    prompt_length_ = count;
+    f32* logits = target_->prefill(prompt, count, 0);
+    sampler_.distribution(logits);
+    tokens_.push_back(sampler_.sample_distribution(logits));
+    position_ = count;
+    // the draft sees the prompt at the first step
+    draft_position_ = 0;
+    ngrams_.clear();
+    indexed_ = 0;
+    drafted_ = 0;
+    accepted_ = 0;
+}
+
+u64 SpeculativeDecoder::step()
+{
+    Timer timer(duration_);
+    assert(nullptr != target_);
+    const u64 vocab_size = target_->config().vocab_size_;
+    // the last token is not in the caches yet
+    const u64 end = tokens_.size();
+    assert(position_ + 1 == end);
+
+    // proposals never run past the caches
+    u64 k = num_draft_;
+    for(Llama2* model: {target_, draft_}) {
+        if(nullptr != model && !model->cache().is_ring()) {
+            u64 capacity = model->cache().capacity();
+            k = (std::min)(k, end < capacity ? capacity - end : 0);
+        }
     }
-
-    // seed the work queue with all possible 2-character tokens.
-    for(u64 i = 1; i < symbols_.size(); ++i) {
-        try_add_bigram(static_cast<s32>(i - 1), static_cast<s32>(i));
+    if(0 == k) {
+        return 0;
+    }
+
+    KVCache& target_cache = target_->cache();
+    rows_.clear();
+    rows_.push_back({&target_cache, end - 1, tokens_[end - 1], 1});
+    k = (nullptr != draft_) ? propose_draft(k) : propose_lookup(k);
+    const f32* q = probabilities_.data<f32>();
+
+    // the target verifies all the proposals at once
+    target_cache.checkpoint(end, k);
+    f32* logits = target_->forward_batch(&rows_[0], k + 1);
+    u64 n = 0;
+    for(; n < k; ++n) {
+        f32* p = logits + n * vocab_size;
+        const f32* qn = q + n * vocab_size;
+        sampler_.distribution(p);
+        u32 x = rows_[n + 1].token_;
+        if(qn[x] <= p[x] || sampler_.uniform() * qn[x] < p[x]) {
+            tokens_.push_back(x);
+            continue;
+        }
+        // rejected, draw from the residual max(0, p - q)
+        f32 sum = 0.0f;
+        for(u64 v = 0; v < vocab_size; ++v) {
+            p[v] = (std::max)(0.0f, p[v] - qn[v]);
+            sum += p[v];
+        }
+        f32 inv_sum = 1.0f / sum;
+        for(u64 v = 0; v < vocab_size; ++v) {
+            p[v] *= inv_sum;
+        }
+        tokens_.push_back(sampler_.sample_distribution(p));
+        break;
+    }
+    if(k == n) {
+        // all accepted, the last logits give one more
+        f32* p = logits + k * vocab_size;
+        sampler_.distribution(p);
+        tokens_.push_back(sampler_.sample_distribution(p));
     }
+    drafted_ += k;
+    accepted_ += n;
 
-    // keep substituting the highest frequency pairs for as long as we can.
-    while(0 < work_queue_.size()) {
-        Bigram bigram = work_queue_.front();
-        work_queue_.pop_front();
+    // forget the rejected positions
+    position_ = end + n;
+    target_cache.rollback(position_);
+    if(nullptr != draft_) {
+        draft_position_ = end + (std::min)(n, k - 1);
+        draft_->cache().rollback(draft_position_);
+    }
+    return n + 1;
+}
 
-        Symbol& left_sym = symbols_[bigram.left_];
-        Symbol& right_sym = symbols_[bigram.right_];
+u64 SpeculativeDecoder::propose_draft(u64 k)
+{
+    const u64 vocab_size = target_->config().vocab_size_;
+    const u64 end = tokens_.size();
+    KVCache& target_cache = target_->cache();
 
-        // if one of the symbols already got merged, skip it.
-        if(left_sym.len_ == 0
-           || right_sym.len_ == 0
-           || (left_sym.len_ + right_sym.len_) != bigram.size_) {
-            continue;
+    // the draft catches up with the tokens it has not seen, then proposes one by one
+    f32* q = probabilities_.data<f32>();
+    f32* logits = draft_->prefill(&tokens_[draft_position_], end - draft_position_, draft_position_);
+    draft_->cache().checkpoint(end, k - 1);
+    for(u64 i = 0; i < k; ++i) {
+        if(0 < i) {
+            logits = draft_->forward(rows_[i].token_, end + i - 1);
         }
+        f32* qi = q + i * vocab_size;
+        ::memcpy(qi, logits, sizeof(f32) * vocab_size);
+        draft_sampler_.distribution(qi);
+        rows_.push_back({&target_cache, end + i, draft_sampler_.sample_distribution(qi), 1});
+    }
+    return k;
+}
 
-        // merge the right sym into the left one
-        left_sym.len_ += right_sym.len_;
-        right_sym.len_ = 0;
+u64 SpeculativeDecoder::propose_lookup(u64 k)
+{
+    const u64 vocab_size = target_->config().vocab_size_;
+    const u64 end = tokens_.size();
+    KVCache& target_cache = target_->cache();
 
-        // remove the right sym from the chain
-        left_sym.next_ = right_sym.next_;
-        if(0 <= right_sym.next_) {
-            symbols_[right_sym.next_].prev_ = bigram.left_;
+    // index the n-grams which have a following token, the latest occurrence wins
+    for(; (indexed_ + 1) < end; ++indexed_) {
+        for(u32 n = 1; n <= ngram_size_ && n <= (indexed_ + 1); ++n) {
+            u64 key = hash_ngram(indexed_ + 1, n);
+            u32* next = nullptr;
+            if(ngrams_.tryGet(key, next)) {
+                *next = static_cast<u32>(indexed_ + 1);
+            } else {
+                ngrams_.add(key, static_cast<u32>(indexed_ + 1));
+            }
         }
-
-        // find more substitutions
-        try_add_bigram(left_sym.prev_, bigram.left_);
-        try_add_bigram(bigram.left_, left_sym.next_);
     }
 
-    for(s32 i = 0; i != -1; i = symbols_[i].next_) {
-        Symbol& symbol = symbols_[i];
-        resegment(result, symbol);
+    // the longest match proposes what followed it, the proposal is certain for the verification
+    for(u32 n = static_cast<u32>((std::min)(static_cast<u64>(ngram_size_), end)); 0 < n; --n) {
+        u32* next = nullptr;
+        if(!ngrams_.tryGet(hash_ngram(end, n), next)) {
+            continue;
+        }
+        u64 start = *next;
+        u64 count = (std::min)(k, end - start);
+        f32* q = probabilities_.data<f32>();
+        ::memset(q, 0, sizeof(f32) * count * vocab_size);
+        for(u64 i = 0; i < count; ++i) {
+            u32 token = tokens_[start + i];
+            q[i * vocab_size + token] = 1.0f;
+            rows_.push_back({&target_cache, end + i, token, 1});
+        }
+        return count;
     }
-    return result;
+    return 0;
 }
 
-u64 Tokenizer::length(char c)
+u64 SpeculativeDecoder::hash_ngram(u64 end, u32 n) const
 {
-    static const u64 lookup[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
-    return lookup[static_cast<uint8_t>(c) >> 4];
+    assert(n <= end);
+    return wyhash64(sizeof(u32) * n, &tokens_[end - n], n);
 }
 
-s32 Tokenizer::byte_to_token(const Vocabulary& vocab, char8_t c)
+const u32* SpeculativeDecoder::generated(u64& count) const
 {
-    s32 token_id = 0;
-    const std::u8string& str = unicode_byte_to_utf8(c);
-    if(vocab.tokenToId(token_id, str)) {
-        return token_id;
-    }
-    return vocab.getUnknown();
+    count = tokens_.size() - prompt_length_;
+    return 0 < count ? &tokens_[prompt_length_] : nullptr;
 }
 
-void Tokenizer::try_add_bigram(Symbol::index left, Symbol::index right)
+u64 SpeculativeDecoder::drafted() const
 {
-    if(left == -1 || right == -1) {
-        return;
-    }
+    return drafted_;
+}
 
-    u64 size = symbols_[left].len_ + symbols_[right].len_;
-    s32 tokenId = 0;
-    if(vocab_.encode(tokenId, size, symbols_[left].text_)) {
-        return;
-    }
-    if(vocab_.idToTokenSize() <= static_cast<u64>(tokenId)) {
-        return;
-    }
-    const Vocabulary::Token& token = vocab_.idToToken(tokenId);
+u64 SpeculativeDecoder::accepted() const
+{
+    return accepted_;
+}
 
-    Bigram bigram;
-    bigram.left_ = left;
-    bigram.right_ = right;
-    bigram.score_ = token.score_;
-    bigram.size_ = size;
+//--- Generation
+//-----------------------------------------------------------
+Generation::promise_type::promise_type()
+{
+}
 
-    work_queue_.push_back(bigram);
+Generation::promise_type::promise_type(Llama2&, const Tokenizer* tokenizer, const Array<u32>&, const GenerationParams&)
+    : tokenizer_(tokenizer)
+{
+    if(nullptr != tokenizer_) {
+        detokenizer_ = Detokenizer(tokenizer_->vocabulary());
+    }
+}
 
-    // Do we need to support is_unused?
-    String str;
-    str.len_ = size;
-    str.str_ = symbols_[left].text_;
-    rev_merge_.add(str, {left, right});
+Generation Generation::promise_type::get_return_object()
+{
+    return Generation(handle_type::from_promise(*this));
 }
 
-void Tokenizer::resegment(Array<s32>& output, const Symbol& symbol) const
+std::suspend_always Generation::promise_type::yield_value(u32 token) noexcept
 {
-    String text;
-    text.len_ = symbol.len_;
-    text.str_ = symbol.text_;
-    s32 token_id = 0;
-    // Do we need to support is_unused?
-    if(vocab_.tokenToId(token_id, text)) {
-        output.push_back(token_id);
-        return;
+    Clock::time_point now = Clock::now();
+    if(0 == stats_.num_tokens_) {
+        stats_.time_to_first_token_ = std::chrono::duration_cast<std::chrono::microseconds>(now - start_).count();
+    } else {
+        s64 interval = std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count();
+        stats_.inter_token_total_ += interval;
+        stats_.inter_token_max_ = (std::max)(stats_.inter_token_max_, interval);
     }
-    u32 pos = rev_merge_.find(text);
-    if(pos == rev_merge_.end()) {
-        // output any symbols that did not form tokens as bytes.
-        output.reserve(output.size() + symbol.len_);
-        for(u64 i = 0; i < symbol.len_; ++i) {
-            s32 t_token_id = byte_to_token(vocab_, symbol.text_[i]);
-            output.push_back(t_token_id);
-        }
-        return;
+    ++stats_.num_tokens_;
+    last_ = now;
+    token_ = token;
+    if(nullptr != tokenizer_) {
+        text_.clear();
+        detokenizer_.push(text_, static_cast<s32>(token));
     }
-    Pair r = rev_merge_.getValue(pos);
+    return {};
+}
 
-    resegment(output, symbols_[r.left_]);
-    resegment(output, symbols_[r.right_]);
+void Generation::promise_type::return_void() noexcept
+{
+    // EOS or a limit may end the stream in a char, its bytes go out as they are
+    if(nullptr != tokenizer_) {
+        text_.clear();
+        detokenizer_.finish(text_);
+    }
 }
 
-//--- Sampler
-//-----------------------------------------------------------
-Sampler::Sampler()
-    : vocab_size_(0)
-    , temperature_(1.0f)
-    , topp_(0.9f)
-    , probindex_(nullptr)
+void Generation::promise_type::unhandled_exception()
 {
+    // built without exceptions
+    assert(false);
+    ::abort();
 }
 
-Sampler::~Sampler()
+Generation::Generation()
+    : handle_(nullptr)
+    , stats_{}
 {
-    deallocate(probindex_);
-    probindex_ = nullptr;
 }
 
-Sampler::Sampler(Sampler&& other)
-    :vocab_size_(other.vocab_size_)
-    , temperature_(other.temperature_)
-    , topp_(other.topp_)
-    , random_(other.random_)
-    , probindex_(other.probindex_)
+Generation::Generation(handle_type handle)
+    : handle_(handle)
+    , stats_{}
 {
-    other.vocab_size_ = 0;
-    other.probindex_ = nullptr;
 }
 
-Sampler& Sampler::operator=(Sampler&& other)
+Generation::~Generation()
 {
-    if(this != &other) {
-        deallocate(probindex_);
+    cancel();
+}
 
-        vocab_size_ = other.vocab_size_;
-        temperature_ = other.temperature_;
-        topp_ = other.topp_;
-        random_ = other.random_;
-        probindex_ = other.probindex_;
+Generation::Generation(Generation&& other)
+    : handle_(other.handle_)
+    , stats_(other.stats_)
+{
+    other.handle_ = nullptr;
+}
 
-        other.vocab_size_ = 0;
-        other.probindex_ = nullptr;
+Generation& Generation::operator=(Generation&& other)
+{
+    if(this != &other) {
+        cancel();
+        handle_ = other.handle_;
+        stats_ = other.stats_;
+        other.handle_ = nullptr;
     }
     return *this;
 }
 
-u32 Sampler::sample(f32* logits)
+bool Generation::next()
 {
-    assert(nullptr != logits);
-    if(temperature_ <= std::numeric_limits<f32>::epsilon()) {
-        return sample_argmax(vocab_size_, logits);
-    }
-    f32 inv_temperature = 1.0f / temperature_;
-    for(u32 i = 0; i < vocab_size_; ++i) {
-        logits[i] *= inv_temperature;
-    }
-    op::softmax(vocab_size_, logits);
-    f32 coin = random_.frand();
-    if(topp_ <= 0.0f || 1.0f <= topp_) {
-        return sample_mult(vocab_size_, coin, logits);
-    } else {
-        return sample_topp(vocab_size_, topp_, coin, probindex_, logits);
+    if(!handle_ || handle_.done()) {
+        return false;
     }
+    handle_.resume();
+    return !handle_.done();
 }
 
-u32 Sampler::sample_argmax(u32 size, const f32* probabilities)
+u32 Generation::token() const
 {
-    assert(0 < size);
-    u32 max_index = 0;
-    f32 max_p = probabilities[0];
-    for(u32 i = 1; i < size; ++i) {
-        if(max_p < probabilities[i]) {
-            max_index = i;
-            max_p = probabilities[i];
-        }
-    }
-    return max_index;
+    assert(handle_);
+    return handle_.promise().token_;
 }
 
-u32 Sampler::sample_mult(u32 size, f32 coin, const f32* probabilities)
+const std::u8string& Generation::text() const
 {
-    f32 cdf = 0.0f;
-    for(u32 i = 0; i < size; ++i) {
-        cdf += probabilities[i];
-        if(coin < cdf) {
-            return i;
-        }
+    assert(handle_);
+    return handle_.promise().text_;
+}
+
+bool Generation::done() const
+{
+    return !handle_ || handle_.done();
+}
+
+void Generation::cancel()
+{
+    if(handle_) {
+        stats_ = handle_.promise().stats_;
+        handle_.destroy();
+        handle_ = nullptr;
     }
-    return size - 1;
 }
 
-u32 Sampler::sample_topp(u32 size, f32 topp, f32 coin, ProbIndex* probindex, const f32* probabilities)
+const GenerationStats& Generation::stats() const
 {
-    u32 n0 = 0;
-    const f32 cutoff = (1.0f - topp) / (size - 1);
-    for(u32 i = 0; i < size; ++i) {
-        if(cutoff <= probabilities[i]) {
-            probindex[n0].index_ = i;
-            probindex[n0].prob_ = probabilities[i];
-            ++n0;
+    return handle_ ? handle_.promise().stats_ : stats_;
+}
+
+Generation generate(Llama2& model, const Tokenizer*, Array<u32> prompt, GenerationParams params)
+{
+    // the tokenizer is read by the promise, which is made from the arguments
+    assert(model.valid());
+    assert(0 < prompt.size());
+    const Config& config = model.config();
+    KVCache cache(config, params.kv_window_, params.kv_sinks_);
+    Sampler sampler(static_cast<u32>(config.vocab_size_), params.temperature_, params.topp_, params.seed_);
+    // without a ring, the cache holds the prompt and the generated tokens
+    const u64 capacity = cache.is_ring() ? ~0ULL : cache.capacity();
+    if(capacity < prompt.size()) {
+        co_return;
+    }
+
+    // prefill in chunks of the batch size, only the last row needs the logits
+    Array<BatchRow> rows;
+    rows.reserve(model.batch_size());
+    f32* logits = nullptr;
+    u64 position = 0;
+    while(position < prompt.size()) {
+        const u64 count = (std::min)(model.batch_size(), prompt.size() - position);
+        rows.clear();
+        for(u64 t = 0; t < count; ++t) {
+            u32 last = (prompt.size() == (position + t + 1)) ? 1 : 0;
+            rows.push_back({&cache, position + t, prompt[position + t], last});
         }
+        logits = model.forward_batch(&rows[0], count);
+        position += count;
     }
-    std::sort(probindex, probindex + n0, [](const ProbIndex& x0, const ProbIndex& x1) {
-        return x0.prob_ > x1.prob_;
-    });
-    f32 cumulative_prob = 0.0f;
-    u32 end = n0;
-    for(u32 i = 0; i < n0; ++i) {
-        cumulative_prob += probindex[i].prob_;
-        if(topp < cumulative_prob) {
-            end = i + 1;
+
+    // logits are in the buffer of the model shared with other generations, sampled before yielding
+    for(u32 i = 0; i < params.max_tokens_; ++i) {
+        u32 token = sampler.sample(logits);
+        if(params.eos_token_ == token) {
             break;
         }
-    }
-    f32 r = coin * cumulative_prob;
-    f32 cdf = 0.0f;
-    for(u32 i = 0; i < end; ++i) {
-        cdf += probindex[i].prob_;
-        if(r < cdf) {
-            return probindex[i].index_;
+        co_yield token;
+        if(capacity <= position) {
+            break;
         }
+        BatchRow row = {&cache, position, token, 1};
+        logits = model.forward_batch(&row, 1);
+        ++position;
     }
-    return probindex[end - 1].index_;
 }
 
-//--- Llama2
+Generation generate(Llama2& model, Tokenizer& tokenizer, const std::u8string& prompt, const GenerationParams& params)
+{
+    Array<s32> tokens = tokenizer.tokenize(prompt);
+    Array<u32> ids;
+    ids.reserve(tokens.size() + 1);
+    s32 bos = tokenizer.vocabulary().getBOS();
+    if(0 <= bos) {
+        ids.push_back(static_cast<u32>(bos));
+    }
+    for(u64 i = 0; i < tokens.size(); ++i) {
+        ids.push_back(static_cast<u32>(tokens[i]));
+    }
+    return generate(model, &tokenizer, std::move(ids), params);
+}
+
+//--- Scorer
 //-----------------------------------------------------------
-Llama2::Llama2()
+Scorer::Scorer()
+    : duration_(0)
+    , model_(nullptr)
 {
 }
 
-Llama2::Llama2(const Config& config)
-    : config_(config)
+Scorer::Scorer(Llama2& model)
+    : duration_(0)
+    , model_(&model)
 {
+    assert(model.valid());
+    cache_ = KVCache(model.config(), 0, 0);
+    rows_.reserve(model.batch_size());
+    prefix_logits_ = Tensor(ggml_type::GGML_TYPE_F32, {model.config().vocab_size_});
 }
 
-Llama2::Llama2(Llama2&& /*other*/)
+Scorer::~Scorer()
 {
 }
 
-Llama2::~Llama2()
+Scorer::Scorer(Scorer&& other)
+    : duration_(0)
+    , model_(other.model_)
+    , cache_(std::move(other.cache_))
+    , rows_(std::move(other.rows_))
+    , prefix_logits_(std::move(other.prefix_logits_))
 {
+    other.model_ = nullptr;
 }
 
-Llama2& Llama2::operator=(Llama2&& other)
+Scorer& Scorer::operator=(Scorer&& other)
 {
     if(this != &other) {
-        config_ = other.config_;
+        duration_ = 0;
+        model_ = other.model_;
+        cache_ = std::move(other.cache_);
+        rows_ = std::move(other.rows_);
+        prefix_logits_ = std::move(other.prefix_logits_);
+        other.model_ = nullptr;
     }
     return *this;
 }
 
-void Llama2::forward(u32 , u32 )
+bool Scorer::score(f32* log_probs, const u32* tokens, u64 count)
+{
+    assert(nullptr != model_);
+    assert(1 < count);
+    if(cache_.capacity() < count) {
+        return false;
+    }
+    Timer timer(duration_);
+    run(log_probs, tokens, count, 0, nullptr);
+    return true;
+}
+
+bool Scorer::score_candidates(f32* log_probs, const u32* prefix, u64 prefix_count, u64 num_candidates, const u32* const* candidates, const u64* counts)
+{
+    assert(nullptr != model_);
+    assert(0 < prefix_count);
+    for(u64 i = 0; i < num_candidates; ++i) {
+        if(cache_.capacity() < prefix_count + counts[i]) {
+            return false;
+        }
+    }
+    Timer timer(duration_);
+    const u64 vocab_size = model_->config().vocab_size_;
+    // the prefix once, its last logits score the first token of every candidate
+    run(nullptr, prefix, prefix_count, 0, prefix_logits_.data<f32>());
+    for(u64 i = 0; i < num_candidates; ++i) {
+        if(0 == counts[i]) {
+            continue;
+        }
+        log_probs[0] = op::log_prob(vocab_size, prefix_logits_.data<f32>(), candidates[i][0]);
+        // a candidate overwrites the positions after the prefix of the previous one
+        if(1 < counts[i]) {
+            run(log_probs + 1, candidates[i], counts[i], prefix_count, nullptr);
+        }
+        log_probs += counts[i];
+    }
+    return true;
+}
+
+void Scorer::run(f32* log_probs, const u32* tokens, u64 count, u64 position, f32* last_logits)
 {
+    const u64 vocab_size = model_->config().vocab_size_;
+    const u64 batch_size = model_->batch_size();
+    for(u64 chunk = 0; chunk < count; chunk += batch_size) {
+        const u64 size = (std::min)(batch_size, count - chunk);
+        rows_.clear();
+        for(u64 t = 0; t < size; ++t) {
+            // a row predicts the next token, the last one only when its logits are wanted
+            u64 index = chunk + t;
+            u32 logits = (index + 1 < count) ? (nullptr != log_probs ? 1 : 0) : (nullptr != last_logits ? 1 : 0);
+            rows_.push_back({&cache_, position + index, tokens[index], logits});
+        }
+        const f32* logits = model_->forward_batch(&rows_[0], size);
+        for(u64 t = 0; t < size; ++t) {
+            if(!rows_[t].logits_) {
+                continue;
+            }
+            u64 index = chunk + t;
+            if(index + 1 < count) {
+                log_probs[index] = op::log_prob(vocab_size, logits, tokens[index + 1]);
+            } else {
+                ::memcpy(last_logits, logits, sizeof(f32) * vocab_size);
+            }
+            logits += vocab_size;
+        }
+    }
 }
 } // namespace cppgpt
@@ -254,7 +254,7 @@ std::tuple<uint64_t, uint8_t*> read(const char8_t* filepath)
         }
         bool result = s <= 0;
 #else
-        bool result = 1 == fread(dst, size, 1, (FILE*)file);
+        bool result = 1 == fread(data, size, 1, (FILE*)file);
 #endif
         if(!result) {
             delete[] data;
@@ -412,86 +412,142 @@ namespace
         }
     }
 
-    uint64_t get_bits(ggml_type type)
+    /**
+     * @brief Number of weights in a block and bytes of a block, zero for an unknown type
+     */
+    void get_block(uint64_t& block_size, uint64_t& block_bytes, ggml_type type)
     {
+        static constexpr uint64_t QK = 32;
+        static constexpr uint64_t QK_K = 256;
+        struct Layout
+        {
+            uint64_t size_;
+            uint64_t bytes_;
+        };
+        Layout layout = {0, 0};
         switch(type) {
         case ggml_type::GGML_TYPE_F32:
-            return 32;
+            layout = {1, 4};
+            break;
         case ggml_type::GGML_TYPE_F16:
-            return 16;
+            layout = {1, 2};
+            break;
         case ggml_type::GGML_TYPE_Q4_0:
-            return 4;
+            layout = {QK, 2 + QK / 2};
+            break;
         case ggml_type::GGML_TYPE_Q4_1:
-            return 4;
+            layout = {QK, 4 + QK / 2};
+            break;
         case ggml_type::GGML_TYPE_Q5_0:
-            return 5;
+            layout = {QK, 2 + 4 + QK / 2};
+            break;
         case ggml_type::GGML_TYPE_Q5_1:
-            return 5;
+            layout = {QK, 4 + 4 + QK / 2};
+            break;
         case ggml_type::GGML_TYPE_Q8_0:
-            return 8;
+            layout = {QK, 2 + QK};
+            break;
         case ggml_type::GGML_TYPE_Q8_1:
-            return 8;
+            layout = {QK, 4 + QK};
+            break;
         case ggml_type::GGML_TYPE_Q2_K:
-            return 2;
+            layout = {QK_K, 2 * 2 + QK_K / 16 + QK_K / 4};
+            break;
         case ggml_type::GGML_TYPE_Q3_K:
-            return 3;
+            layout = {QK_K, 2 + QK_K / 8 + QK_K / 4 + 12};
+            break;
         case ggml_type::GGML_TYPE_Q4_K:
-            return 4;
+            layout = {QK_K, 2 * 2 + 12 + QK_K / 2};
+            break;
         case ggml_type::GGML_TYPE_Q5_K:
-            return 5;
+            layout = {QK_K, 2 * 2 + 12 + QK_K / 8 + QK_K / 2};
+            break;
         case ggml_type::GGML_TYPE_Q6_K:
-            return 6;
+            layout = {QK_K, QK_K / 2 + QK_K / 4 + QK_K / 16 + 2};
+            break;
         case ggml_type::GGML_TYPE_Q8_K:
-            return 8;
+            layout = {QK_K, 4 + QK_K + 2 * (QK_K / 16)};
+            break;
         case ggml_type::GGML_TYPE_IQ2_XXS:
-            return 2;
+            layout = {QK_K, 2 + QK_K / 4};
+            break;
         case ggml_type::GGML_TYPE_IQ2_XS:
-            return 2;
+            layout = {QK_K, 2 + QK_K / 4 + QK_K / 32};
+            break;
         case ggml_type::GGML_TYPE_IQ3_XXS:
-            return 3;
+            layout = {QK_K, 2 + 3 * (QK_K / 8)};
+            break;
         case ggml_type::GGML_TYPE_IQ1_S:
-            return 1;
+            layout = {QK_K, 2 + QK_K / 8 + QK_K / 16};
+            break;
         case ggml_type::GGML_TYPE_IQ4_NL:
-            return 4;
+            layout = {QK, 2 + QK / 2};
+            break;
         case ggml_type::GGML_TYPE_IQ3_S:
-            return 3;
+            layout = {QK_K, 2 + QK_K / 4 + QK_K / 32 + QK_K / 8 + QK_K / 64};
+            break;
         case ggml_type::GGML_TYPE_IQ2_S:
-            return 2;
+            layout = {QK_K, 2 + QK_K / 4 + QK_K / 32 + QK_K / 32};
+            break;
         case ggml_type::GGML_TYPE_IQ4_XS:
-            return 4;
+            layout = {QK_K, 2 + 2 + QK_K / 64 + QK_K / 2};
+            break;
         case ggml_type::GGML_TYPE_I8:
-            return 8;
+            layout = {1, 1};
+            break;
         case ggml_type::GGML_TYPE_I16:
-            return 16;
+            layout = {1, 2};
+            break;
         case ggml_type::GGML_TYPE_I32:
-            return 32;
+            layout = {1, 4};
+            break;
         case ggml_type::GGML_TYPE_I64:
-            return 64;
+            layout = {1, 8};
+            break;
         case ggml_type::GGML_TYPE_F64:
-            return 64;
+            layout = {1, 8};
+            break;
         case ggml_type::GGML_TYPE_IQ1_M:
-            return 1;
+            layout = {QK_K, QK_K / 8 + QK_K / 16 + QK_K / 32};
+            break;
         default:
             assert(false);
-            return 0;
+            break;
         }
+        block_size = layout.size_;
+        block_bytes = layout.bytes_;
     }
 
-    uint64_t get_tensor_bits(const gguf_tensor_info_t& info, const uint8_t* data)
+    /**
+     * @brief Bytes of a tensor, rows of the innermost dimension in whole blocks
+     * @return false if a row is not whole blocks or the size overflows
+     */
+    bool get_tensor_size(uint64_t& size, const gguf_tensor_info_t& info, const uint8_t* data)
     {
-        uint64_t size = 0;
+        uint64_t block_size = 0;
+        uint64_t block_bytes = 0;
+        get_block(block_size, block_bytes, info.type_);
+        if(block_size <= 0) {
+            return false;
+        }
         const uint64_t* dimensions = reinterpret_cast<const uint64_t*>(data + info.dimensions_);
-        for(uint64_t i = 0; i < info.n_dimensions_; ++i) {
-            size += dimensions[i];
+        uint64_t rows = 1;
+        for(uint64_t i = 1; i < info.n_dimensions_; ++i) {
+            if(0 < dimensions[i] && (UINT64_MAX / dimensions[i]) < rows) {
+                return false;
+            }
+            rows *= dimensions[i];
         }
-        return size * get_bits(info.type_);
-    }
-
-    uint64_t get_tensor_size(const gguf_tensor_info_t& info, const uint8_t* data)
-    {
-        uint64_t size = get_tensor_bits(info, data);
-        size = (size + 7ULL) & (~7ULL);
-        return size;
+        uint64_t columns = 0 < info.n_dimensions_ ? dimensions[0] : 1;
+        if(0 != (columns % block_size)) {
+            return false;
+        }
+        uint64_t row_bytes = (columns / block_size) * block_bytes;
+        if(0 < rows && (UINT64_MAX / rows) < row_bytes) {
+            return false;
+        }
+        size = row_bytes * rows;
+        return true;
     }
 
     uint32_t get_size(gguf_metadata_value_type type)
@@ -586,7 +642,7 @@ Error GGUF::load(const char8_t* filepath)
     if(!validate_metadate(u8"general.architecture", gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_STRING)) {
         return Error::InvalidFormat;
     }
-    if(!validate_metadate(u8"general.quantization_version", gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32)) {
+    if(validate_metadate(u8"general.quantization_version", gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32)) {
         get_metadata_uint32(quantization_version_, u8"general.quantization_version");
     } else {
         quantization_version_ = 0;
@@ -594,23 +650,25 @@ Error GGUF::load(const char8_t* filepath)
     if(validate_metadate(u8"general.alignment", gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32)) {
         get_metadata_uint32(alignment_, u8"general.alignment");
     } else {
-        alignment_ = 4;
+        alignment_ = 32;
     }
     offset = align_offset(offset, alignment_);
+    if(size_ < offset) {
+        return Error::InvalidFormat;
+    }
 
     tensor_data_ = data_ + offset;
 
-    uint64_t total_tensor_size = 0;
+    // tensor offsets are from the start of the tensor data
+    uint64_t tensor_data_size = size_ - offset;
     for(uint64_t i = 0; i < tensor_info_.size(); ++i) {
-        uint64_t tensor_size = get_tensor_size(tensor_info_[i], data_);
-        uint64_t end = tensor_info_[i].offset_ + tensor_size;
-        if(size_ < end) {
+        uint64_t tensor_size = 0;
+        if(!get_tensor_size(tensor_size, tensor_info_[i], data_)) {
+            return Error::InvalidFormat;
+        }
+        if(tensor_data_size < tensor_info_[i].offset_ || (tensor_data_size - tensor_info_[i].offset_) < tensor_size) {
             return Error::InvalidFormat;
         }
-        total_tensor_size += tensor_size;
-    }
-    if(size_ < (offset + total_tensor_size)) {
-        return Error::InvalidFormat;
     }
     return Error::Success;
 }
@@ -808,7 +866,40 @@ const gguf_tensor_info_t& GGUF::getTensor(uint64_t x) const
 const void* GGUF::getTensorData(uint64_t x) const
 {
     const gguf_tensor_info_t& info = tensor_info_[x];
-    return &data_[info.offset_];
+    return &tensor_data_[info.offset_];
+}
+
+GGUFString GGUF::getTensorName(uint64_t x) const
+{
+    const gguf_tensor_info_t& info = tensor_info_[x];
+    GGUFString str;
+    str.length_ = info.name_.length_;
+    str.str_ = reinterpret_cast<const char8_t*>(&data_[info.name_.offset_]);
+    return str;
+}
+
+uint64_t GGUF::getTensorDimension(uint64_t x, uint32_t index) const
+{
+    const gguf_tensor_info_t& info = tensor_info_[x];
+    assert(index < info.n_dimensions_);
+    uint64_t dimension;
+    ::memcpy(&dimension, &data_[info.dimensions_ + sizeof(uint64_t) * index], sizeof(uint64_t));
+    return dimension;
+}
+
+bool GGUF::findTensor(uint64_t& x, const char8_t* name) const
+{
+    assert(nullptr != name);
+    uint64_t len = ::strlen((const char*)name);
+    for(uint64_t i = 0; i < tensor_info_.size(); ++i) {
+        const gguf_tensor_info_t& info = tensor_info_[i];
+        if(len == info.name_.length_
+           && 0 == ::strncmp(reinterpret_cast<const char*>(&data_[info.name_.offset_]), reinterpret_cast<const char*>(name), len)) {
+            x = i;
+            return true;
+        }
+    }
+    return false;
 }
 
 Error GGUF::parse_string(gguf_string_t& str, uintptr_t offset)
@@ -976,7 +1067,7 @@ bool GGUF::get_metadata_uint32(uint32_t& dst, const char8_t* key) const
 {
     assert(nullptr != key);
     const gguf_metadata_kv_t* metadata = get_metadata(key);
-    if(nullptr != metadata || gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32 != metadata->value_type_) {
+    if(nullptr == metadata || gguf_metadata_value_type::GGUF_METADATA_VALUE_TYPE_UINT32 != metadata->value_type_) {
         return false;
     }
     dst = metadata->value_.uint32_;
@@ -0,0 +1,98 @@
+/**
+ * @brief Perplexity of a tokenized corpus
+ *
+ * usage: perplexity model.gguf corpus.bin [context] [batch]
+ * corpus.bin is a sequence of little endian u32 tokens, read in windows of the context length.
+ * Every window is scored independently, its first token has no prediction.
+ */
+#include "cppgpt.h"
+#include "gguf.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+    using namespace cppgpt;
+    if(argc < 3) {
+        ::fprintf(stderr, "usage: %s model.gguf corpus.bin [context] [batch]\n", argv[0]);
+        return 1;
+    }
+    gguf::GGUF model_data;
+    if(gguf::Error::Success != model_data.load(reinterpret_cast<const char8_t*>(argv[1]))) {
+        ::fprintf(stderr, "cannot load %s\n", argv[1]);
+        return 1;
+    }
+    u64 batch_size = 5 <= argc ? ::strtoull(argv[4], nullptr, 10) : 64;
+    Llama2 model(model_data, 0, 0, batch_size);
+    if(!model.valid()) {
+        ::fprintf(stderr, "invalid model %s\n", argv[1]);
+        return 1;
+    }
+    u64 context = model.config().sequence_length_;
+    if(4 <= argc) {
+        context = (std::min)(context, static_cast<u64>(::strtoull(argv[3], nullptr, 10)));
+    }
+    if(context < 2) {
+        ::fprintf(stderr, "context must be 2 or more\n");
+        return 1;
+    }
+    FILE* file = ::fopen(argv[2], "rb");
+    if(nullptr == file) {
+        ::fprintf(stderr, "cannot open %s\n", argv[2]);
+        return 1;
+    }
+
+    Scorer scorer(model);
+    std::vector<u32> tokens(context);
+    std::vector<f32> log_probs(context);
+    const u64 vocab_size = model.config().vocab_size_;
+    f64 nll = 0.0;
+    u64 num_scored = 0;
+    u64 num_tokens = 0;
+    u64 num_windows = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(;;) {
+        // stream a window at a time, the corpus is never held as a whole
+        u64 count = ::fread(tokens.data(), sizeof(u32), context, file);
+        if(count < 2) {
+            break;
+        }
+        for(u64 i = 0; i < count; ++i) {
+            if(vocab_size <= tokens[i]) {
+                ::fprintf(stderr, "token %u out of the vocabulary at %llu\n", tokens[i], static_cast<unsigned long long>(num_tokens + i));
+                ::fclose(file);
+                return 1;
+            }
+        }
+        scorer.score(log_probs.data(), tokens.data(), count);
+        for(u64 i = 0; i + 1 < count; ++i) {
+            nll -= log_probs[i];
+        }
+        num_scored += count - 1;
+        num_tokens += count;
+        ++num_windows;
+
+        f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+        ::fprintf(stderr, "[%llu] tokens %llu, %.1f tokens/s, perplexity %.4f\n",
+                  static_cast<unsigned long long>(num_windows),
+                  static_cast<unsigned long long>(num_tokens),
+                  num_tokens / seconds,
+                  ::exp(nll / num_scored));
+        if(count < context) {
+            break;
+        }
+    }
+    ::fclose(file);
+    if(0 == num_scored) {
+        ::fprintf(stderr, "no tokens to score\n");
+        return 1;
+    }
+    f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+    ::printf("tokens: %llu\n", static_cast<unsigned long long>(num_tokens));
+    ::printf("tokens/s: %.1f\n", num_tokens / seconds);
+    ::printf("perplexity: %.4f\n", ::exp(nll / num_scored));
+    return 0;
+}
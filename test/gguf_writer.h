@@ -0,0 +1,138 @@
+#ifndef INC_TEST_GGUF_WRITER_H_
+#define INC_TEST_GGUF_WRITER_H_
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace test
+{
+/**
+ * @brief Minimal GGUF writer for F32 tensors and metadata of tests
+ */
+class GGUFWriter
+{
+public:
+	void add_u32(const std::string& key, uint32_t value)
+	{
+		add_key(key, 4);
+		write(&value, sizeof(value), metadata_);
+		++num_metadata_;
+	}
+
+	void add_f32(const std::string& key, float value)
+	{
+		add_key(key, 6);
+		write(&value, sizeof(value), metadata_);
+		++num_metadata_;
+	}
+
+	void add_string(const std::string& key, const std::string& value)
+	{
+		add_key(key, 8);
+		write_string(value, metadata_);
+		++num_metadata_;
+	}
+
+	void add_array(const std::string& key, const std::vector<std::string>& values)
+	{
+		add_array_header(key, 8, values.size());
+		for(const std::string& value: values) {
+			write_string(value, metadata_);
+		}
+		++num_metadata_;
+	}
+
+	void add_array(const std::string& key, const std::vector<float>& values)
+	{
+		add_array_header(key, 6, values.size());
+		write(values.data(), sizeof(float) * values.size(), metadata_);
+		++num_metadata_;
+	}
+
+	void add_array(const std::string& key, const std::vector<int32_t>& values)
+	{
+		add_array_header(key, 5, values.size());
+		write(values.data(), sizeof(int32_t) * values.size(), metadata_);
+		++num_metadata_;
+	}
+
+	/**
+	 * @param dimensions ... innermost first
+	 */
+	void add_tensor(const std::string& name, std::vector<uint64_t> dimensions, const std::vector<float>& data)
+	{
+		write_string(name, infos_);
+		uint32_t num_dimensions = static_cast<uint32_t>(dimensions.size());
+		write(&num_dimensions, sizeof(num_dimensions), infos_);
+		write(dimensions.data(), sizeof(uint64_t) * dimensions.size(), infos_);
+		uint32_t type = 0; // F32
+		write(&type, sizeof(type), infos_);
+		uint64_t offset = data_.size();
+		write(&offset, sizeof(offset), infos_);
+		write(data.data(), sizeof(float) * data.size(), data_);
+		while(0 != (data_.size() % 32)) {
+			data_.push_back(0);
+		}
+		++num_tensors_;
+	}
+
+	bool save(const char* filepath) const
+	{
+		std::vector<uint8_t> file;
+		uint32_t magic = 0x46554747UL;
+		uint32_t version = 3;
+		write(&magic, sizeof(magic), file);
+		write(&version, sizeof(version), file);
+		write(&num_tensors_, sizeof(num_tensors_), file);
+		write(&num_metadata_, sizeof(num_metadata_), file);
+		file.insert(file.end(), metadata_.begin(), metadata_.end());
+		file.insert(file.end(), infos_.begin(), infos_.end());
+		while(0 != (file.size() % 32)) {
+			file.push_back(0);
+		}
+		file.insert(file.end(), data_.begin(), data_.end());
+		FILE* f = fopen(filepath, "wb");
+		if(nullptr == f) {
+			return false;
+		}
+		bool result = 1 == fwrite(file.data(), file.size(), 1, f);
+		fclose(f);
+		return result;
+	}
+
+private:
+	static void write(const void* data, size_t size, std::vector<uint8_t>& dst)
+	{
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		dst.insert(dst.end(), p, p + size);
+	}
+
+	static void write_string(const std::string& str, std::vector<uint8_t>& dst)
+	{
+		uint64_t length = str.size();
+		write(&length, sizeof(length), dst);
+		write(str.data(), str.size(), dst);
+	}
+
+	void add_key(const std::string& key, uint32_t type)
+	{
+		write_string(key, metadata_);
+		write(&type, sizeof(type), metadata_);
+	}
+
+	void add_array_header(const std::string& key, uint32_t type, uint64_t size)
+	{
+		add_key(key, 9);
+		write(&type, sizeof(type), metadata_);
+		write(&size, sizeof(size), metadata_);
+	}
+
+	uint64_t num_tensors_ = 0;
+	uint64_t num_metadata_ = 0;
+	std::vector<uint8_t> metadata_;
+	std::vector<uint8_t> infos_;
+	std::vector<uint8_t> data_;
+};
+} // namespace test
+#endif // INC_TEST_GGUF_WRITER_H_
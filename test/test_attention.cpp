@@ -0,0 +1,566 @@
+#include "catch_amalgamated.hpp"
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include "cppgpt.h"
+
+namespace
+{
+	void rope_reference(uint64_t position, uint64_t head_size, uint64_t size, float* x)
+	{
+		for(uint64_t i = 0; i < size; i += 2) {
+			uint64_t head_dim = i % head_size;
+			float freq = 1.0f / ::powf(10000.0f, head_dim / (float)head_size);
+			float value = position * freq;
+			float fcr = ::cosf(value);
+			float fci = ::sinf(value);
+			float v0 = x[i + 0];
+			float v1 = x[i + 1];
+			x[i + 0] = v0 * fcr - v1 * fci;
+			x[i + 1] = v0 * fci + v1 * fcr;
+		}
+	}
+
+	/**
+	 * @brief Angle of a pair at a position with NTK-aware scaling, the base is raised by factor^(dimension/(dimension-2))
+	 */
+	double rope_ntk_angle(uint64_t position, uint64_t pair, uint64_t dimension, double base, double factor)
+	{
+		double scaled_base = base * std::pow(factor, dimension / (dimension - 2.0));
+		return position * std::pow(scaled_base, -2.0 * pair / dimension);
+	}
+
+	/**
+	 * @brief Angle of a pair at a position with YaRN, pairs blend from extrapolation to interpolation between the correction dimensions
+	 */
+	double rope_yarn_angle(uint64_t position, uint64_t pair, uint64_t dimension, uint64_t original_context, double base, double factor, double beta_fast, double beta_slow)
+	{
+		const double pi = 3.14159265358979323846;
+		auto correction_dimension = [&](double beta) {
+			return dimension * std::log(original_context / (beta * 2.0 * pi)) / (2.0 * std::log(base));
+		};
+		double low = (std::max)(0.0, std::floor(correction_dimension(beta_fast)));
+		double high = (std::min)(dimension - 1.0, std::ceil(correction_dimension(beta_slow)));
+		double y = (pair - low) / (std::max)(0.001, high - low);
+		double extrapolation_weight = 1.0 - (std::min)(1.0, (std::max)(0.0, y));
+		double extrapolation = std::pow(base, -2.0 * pair / dimension);
+		double interpolation = extrapolation / factor;
+		return position * (interpolation * (1.0 - extrapolation_weight) + extrapolation * extrapolation_weight);
+	}
+}
+
+TEST_CASE("RotaryEmbedding" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 64;
+	static constexpr uint64_t Heads = 8;
+	static constexpr uint64_t KVHeads = 2;
+	static constexpr uint64_t Positions = 512;
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+
+	RotaryEmbedding rope(RotaryEmbedding::default_parameters(), HeadSize, Positions);
+	CHECK(HeadSize == rope.dimension());
+	CHECK(Positions == rope.max_positions());
+	for(uint64_t position: {0ULL, 1ULL, 17ULL, 511ULL}) {
+		std::vector<float> q(Heads * HeadSize);
+		std::vector<float> k(KVHeads * HeadSize);
+		for(float& x: q) {
+			x = distribution(engine);
+		}
+		for(float& x: k) {
+			x = distribution(engine);
+		}
+		std::vector<float> q_ref = q;
+		std::vector<float> k_ref = k;
+		rope_reference(position, HeadSize, q_ref.size(), q_ref.data());
+		rope_reference(position, HeadSize, k_ref.size(), k_ref.data());
+		rope.forward(position, Heads, q.data(), KVHeads, k.data());
+		for(uint64_t i = 0; i < q.size(); ++i) {
+			CHECK(std::abs(q[i] - q_ref[i]) < 1.0e-3f);
+		}
+		for(uint64_t i = 0; i < k.size(); ++i) {
+			CHECK(std::abs(k[i] - k_ref[i]) < 1.0e-3f);
+		}
+	}
+
+	// linear scaling by 4 equals to a quarter of the position
+	RotaryEmbedding::Parameters parameters = RotaryEmbedding::default_parameters();
+	parameters.scaling_ = RotaryEmbedding::Scaling::Linear;
+	parameters.scaling_factor_ = 4.0f;
+	RotaryEmbedding linear(parameters, HeadSize, Positions);
+	for(uint64_t i = 0; i < HeadSize; ++i) {
+		CHECK(std::abs(linear.cos(400)[i] - rope.cos(100)[i]) < 1.0e-5f);
+		CHECK(std::abs(linear.sin(400)[i] - rope.sin(100)[i]) < 1.0e-5f);
+	}
+
+	// NTK-aware scaling keeps the highest frequency and scales the lowest one like linear
+	parameters = RotaryEmbedding::default_parameters();
+	parameters.scaling_ = RotaryEmbedding::Scaling::NTK;
+	parameters.scaling_factor_ = 4.0f;
+	RotaryEmbedding ntk(parameters, HeadSize, Positions);
+	for(uint64_t position: {0ULL, 1ULL, 17ULL, 400ULL, 511ULL}) {
+		CHECK(std::abs(ntk.cos(position)[0] - rope.cos(position)[0]) < 1.0e-5f);
+		CHECK(std::abs(ntk.cos(position)[HeadSize - 2] - linear.cos(position)[HeadSize - 2]) < 1.0e-4f);
+		CHECK(std::abs(ntk.sin(position)[HeadSize - 2] - linear.sin(position)[HeadSize - 2]) < 1.0e-4f);
+		for(uint64_t i = 0; i < HeadSize; i += 2) {
+			double angle = rope_ntk_angle(position, i >> 1, HeadSize, 10000.0, 4.0);
+			CHECK(std::abs(ntk.cos(position)[i] - std::cos(angle)) < 1.0e-4);
+			CHECK(std::abs(ntk.sin(position)[i] - std::sin(angle)) < 1.0e-4);
+			CHECK(ntk.cos(position)[i] == ntk.cos(position)[i + 1]);
+			CHECK(ntk.sin(position)[i] == ntk.sin(position)[i + 1]);
+		}
+	}
+
+	// the exponent uses the rotated dimensions, not the head size
+	parameters.dimension_ = 32;
+	RotaryEmbedding ntk_partial(parameters, HeadSize, Positions);
+	CHECK(32 == ntk_partial.dimension());
+	for(uint64_t i = 0; i < 32; i += 2) {
+		double angle = rope_ntk_angle(100, i >> 1, 32, 10000.0, 4.0);
+		CHECK(std::abs(ntk_partial.cos(100)[i] - std::cos(angle)) < 1.0e-4);
+		CHECK(std::abs(ntk_partial.sin(100)[i] - std::sin(angle)) < 1.0e-4);
+	}
+	for(uint64_t i = 32; i < HeadSize; ++i) {
+		CHECK(1.0f == ntk_partial.cos(100)[i]);
+		CHECK(0.0f == ntk_partial.sin(100)[i]);
+	}
+
+	// YaRN, 64 dimensions from a context of 256 give correction dimensions floor(0.839) = 0 and ceil(12.88) = 13
+	parameters = RotaryEmbedding::default_parameters();
+	parameters.scaling_ = RotaryEmbedding::Scaling::YaRN;
+	parameters.scaling_factor_ = 4.0f;
+	parameters.original_context_ = 256;
+	RotaryEmbedding yarn(parameters, HeadSize, Positions);
+	const float mscale = 1.0f + 0.1f * std::log(4.0f);
+	CHECK(std::abs(yarn.cos(0)[0] - mscale) < 1.0e-6f);
+	CHECK(std::abs(yarn.sin(0)[0]) < 1.0e-6f);
+	for(uint64_t position: {0ULL, 1ULL, 17ULL, 400ULL, 511ULL}) {
+		// the first pair extrapolates, pairs from the upper correction dimension interpolate
+		CHECK(std::abs(yarn.cos(position)[0] - mscale * rope.cos(position)[0]) < 1.0e-4f);
+		CHECK(std::abs(yarn.sin(position)[0] - mscale * rope.sin(position)[0]) < 1.0e-4f);
+		for(uint64_t i = 26; i < HeadSize; i += 2) {
+			CHECK(std::abs(yarn.cos(position)[i] - mscale * linear.cos(position)[i]) < 1.0e-4f);
+			CHECK(std::abs(yarn.sin(position)[i] - mscale * linear.sin(position)[i]) < 1.0e-4f);
+		}
+		for(uint64_t i = 0; i < HeadSize; i += 2) {
+			double angle = rope_yarn_angle(position, i >> 1, HeadSize, 256, 10000.0, 4.0, 32.0, 1.0);
+			CHECK(std::abs(yarn.cos(position)[i] - mscale * std::cos(angle)) < 1.0e-4);
+			CHECK(std::abs(yarn.sin(position)[i] - mscale * std::sin(angle)) < 1.0e-4);
+		}
+	}
+	// pairs on the ramp are strictly between both frequencies
+	for(uint64_t i = 2; i < 26; i += 2) {
+		double extrapolation = std::pow(10000.0, -static_cast<double>(i) / HeadSize);
+		double angle = std::atan2(yarn.sin(1)[i], yarn.cos(1)[i]);
+		CHECK(extrapolation / 4.0 < angle);
+		CHECK(angle < extrapolation);
+	}
+}
+
+namespace
+{
+	void attention_reference(
+		uint64_t head_size,
+		uint64_t num_heads,
+		uint64_t num_kv_heads,
+		uint64_t length,
+		float* output,
+		const float* query,
+		const float* keys,
+		const float* values)
+	{
+		uint64_t kv_dim = head_size * num_kv_heads;
+		uint64_t kv_mul = num_heads / num_kv_heads;
+		std::vector<float> scores(length);
+		for(uint64_t h = 0; h < num_heads; ++h) {
+			const float* q = query + h * head_size;
+			float max_score = -1.0e30f;
+			for(uint64_t t = 0; t < length; ++t) {
+				const float* k = keys + t * kv_dim + (h / kv_mul) * head_size;
+				float score = 0.0f;
+				for(uint64_t i = 0; i < head_size; ++i) {
+					score += q[i] * k[i];
+				}
+				scores[t] = score / std::sqrt(static_cast<float>(head_size));
+				max_score = (std::max)(max_score, scores[t]);
+			}
+			float sum = 0.0f;
+			for(uint64_t t = 0; t < length; ++t) {
+				scores[t] = std::exp(scores[t] - max_score);
+				sum += scores[t];
+			}
+			float* o = output + h * head_size;
+			for(uint64_t i = 0; i < head_size; ++i) {
+				o[i] = 0.0f;
+			}
+			for(uint64_t t = 0; t < length; ++t) {
+				const float* v = values + t * kv_dim + (h / kv_mul) * head_size;
+				for(uint64_t i = 0; i < head_size; ++i) {
+					o[i] += scores[t] / sum * v[i];
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Same steps as SelfAttention::forward after the cache is updated
+	 */
+	void cached_attention(
+		const cppgpt::KVCache& cache,
+		uint64_t layer,
+		uint64_t num_heads,
+		uint64_t position,
+		const cppgpt::RotaryEmbedding* rope,
+		float* output,
+		const float* query)
+	{
+		using namespace cppgpt;
+		uint64_t head_size = cache.head_size();
+		uint64_t group_size = num_heads / cache.num_kv_heads();
+		uint64_t capacity = cache.capacity();
+		uint64_t length = cache.length(position);
+		KVCache::Segment segments[KVCache::MaxSegments];
+		uint32_t num_segments = cache.segments(segments, position);
+		std::vector<float> scores(num_heads * capacity);
+		for(uint64_t g = 0; g < cache.num_kv_heads(); ++g) {
+			uint64_t head_offset = g * group_size * head_size;
+			float* s = scores.data() + g * group_size * capacity;
+			uint64_t index = 0;
+			for(uint32_t i = 0; i < num_segments; ++i) {
+				const float* keys = cache.key(layer, g, segments[i].slot_);
+				if(KVCache::Layout::TransposedKey == cache.layout()) {
+					op::attention_scores_transposed(head_size, group_size, segments[i].count_, s + index, capacity, query + head_offset, keys, cache.key_dimension_stride(), rope, index);
+				} else {
+					op::attention_scores(head_size, group_size, segments[i].count_, s + index, capacity, query + head_offset, keys, cache.key_stride(), rope, index);
+				}
+				index += segments[i].count_;
+			}
+			for(uint64_t h = 0; h < group_size; ++h) {
+				op::softmax(length, s + h * capacity);
+			}
+			float* o = output + head_offset;
+			std::fill_n(o, group_size * head_size, 0.0f);
+			index = 0;
+			for(uint32_t i = 0; i < num_segments; ++i) {
+				op::attention_values(head_size, group_size, segments[i].count_, o, s + index, capacity, cache.value(layer, g, segments[i].slot_), cache.value_stride());
+				index += segments[i].count_;
+			}
+		}
+	}
+}
+
+TEST_CASE("GroupedQueryAttention" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 36;
+	static constexpr uint64_t Heads = 32;
+	static constexpr uint64_t KVHeads = 4;
+	static constexpr uint64_t Length = 97;
+	static constexpr uint64_t KVDim = HeadSize * KVHeads;
+	static constexpr uint64_t GroupSize = Heads / KVHeads;
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<float> query(Heads * HeadSize);
+	std::vector<float> keys(Length * KVDim);
+	std::vector<float> values(Length * KVDim);
+	for(std::vector<float>* v: {&query, &keys, &values}) {
+		for(float& x: *v) {
+			x = distribution(engine);
+		}
+	}
+	std::vector<float> expected(Heads * HeadSize);
+	attention_reference(HeadSize, Heads, KVHeads, Length, expected.data(), query.data(), keys.data(), values.data());
+
+	std::vector<float> output(Heads * HeadSize);
+	std::vector<float> scores(Heads * Length);
+	for(uint64_t g = 0; g < KVHeads; ++g) {
+		uint64_t head_offset = g * GroupSize * HeadSize;
+		op::attention_gqa(
+			HeadSize,
+			GroupSize,
+			Length,
+			output.data() + head_offset,
+			query.data() + head_offset,
+			keys.data() + g * HeadSize,
+			KVDim,
+			values.data() + g * HeadSize,
+			KVDim,
+			scores.data() + g * GroupSize * Length,
+			Length);
+	}
+	for(uint64_t i = 0; i < output.size(); ++i) {
+		CHECK(std::abs(output[i] - expected[i]) < 1.0e-4f);
+	}
+}
+
+TEST_CASE("KVCache" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 16;
+	static constexpr uint64_t Heads = 4;
+	static constexpr uint64_t KVHeads = 2;
+	static constexpr uint64_t KVDim = HeadSize * KVHeads;
+	static constexpr uint64_t Window = 8;
+	static constexpr uint64_t Sinks = 2;
+	static constexpr uint64_t Positions = 30;
+	Config config = {HeadSize * Heads, 0, 1, Heads, KVHeads, 0, 64};
+
+	KVCache linear(config);
+	CHECK(64 == linear.capacity());
+	CHECK_FALSE(linear.is_ring());
+	CHECK(17 == linear.slot(17));
+	CHECK(18 == linear.length(17));
+
+	KVCache cache(config, Window, Sinks);
+	CHECK(Window + Sinks == cache.capacity());
+	CHECK(cache.is_ring());
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<float> keys(Positions * KVDim);
+	std::vector<float> values(Positions * KVDim);
+	for(std::vector<float>* v: {&keys, &values}) {
+		for(float& x: *v) {
+			x = distribution(engine);
+		}
+	}
+	for(uint64_t p = 0; p < Positions; ++p) {
+		cache.store(0, cache.slot(p), keys.data() + p * KVDim, values.data() + p * KVDim);
+	}
+
+	// sinks stay, then the last Window positions in order
+	uint64_t position = Positions - 1;
+	std::vector<uint64_t> visible = {0, 1};
+	for(uint64_t p = Positions - Window; p < Positions; ++p) {
+		visible.push_back(p);
+	}
+	REQUIRE(visible.size() == cache.length(position));
+	KVCache::Segment segments[KVCache::MaxSegments];
+	uint32_t num_segments = cache.segments(segments, position);
+	uint64_t index = 0;
+	for(uint32_t i = 0; i < num_segments; ++i) {
+		for(uint64_t j = 0; j < segments[i].count_; ++j, ++index) {
+			CHECK(keys[visible[index] * KVDim] == *cache.key(0, 0, segments[i].slot_ + j));
+		}
+	}
+	CHECK(visible.size() == index);
+
+	// keys are rotated by the index in the cache
+	RotaryEmbedding rope(RotaryEmbedding::default_parameters(), HeadSize, config.sequence_length_);
+	uint64_t length = visible.size();
+	std::vector<float> query(Heads * HeadSize);
+	for(float& x: query) {
+		x = distribution(engine);
+	}
+	std::vector<float> rotated_keys(length * KVDim);
+	std::vector<float> gathered_values(length * KVDim);
+	for(uint64_t t = 0; t < length; ++t) {
+		for(uint64_t h = 0; h < KVHeads; ++h) {
+			rope.rotate(t, rotated_keys.data() + t * KVDim + h * HeadSize, keys.data() + visible[t] * KVDim + h * HeadSize);
+		}
+		std::copy_n(values.data() + visible[t] * KVDim, KVDim, gathered_values.data() + t * KVDim);
+	}
+	std::vector<float> expected(Heads * HeadSize);
+	attention_reference(HeadSize, Heads, KVHeads, length, expected.data(), query.data(), rotated_keys.data(), gathered_values.data());
+
+	std::vector<float> output(Heads * HeadSize);
+	cached_attention(cache, 0, Heads, position, &rope, output.data(), query.data());
+	for(uint64_t i = 0; i < output.size(); ++i) {
+		CHECK(std::abs(output[i] - expected[i]) < 1.0e-4f);
+	}
+}
+
+TEST_CASE("KVCacheSnapshot" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 8;
+	static constexpr uint64_t Heads = 4;
+	static constexpr uint64_t KVHeads = 2;
+	static constexpr uint64_t KVDim = HeadSize * KVHeads;
+	static constexpr uint64_t Positions = 21;
+	Config config = {HeadSize * Heads, 0, 2, Heads, KVHeads, 0, 32};
+	const char8_t* filepath = u8"kvcache_snapshot.bin";
+
+	KVCache cache(config, 12, 4);
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<float> key(KVDim);
+	std::vector<float> value(KVDim);
+	for(uint64_t p = 0; p < Positions; ++p) {
+		for(uint64_t layer = 0; layer < config.num_layers_; ++layer) {
+			for(uint64_t i = 0; i < KVDim; ++i) {
+				key[i] = distribution(engine);
+				value[i] = distribution(engine);
+			}
+			cache.store(layer, cache.slot(p), key.data(), value.data());
+		}
+	}
+	Sampler sampler;
+	REQUIRE(cache.save(filepath, Positions, sampler));
+
+	KVCache restored(config, 12, 4);
+	Sampler restored_sampler;
+	uint64_t position = 0;
+	REQUIRE(restored.load(filepath, position, restored_sampler));
+	CHECK(Positions == position);
+	CHECK(sampler.state().random_ == restored_sampler.state().random_);
+	for(uint64_t layer = 0; layer < config.num_layers_; ++layer) {
+		for(uint64_t slot = 0; slot < cache.capacity(); ++slot) {
+			for(uint64_t i = 0; i < KVDim; ++i) {
+				CHECK(cache.key(layer, 0, slot)[i] == restored.key(layer, 0, slot)[i]);
+				CHECK(cache.value(layer, 0, slot)[i] == restored.value(layer, 0, slot)[i]);
+			}
+		}
+	}
+
+	// the shape should match
+	KVCache other(config);
+	CHECK_FALSE(other.load(filepath, position, restored_sampler));
+	std::remove(reinterpret_cast<const char*>(filepath));
+}
+
+TEST_CASE("KVCacheLayout" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 32;
+	static constexpr uint64_t Heads = 8;
+	static constexpr uint64_t KVHeads = 2;
+	static constexpr uint64_t KVDim = HeadSize * KVHeads;
+	static constexpr uint64_t Positions = 45;
+	Config config = {HeadSize * Heads, 0, 2, Heads, KVHeads, 0, 64};
+	RotaryEmbedding rope(RotaryEmbedding::default_parameters(), HeadSize, config.sequence_length_);
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<float> keys(config.num_layers_ * Positions * KVDim);
+	std::vector<float> values(config.num_layers_ * Positions * KVDim);
+	std::vector<float> query(Heads * HeadSize);
+	for(std::vector<float>* v: {&keys, &values, &query}) {
+		for(float& x: *v) {
+			x = distribution(engine);
+		}
+	}
+
+	for(uint64_t window: {0ULL, 19ULL}) {
+		const RotaryEmbedding* key_rope = 0 < window ? &rope : nullptr;
+		std::vector<float> expected(Heads * HeadSize);
+		for(KVCache::Layout layout: {KVCache::Layout::PositionMajor, KVCache::Layout::HeadMajor, KVCache::Layout::TransposedKey}) {
+			KVCache cache(config, window, 3, layout);
+			for(uint64_t layer = 0; layer < config.num_layers_; ++layer) {
+				for(uint64_t p = 0; p < Positions; ++p) {
+					const float* k = keys.data() + (layer * Positions + p) * KVDim;
+					const float* v = values.data() + (layer * Positions + p) * KVDim;
+					cache.store(layer, cache.slot(p), k, v);
+				}
+			}
+			std::vector<float> key(KVDim);
+			std::vector<float> value(KVDim);
+			cache.fetch(1, cache.slot(Positions - 1), key.data(), value.data());
+			CHECK(std::equal(key.begin(), key.end(), keys.begin() + (2 * Positions - 1) * KVDim));
+			CHECK(std::equal(value.begin(), value.end(), values.begin() + (2 * Positions - 1) * KVDim));
+
+			std::vector<float> output(Heads * HeadSize);
+			cached_attention(cache, 1, Heads, Positions - 1, key_rope, output.data(), query.data());
+			if(KVCache::Layout::PositionMajor == layout) {
+				expected = output;
+				continue;
+			}
+			for(uint64_t i = 0; i < output.size(); ++i) {
+				CHECK(std::abs(output[i] - expected[i]) < 1.0e-4f);
+			}
+		}
+	}
+}
+
+TEST_CASE("KVCacheRollback" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 8;
+	static constexpr uint64_t KVHeads = 2;
+	static constexpr uint64_t KVDim = HeadSize * KVHeads;
+	static constexpr uint64_t Layers = 2;
+	static constexpr uint64_t Positions = 12;
+	Config config = {HeadSize * KVHeads, 0, Layers, KVHeads, KVHeads, 0, 32};
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<float> data(2 * Positions * KVDim);
+	for(float& x: data) {
+		x = distribution(engine);
+	}
+	auto key = [&](uint64_t p) { return data.data() + p * KVDim; };
+	auto value = [&](uint64_t p) { return data.data() + (Positions + p) * KVDim; };
+
+	for(KVCache::Layout layout: {KVCache::Layout::HeadMajor, KVCache::Layout::TransposedKey}) {
+		KVCache cache(config, 4, 1, layout);
+		for(uint64_t p = 0; p < 8; ++p) {
+			for(uint64_t l = 0; l < Layers; ++l) {
+				cache.store(l, cache.slot(p), key(p), value(p));
+			}
+		}
+		// speculate 8, 9 and 10, then keep only 8
+		cache.checkpoint(8, 3);
+		for(uint64_t p = 8; p < 11; ++p) {
+			for(uint64_t l = 0; l < Layers; ++l) {
+				cache.store(l, cache.slot(p), key(p), value(p));
+			}
+		}
+		cache.rollback(9);
+
+		// visible from 8 are the sink and 5 to 8, as if 9 and 10 were never stored
+		std::vector<float> k(KVDim);
+		std::vector<float> v(KVDim);
+		for(uint64_t p: {0, 5, 6, 7, 8}) {
+			for(uint64_t l = 0; l < Layers; ++l) {
+				cache.fetch(l, cache.slot(p), k.data(), v.data());
+				CHECK(0 == memcmp(k.data(), key(p), sizeof(float) * KVDim));
+				CHECK(0 == memcmp(v.data(), value(p), sizeof(float) * KVDim));
+			}
+		}
+	}
+
+	// a whole cache has nothing to restore
+	KVCache linear(config);
+	linear.checkpoint(3, 4);
+	linear.rollback(4);
+	CHECK(32 == linear.capacity());
+}
+
+TEST_CASE("KVCacheLayoutBenchmark", "[.][benchmark]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t HeadSize = 128;
+	static constexpr uint64_t Heads = 32;
+	static constexpr uint64_t KVHeads = 8;
+	static constexpr uint64_t KVDim = HeadSize * KVHeads;
+	std::mt19937 engine;
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<float> query(Heads * HeadSize);
+	std::vector<float> key(KVDim);
+	std::vector<float> value(KVDim);
+	for(std::vector<float>* v: {&query, &key, &value}) {
+		for(float& x: *v) {
+			x = distribution(engine);
+		}
+	}
+	std::vector<float> output(Heads * HeadSize);
+
+	for(uint64_t length: {512ULL, 2048ULL, 8192ULL}) {
+		Config config = {HeadSize * Heads, 0, 1, Heads, KVHeads, 0, length};
+		for(KVCache::Layout layout: {KVCache::Layout::PositionMajor, KVCache::Layout::HeadMajor, KVCache::Layout::TransposedKey}) {
+			KVCache cache(config, 0, 0, layout);
+			for(uint64_t p = 0; p < length; ++p) {
+				cache.store(0, p, key.data(), value.data());
+			}
+			static const char* names[] = {"position major", "head major", "transposed key"};
+			std::string name = std::string(names[static_cast<uint32_t>(layout)]) + " " + std::to_string(length);
+			BENCHMARK(name.c_str())
+			{
+				cached_attention(cache, 0, Heads, length - 1, nullptr, output.data(), query.data());
+				return output[0];
+			};
+		}
+	}
+}
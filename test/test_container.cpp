@@ -1,8 +1,10 @@
 #include "catch_amalgamated.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <random>
 #include <string>
 #include <iostream>
+#include <vector>
 #include "cppgpt.h"
 
 TEST_CASE("PriorityQueue" "[CPPGPT]")
@@ -34,3 +36,45 @@ TEST_CASE("PriorityQueue" "[CPPGPT]")
     }
 }
 
+
+TEST_CASE("PriorityQueueHeap" "[CPPGPT]")
+{
+    using namespace cppgpt;
+    struct Item
+    {
+        uint32_t key_;
+        uint32_t order_;
+    };
+    // smaller key first, then earlier order
+    struct Comparator
+    {
+        bool operator()(const Item& x0, const Item& x1) const
+        {
+            return (x0.key_ > x1.key_) || (x0.key_ == x1.key_ && x0.order_ > x1.order_);
+        }
+    };
+    std::mt19937 engine;
+    PriorityQueue<Item, Comparator> items;
+    std::vector<Item> expected;
+    uint32_t order = 0;
+    // pushes and pops interleaved over many expansions
+    for(uint32_t round = 0; round < 200; ++round) {
+        for(uint32_t i = 0; i < 100; ++i) {
+            Item item = {static_cast<uint32_t>(engine() % 50), order++};
+            items.push_back(item);
+            expected.push_back(item);
+        }
+        for(uint32_t i = 0; i < 60; ++i) {
+            auto best = std::min_element(expected.begin(), expected.end(), [](const Item& x0, const Item& x1) {
+                return x0.key_ < x1.key_ || (x0.key_ == x1.key_ && x0.order_ < x1.order_);
+            });
+            REQUIRE(best->key_ == items.front().key_);
+            REQUIRE(best->order_ == items.front().order_);
+            items.pop_front();
+            expected.erase(best);
+        }
+    }
+    CHECK(expected.size() == items.size());
+    items.clear();
+    CHECK(0 == items.size());
+}
@@ -1,8 +1,10 @@
 #include "catch_amalgamated.hpp"
+#include <cstdio>
 #include <vector>
 #include <random>
 #include "gguf.h"
 #include "cppgpt.h"
+#include "gguf_writer.h"
 
 TEST_CASE("Load GGUF" "[GGUF]")
 {
@@ -12,6 +14,43 @@ TEST_CASE("Load GGUF" "[GGUF]")
 	CHECK(gguf::Error::Success == result);
 }
 
+TEST_CASE("Truncated GGUF" "[GGUF]")
+{
+	using namespace gguf;
+	const char* filepath = "test_truncated.gguf";
+	test::GGUFWriter writer;
+	writer.add_string("general.architecture", "llama");
+	writer.add_tensor("a.weight", {8, 4}, std::vector<float>(32, 1.0f));
+	writer.add_tensor("b.weight", {16, 16}, std::vector<float>(256, 2.0f));
+	REQUIRE(writer.save(filepath));
+	{
+		GGUF gguf;
+		REQUIRE(Error::Success == gguf.load(reinterpret_cast<const char8_t*>(filepath)));
+		CHECK(2 == gguf.getNumTensors());
+	}
+
+	// the last rows of b.weight are cut off
+	std::vector<uint8_t> bytes;
+	{
+		FILE* file = fopen(filepath, "rb");
+		REQUIRE(nullptr != file);
+		int c;
+		while(EOF != (c = fgetc(file))) {
+			bytes.push_back(static_cast<uint8_t>(c));
+		}
+		fclose(file);
+	}
+	FILE* file = fopen(filepath, "wb");
+	REQUIRE(nullptr != file);
+	REQUIRE(1 == fwrite(bytes.data(), bytes.size() - 256, 1, file));
+	fclose(file);
+	{
+		GGUF gguf;
+		CHECK(Error::InvalidFormat == gguf.load(reinterpret_cast<const char8_t*>(filepath)));
+	}
+	std::remove(filepath);
+}
+
 #if 0
 TEST_CASE("Load Vocab" "[GGUF]")
 {
@@ -97,3 +97,101 @@ TEST_CASE("HashMap" "[CPPGPT]")
 	}
 }
 
+
+TEST_CASE("HashMapClear" "[CPPGPT]")
+{
+	std::mt19937 engine;
+	cppgpt::HashMap<std::string, uint32_t> hashMap(16);
+	// a map reused after clear, as the tokenizer does for every text
+	for(uint32_t round = 0; round < 8; ++round) {
+		std::vector<std::string> keys;
+		for(uint32_t i = 0; i < 100; ++i) {
+			std::string str = random_string(engine, 3, 8);
+			if(std::find(keys.begin(), keys.end(), str) == keys.end()) {
+				keys.push_back(str);
+			}
+		}
+		for(uint32_t i = 0; i < keys.size(); ++i) {
+			hashMap.add(keys[i], i);
+		}
+		CHECK(keys.size() == hashMap.size());
+		for(uint32_t i = 0; i < keys.size(); ++i) {
+			uint32_t pos = hashMap.find(keys[i]);
+			REQUIRE(pos != hashMap.end());
+			CHECK(i == hashMap.getValue(pos));
+		}
+		hashMap.clear();
+		CHECK(0 == hashMap.size());
+		for(const std::string& key: keys) {
+			CHECK(hashMap.find(key) == hashMap.end());
+		}
+	}
+}
+
+TEST_CASE("MinimalPerfectHash" "[CPPGPT]")
+{
+	std::mt19937_64 engine(48);
+	for(uint64_t size: {0ULL, 1ULL, 5ULL, 1000ULL, 150000ULL}) {
+		std::vector<uint64_t> hashes;
+		for(uint64_t i = 0; i < size; ++i) {
+			hashes.push_back(engine());
+		}
+		cppgpt::MinimalPerfectHash hash;
+		REQUIRE(hash.build(hashes.size(), hashes.data()));
+		CHECK(size == hash.size());
+		// a bijection to [0, size)
+		std::vector<uint8_t> taken(size, 0);
+		for(uint64_t h: hashes) {
+			uint64_t slot = hash(h);
+			REQUIRE(slot < size);
+			CHECK(0 == taken[slot]);
+			taken[slot] = 1;
+		}
+	}
+
+	std::vector<uint64_t> duplicated = {1, 2, 3, 2};
+	cppgpt::MinimalPerfectHash hash;
+	CHECK_FALSE(hash.build(duplicated.size(), duplicated.data()));
+}
+
+TEST_CASE("FlatTable" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	std::mt19937_64 engine(50);
+	for(uint32_t size: {0U, 1U, 5U, 1000U}) {
+		HashMap<u64, u32> map;
+		std::vector<uint64_t> keys;
+		for(uint32_t i = 0; i < size; ++i) {
+			keys.push_back(engine());
+			map.add(keys.back(), i);
+		}
+		FlatTable<u32> table;
+		REQUIRE(table.build(map));
+		CHECK(size == table.size());
+		for(uint32_t i = 0; i < size; ++i) {
+			const u32* value = table.find(keys[i]);
+			REQUIRE(nullptr != value);
+			CHECK(i == *value);
+		}
+		// a key out of the table finds another key in its slot
+		for(uint32_t i = 0; i < 100; ++i) {
+			uint64_t key = engine();
+			if(map.find(key) == map.end()) {
+				CHECK(nullptr == table.find(key));
+			}
+		}
+
+		// the pilots and the entries of a built table
+		FlatTable<u32> restored;
+		restored.entries() = std::move(table.entries());
+		REQUIRE(restored.restore(table.hash().num_buckets(), table.hash().pilots()));
+		for(uint32_t i = 0; i < size; ++i) {
+			const u32* value = restored.find(keys[i]);
+			REQUIRE(nullptr != value);
+			CHECK(i == *value);
+		}
+		if(0 < size) {
+			CHECK_FALSE(restored.restore(table.hash().num_buckets() + 1, table.hash().pilots()));
+		}
+	}
+}
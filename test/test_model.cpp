@@ -0,0 +1,921 @@
+#include "catch_amalgamated.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <immintrin.h>
+#include <string>
+#include <vector>
+#include "gguf.h"
+#include "cppgpt.h"
+#include "gguf_writer.h"
+
+namespace
+{
+	struct Weights
+	{
+		std::vector<float> token_embd_;
+		std::vector<float> output_norm_;
+		std::vector<std::vector<float>> attn_norm_;
+		std::vector<std::vector<float>> wq_;
+		std::vector<std::vector<float>> wk_;
+		std::vector<std::vector<float>> wv_;
+		std::vector<std::vector<float>> wo_;
+		std::vector<std::vector<float>> ffn_norm_;
+		std::vector<std::vector<float>> w1_;
+		std::vector<std::vector<float>> w2_;
+		std::vector<std::vector<float>> w3_;
+	};
+
+	void matmul_reference(float* dst, const float* x, const std::vector<float>& w, uint64_t n, uint64_t d)
+	{
+		for(uint64_t i = 0; i < d; ++i) {
+			float sum = 0.0f;
+			for(uint64_t j = 0; j < n; ++j) {
+				sum += w[i * n + j] * x[j];
+			}
+			dst[i] = sum;
+		}
+	}
+
+	void rmsnorm_reference(float* dst, const float* x, const std::vector<float>& w, uint64_t size)
+	{
+		float ss = 0.0f;
+		for(uint64_t i = 0; i < size; ++i) {
+			ss += x[i] * x[i];
+		}
+		ss = 1.0f / std::sqrt(ss / size + 1.0e-5f);
+		for(uint64_t i = 0; i < size; ++i) {
+			dst[i] = w[i] * (ss * x[i]);
+		}
+	}
+
+	/**
+	 * @brief Straightforward llama2.c style forward
+	 */
+	class Llama2Reference
+	{
+	public:
+		Llama2Reference(const cppgpt::Config& config, const Weights& weights)
+			: config_(config)
+			, weights_(weights)
+		{
+			uint64_t kv_dim = config_.dimension_ * config_.num_kv_heads_ / config_.num_heads_;
+			key_cache_.resize(config_.num_layers_ * config_.sequence_length_ * kv_dim);
+			value_cache_.resize(config_.num_layers_ * config_.sequence_length_ * kv_dim);
+		}
+
+		std::vector<float> forward(uint32_t token, uint64_t position)
+		{
+			const uint64_t dim = config_.dimension_;
+			const uint64_t hidden_dim = config_.hidden_dim_;
+			const uint64_t head_size = dim / config_.num_heads_;
+			const uint64_t kv_dim = head_size * config_.num_kv_heads_;
+			const uint64_t kv_mul = config_.num_heads_ / config_.num_kv_heads_;
+			std::vector<float> x(weights_.token_embd_.begin() + token * dim, weights_.token_embd_.begin() + (token + 1) * dim);
+			std::vector<float> xb(dim);
+			std::vector<float> xb2(dim);
+			std::vector<float> q(dim);
+			std::vector<float> hb(hidden_dim);
+			std::vector<float> hb2(hidden_dim);
+			for(uint64_t l = 0; l < config_.num_layers_; ++l) {
+				rmsnorm_reference(xb.data(), x.data(), weights_.attn_norm_[l], dim);
+				float* k = key_cache_.data() + (l * config_.sequence_length_ + position) * kv_dim;
+				float* v = value_cache_.data() + (l * config_.sequence_length_ + position) * kv_dim;
+				matmul_reference(q.data(), xb.data(), weights_.wq_[l], dim, dim);
+				matmul_reference(k, xb.data(), weights_.wk_[l], dim, kv_dim);
+				matmul_reference(v, xb.data(), weights_.wv_[l], dim, kv_dim);
+				for(uint64_t i = 0; i < dim; i += 2) {
+					float freq = 1.0f / std::pow(10000.0f, (i % head_size) / static_cast<float>(head_size));
+					float c = std::cos(position * freq);
+					float s = std::sin(position * freq);
+					for(float* vec: {q.data(), k}) {
+						if(vec == k && kv_dim <= i) {
+							continue;
+						}
+						float v0 = vec[i];
+						float v1 = vec[i + 1];
+						vec[i] = v0 * c - v1 * s;
+						vec[i + 1] = v0 * s + v1 * c;
+					}
+				}
+				for(uint64_t h = 0; h < config_.num_heads_; ++h) {
+					std::vector<float> att(position + 1);
+					float max_value = -1.0e30f;
+					for(uint64_t t = 0; t <= position; ++t) {
+						const float* kt = key_cache_.data() + (l * config_.sequence_length_ + t) * kv_dim + (h / kv_mul) * head_size;
+						float score = 0.0f;
+						for(uint64_t i = 0; i < head_size; ++i) {
+							score += q[h * head_size + i] * kt[i];
+						}
+						att[t] = score / std::sqrt(static_cast<float>(head_size));
+						max_value = (std::max)(max_value, att[t]);
+					}
+					float sum = 0.0f;
+					for(float& a: att) {
+						a = std::exp(a - max_value);
+						sum += a;
+					}
+					for(uint64_t i = 0; i < head_size; ++i) {
+						float value = 0.0f;
+						for(uint64_t t = 0; t <= position; ++t) {
+							value += att[t] / sum * value_cache_[(l * config_.sequence_length_ + t) * kv_dim + (h / kv_mul) * head_size + i];
+						}
+						xb[h * head_size + i] = value;
+					}
+				}
+				matmul_reference(xb2.data(), xb.data(), weights_.wo_[l], dim, dim);
+				for(uint64_t i = 0; i < dim; ++i) {
+					x[i] += xb2[i];
+				}
+				rmsnorm_reference(xb.data(), x.data(), weights_.ffn_norm_[l], dim);
+				matmul_reference(hb.data(), xb.data(), weights_.w1_[l], dim, hidden_dim);
+				matmul_reference(hb2.data(), xb.data(), weights_.w3_[l], dim, hidden_dim);
+				for(uint64_t i = 0; i < hidden_dim; ++i) {
+					hb[i] = hb[i] / (1.0f + std::exp(-hb[i])) * hb2[i];
+				}
+				matmul_reference(xb.data(), hb.data(), weights_.w2_[l], hidden_dim, dim);
+				for(uint64_t i = 0; i < dim; ++i) {
+					x[i] += xb[i];
+				}
+			}
+			rmsnorm_reference(x.data(), x.data(), weights_.output_norm_, dim);
+			std::vector<float> logits(config_.vocab_size_);
+			matmul_reference(logits.data(), x.data(), weights_.token_embd_, dim, config_.vocab_size_);
+			return logits;
+		}
+
+	private:
+		cppgpt::Config config_;
+		const Weights& weights_;
+		std::vector<float> key_cache_;
+		std::vector<float> value_cache_;
+	};
+
+	std::vector<float> random_vector(std::mt19937& engine, uint64_t size, float scale)
+	{
+		std::uniform_real_distribution<float> distribution(-scale, scale);
+		std::vector<float> v(size);
+		for(float& x: v) {
+			x = distribution(engine);
+		}
+		return v;
+	}
+
+	uint16_t f32_to_f16(float x)
+	{
+		return _cvtss_sh(x, 0);
+	}
+
+	/**
+	 * @brief Write a random F32 llama model to filepath
+	 */
+	bool write_model(const char* filepath, const cppgpt::Config& config, Weights& weights, uint32_t seed = std::mt19937::default_seed)
+	{
+		const uint64_t dim = config.dimension_;
+		const uint64_t kv_dim = dim * config.num_kv_heads_ / config.num_heads_;
+		std::mt19937 engine(seed);
+		test::GGUFWriter writer;
+		writer.add_string("general.architecture", "llama");
+		writer.add_u32("llama.embedding_length", static_cast<uint32_t>(dim));
+		writer.add_u32("llama.feed_forward_length", static_cast<uint32_t>(config.hidden_dim_));
+		writer.add_u32("llama.block_count", static_cast<uint32_t>(config.num_layers_));
+		writer.add_u32("llama.attention.head_count", static_cast<uint32_t>(config.num_heads_));
+		writer.add_u32("llama.attention.head_count_kv", static_cast<uint32_t>(config.num_kv_heads_));
+		writer.add_u32("llama.context_length", static_cast<uint32_t>(config.sequence_length_));
+		writer.add_f32("llama.attention.layer_norm_rms_epsilon", 1.0e-5f);
+		weights.token_embd_ = random_vector(engine, config.vocab_size_ * dim, 1.0f);
+		weights.output_norm_ = random_vector(engine, dim, 1.0f);
+		writer.add_tensor("token_embd.weight", {dim, config.vocab_size_}, weights.token_embd_);
+		writer.add_tensor("output_norm.weight", {dim}, weights.output_norm_);
+		for(uint64_t l = 0; l < config.num_layers_; ++l) {
+			std::string prefix = "blk." + std::to_string(l) + ".";
+			weights.attn_norm_.push_back(random_vector(engine, dim, 1.0f));
+			weights.wq_.push_back(random_vector(engine, dim * dim, 0.3f));
+			weights.wk_.push_back(random_vector(engine, kv_dim * dim, 0.3f));
+			weights.wv_.push_back(random_vector(engine, kv_dim * dim, 0.3f));
+			weights.wo_.push_back(random_vector(engine, dim * dim, 0.3f));
+			weights.ffn_norm_.push_back(random_vector(engine, dim, 1.0f));
+			weights.w1_.push_back(random_vector(engine, config.hidden_dim_ * dim, 0.3f));
+			weights.w2_.push_back(random_vector(engine, dim * config.hidden_dim_, 0.3f));
+			weights.w3_.push_back(random_vector(engine, config.hidden_dim_ * dim, 0.3f));
+			writer.add_tensor(prefix + "attn_norm.weight", {dim}, weights.attn_norm_[l]);
+			writer.add_tensor(prefix + "attn_q.weight", {dim, dim}, weights.wq_[l]);
+			writer.add_tensor(prefix + "attn_k.weight", {dim, kv_dim}, weights.wk_[l]);
+			writer.add_tensor(prefix + "attn_v.weight", {dim, kv_dim}, weights.wv_[l]);
+			writer.add_tensor(prefix + "attn_output.weight", {dim, dim}, weights.wo_[l]);
+			writer.add_tensor(prefix + "ffn_norm.weight", {dim}, weights.ffn_norm_[l]);
+			writer.add_tensor(prefix + "ffn_gate.weight", {dim, config.hidden_dim_}, weights.w1_[l]);
+			writer.add_tensor(prefix + "ffn_down.weight", {config.hidden_dim_, dim}, weights.w2_[l]);
+			writer.add_tensor(prefix + "ffn_up.weight", {dim, config.hidden_dim_}, weights.w3_[l]);
+		}
+		return writer.save(filepath);
+	}
+
+	/**
+	 * @brief Decode a prompt alone token by token
+	 */
+	std::vector<uint32_t> generate_greedy(const gguf::GGUF& model_data, const std::vector<uint32_t>& prompt, uint64_t max_tokens, uint64_t kv_window = 0, uint64_t kv_sinks = 0)
+	{
+		cppgpt::Llama2 model(model_data, kv_window, kv_sinks);
+		cppgpt::Sampler sampler(static_cast<uint32_t>(model.config().vocab_size_), 0.0f, 0.9f, 1);
+		std::vector<uint32_t> tokens;
+		uint64_t position = 0;
+		uint32_t token = 0;
+		for(uint32_t t: prompt) {
+			token = sampler.sample(model.forward(t, position++));
+		}
+		tokens.push_back(token);
+		while(tokens.size() < max_tokens) {
+			token = sampler.sample(model.forward(token, position++));
+			tokens.push_back(token);
+		}
+		return tokens;
+	}
+}
+
+TEST_CASE("Dequantize" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	static constexpr uint64_t Size = 64;
+	std::mt19937 engine;
+	std::vector<float> x = random_vector(engine, Size, 1.0f);
+
+	// Q8_0: 32 elements share a half precision scale
+	std::vector<uint8_t> q8(op::row_bytes(ggml_type::GGML_TYPE_Q8_0, Size));
+	REQUIRE(68 == q8.size());
+	for(uint64_t b = 0; b < Size / 32; ++b) {
+		float amax = 0.0f;
+		for(uint64_t i = 0; i < 32; ++i) {
+			amax = (std::max)(amax, std::abs(x[b * 32 + i]));
+		}
+		float d = amax / 127.0f;
+		uint16_t d16 = f32_to_f16(d);
+		::memcpy(&q8[b * 34], &d16, sizeof(uint16_t));
+		for(uint64_t i = 0; i < 32; ++i) {
+			q8[b * 34 + 2 + i] = static_cast<uint8_t>(static_cast<int8_t>(std::round(x[b * 32 + i] / d)));
+		}
+	}
+	std::vector<float> y(Size);
+	op::dequantize_row(ggml_type::GGML_TYPE_Q8_0, Size, y.data(), q8.data());
+	for(uint64_t i = 0; i < Size; ++i) {
+		CHECK(std::abs(x[i] - y[i]) < 1.0e-2f);
+	}
+
+	// Q4_0: low nibbles are the first half of a block
+	std::vector<uint8_t> q4(op::row_bytes(ggml_type::GGML_TYPE_Q4_0, Size));
+	REQUIRE(36 == q4.size());
+	for(uint64_t b = 0; b < Size / 32; ++b) {
+		uint16_t d16 = f32_to_f16(0.5f);
+		::memcpy(&q4[b * 18], &d16, sizeof(uint16_t));
+		for(uint64_t i = 0; i < 16; ++i) {
+			q4[b * 18 + 2 + i] = static_cast<uint8_t>((i & 0x0F) | ((15 - i) << 4));
+		}
+	}
+	op::dequantize_row(ggml_type::GGML_TYPE_Q4_0, Size, y.data(), q4.data());
+	for(uint64_t i = 0; i < 16; ++i) {
+		CHECK(y[i] == (static_cast<int32_t>(i) - 8) * 0.5f);
+		CHECK(y[i + 16] == (7 - static_cast<int32_t>(i)) * 0.5f);
+	}
+
+	CHECK(0 == op::row_bytes(ggml_type::GGML_TYPE_Q4_K, 100));
+	CHECK(144 == op::row_bytes(ggml_type::GGML_TYPE_Q4_K, 256));
+}
+
+TEST_CASE("FusedKernels" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	// odd sizes for the remainders of the vector loops and a partial tile
+	static constexpr uint64_t N = 37;
+	static constexpr uint64_t D = 22;
+	static constexpr uint64_t Count = 3;
+	std::mt19937 engine;
+	std::vector<float> x = random_vector(engine, Count * N, 1.0f);
+	std::vector<float> norm = random_vector(engine, N, 1.0f);
+	std::vector<float> gate = random_vector(engine, D * N, 0.5f);
+	std::vector<float> up = random_vector(engine, D * N, 0.5f);
+	std::vector<uint16_t> gate16(D * N);
+	std::vector<uint16_t> up16(D * N);
+	for(uint64_t i = 0; i < D * N; ++i) {
+		gate16[i] = f32_to_f16(gate[i]);
+		up16[i] = f32_to_f16(up[i]);
+	}
+	auto close = [](float x0, float x1) {
+		return std::abs(x0 - x1) < 1.0e-3f * (std::max)(1.0f, std::abs(x1));
+	};
+
+	const ggml_type types[] = {ggml_type::GGML_TYPE_F32, ggml_type::GGML_TYPE_F16};
+	for(ggml_type type: types) {
+		const void* gate_data = ggml_type::GGML_TYPE_F32 == type ? static_cast<const void*>(gate.data()) : gate16.data();
+		const void* up_data = ggml_type::GGML_TYPE_F32 == type ? static_cast<const void*>(up.data()) : up16.data();
+		Tensor w_gate(type, {D, N}, gate_data);
+		Tensor w_up(type, {D, N}, up_data);
+
+		// unfused references
+		std::vector<float> xn(Count * N);
+		for(uint64_t t = 0; t < Count; ++t) {
+			op::rmsnorm(N, xn.data() + t * N, x.data() + t * N, norm.data(), 1.0e-5f);
+		}
+		std::vector<float> g(Count * D);
+		std::vector<float> u(Count * D);
+		op::matmat(g.data(), xn.data(), Count, w_gate, N, D);
+		op::matmat(u.data(), xn.data(), Count, w_up, N, D);
+
+		std::vector<float> y(Count * D);
+		const float scale = op::rmsnorm_scale(N, x.data(), 1.0e-5f);
+		op::matvec_norm(y.data(), x.data(), norm.data(), scale, w_gate, N, D);
+		for(uint64_t i = 0; i < D; ++i) {
+			CHECK(close(y[i], g[i]));
+		}
+
+		std::vector<float> h(Count * D);
+		op::matvec_swiglu(h.data(), x.data(), norm.data(), scale, w_gate, w_up, N, D);
+		for(uint64_t i = 0; i < D; ++i) {
+			CHECK(close(h[i], g[i] / (1.0f + std::exp(-g[i])) * u[i]));
+		}
+		op::matmat_swiglu(h.data(), xn.data(), Count, w_gate, w_up, N, D);
+		for(uint64_t i = 0; i < Count * D; ++i) {
+			CHECK(close(h[i], g[i] / (1.0f + std::exp(-g[i])) * u[i]));
+		}
+
+		std::vector<float> residual = random_vector(engine, Count * D, 1.0f);
+		y = residual;
+		op::matvec_add(y.data(), xn.data(), w_gate, N, D);
+		for(uint64_t i = 0; i < D; ++i) {
+			CHECK(close(y[i], residual[i] + g[i]));
+		}
+		y = residual;
+		op::matmat_add(y.data(), xn.data(), Count, w_gate, N, D);
+		for(uint64_t i = 0; i < Count * D; ++i) {
+			CHECK(close(y[i], residual[i] + g[i]));
+		}
+	}
+
+	// gate and up of different types are read in place, neither is converted
+	{
+		Tensor w_gate(ggml_type::GGML_TYPE_F16, {D, N}, gate16.data());
+		Tensor w_up(ggml_type::GGML_TYPE_F32, {D, N}, up.data());
+		std::vector<float> xn(Count * N);
+		for(uint64_t t = 0; t < Count; ++t) {
+			op::rmsnorm(N, xn.data() + t * N, x.data() + t * N, norm.data(), 1.0e-5f);
+		}
+		std::vector<float> g(Count * D);
+		std::vector<float> u(Count * D);
+		op::matmat(g.data(), xn.data(), Count, w_gate, N, D);
+		op::matmat(u.data(), xn.data(), Count, w_up, N, D);
+		std::vector<float> h(Count * D);
+		const float scale = op::rmsnorm_scale(N, x.data(), 1.0e-5f);
+		op::matvec_swiglu(h.data(), x.data(), norm.data(), scale, w_gate, w_up, N, D);
+		for(uint64_t i = 0; i < D; ++i) {
+			CHECK(close(h[i], g[i] / (1.0f + std::exp(-g[i])) * u[i]));
+		}
+		op::matmat_swiglu(h.data(), xn.data(), Count, w_gate, w_up, N, D);
+		for(uint64_t i = 0; i < Count * D; ++i) {
+			CHECK(close(h[i], g[i] / (1.0f + std::exp(-g[i])) * u[i]));
+		}
+	}
+}
+
+TEST_CASE("Llama2" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_llama2.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Llama2 model(model_data);
+	REQUIRE(model.valid());
+	CHECK(config.vocab_size_ == model.config().vocab_size_);
+	CHECK(config.num_kv_heads_ == model.config().num_kv_heads_);
+
+	// the output shares the embedding
+	Llama2Reference reference(config, weights);
+	const uint32_t tokens[] = {1, 5, 7, 23, 0, 11};
+	for(uint64_t position = 0; position < sizeof(tokens) / sizeof(tokens[0]); ++position) {
+		std::vector<float> expected = reference.forward(tokens[position], position);
+		const float* logits = model.forward(tokens[position], position);
+		for(uint64_t i = 0; i < config.vocab_size_; ++i) {
+			CHECK(std::abs(logits[i] - expected[i]) < 1.0e-3f * (std::max)(1.0f, std::abs(expected[i])));
+		}
+	}
+	std::remove(filepath);
+}
+
+TEST_CASE("Llama2Prefill" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_llama2_prefill.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	const uint32_t tokens[] = {3, 1, 5, 7, 23, 0, 11, 2, 9, 17, 4, 6};
+	const uint64_t num_tokens = sizeof(tokens) / sizeof(tokens[0]);
+
+	// {window, sinks, batch size}, chunks smaller than the prompt and a ring cache evicting inside a chunk
+	const uint64_t settings[][3] = {{0, 0, 64}, {0, 0, 4}, {0, 0, 1}, {6, 1, 4}, {5, 0, 8}};
+	for(const auto& setting: settings) {
+		Llama2 sequential(model_data, setting[0], setting[1]);
+		Llama2 batched(model_data, setting[0], setting[1], setting[2]);
+		REQUIRE(sequential.valid());
+		REQUIRE(batched.valid());
+
+		// the prompt except the last token, then one more token to check the cache
+		std::vector<float> expected;
+		for(uint64_t i = 0; i < num_tokens - 1; ++i) {
+			const float* logits = sequential.forward(tokens[i], i);
+			expected.assign(logits, logits + config.vocab_size_);
+		}
+		const float* logits = batched.prefill(tokens, num_tokens - 1, 0);
+		for(uint64_t i = 0; i < config.vocab_size_; ++i) {
+			CHECK(std::abs(logits[i] - expected[i]) < 1.0e-3f * (std::max)(1.0f, std::abs(expected[i])));
+		}
+		const float* next = sequential.forward(tokens[num_tokens - 1], num_tokens - 1);
+		expected.assign(next, next + config.vocab_size_);
+		logits = batched.forward(tokens[num_tokens - 1], num_tokens - 1);
+		for(uint64_t i = 0; i < config.vocab_size_; ++i) {
+			CHECK(std::abs(logits[i] - expected[i]) < 1.0e-3f * (std::max)(1.0f, std::abs(expected[i])));
+		}
+	}
+	std::remove(filepath);
+}
+
+TEST_CASE("Llama2Allocation" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_llama2_allocation.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	Llama2 llama2(model_data, 0, 0, 4);
+	REQUIRE(llama2.valid());
+	const uint32_t tokens[] = {3, 1, 5, 7, 23, 0, 11, 2, 9, 17, 4, 6};
+	const uint64_t num_tokens = sizeof(tokens) / sizeof(tokens[0]);
+
+	// steady state runs on the planned arena only
+	const uint64_t count = allocation_count();
+	const float* logits = llama2.prefill(tokens, num_tokens - 1, 0);
+	for(uint64_t i = num_tokens - 1; i < config.sequence_length_; ++i) {
+		logits = llama2.forward(tokens[i % num_tokens], i);
+	}
+	CHECK(nullptr != logits);
+	CHECK(count == allocation_count());
+	std::remove(filepath);
+}
+
+TEST_CASE("MemoryPlan" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	MemoryPlan plan;
+	const uint32_t a = plan.add(100, 0, 2);
+	const uint32_t b = plan.add(200, 1, 3);
+	const uint32_t c = plan.add(64, 3, 4);
+	const uint32_t d = plan.add(300, 4, 5);
+	const uint64_t size = plan.build(64);
+	// buffers overlapping in time never overlap in memory
+	CHECK(plan.offset(a) % 64 == 0);
+	CHECK(plan.offset(b) % 64 == 0);
+	CHECK(plan.offset(c) % 64 == 0);
+	CHECK(plan.offset(d) % 64 == 0);
+	CHECK((plan.offset(a) + 100 <= plan.offset(b) || plan.offset(b) + 200 <= plan.offset(a)));
+	CHECK((plan.offset(b) + 200 <= plan.offset(c) || plan.offset(c) + 64 <= plan.offset(b)));
+	CHECK((plan.offset(c) + 64 <= plan.offset(d) || plan.offset(d) + 300 <= plan.offset(c)));
+	CHECK(size == plan.size());
+	CHECK(size < 100 + 200 + 64 + 300 + 3 * 64);
+	CHECK(plan.offset(d) + 300 <= size);
+}
+
+TEST_CASE("Scheduler" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_llama2_scheduler.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	const std::vector<uint32_t> prompts[] = {{3, 1, 5, 7, 23}, {2, 9, 17}, {4, 6, 8, 10, 12, 14, 16}};
+	const uint64_t max_tokens = 6;
+
+	// greedy decoding of each prompt alone
+	std::vector<uint32_t> expected[3];
+	for(uint64_t i = 0; i < 3; ++i) {
+		expected[i] = generate_greedy(model_data, prompts[i], max_tokens);
+	}
+
+	// rows of a step are more than the batch size
+	Llama2 model(model_data, 0, 0, 4);
+	Scheduler scheduler(model, 2, static_cast<uint32_t>(config.vocab_size_));
+	s32 ids[3];
+	ids[0] = scheduler.add(prompts[0].data(), prompts[0].size(), max_tokens);
+	ids[1] = scheduler.add(prompts[1].data(), prompts[1].size(), max_tokens - 2);
+	REQUIRE(Scheduler::Invalid != ids[0]);
+	REQUIRE(Scheduler::Invalid != ids[1]);
+	CHECK(Scheduler::Invalid == scheduler.add(prompts[2].data(), prompts[2].size(), max_tokens));
+	CHECK(2 == scheduler.step());
+	CHECK(2 == scheduler.step());
+
+	// the second finishes first, then the third joins in its slot
+	while(Scheduler::State::Finished != scheduler.state(ids[1])) {
+		scheduler.step();
+	}
+	CHECK(Scheduler::State::Decode == scheduler.state(ids[0]));
+	uint64_t count = 0;
+	const u32* generated = scheduler.generated(ids[1], count);
+	REQUIRE(max_tokens - 2 == count);
+	for(uint64_t i = 0; i < count; ++i) {
+		CHECK(expected[1][i] == generated[i]);
+	}
+	scheduler.release(ids[1]);
+	ids[2] = scheduler.add(prompts[2].data(), prompts[2].size(), max_tokens);
+	REQUIRE(Scheduler::Invalid != ids[2]);
+	while(0 < scheduler.step()) {
+	}
+	for(uint64_t i = 0; i < 3; i += 2) {
+		CHECK(Scheduler::State::Finished == scheduler.state(ids[i]));
+		generated = scheduler.generated(ids[i], count);
+		REQUIRE(max_tokens == count);
+		for(uint64_t j = 0; j < count; ++j) {
+			CHECK(expected[i][j] == generated[j]);
+		}
+	}
+
+	// no token to generate, the sequence finishes after its prompt
+	for(uint64_t i = 0; i < 3; i += 2) {
+		scheduler.release(ids[i]);
+	}
+	ids[0] = scheduler.add(prompts[0].data(), prompts[0].size(), 0);
+	REQUIRE(Scheduler::Invalid != ids[0]);
+	CHECK(0 == scheduler.step());
+	CHECK(Scheduler::State::Finished == scheduler.state(ids[0]));
+	generated = scheduler.generated(ids[0], count);
+	CHECK(0 == count);
+	std::remove(filepath);
+}
+
+TEST_CASE("SchedulerChunkedPrefill" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_llama2_chunked.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	const std::vector<uint32_t> short_prompt = {3, 1, 5};
+	const std::vector<uint32_t> long_prompt = {4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 1, 3};
+	const uint64_t max_tokens = 3;
+	std::vector<uint32_t> expected_short = generate_greedy(model_data, short_prompt, 10);
+	std::vector<uint32_t> expected_long = generate_greedy(model_data, long_prompt, max_tokens);
+
+	Llama2 model(model_data);
+	Scheduler scheduler(model, 2, static_cast<uint32_t>(config.vocab_size_));
+	scheduler.set_token_budget(4);
+	s32 decoding = scheduler.add(short_prompt.data(), short_prompt.size(), 10);
+	REQUIRE(Scheduler::Invalid != decoding);
+	scheduler.step();
+	REQUIRE(Scheduler::State::Decode == scheduler.state(decoding));
+
+	// the long prompt comes in chunks of 3 beside the decoding row, which keeps a token every step
+	s32 prefilling = scheduler.add(long_prompt.data(), long_prompt.size(), max_tokens);
+	REQUIRE(Scheduler::Invalid != prefilling);
+	uint64_t count = 0;
+	for(uint64_t i = 0; i < 4; ++i) {
+		CHECK(Scheduler::State::Prefill == scheduler.state(prefilling));
+		scheduler.step();
+		CHECK(4 == scheduler.rows());
+		scheduler.generated(decoding, count);
+		CHECK(i + 2 == count);
+	}
+	CHECK(Scheduler::State::Decode == scheduler.state(prefilling));
+	scheduler.generated(prefilling, count);
+	CHECK(1 == count);
+
+	while(0 < scheduler.step()) {
+		CHECK(scheduler.rows() <= 4);
+	}
+	const u32* generated = scheduler.generated(decoding, count);
+	REQUIRE(expected_short.size() == count);
+	for(uint64_t i = 0; i < count; ++i) {
+		CHECK(expected_short[i] == generated[i]);
+	}
+	generated = scheduler.generated(prefilling, count);
+	REQUIRE(expected_long.size() == count);
+	for(uint64_t i = 0; i < count; ++i) {
+		CHECK(expected_long[i] == generated[i]);
+	}
+	std::remove(filepath);
+}
+
+TEST_CASE("SpeculativeDecoder" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* target_path = "test_llama2_target.gguf";
+	const char* draft_path = "test_llama2_draft.gguf";
+	Weights target_weights;
+	Weights draft_weights;
+	REQUIRE(write_model(target_path, config, target_weights));
+	REQUIRE(write_model(draft_path, {32, 32, 1, 4, 2, 24, 16, 1.0e-5f}, draft_weights, 7));
+	gguf::GGUF target_data;
+	gguf::GGUF draft_data;
+	REQUIRE(gguf::Error::Success == target_data.load(reinterpret_cast<const char8_t*>(target_path)));
+	REQUIRE(gguf::Error::Success == draft_data.load(reinterpret_cast<const char8_t*>(draft_path)));
+
+	const std::vector<uint32_t> prompt = {3, 1, 5};
+	// {window, sinks, number of tokens}, a ring cache restores the evicted entries on a rejection
+	const uint64_t settings[][3] = {{0, 0, 13}, {6, 1, 24}};
+	for(const auto& setting: settings) {
+		std::vector<uint32_t> expected = generate_greedy(target_data, prompt, setting[2], setting[0], setting[1]);
+
+		// greedy output is exactly the target's whatever the draft proposes
+		for(const gguf::GGUF* data: {&draft_data, &target_data}) {
+			Llama2 target(target_data, setting[0], setting[1], 8);
+			Llama2 draft(*data, setting[0], setting[1], 8);
+			SpeculativeDecoder decoder(target, draft, 4);
+			decoder.start(prompt.data(), prompt.size());
+			uint64_t count = 0;
+			decoder.generated(count);
+			while(count < setting[2]) {
+				uint64_t n = decoder.step();
+				if(0 == n) {
+					break;
+				}
+				CHECK(n <= 5);
+				decoder.generated(count);
+			}
+			const u32* generated = decoder.generated(count);
+			REQUIRE(expected.size() <= count);
+			for(uint64_t i = 0; i < expected.size(); ++i) {
+				CHECK(expected[i] == generated[i]);
+			}
+			if(data == &target_data) {
+				// the same model never rejects
+				CHECK(decoder.accepted() == decoder.drafted());
+			} else {
+				CHECK(decoder.accepted() < decoder.drafted());
+			}
+		}
+	}
+	std::remove(target_path);
+	std::remove(draft_path);
+}
+
+TEST_CASE("PromptLookupDecoding" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 32, 1.0e-5f};
+	const char* filepath = "test_llama2_lookup.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	const std::vector<uint32_t> prompt = {3, 1, 5, 7, 3, 1, 5, 7, 3, 1};
+	// {window, sinks, number of tokens}
+	const uint64_t settings[][3] = {{0, 0, 20}, {8, 1, 40}};
+	for(const auto& setting: settings) {
+		std::vector<uint32_t> expected = generate_greedy(model_data, prompt, setting[2], setting[0], setting[1]);
+
+		Llama2 target(model_data, setting[0], setting[1], 8);
+		SpeculativeDecoder decoder(target, 4, 3);
+		decoder.start(prompt.data(), prompt.size());
+		uint64_t count = 0;
+		uint64_t steps = 0;
+		decoder.generated(count);
+		while(count < setting[2]) {
+			uint64_t n = decoder.step();
+			if(0 == n) {
+				break;
+			}
+			CHECK(n <= 5);
+			++steps;
+			decoder.generated(count);
+		}
+		const u32* generated = decoder.generated(count);
+		REQUIRE(expected.size() <= count);
+		for(uint64_t i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == generated[i]);
+		}
+		// the repeating output is copied in multi-token steps
+		CHECK(0 < decoder.accepted());
+		CHECK(decoder.accepted() <= decoder.drafted());
+		CHECK(steps < expected.size());
+	}
+	std::remove(filepath);
+}
+
+TEST_CASE("Generation" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_generation.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	const std::vector<uint32_t> prompts[] = {{3, 1, 5, 7}, {23, 0, 11, 2, 9, 17}, {4}};
+	const uint64_t max_tokens = 8;
+	GenerationParams params;
+	params.max_tokens_ = max_tokens;
+	params.eos_token_ = 0xFFFF'FFFFUL;
+
+	// generations share one model, resumed in turn
+	Llama2 model(model_data, 0, 0, 4);
+	REQUIRE(model.valid());
+	Generation generations[3];
+	for(uint64_t i = 0; i < 3; ++i) {
+		Array<uint32_t> prompt;
+		for(uint32_t token: prompts[i]) {
+			prompt.push_back(token);
+		}
+		generations[i] = generate(model, nullptr, std::move(prompt), params);
+	}
+	std::vector<uint32_t> tokens[3];
+	bool running = true;
+	while(running) {
+		running = false;
+		for(uint64_t i = 0; i < 3; ++i) {
+			if(generations[i].next()) {
+				tokens[i].push_back(generations[i].token());
+				running = true;
+			}
+			// cancel mid-stream
+			if(2 == i && 2 == tokens[i].size()) {
+				generations[i].cancel();
+			}
+		}
+	}
+	for(uint64_t i = 0; i < 2; ++i) {
+		CHECK(tokens[i] == generate_greedy(model_data, prompts[i], max_tokens));
+		CHECK(generations[i].done());
+		CHECK(max_tokens == generations[i].stats().num_tokens_);
+		CHECK(0 <= generations[i].stats().time_to_first_token_);
+		CHECK(generations[i].stats().inter_token_max_ <= generations[i].stats().inter_token_total_);
+	}
+	std::vector<uint32_t> expected = generate_greedy(model_data, prompts[2], 2);
+	CHECK(tokens[2] == expected);
+	CHECK(generations[2].done());
+	CHECK(2 == generations[2].stats().num_tokens_);
+	CHECK_FALSE(generations[2].next());
+
+	// the stream ends at the end of the cache
+	Array<uint32_t> prompt;
+	for(uint32_t i = 0; i < config.sequence_length_ - 2; ++i) {
+		prompt.push_back(i % config.vocab_size_);
+	}
+	params.max_tokens_ = 100;
+	Generation generation = generate(model, nullptr, std::move(prompt), params);
+	uint64_t count = 0;
+	while(generation.next()) {
+		++count;
+	}
+	CHECK(3 == count);
+
+	// the end cuts a char of byte tokens, its bytes are the text after the last token
+	const char* vocab_path = "test_generation_vocab.gguf";
+	test::GGUFWriter writer;
+	writer.add_string("general.architecture", "llama");
+	writer.add_string("tokenizer.ggml.model", "llama");
+	writer.add_array("tokenizer.ggml.tokens", std::vector<std::string>(config.vocab_size_, "<0xE6>"));
+	writer.add_array("tokenizer.ggml.scores", std::vector<float>(config.vocab_size_, 0.0f));
+	writer.add_array("tokenizer.ggml.token_type", std::vector<int32_t>(config.vocab_size_, 6));
+	REQUIRE(writer.save(vocab_path));
+	gguf::GGUF vocab_data;
+	REQUIRE(gguf::Error::Success == vocab_data.load(reinterpret_cast<const char8_t*>(vocab_path)));
+	Tokenizer tokenizer(vocab_data);
+	prompt.clear();
+	prompt.push_back(3);
+	params.max_tokens_ = 3;
+	generation = generate(model, &tokenizer, std::move(prompt), params);
+	std::u8string text;
+	count = 0;
+	while(generation.next()) {
+		text += generation.text();
+		++count;
+	}
+	CHECK(3 == count);
+	CHECK(std::u8string(2, 0xE6) == text);
+	text += generation.text();
+	CHECK(std::u8string(3, 0xE6) == text);
+
+	// a text prompt is tokenized after BOS, the text of the tokens follows
+	std::vector<std::string> pieces = {"<unk>", "<s>", "</s>"};
+	for(char c = 'a'; c <= 'r'; ++c) {
+		pieces.push_back(std::string(1, c));
+	}
+	pieces.push_back("ab");
+	pieces.push_back("ba");
+	pieces.push_back("abba");
+	REQUIRE(config.vocab_size_ == pieces.size());
+	std::vector<float> scores;
+	for(const std::string& piece: pieces) {
+		scores.push_back(static_cast<float>(piece.size()));
+	}
+	test::GGUFWriter text_writer;
+	text_writer.add_string("general.architecture", "llama");
+	text_writer.add_string("tokenizer.ggml.model", "llama");
+	text_writer.add_array("tokenizer.ggml.tokens", pieces);
+	text_writer.add_array("tokenizer.ggml.scores", scores);
+	text_writer.add_array("tokenizer.ggml.token_type", std::vector<int32_t>(pieces.size(), 1));
+	text_writer.add_u32("tokenizer.ggml.bos_token_id", 1);
+	text_writer.add_u32("tokenizer.ggml.eos_token_id", 2);
+	REQUIRE(text_writer.save(vocab_path));
+	gguf::GGUF text_data;
+	REQUIRE(gguf::Error::Success == text_data.load(reinterpret_cast<const char8_t*>(vocab_path)));
+	Tokenizer text_tokenizer(text_data);
+	params.max_tokens_ = 5;
+	generation = generate(model, text_tokenizer, u8"abbarab", params);
+	std::vector<uint32_t> text_prompt = {1, 23, 20, 21};
+	std::vector<uint32_t> expected_tokens = generate_greedy(model_data, text_prompt, params.max_tokens_);
+	std::vector<uint32_t> generated;
+	std::u8string expected_text;
+	text.clear();
+	while(generation.next()) {
+		generated.push_back(generation.token());
+		text += generation.text();
+		text_tokenizer.decode(expected_text, static_cast<s32>(generation.token()));
+	}
+	text += generation.text();
+	CHECK(expected_tokens == generated);
+	CHECK(expected_text == text);
+	std::remove(vocab_path);
+	std::remove(filepath);
+}
+
+TEST_CASE("Scorer" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	Config config = {32, 48, 2, 4, 2, 24, 16, 1.0e-5f};
+	const char* filepath = "test_scorer.gguf";
+	Weights weights;
+	REQUIRE(write_model(filepath, config, weights));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+
+	const uint32_t tokens[] = {3, 1, 5, 7, 23, 0, 11, 2, 9, 17, 4, 6};
+	const uint64_t num_tokens = sizeof(tokens) / sizeof(tokens[0]);
+	auto log_prob = [&](const float* logits, uint32_t token) {
+		double sum = 0.0;
+		for(uint64_t i = 0; i < config.vocab_size_; ++i) {
+			sum += std::exp(static_cast<double>(logits[i]));
+		}
+		return static_cast<float>(logits[token] - std::log(sum));
+	};
+
+	// teacher forced log-probabilities of the sequential forward
+	std::vector<float> expected;
+	{
+		Llama2 model(model_data);
+		for(uint64_t i = 0; i + 1 < num_tokens; ++i) {
+			expected.push_back(log_prob(model.forward(tokens[i], i), tokens[i + 1]));
+		}
+	}
+
+	// chunks smaller than the tokens
+	Llama2 model(model_data, 0, 0, 5);
+	Scorer scorer(model);
+	std::vector<float> log_probs(num_tokens - 1);
+	REQUIRE(scorer.score(log_probs.data(), tokens, num_tokens));
+	for(uint64_t i = 0; i + 1 < num_tokens; ++i) {
+		CHECK(std::abs(log_probs[i] - expected[i]) < 1.0e-3f);
+	}
+
+	// candidates following a prefix score as the prefix and the candidate together
+	const uint64_t prefix_count = 7;
+	const uint32_t candidate0[] = {11, 2, 9, 17, 4, 6};
+	const uint32_t candidate1[] = {8};
+	const uint32_t candidate2[] = {20, 12, 5};
+	const uint32_t* candidates[] = {candidate0, candidate1, candidate2};
+	const uint64_t counts[] = {6, 1, 3};
+	std::vector<float> candidate_log_probs(10);
+	REQUIRE(scorer.score_candidates(candidate_log_probs.data(), tokens, prefix_count, 3, candidates, counts));
+	uint64_t offset = 0;
+	for(uint64_t c = 0; c < 3; ++c) {
+		std::vector<uint32_t> sequence(tokens, tokens + prefix_count);
+		sequence.insert(sequence.end(), candidates[c], candidates[c] + counts[c]);
+		std::vector<float> whole(sequence.size() - 1);
+		REQUIRE(scorer.score(whole.data(), sequence.data(), sequence.size()));
+		for(uint64_t i = 0; i < counts[c]; ++i) {
+			CHECK(std::abs(candidate_log_probs[offset + i] - whole[prefix_count - 1 + i]) < 1.0e-3f);
+		}
+		offset += counts[c];
+	}
+
+	std::vector<uint32_t> long_tokens(config.sequence_length_ + 1, 1);
+	std::vector<float> long_log_probs(config.sequence_length_);
+	CHECK_FALSE(scorer.score(long_log_probs.data(), long_tokens.data(), long_tokens.size()));
+	std::remove(filepath);
+}
@@ -0,0 +1,958 @@
+#include "catch_amalgamated.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gguf.h"
+#include "cppgpt.h"
+#include "gguf_writer.h"
+
+namespace
+{
+	struct Vocab
+	{
+		std::vector<std::string> tokens_;
+		std::vector<float> scores_;
+		std::vector<std::string> merges_;
+		std::vector<int32_t> types_; //!< normal if empty
+		std::vector<std::string> added_;
+	};
+
+	/**
+	 * @brief Pieces of four letters, merged pieces score by their length
+	 */
+	Vocab make_vocab()
+	{
+		Vocab vocab;
+		vocab.tokens_ = {"<unk>", "<s>", "</s>", "a", "b", "c", "d", "ab", "bc", "cd", "da", "aa", "abc", "bcd", "aaa", "dab", "abcd", "aaaa"};
+		std::mt19937 engine(7);
+		for(const std::string& token: vocab.tokens_) {
+			// ties are common, the leftmost pair merges first
+			vocab.scores_.push_back(static_cast<float>(token.size()) + static_cast<float>(engine() % 3));
+		}
+		return vocab;
+	}
+
+	bool write_vocab(const char* filepath, const Vocab& vocab)
+	{
+		test::GGUFWriter writer;
+		writer.add_string("general.architecture", "llama");
+		writer.add_string("tokenizer.ggml.model", "llama");
+		writer.add_array("tokenizer.ggml.tokens", vocab.tokens_);
+		writer.add_array("tokenizer.ggml.scores", vocab.scores_);
+		writer.add_array("tokenizer.ggml.token_type", vocab.types_.empty() ? std::vector<int32_t>(vocab.tokens_.size(), 1) : vocab.types_);
+		if(!vocab.added_.empty()) {
+			writer.add_array("tokenizer.ggml.added_tokens", vocab.added_);
+		}
+		if(!vocab.merges_.empty()) {
+			writer.add_array("tokenizer.ggml.merges", vocab.merges_);
+		}
+		writer.add_u32("tokenizer.ggml.bos_token_id", 1);
+		writer.add_u32("tokenizer.ggml.eos_token_id", 2);
+		return writer.save(filepath);
+	}
+
+	/**
+	 * @brief Merge the adjacent pair of the highest score until none is in the vocabulary, the leftmost of ties
+	 *
+	 * The text is split into UTF-8 chars, a char out of the vocabulary is the unknown token for each its byte.
+	 */
+	std::vector<int32_t> tokenize_reference(const Vocab& vocab, const std::string& text)
+	{
+		auto find = [&](const std::string& piece) {
+			for(size_t i = 0; i < vocab.tokens_.size(); ++i) {
+				if(vocab.tokens_[i] == piece) {
+					return static_cast<int32_t>(i);
+				}
+			}
+			return -1;
+		};
+		std::vector<std::string> pieces;
+		for(size_t i = 0; i < text.size();) {
+			uint8_t c = static_cast<uint8_t>(text[i]);
+			size_t length = c < 0x80U ? 1 : (c < 0xE0U ? 2 : (c < 0xF0U ? 3 : 4));
+			pieces.push_back(text.substr(i, length));
+			i += length;
+		}
+		for(;;) {
+			int32_t best = -1;
+			float best_score = 0.0f;
+			for(size_t i = 0; i + 1 < pieces.size(); ++i) {
+				int32_t id = find(pieces[i] + pieces[i + 1]);
+				if(0 <= id && (best < 0 || best_score < vocab.scores_[id])) {
+					best = static_cast<int32_t>(i);
+					best_score = vocab.scores_[id];
+				}
+			}
+			if(best < 0) {
+				break;
+			}
+			pieces[best] += pieces[best + 1];
+			pieces.erase(pieces.begin() + best + 1);
+		}
+		std::vector<int32_t> result;
+		for(const std::string& piece: pieces) {
+			int32_t id = find(piece);
+			if(id < 0) {
+				result.insert(result.end(), piece.size(), 0);
+			} else {
+				result.push_back(id);
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * @brief Every split of a token into two tokens is a merge, the order is shuffled
+	 */
+	std::vector<std::string> make_merges(const Vocab& vocab, std::mt19937& engine)
+	{
+		std::vector<std::string> merges;
+		auto contains = [&](const std::string& piece) {
+			for(const std::string& token: vocab.tokens_) {
+				if(token == piece) {
+					return true;
+				}
+			}
+			return false;
+		};
+		for(const std::string& token: vocab.tokens_) {
+			if('<' == token[0]) {
+				continue;
+			}
+			for(size_t split = 1; split < token.size(); ++split) {
+				if(contains(token.substr(0, split)) && contains(token.substr(split))) {
+					merges.push_back(token.substr(0, split) + " " + token.substr(split));
+				}
+			}
+		}
+		std::shuffle(merges.begin(), merges.end(), engine);
+		return merges;
+	}
+
+	/**
+	 * @brief Apply the merge of the lowest rank until none applies, the leftmost of ties
+	 */
+	std::vector<int32_t> tokenize_reference_ranks(const Vocab& vocab, const std::string& text)
+	{
+		auto find = [&](const std::string& piece) {
+			for(size_t i = 0; i < vocab.tokens_.size(); ++i) {
+				if(vocab.tokens_[i] == piece) {
+					return static_cast<int32_t>(i);
+				}
+			}
+			return -1;
+		};
+		auto rank = [&](const std::string& left, const std::string& right) {
+			for(size_t i = 0; i < vocab.merges_.size(); ++i) {
+				if(vocab.merges_[i] == left + " " + right) {
+					return static_cast<int32_t>(i);
+				}
+			}
+			return -1;
+		};
+		std::vector<std::string> pieces;
+		for(char c: text) {
+			pieces.push_back(std::string(1, c));
+		}
+		for(;;) {
+			int32_t best = -1;
+			int32_t best_rank = 0;
+			for(size_t i = 0; i + 1 < pieces.size(); ++i) {
+				int32_t r = rank(pieces[i], pieces[i + 1]);
+				if(0 <= r && (best < 0 || r < best_rank)) {
+					best = static_cast<int32_t>(i);
+					best_rank = r;
+				}
+			}
+			if(best < 0) {
+				break;
+			}
+			pieces[best] += pieces[best + 1];
+			pieces.erase(pieces.begin() + best + 1);
+		}
+		std::vector<int32_t> result;
+		for(const std::string& piece: pieces) {
+			result.push_back(find(piece));
+		}
+		return result;
+	}
+
+	std::string random_text(std::mt19937& engine, size_t size)
+	{
+		std::string text;
+		for(size_t i = 0; i < size; ++i) {
+			text.push_back(static_cast<char>('a' + engine() % 4));
+		}
+		return text;
+	}
+}
+
+TEST_CASE("TokenizerMerge" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_tokenizer_merge.gguf";
+	Vocab vocab = make_vocab();
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+	REQUIRE(tokenizer.valid());
+
+	std::mt19937 engine;
+	for(size_t size = 1; size < 64; ++size) {
+		std::string text = random_text(engine, size);
+		std::u8string input(text.begin(), text.end());
+		Array<s32> tokens = tokenizer.tokenize(input);
+		std::vector<int32_t> expected = tokenize_reference(vocab, text);
+		REQUIRE(expected.size() == tokens.size());
+		for(size_t i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == tokens[i]);
+		}
+	}
+
+	// a long document, the pieces cover the text
+	std::string text = random_text(engine, 200'000);
+	std::u8string input(text.begin(), text.end());
+	Array<s32> tokens = tokenizer.tokenize(input);
+	size_t length = 0;
+	for(u64 i = 0; i < tokens.size(); ++i) {
+		REQUIRE(3 <= tokens[i]);
+		length += vocab.tokens_[tokens[i]].size();
+	}
+	CHECK(text.size() == length);
+	std::remove(filepath);
+}
+
+TEST_CASE("TokenizerMergeRanks" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	std::mt19937 engine(11);
+	{
+		// ranks by the scores, the same pieces as merging by the scores
+		const char* filepath = "test_tokenizer_scores.gguf";
+		Vocab vocab = make_vocab();
+		REQUIRE(write_vocab(filepath, vocab));
+		gguf::GGUF model_data;
+		REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+		Tokenizer tokenizer(model_data);
+		for(size_t size = 1; size < 4096; size *= 2) {
+			std::string text = random_text(engine, size);
+			// chars out of the vocabulary split the merges
+			text.insert(engine() % text.size(), "e");
+			text.insert(engine() % text.size(), "\xC3\xA9");
+			std::u8string input(text.begin(), text.end());
+			Array<s32> tokens = tokenizer.tokenize(input);
+			std::vector<int32_t> expected = tokenize_reference(vocab, text);
+			REQUIRE(expected.size() == tokens.size());
+			for(u64 i = 0; i < expected.size(); ++i) {
+				CHECK(expected[i] == tokens[i]);
+			}
+		}
+		CHECK(0 == tokenizer.tokenize(u8"").size());
+		std::remove(filepath);
+	}
+	{
+		// ranks by tokenizer.ggml.merges
+		const char* filepath = "test_tokenizer_ranks.gguf";
+		Vocab vocab = make_vocab();
+		vocab.merges_ = make_merges(vocab, engine);
+		REQUIRE(write_vocab(filepath, vocab));
+		gguf::GGUF model_data;
+		REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+		Tokenizer tokenizer(model_data);
+		for(size_t size = 1; size < 64; ++size) {
+			std::string text = random_text(engine, size);
+			std::u8string input(text.begin(), text.end());
+			Array<s32> tokens = tokenizer.tokenize(input);
+			std::vector<int32_t> expected = tokenize_reference_ranks(vocab, text);
+			REQUIRE(expected.size() == tokens.size());
+			for(size_t i = 0; i < expected.size(); ++i) {
+				CHECK(expected[i] == tokens[i]);
+			}
+		}
+		std::remove(filepath);
+	}
+}
+
+TEST_CASE("PreTokenizer" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	auto split = [](const std::string& text) {
+		Array<PreTokenizer::Piece> pieces;
+		PreTokenizer::split(pieces, text.size(), reinterpret_cast<const char8_t*>(text.c_str()));
+		std::vector<std::string> result;
+		for(u64 i = 0; i < pieces.size(); ++i) {
+			result.push_back(text.substr(pieces[i].offset_, pieces[i].length_));
+		}
+		return result;
+	};
+
+	// differential against the regex over ASCII
+	std::regex pattern(reinterpret_cast<const char*>(Tokenizer::Pattern));
+	const std::string alphabet = "abcdXYZ0123456789'srevltmd   \t\n\r!?.,-_()";
+	std::mt19937 engine(43);
+	for(size_t count = 0; count < 2000; ++count) {
+		std::string text;
+		size_t size = engine() % 96;
+		for(size_t i = 0; i < size; ++i) {
+			text.push_back(alphabet[engine() % alphabet.size()]);
+		}
+		std::vector<std::string> expected;
+		for(std::sregex_iterator itr(text.begin(), text.end(), pattern), end; itr != end; ++itr) {
+			expected.push_back(itr->str());
+		}
+		std::vector<std::string> pieces = split(text);
+		REQUIRE(expected.size() == pieces.size());
+		for(size_t i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == pieces[i]);
+		}
+	}
+
+	// long runs take the vector paths
+	std::string letters(100, 'q');
+	std::string digits(70, '7');
+	std::string text = " " + letters + "Q " + digits + "  x";
+	std::vector<std::string> pieces = split(text);
+	REQUIRE(4 == pieces.size());
+	CHECK((" " + letters + "Q") == pieces[0]);
+	CHECK((" " + digits) == pieces[1]);
+	CHECK(" " == pieces[2]);
+	CHECK(" x" == pieces[3]);
+
+	// Unicode letters, digits and spaces
+	pieces = split("h\xC3\xA9llo w\xC3\xB6rld \xD9\xA3\xD9\xA4\xE3\x80\x80\xE6\x97\xA5\xE6\x9C\xAC!\xE2\x80\x94 'll");
+	REQUIRE(8 == pieces.size());
+	CHECK("h\xC3\xA9llo" == pieces[0]);
+	CHECK(" w\xC3\xB6rld" == pieces[1]);
+	CHECK(" \xD9\xA3\xD9\xA4" == pieces[2]);
+	CHECK("\xE3\x80\x80" == pieces[3]);
+	CHECK("\xE6\x97\xA5\xE6\x9C\xAC" == pieces[4]);
+	CHECK("!\xE2\x80\x94" == pieces[5]);
+	CHECK(" '" == pieces[6]);
+	CHECK("ll" == pieces[7]);
+	CHECK(0 == PreTokenizer::next(0, nullptr));
+}
+
+TEST_CASE("TokenizerBatch" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_tokenizer_batch.gguf";
+	Vocab vocab = make_vocab();
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+
+	std::mt19937 engine(44);
+	std::vector<std::u8string> documents;
+	for(size_t i = 0; i < 1000; ++i) {
+		// some documents are empty
+		std::string text = random_text(engine, engine() % 200);
+		documents.push_back(std::u8string(text.begin(), text.end()));
+	}
+
+	for(u32 num_threads: {1U, 3U, 8U, 0U}) {
+		Array<s32> tokens;
+		Array<u64> offsets;
+		tokenizer.tokenize_batch(tokens, offsets, documents.size(), documents.data(), num_threads);
+		REQUIRE((documents.size() + 1) == offsets.size());
+		CHECK(0 == offsets[0]);
+		CHECK(tokens.size() == offsets[documents.size()]);
+		for(size_t i = 0; i < documents.size(); ++i) {
+			Array<s32> expected = tokenizer.tokenize(documents[i]);
+			REQUIRE(expected.size() == (offsets[i + 1] - offsets[i]));
+			for(u64 j = 0; j < expected.size(); ++j) {
+				CHECK(expected[j] == tokens[offsets[i] + j]);
+			}
+		}
+	}
+
+	// threads share one tokenizer, each with its own scratch
+	const Tokenizer& shared = tokenizer;
+	std::vector<std::thread> threads;
+	std::vector<int> matches(4, 0);
+	for(size_t t = 0; t < matches.size(); ++t) {
+		threads.emplace_back([&, t]() {
+			Tokenizer::Scratch scratch;
+			for(size_t i = t; i < documents.size(); i += matches.size()) {
+				Array<s32> tokens;
+				shared.tokenize(tokens, scratch, documents[i].size(), documents[i].c_str());
+				std::vector<int32_t> expected = tokenize_reference(vocab, std::string(documents[i].begin(), documents[i].end()));
+				bool match = expected.size() == tokens.size();
+				for(u64 j = 0; match && j < tokens.size(); ++j) {
+					match = expected[j] == tokens[j];
+				}
+				matches[t] += match ? 1 : 0;
+			}
+		});
+	}
+	int total = 0;
+	for(size_t t = 0; t < threads.size(); ++t) {
+		threads[t].join();
+		total += matches[t];
+	}
+	CHECK(documents.size() == static_cast<size_t>(total));
+
+	Array<s32> tokens;
+	Array<u64> offsets;
+	tokenizer.tokenize_batch(tokens, offsets, 0, nullptr, 4);
+	CHECK(1 == offsets.size());
+	CHECK(0 == tokens.size());
+	std::remove(filepath);
+}
+
+TEST_CASE("StreamTokenizer" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_tokenizer_stream.gguf";
+	Vocab vocab = make_vocab();
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+
+	// the tokens of the whole text at once
+	auto tokenize = [](Tokenizer& tokenizer, const std::string& text) {
+		return tokenizer.tokenize(std::u8string(text.begin(), text.end()));
+	};
+	// chunks of random sizes cut chars of UTF-8 and special tokens too
+	auto tokenize_stream = [](std::mt19937& engine, const Tokenizer& tokenizer, const std::string& text) {
+		StreamTokenizer stream(tokenizer);
+		Array<s32> tokens;
+		const char8_t* str = reinterpret_cast<const char8_t*>(text.c_str());
+		size_t offset = 0;
+		while(offset < text.size()) {
+			size_t length = (std::min)(static_cast<size_t>(engine() % 7), text.size() - offset);
+			stream.push(tokens, length, str + offset);
+			offset += length;
+		}
+		stream.finish(tokens);
+		CHECK(0 == stream.pending());
+		return tokens;
+	};
+
+	const std::vector<std::string> words = {"abcd", "dab", "a", "'s", "'re", "'", "r", "e", "  ", " ", "\t", "\n\n", "42", "!?", "\xC3\xA9", "\xE6\x97\xA5", "ba", "cc"};
+	std::mt19937 engine(45);
+	for(size_t count = 0; count < 200; ++count) {
+		std::string text;
+		size_t size = engine() % 64;
+		for(size_t i = 0; i < size; ++i) {
+			text += words[engine() % words.size()];
+		}
+		Array<s32> expected = tokenize(tokenizer, text);
+		Array<s32> tokens = tokenize_stream(engine, tokenizer, text);
+		REQUIRE(expected.size() == tokens.size());
+		for(u64 i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == tokens[i]);
+		}
+	}
+
+	// the pending bytes, the text after the last cut between two bytes no token has next to each other
+	{
+		StreamTokenizer stream(tokenizer);
+		Array<s32> tokens;
+		stream.push(tokens, 4, u8"abcd");
+		CHECK(4 == stream.pending());
+		stream.push(tokens, 3, u8"dab");
+		CHECK(3 == stream.pending());
+		stream.finish(tokens);
+		Array<s32> expected = tokenize(tokenizer, "abcddab");
+		REQUIRE(expected.size() == tokens.size());
+		for(u64 i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == tokens[i]);
+		}
+	}
+
+	// byte by byte without a cut, each push scans the new byte
+	{
+		std::string text;
+		for(size_t i = 0; i < 5000; ++i) {
+			text += "abcd";
+		}
+		StreamTokenizer stream(tokenizer);
+		Array<s32> tokens;
+		for(size_t i = 0; i < text.size(); ++i) {
+			stream.push(tokens, 1, reinterpret_cast<const char8_t*>(text.c_str()) + i);
+		}
+		CHECK(0 == tokens.size());
+		CHECK(text.size() == stream.pending());
+		stream.finish(tokens);
+		Array<s32> expected = tokenize(tokenizer, text);
+		REQUIRE(expected.size() == tokens.size());
+		for(u64 i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == tokens[i]);
+		}
+	}
+
+	// special tokens split over chunks, a prefix of a longer one waits for it
+	{
+		const char* special_filepath = "test_tokenizer_stream_special.gguf";
+		Vocab special_vocab = make_vocab();
+		special_vocab.types_.resize(special_vocab.tokens_.size(), 1);
+		const std::vector<std::string> specials = {"<|im_start|>", "<|im", "cab"};
+		for(const std::string& special: specials) {
+			special_vocab.tokens_.push_back(special);
+			special_vocab.scores_.push_back(0.0f);
+			special_vocab.types_.push_back(3);
+		}
+		REQUIRE(write_vocab(special_filepath, special_vocab));
+		gguf::GGUF special_data;
+		REQUIRE(gguf::Error::Success == special_data.load(reinterpret_cast<const char8_t*>(special_filepath)));
+		Tokenizer special_tokenizer(special_data);
+
+		{
+			StreamTokenizer stream(special_tokenizer);
+			Array<s32> tokens;
+			stream.push(tokens, 5, u8"ab<|i");
+			stream.push(tokens, 9, u8"m_start|>");
+			stream.push(tokens, 2, u8"ab");
+			stream.finish(tokens);
+			Array<s32> expected = tokenize(special_tokenizer, "ab<|im_start|>ab");
+			REQUIRE(3 == expected.size());
+			REQUIRE(expected.size() == tokens.size());
+			for(u64 i = 0; i < expected.size(); ++i) {
+				CHECK(expected[i] == tokens[i]);
+			}
+		}
+
+		const std::vector<std::string> special_words = {"a", "b", "c", "d", "ab", "<|im_start|>", "<|im", "<|", "|>", "cab", "\xC3\xA9"};
+		for(size_t count = 0; count < 200; ++count) {
+			std::string text;
+			size_t size = engine() % 32;
+			for(size_t i = 0; i < size; ++i) {
+				text += special_words[engine() % special_words.size()];
+			}
+			Array<s32> expected = tokenize(special_tokenizer, text);
+			Array<s32> tokens = tokenize_stream(engine, special_tokenizer, text);
+			REQUIRE(expected.size() == tokens.size());
+			for(u64 i = 0; i < expected.size(); ++i) {
+				CHECK(expected[i] == tokens[i]);
+			}
+		}
+		std::remove(special_filepath);
+	}
+
+	// a long piece is cut over the limit, the bytes are all kept
+	std::string text = random_text(engine, 1000);
+	StreamTokenizer stream(tokenizer, 100);
+	Array<s32> tokens;
+	for(size_t i = 0; i < text.size(); i += 10) {
+		stream.push(tokens, 10, reinterpret_cast<const char8_t*>(text.c_str()) + i);
+		CHECK(stream.pending() <= 110);
+	}
+	stream.finish(tokens);
+	size_t length = 0;
+	for(u64 i = 0; i < tokens.size(); ++i) {
+		length += vocab.tokens_[tokens[i]].size();
+	}
+	CHECK(text.size() == length);
+	std::remove(filepath);
+}
+
+TEST_CASE("Detokenizer" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_detokenizer.gguf";
+	// U+2581 marks a space, pieces may cut a char of UTF-8
+	Vocab vocab;
+	vocab.tokens_ = {"<unk>", "<s>", "</s>", "\xE2\x96\x81hi", "<0xC3>", "<0xA9>", "<0xE6>", "a", "\xE6\x97", "\xA5" "b", "\xE2\x96\x81"};
+	vocab.scores_.resize(vocab.tokens_.size(), 0.0f);
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+	const Vocabulary& vocabulary = tokenizer.vocabulary();
+
+	String piece = vocabulary.tokenToPiece(3);
+	CHECK(u8" hi" == std::u8string(piece.str_, piece.len_));
+	piece = vocabulary.tokenToPiece(5);
+	REQUIRE(1 == piece.len_);
+	CHECK(0xA9 == piece.str_[0]);
+	CHECK(5 == vocabulary.tokenToPiece(0).len_);
+
+	auto run = [&](std::initializer_list<s32> tokens, std::vector<std::u8string> expected) {
+		Detokenizer detokenizer(vocabulary);
+		std::u8string text;
+		size_t i = 0;
+		for(s32 token: tokens) {
+			detokenizer.push(text, token);
+			CHECK(expected[i] == text);
+			++i;
+		}
+		detokenizer.finish(text);
+		CHECK(expected[i] == text);
+	};
+	// a byte fallback char
+	run({3, 4, 5, 7}, {u8" hi", u8" hi", u8" hi\u00E9", u8" hi\u00E9a", u8" hi\u00E9a"});
+	// a char over pieces
+	run({8, 9, 10}, {u8"", u8"\u65E5b", u8"\u65E5b ", u8"\u65E5b "});
+	// a broken char goes out as it is
+	run({4, 7, 6}, {u8"", u8"\xC3" "a", u8"\xC3" "a", u8"\xC3" "a\xE6"});
+
+	// decode is the piece
+	std::u8string text;
+	tokenizer.decode(text, 3);
+	tokenizer.decode(text, 4);
+	CHECK(u8" hi\xC3" == text);
+	std::remove(filepath);
+}
+
+TEST_CASE("SpecialTokenMatcher" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_tokenizer_special.gguf";
+	Vocab vocab = make_vocab();
+	vocab.types_.resize(vocab.tokens_.size(), 1);
+	// control, user defined, and added which is a normal token
+	const std::vector<std::string> specials = {"<|im_start|>", "<|im_end|>", "<|im", "cab"};
+	const std::vector<int32_t> types = {3, 3, 4, 1};
+	for(size_t i = 0; i < specials.size(); ++i) {
+		vocab.tokens_.push_back(specials[i]);
+		vocab.scores_.push_back(0.0f);
+		vocab.types_.push_back(types[i]);
+	}
+	vocab.added_ = {"cab"};
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+	CHECK(4 == tokenizer.vocabulary().getSpecialTokens().size());
+
+	auto id = [&](const std::string& token) {
+		return static_cast<int32_t>(std::find(vocab.tokens_.begin(), vocab.tokens_.end(), token) - vocab.tokens_.begin());
+	};
+	const std::vector<std::string> words = {"a", "b", "c", "d", "ab", "<|im_start|>", "<|im_end|>", "<|im", "cab"};
+	std::mt19937 engine(47);
+	for(size_t count = 0; count < 300; ++count) {
+		std::string text;
+		size_t size = engine() % 32;
+		for(size_t i = 0; i < size; ++i) {
+			text += words[engine() % words.size()];
+		}
+		// leftmost then longest, an added token may span words
+		std::vector<int32_t> expected;
+		size_t offset = 0;
+		std::string ordinary;
+		auto flush = [&]() {
+			std::vector<int32_t> tokens = tokenize_reference(vocab, ordinary);
+			expected.insert(expected.end(), tokens.begin(), tokens.end());
+			ordinary.clear();
+		};
+		while(offset < text.size()) {
+			size_t best = 0;
+			for(const std::string& special: specials) {
+				if(best < special.size() && 0 == text.compare(offset, special.size(), special)) {
+					best = special.size();
+				}
+			}
+			if(0 < best) {
+				flush();
+				expected.push_back(id(text.substr(offset, best)));
+				offset += best;
+			} else {
+				ordinary.push_back(text[offset]);
+				++offset;
+			}
+		}
+		flush();
+
+		std::u8string input(text.begin(), text.end());
+		Array<s32> tokens = tokenizer.tokenize(input);
+		REQUIRE(expected.size() == tokens.size());
+		for(size_t i = 0; i < expected.size(); ++i) {
+			CHECK(expected[i] == tokens[i]);
+		}
+	}
+
+	// many pieces of text between the tokens take the vector scan
+	std::string text = std::string(100, 'a') + "<|im_start|>" + std::string(40, 'b') + "<|im" + "<|im_end|>";
+	std::u8string input(text.begin(), text.end());
+	Array<s32> tokens = tokenizer.tokenize(input);
+	u64 found = 0;
+	for(u64 i = 0; i < tokens.size(); ++i) {
+		found += (id("<|im_start|>") == tokens[i] || id("<|im") == tokens[i] || id("<|im_end|>") == tokens[i]) ? 1 : 0;
+	}
+	CHECK(3 == found);
+	std::remove(filepath);
+}
+
+TEST_CASE("VocabularyLookup" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_vocabulary_lookup.gguf";
+	Vocab vocab;
+	vocab.tokens_ = {"<unk>", "<s>", "</s>", ""};
+	std::mt19937 engine(48);
+	for(size_t i = 0; i < 5000; ++i) {
+		vocab.tokens_.push_back(random_text(engine, 1 + engine() % 12));
+	}
+	// a duplicated text is the first of it
+	vocab.tokens_.push_back("<s>");
+	for(size_t i = 0; i < vocab.tokens_.size(); ++i) {
+		vocab.scores_.push_back(static_cast<float>(i));
+	}
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Vocabulary vocabulary(model_data);
+	REQUIRE(vocab.tokens_.size() == vocabulary.idToTokenSize());
+
+	for(size_t i = 0; i < vocab.tokens_.size(); ++i) {
+		const std::string& text = vocab.tokens_[i];
+		int32_t first = static_cast<int32_t>(std::find(vocab.tokens_.begin(), vocab.tokens_.end(), text) - vocab.tokens_.begin());
+		s32 id = -1;
+		REQUIRE(vocabulary.encode(id, text.size(), reinterpret_cast<const char8_t*>(text.c_str())));
+		CHECK(first == id);
+		Vocabulary::Token token = vocabulary.idToToken(static_cast<s32>(i));
+		CHECK(text == std::string(token.text_.str_, token.text_.str_ + token.text_.len_));
+		CHECK(static_cast<float>(i) == token.score_);
+		CHECK(1 == token.type_);
+	}
+
+	// texts out of the vocabulary land on a slot of another token
+	size_t misses = 0;
+	for(size_t i = 0; i < 5000; ++i) {
+		std::string text = random_text(engine, 13 + engine() % 4) + "e";
+		s32 id = -1;
+		misses += vocabulary.encode(id, text.size(), reinterpret_cast<const char8_t*>(text.c_str())) ? 0 : 1;
+	}
+	CHECK(5000 == misses);
+
+	// a move keeps the lookup
+	Vocabulary moved(std::move(vocabulary));
+	s32 id = -1;
+	CHECK(moved.tokenToId(id, std::u8string(u8"</s>")));
+	CHECK(2 == id);
+	CHECK_FALSE(vocabulary.tokenToId(id, std::u8string(u8"</s>")));
+	std::remove(filepath);
+}
+
+TEST_CASE("TokenizerArtifact" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_tokenizer_artifact.gguf";
+	const char* artifact = "test_tokenizer_artifact.tok";
+	std::mt19937 engine(49);
+	Vocab vocab = make_vocab();
+	vocab.merges_ = make_merges(vocab, engine);
+	vocab.types_.resize(vocab.tokens_.size(), 1);
+	vocab.tokens_.push_back("<|im_start|>");
+	vocab.scores_.push_back(0.0f);
+	vocab.types_.push_back(3);
+	vocab.added_ = {"dab"};
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+	REQUIRE(tokenizer.save(reinterpret_cast<const char8_t*>(artifact)));
+
+	// the loaded tables give the same tokens and texts
+	Tokenizer loaded;
+	REQUIRE(loaded.load(reinterpret_cast<const char8_t*>(artifact)));
+	const Vocabulary& expected = tokenizer.vocabulary();
+	const Vocabulary& actual = loaded.vocabulary();
+	REQUIRE(expected.idToTokenSize() == actual.idToTokenSize());
+	CHECK(expected.getBOS() == actual.getBOS());
+	CHECK(expected.getEOS() == actual.getEOS());
+	CHECK(expected.getMaxTokenLength() == actual.getMaxTokenLength());
+	CHECK(expected.getSpecialTokens().size() == actual.getSpecialTokens().size());
+	for(size_t i = 0; i < vocab.tokens_.size(); ++i) {
+		s32 id = -1;
+		REQUIRE(actual.encode(id, vocab.tokens_[i].size(), reinterpret_cast<const char8_t*>(vocab.tokens_[i].c_str())));
+		CHECK(static_cast<s32>(i) == id);
+		CHECK(expected.idToToken(id).score_ == actual.idToToken(id).score_);
+	}
+	for(size_t count = 0; count < 100; ++count) {
+		std::string text = random_text(engine, engine() % 64);
+		text.insert(engine() % (text.size() + 1), "<|im_start|>");
+		std::u8string input(text.begin(), text.end());
+		Array<s32> tokens = loaded.tokenize(input);
+		Array<s32> reference = tokenizer.tokenize(input);
+		REQUIRE(reference.size() == tokens.size());
+		std::u8string decoded;
+		for(u64 i = 0; i < tokens.size(); ++i) {
+			CHECK(reference[i] == tokens[i]);
+			loaded.decode(decoded, tokens[i]);
+		}
+		CHECK(input == decoded);
+	}
+
+	// neither a model nor a broken file loads
+	CHECK_FALSE(loaded.load(reinterpret_cast<const char8_t*>(filepath)));
+	CHECK_FALSE(loaded.load(reinterpret_cast<const char8_t*>("test_tokenizer_missing.tok")));
+
+	// an offset or an id out of its table, the ranges of the sections follow the 360 bytes of the header fields
+	const char* corrupted = "test_tokenizer_corrupted.tok";
+	auto corrupt = [&](u32 section, u64 index, s32 value) {
+		std::vector<char> bytes;
+		FILE* file = fopen(artifact, "rb");
+		REQUIRE(nullptr != file);
+		fseek(file, 0, SEEK_END);
+		bytes.resize(ftell(file));
+		fseek(file, 0, SEEK_SET);
+		REQUIRE(1 == fread(bytes.data(), bytes.size(), 1, file));
+		fclose(file);
+		u64 offset = 0;
+		::memcpy(&offset, bytes.data() + 360 + 16 * section, sizeof(u64));
+		::memcpy(&bytes[offset + sizeof(s32) * index], &value, sizeof(s32));
+		file = fopen(corrupted, "wb");
+		REQUIRE(nullptr != file);
+		REQUIRE(1 == fwrite(bytes.data(), bytes.size(), 1, file));
+		fclose(file);
+		return loaded.load(reinterpret_cast<const char8_t*>(corrupted));
+	};
+	const s32 size = static_cast<s32>(vocab.tokens_.size());
+	CHECK_FALSE(corrupt(1, 1, 0x7FFFFFFF)); // TokenOffsets
+	CHECK_FALSE(corrupt(5, 0, size)); // SlotToId
+	CHECK_FALSE(corrupt(6, 0, -2)); // SpecialTokens
+	CHECK_FALSE(corrupt(13, 1, size)); // Nodes
+	CHECK(corrupt(5, 0, 0));
+	CHECK(expected.idToTokenSize() == loaded.vocabulary().idToTokenSize());
+	std::remove(corrupted);
+	std::remove(filepath);
+	std::remove(artifact);
+}
+
+TEST_CASE("TokenTrie" "[CPPGPT]")
+{
+	using namespace cppgpt;
+	const char* filepath = "test_token_trie.gguf";
+	Vocab vocab = make_vocab();
+	std::mt19937 engine(50);
+	for(size_t i = 0; i < 3000; ++i) {
+		vocab.tokens_.push_back(random_text(engine, 1 + engine() % 8));
+	}
+	// a byte token has the piece of its byte, a space is U+2581
+	vocab.tokens_.push_back("<0x61>");
+	vocab.tokens_.push_back("\xE2\x96\x81" "ab");
+	vocab.tokens_.push_back(" ");
+	vocab.tokens_.push_back("");
+	vocab.scores_.resize(vocab.tokens_.size(), 0.0f);
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Vocabulary vocabulary(model_data);
+	TokenTrie trie(vocabulary);
+	REQUIRE(trie.valid());
+	REQUIRE(vocab.tokens_.size() == trie.size());
+	REQUIRE(((trie.size() + 63) / 64) == trie.mask_size());
+
+	std::vector<std::string> pieces;
+	for(size_t i = 0; i < vocab.tokens_.size(); ++i) {
+		String piece = vocabulary.tokenToPiece(static_cast<s32>(i));
+		pieces.push_back(std::string(piece.str_, piece.str_ + piece.len_));
+	}
+	auto bit = [](const std::vector<u64>& mask, size_t id) {
+		return 0 != ((mask[id / 64] >> (id % 64)) & 1);
+	};
+	std::vector<std::string> queries = {"", "a", " ", " a", "ab", "e", "abcdabcd"};
+	for(size_t i = 0; i < 200; ++i) {
+		queries.push_back(random_text(engine, engine() % 10));
+	}
+	for(const std::string& query: queries) {
+		const char8_t* str = reinterpret_cast<const char8_t*>(query.c_str());
+		Array<s32> starts;
+		Array<s32> prefixes;
+		trie.starts_with(starts, query.size(), str);
+		trie.prefixes_of(prefixes, query.size(), str);
+		std::vector<u64> starts_mask(trie.mask_size(), 0);
+		std::vector<u64> consistent_mask(trie.mask_size(), 0);
+		trie.mask_starts_with(starts_mask.data(), query.size(), str);
+		trie.mask_consistent(consistent_mask.data(), query.size(), str);
+
+		std::vector<int32_t> expected_starts;
+		std::vector<int32_t> expected_prefixes;
+		for(size_t i = 0; i < pieces.size(); ++i) {
+			bool starts_with = 0 == pieces[i].compare(0, query.size(), query);
+			bool prefix_of = !pieces[i].empty() && 0 == query.compare(0, pieces[i].size(), pieces[i]);
+			if(starts_with) {
+				expected_starts.push_back(static_cast<int32_t>(i));
+			}
+			if(prefix_of) {
+				expected_prefixes.push_back(static_cast<int32_t>(i));
+			}
+			CHECK(starts_with == bit(starts_mask, i));
+			CHECK((starts_with || prefix_of) == bit(consistent_mask, i));
+		}
+		std::vector<int32_t> actual_starts;
+		std::vector<int32_t> actual_prefixes;
+		for(u64 i = 0; i < starts.size(); ++i) {
+			actual_starts.push_back(starts[i]);
+		}
+		for(u64 i = 0; i < prefixes.size(); ++i) {
+			actual_prefixes.push_back(prefixes[i]);
+		}
+		std::sort(actual_starts.begin(), actual_starts.end());
+		std::sort(actual_prefixes.begin(), actual_prefixes.end());
+		CHECK(expected_starts == actual_starts);
+		CHECK(expected_prefixes == actual_prefixes);
+		// no bit past the vocabulary
+		if(0 != (trie.size() % 64)) {
+			CHECK(0 == (starts_mask.back() >> (trie.size() % 64)));
+		}
+
+		std::vector<float> logits(trie.size());
+		for(size_t i = 0; i < logits.size(); ++i) {
+			logits[i] = static_cast<float>(i);
+		}
+		TokenTrie::apply(logits.data(), logits.size(), consistent_mask.data());
+		for(size_t i = 0; i < logits.size(); ++i) {
+			CHECK((bit(consistent_mask, i) ? static_cast<float>(i) : -std::numeric_limits<float>::infinity()) == logits[i]);
+		}
+	}
+	std::remove(filepath);
+}
+
+TEST_CASE("TokenizerBenchmark", "[.][benchmark]")
+{
+	using namespace cppgpt;
+	// words of a few thousand tokens, merged by their scores
+	const char* filepath = "test_tokenizer_benchmark.gguf";
+	Vocab vocab;
+	vocab.tokens_ = {"<unk>", "<s>", "</s>", " "};
+	for(char c = 'a'; c <= 'z'; ++c) {
+		vocab.tokens_.push_back(std::string(1, c));
+	}
+	std::mt19937 engine(42);
+	for(size_t i = 0; i < 4000; ++i) {
+		std::string token = (0 == engine() % 2) ? " " : "";
+		size_t size = 2 + engine() % 6;
+		for(size_t j = 0; j < size; ++j) {
+			token.push_back(static_cast<char>('a' + engine() % 26));
+		}
+		vocab.tokens_.push_back(token);
+	}
+	for(const std::string& token: vocab.tokens_) {
+		vocab.scores_.push_back(static_cast<float>(token.size()) + static_cast<float>(engine() % 100) * 0.01f);
+	}
+	REQUIRE(write_vocab(filepath, vocab));
+	gguf::GGUF model_data;
+	REQUIRE(gguf::Error::Success == model_data.load(reinterpret_cast<const char8_t*>(filepath)));
+	Tokenizer tokenizer(model_data);
+
+	// a text of 1 MiB, words of the letters
+	std::u8string text;
+	while(text.size() < (1ULL << 20)) {
+		size_t size = 1 + engine() % 8;
+		for(size_t j = 0; j < size; ++j) {
+			text.push_back(static_cast<char8_t>('a' + engine() % 26));
+		}
+		text.push_back(u8' ');
+	}
+	Tokenizer::Scratch scratch;
+	Array<s32> tokens;
+	BENCHMARK("tokenize 1 MiB")
+	{
+		tokens.clear();
+		tokenizer.tokenize(tokens, scratch, text.size(), text.c_str());
+		return tokens.size();
+	};
+	std::remove(filepath);
+}